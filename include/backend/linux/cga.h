@@ -4,6 +4,10 @@
 #include <SDL2/SDL_mutex.h>
 #include <SDL2/SDL.h>
 #include <pthread.h>
+#include <signal.h>
+
+#include "kbd.h"
+#include "vm_mem.h"
 
 typedef struct {
     uint8_t mode;
@@ -13,11 +17,22 @@ typedef struct {
     // TODO this whole lock thing
     SDL_mutex* lock;
     uint8_t *font;
+    // Of the machine the card is in: the frame buffer, the keyboard the
+    // window's keys go to and its stop request, which closes the window
+    vm_mem_t *mem;
+    kbd_state_t *kbd;
+    volatile sig_atomic_t *stop;
+    int dirty_view;
+    // The window thread is up; quit has it close the window
+    bool started;
+    bool quit;
+    pthread_t thread;
 } cga_state_t;
 
-void cga_start();
-
-extern cga_state_t cga_state;
+// Open the window from a thread of its own
+void cga_start(cga_state_t *cga);
+// Close it and wait for the thread
+void cga_stop(cga_state_t *cga);
 
 #define CGA_REG_MODE  0x3D8
 #define CGA_REG_COLOR 0x3D9
@@ -26,6 +41,38 @@ extern cga_state_t cga_state;
 #define CGA_COLOR_ADDR 0xB8000
 #define CGA_FONTROM_SIZE 2048
 
+// Raster timing in CPU clocks (a third of the 14.318 MHz dot clock): 912
+// dots per scanline of which 640 are displayed, 262 lines per frame
+#define CGA_LINE_CLK    304
+#define CGA_HDISP_CLK   213
+#define CGA_FRAME_LINES 262
+#define CGA_VDISP_LINES 200
+#define CGA_VSYNC_START 224
+#define CGA_VSYNC_LINES 16
+
+#define CGA_STATUS_NODISP  0x01
+#define CGA_STATUS_VRETRACE 0x08
+
+// Status register for the beam position at CPU clock clk
+static inline uint8_t cga_status(uint64_t clk) {
+    uint32_t pos = clk % (CGA_LINE_CLK * CGA_FRAME_LINES);
+    uint32_t line = pos / CGA_LINE_CLK;
+    uint8_t st = 0;
+    if (line >= CGA_VDISP_LINES || pos % CGA_LINE_CLK >= CGA_HDISP_CLK) {
+        st |= CGA_STATUS_NODISP;
+    }
+    if (line >= CGA_VSYNC_START && line < CGA_VSYNC_START + CGA_VSYNC_LINES) {
+        st |= CGA_STATUS_VRETRACE;
+    }
+    return st;
+}
+
+// First CPU clock after clk at which cga_status may read differently
+static inline uint64_t cga_status_until(uint64_t clk) {
+    uint32_t col = clk % CGA_LINE_CLK;
+    return clk - col + (col < CGA_HDISP_CLK ? CGA_HDISP_CLK : CGA_LINE_CLK);
+}
+
 #define CGA_REG_START CGA_REG_MODE
 #define CGA_REG_END   CGA_REG_STATUS
 
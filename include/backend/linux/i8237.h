@@ -5,6 +5,9 @@
 #include <stdint.h>
 #include <assert.h>
 
+#include "sched.h"
+#include "vm_mem.h"
+
 typedef union {
     uint16_t x;
     struct {
@@ -13,18 +16,38 @@ typedef union {
     };
 } dma_reg_t;
 
-//typedef uint8_t* (*dma_cb_t)();
+// A device on a DMA channel. When it raises DREQ with i8237_dreq(), req_fn
+// says how many bytes it has ready to move; they are moved on SCHED_DMA
+// once the bus cycles for them have passed, in spans as long as memory
+// allows, each through one call to ack_fn. With to_mem, ack_fn fills buf
+// with len bytes for memory; otherwise it takes them from buf. tc_fn is
+// called once the channel's count runs out.
+typedef struct {
+    void *ctx;
+    uint32_t (*req_fn)(void *ctx);
+    void (*ack_fn)(void *ctx, uint8_t *buf, uint32_t len, bool to_mem);
+    void (*tc_fn)(void *ctx);
+} dma_dev_t;
+
+// Transfer types of the mode register
+#define DMA_XFER_VERIFY 0
+#define DMA_XFER_WRITE  1
+#define DMA_XFER_READ   2
 
 typedef struct {
+    // Current registers, and what they are loaded with again on autoinit
     dma_reg_t addr;
     dma_reg_t cntr;
-//    dma_cb_t req_fn;
-//    dma_cb_t ack_fn;
+    uint16_t base_addr;
+    uint16_t base_cntr;
     uint8_t page;
     bool auto_en;
     bool down_en;
-    bool wr_en;
+    uint8_t xfer;
     bool masked;
+    // Bytes of the span whose bus cycles end at due, 0 if none is going
+    uint32_t busy;
+    uint64_t due;
 } dma_chan_t;
 
 typedef struct {
@@ -32,54 +55,71 @@ typedef struct {
     uint8_t status;
     bool ff;
     bool en;
+    // Wiring, kept out of snapshots by i8237_restore()
+    dma_dev_t devs[4];
+    vm_mem_t *mem;
+    sched_state_t *sched;
 } i8237_state_t;
 
-#define I8237_CMD_COND 0x04
+#define I8237_CMD_DISABLE 0x04
 #define I8237_SC_MASK_ON(v) ((v >> 2) & 1)
 #define I8237_MODE_AUTO(v) ((v >> 4) & 1)
 #define I8237_MODE_DOWN(v) ((v >> 5) & 1)
-#define I8237_MODE_WR(v)   ((v >> 2) & 1)
+#define I8237_MODE_XFER(v) ((v >> 2) & 3)
+
+// CPU clocks per byte: a bus cycle of four clocks and a wait state
+#define DMA_XFER_CLK 5
+
+void i8237_init(i8237_state_t *dma, vm_mem_t *mem, sched_state_t *sched);
 
-extern i8237_state_t i8237_state;
+// Plug dev into chan; a copy is kept
+void i8237_attach(i8237_state_t *dma, uint8_t chan, const dma_dev_t *dev);
 
-void i8237_init();
+// A device on chan has bytes to move at CPU clock now
+void i8237_dreq(i8237_state_t *dma, uint8_t chan, uint64_t now);
 
-void i8237_cr_write(uint8_t port, uint8_t val);
+// SCHED_DMA: move the spans due by now and start the next ones
+void i8237_event(i8237_state_t *dma, uint64_t now);
 
-static inline void i8237_chan_write(uint8_t port, uint8_t val) {
+// Put back the registers of saved, keeping the wiring of dma
+void i8237_restore(i8237_state_t *dma, const i8237_state_t *saved);
+
+void i8237_cr_write(i8237_state_t *dma, uint8_t port, uint8_t val,
+                    uint64_t now);
+
+static inline void i8237_chan_write(i8237_state_t *dma, uint8_t port,
+                                    uint8_t val) {
     assert(port < 8);
+    dma_chan_t *chan = &dma->chans[port >> 1];
+    dma_reg_t *reg = (port & 1) ? &chan->cntr : &chan->addr;
+    if (dma->ff) {
+        reg->h = val;
+    } else {
+        reg->l = val;
+    }
+    // Writes load the base register along with the current one
     if (port & 1) {
-        if (i8237_state.ff) {
-            i8237_state.chans[port >> 1].cntr.h = val;
-        } else {
-            i8237_state.chans[port >> 1].cntr.l = val;
-        }
+        chan->base_cntr = reg->x;
     } else {
-        if (i8237_state.ff) {
-            i8237_state.chans[port >> 1].addr.h = val;
-        } else {
-            i8237_state.chans[port >> 1].addr.l = val;
-        }
+        chan->base_addr = reg->x;
     }
-    i8237_state.ff = !i8237_state.ff;
+    dma->ff = !dma->ff;
 }
 
-static inline uint8_t i8237_chan_read(uint8_t port) {
+static inline uint8_t i8237_chan_read(i8237_state_t *dma, uint8_t port) {
     uint8_t ret = 0;
     if (port & 1) {
-        ret = i8237_state.ff ? i8237_state.chans[port >> 1].cntr.h
-            : i8237_state.chans[port >> 1].cntr.l;
+        ret = dma->ff ? dma->chans[port >> 1].cntr.h
+            : dma->chans[port >> 1].cntr.l;
     } else {
-        ret = i8237_state.ff ? i8237_state.chans[port >> 1].addr.h
-            : i8237_state.chans[port >> 1].addr.l;
+        ret = dma->ff ? dma->chans[port >> 1].addr.h
+            : dma->chans[port >> 1].addr.l;
     }
-    i8237_state.ff = !i8237_state.ff;
+    dma->ff = !dma->ff;
     return ret;
 }
 
-uint8_t i8237_cr_read(uint8_t port);
-
-void i8237_xfer(uint8_t chan, uint8_t *buf);
+uint8_t i8237_cr_read(i8237_state_t *dma, uint8_t port);
 
 #define DMA_CHAN_REG_END   0x07
 #define DMA_CTRL_REG_END   0x0F
@@ -88,4 +128,4 @@ void i8237_xfer(uint8_t chan, uint8_t *buf);
 #define DMA_PAGE_CHAN2     0x81
 #define DMA_PAGE_CHAN3     0x82
 
-#endif // I8237_H
\ No newline at end of file
+#endif // I8237_H
@@ -4,22 +4,49 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-typedef union {
-    uint16_t x;
-    struct {
-        uint8_t l;
-        uint8_t h;
-    } __attribute__((packed)) b;
-} ctr_reg_t;
+// The PIT is kept as what was loaded into each counter and the input clock
+// it was loaded at. Counts and outputs are worked out from the time they
+// are asked for, so nothing runs between accesses; the caller waits for
+// output changes with i8253_next_change().
+
+// Access modes of a control word
+#define PIT_RW_LATCH 0
+#define PIT_RW_LSB   1
+#define PIT_RW_MSB   2
+#define PIT_RW_BOTH  3
+
+#define PIT_NEVER UINT64_MAX
+
+typedef struct {
+    uint8_t rw;
+    // 0-5
+    uint8_t mode;
+    bool bcd;
+    // Count as last written, 0 standing for the largest
+    uint16_t reload;
+    // Count being counted down from since start
+    uint16_t count;
+    uint64_t start;
+    // A count has been written since the control word
+    bool loaded;
+    bool counting;
+    // Modes 0 and 4 stop counting while the gate is low, clocks in
+    bool held;
+    uint64_t held_ticks;
+    // Modes 2 and 3 take a new count at the end of the period
+    bool pending;
+    uint64_t pending_at;
+    bool gate;
+    uint16_t latch;
+    bool latched;
+    // Second byte of a PIT_RW_BOTH read or write is next
+    bool read_hi;
+    bool write_hi;
+    uint8_t write_lo;
+} i8253_chan_t;
 
 typedef struct {
-    uint8_t status;
-    ctr_reg_t ctrs[3];
-    uint16_t ctr_limits[3];
-    uint16_t ctrs_latch[3];
-    int access_ctrs[3];
-    bool* out[3];
-    bool init;
+    i8253_chan_t chans[3];
 } i8253_state_t;
 
 #define PIT_REG_TIMER0 0x40
@@ -27,21 +54,26 @@ typedef struct {
 #define PIT_REG_TIMER2 0x42
 #define PIT_REG_CTRL   0x43
 
-extern i8253_state_t i8253_state;
-
-void i8253_init(bool *timer_irq);
-
-void i8253_cr_write(uint8_t val);
+// The PIT runs off the CPU clock divided by 4, 1.19 MHz
+#define PIT_CLOCK_DIV  4
 
-static inline uint8_t i8253_cr_read() {
-    return i8253_state.status | (i8253_state.out[0] ? 0b10000000 : 0);
-}
+// Every gate starts high, as counters 0 and 1 of a PC are wired
+void i8253_init(i8253_state_t *pit);
 
-uint8_t i8253_timer_read(uint8_t ofs);
-void i8253_timer_write(uint8_t ofs, uint8_t val);
+// The rest take now, the input clock of the access
 
-void i8253_tick();
+void i8253_cr_write(i8253_state_t *pit, uint8_t val, uint64_t now);
+// There is no status on an 8253; the counter 0 mode, with its output on top
+uint8_t i8253_cr_read(i8253_state_t *pit, uint64_t now);
 
+uint8_t i8253_timer_read(i8253_state_t *pit, uint8_t ofs, uint64_t now);
+void i8253_timer_write(i8253_state_t *pit, uint8_t ofs, uint8_t val,
+                       uint64_t now);
+void i8253_gate(i8253_state_t *pit, uint8_t ofs, bool gate, uint64_t now);
 
+bool i8253_out(i8253_state_t *pit, uint8_t ofs, uint64_t now);
+// First input clock after now at which the output of counter ofs changes,
+// PIT_NEVER if it doesn't on its own
+uint64_t i8253_next_change(i8253_state_t *pit, uint8_t ofs, uint64_t now);
 
-#endif // I8253_H
\ No newline at end of file
+#endif // I8253_H
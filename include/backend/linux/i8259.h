@@ -5,47 +5,84 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+// Lines, requests, in-service and mask are bitmasks with IRQ n at bit n.
+// Whether the CPU has a request to take is worked out whenever one of them
+// changes and left on the INTR pin, so polling it is a single load.
+
 typedef struct {
     uint8_t icw[4];
     int icw_ind;
-    bool irqs[8];
-    bool irqs_last[8];
+    // Levels of the IRQ lines; a rising edge sets the IRR bit
+    uint8_t lines;
     uint8_t isr;
     uint8_t imr;
     uint8_t irr;
+    // IRQ with the lowest priority, the one after it has the highest
+    uint8_t lowest;
+    // OCW3 has the command port read the ISR rather than the IRR
+    bool read_isr;
+    // The CPU's INTR pin
+    bool *intr;
 } i8259_state_t;
 
 #define I8259_ICW1_INIT     0x10
 #define I8259_ICW1_ICW4     0x01
-#define I8259_ICW1_SINGL    0x02     
+#define I8259_ICW1_SINGL    0x02
 #define I8259_ICW2_OFS_MASK 0xF8
+#define I8259_ICW4_AEOI     0x02
+#define I8259_OCW3          0x08
+#define I8259_OCW3_RR       0x02
+#define I8259_OCW3_RIS      0x01
+// OCW2 commands, bits 7-5; the low 3 bits give the IRQ of specific ones
+#define I8259_OCW2_CMD      0xE0
+#define I8259_OCW2_IRQ      0x07
 #define I8259_EOI           0x20
+#define I8259_SPECIFIC_EOI  0x60
+#define I8259_ROTATE_EOI    0xA0
+#define I8259_SET_PRIORITY  0xC0
+#define I8259_ROTATE_SPECIFIC_EOI 0xE0
 
-#define PIC_REG_COMMAND     0x20 
+#define PIC_REG_COMMAND     0x20
 #define PIC_REG_DATA        0x21
 
+void i8259_init(i8259_state_t *pic, bool *intr);
 
-#define CALCULATE_ISR_MASK(isr) ((uint8_t)((0xFF)-(1<<(__builtin_ctz(isr)))+1))
-
-extern i8259_state_t i8259_state;
+void i8259_write_command(i8259_state_t *pic, uint8_t val);
 
-void i8259_init();
+void i8259_write_data(i8259_state_t *pic, uint8_t val);
 
-void i8259_write_command(uint8_t val);
+uint8_t i8259_read_command(i8259_state_t *pic);
 
-void i8259_write_data(uint8_t val);
+uint8_t i8259_read_data(i8259_state_t *pic);
 
-uint8_t i8259_read_command();
+// Work out the INTR pin again, after the state was put back
+void i8259_update(i8259_state_t *pic);
 
-uint8_t i8259_read_data();
+static inline bool i8259_line(i8259_state_t *pic, uint8_t irq) {
+    return pic->lines & (1 << irq);
+}
 
-void i8259_tick();
+// A device drives IRQ line irq to level
+static inline void i8259_set_irq(i8259_state_t *pic, uint8_t irq,
+                                 bool level) {
+    uint8_t bit = 1 << irq;
+    if (level == i8259_line(pic, irq)) return;
+    if (level) {
+        pic->lines |= bit;
+        pic->irr |= bit;
+    } else {
+        // A request whose line went down before it was taken is dropped
+        pic->lines &= ~bit;
+        pic->irr &= ~bit;
+    }
+    i8259_update(pic);
+}
 
-// TODO unsure if this is correct but it seems like it might
-static inline bool i8259_int() {
-    return (((i8259_state.irr & ~i8259_state.imr) & CALCULATE_ISR_MASK(i8259_state.isr)) != 0);
+static inline bool i8259_int(i8259_state_t *pic) {
+    return *pic->intr;
 }
 
-uint8_t i8259_ack();
+// Take the highest priority request in service, returns its vector
+uint8_t i8259_ack(i8259_state_t *pic);
 
-#endif // I8259_H
\ No newline at end of file
+#endif // I8259_H
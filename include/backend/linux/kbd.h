@@ -1,73 +1,189 @@
 #ifndef KBD_H
 #define KBD_H
 
-#include <SDL2/SDL_mutex.h>
+#include <linux/futex.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
-#define RESET_WAIT 50
+#include "i8259.h"
+#include "sched.h"
 
+#define KBD_IRQ 1
+
+// CPU clocks from the reset command to the self-test reply
+#define KBD_RESET_CLK 500
+// Host scancodes waiting for the CPU thread, a power of two. Override with
+// -DKBD_HOST_QUEUE=n.
+#ifndef KBD_HOST_QUEUE
+#define KBD_HOST_QUEUE 64
+#endif
+_Static_assert((KBD_HOST_QUEUE & (KBD_HOST_QUEUE - 1)) == 0,
+               "KBD_HOST_QUEUE must be a power of two");
+// Scancodes the keyboard holds for the CPU to read
+#define KBD_BUFFER 8
+
+// Scancode set 1: a key's break code is its make code with the top bit set
+#define KBD_SC_BREAK  0x80
+#define KBD_SC_CTRL   0x1D
+#define KBD_SC_LSHIFT 0x2A
+
+// Scancodes from the host thread to the CPU thread, lock free with one
+// producer and one consumer. head and tail run freely and are masked on
+// use; the host only writes tail, the CPU only head.
 typedef struct {
-    uint8_t scancode_stack[8];
-    uint8_t scancode_ptr;
-    SDL_mutex *scancode_mutex;
+    uint8_t buf[KBD_HOST_QUEUE];
+    uint32_t head;
+    uint32_t tail;
+    // The CPU is asleep in kbd_host_wait() and wants a wakeup on tail
+    uint32_t waiting;
+    // Scancodes dropped on a full ring
+    uint32_t overflows;
+} kbd_host_ring_t;
+
+typedef struct {
+    // Scancodes sent to the CPU, oldest first at head
+    uint8_t fifo[KBD_BUFFER];
+    uint8_t head;
+    uint8_t len;
+    // What port A reads once the FIFO is empty: the last scancode sent
+    uint8_t last;
+    // Scancodes dropped on a full FIFO
+    uint32_t dropped;
+    // The CPU takes scancodes from the host at a clock of its own so that
+    // recordings can put them back at the same one
+    kbd_host_ring_t host;
+    // Scancodes of text being typed in, CPU thread only; see io_type()
+    uint8_t *typing;
+    size_t typing_len;
+    size_t typing_pos;
     uint8_t state_sr;
-    uint8_t reset_timer;
-    bool *irq;
+    // Interrupt controller the keyboard's IRQ line goes to
+    i8259_state_t *pic;
+    // Of the machine the keyboard is plugged into
+    sched_state_t *sched;
 } kbd_state_t;
 
-extern kbd_state_t kbd_state;
+// CPU thread: the keyboard sends a scancode
+static inline void kbd_deliver(kbd_state_t *kbd, uint8_t scancode) {
+    if (kbd->len == KBD_BUFFER) {
+        kbd->dropped++;
+        return;
+    }
+    kbd->fifo[(kbd->head + kbd->len++) % KBD_BUFFER] = scancode;
+}
+
+static inline void kbd_init(kbd_state_t *kbd, i8259_state_t *pic,
+                            sched_state_t *sched) {
+    memset(kbd, 0, sizeof(kbd_state_t));
+    kbd->pic = pic;
+    kbd->sched = sched;
+    kbd->last = 0xAA;
+}
 
-static inline void kbd_init(bool *irq) {
-    memset(&kbd_state, 0, sizeof(kbd_state_t));
-    kbd_state.irq = irq;
-    kbd_state.reset_timer = 0;
-    kbd_state.scancode_ptr = 0;
-    kbd_state.scancode_stack[0] = 0xAA;
-    kbd_state.scancode_mutex = SDL_CreateMutex();
+static inline void kbd_free(kbd_state_t *kbd) {
+    free(kbd->typing);
+    kbd->typing = NULL;
 }
 
-static inline void kbd_update_state(uint8_t next) {
-    kbd_state.state_sr = (kbd_state.state_sr << 2) + next;
+// Scancodes typing the ASCII text of len bytes on a US keyboard, make and
+// break for every key with Shift or Ctrl held around it as needed. out has
+// to have room for 4 per byte; returns how many were written. Bytes with no
+// key are left out.
+size_t kbd_text_scancodes(const char *text, size_t len, uint8_t *out);
+
+static inline void kbd_update_state(kbd_state_t *kbd, uint8_t next,
+                                    uint64_t cycles) {
+    kbd->state_sr = (kbd->state_sr << 2) + next;
     // stupid hack to detect reset based on port B commands from BIOS
-    if ((kbd_state.state_sr & 0b111111) == 0b001101) {
+    if ((kbd->state_sr & 0b111111) == 0b001101) {
         // stupid hack to not trip IRQ too early, otherwise it runs ISR
         // before mov ah, 0 is ran in BIOS
-        kbd_state.reset_timer = RESET_WAIT;
+        sched_at(kbd->sched, SCHED_KBD, cycles + KBD_RESET_CLK);
     }
 }
 
-static inline void kbd_push_scancode(uint8_t scancode) {
-    SDL_LockMutex(kbd_state.scancode_mutex);
-    if (kbd_state.scancode_ptr < 8) {
-        kbd_state.scancode_stack[kbd_state.scancode_ptr++] = scancode;
+// SCHED_KBD: the self-test reply
+static inline void kbd_reset_done(kbd_state_t *kbd) {
+    kbd->len = 0;
+    kbd_deliver(kbd, 0xAA);
+}
+
+static inline long kbd_futex(uint32_t *addr, int op, uint32_t val,
+                             const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+// Host thread: queue a key for the CPU to take in. Never blocks; a full
+// ring drops the key and counts it.
+static inline void kbd_push_scancode(kbd_state_t *kbd, uint8_t scancode) {
+    kbd_host_ring_t *r = &kbd->host;
+    uint32_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+        KBD_HOST_QUEUE) {
+        __atomic_fetch_add(&r->overflows, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    r->buf[tail % KBD_HOST_QUEUE] = scancode;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+    sched_kick(kbd->sched);
+    // Paired with the store of waiting in kbd_host_wait(): either it sees
+    // the new tail or this sees it waiting
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        kbd_futex(&r->tail, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+static inline bool kbd_host_pending(kbd_state_t *kbd) {
+    return __atomic_load_n(&kbd->host.tail, __ATOMIC_ACQUIRE) !=
+           kbd->host.head;
+}
+
+// Move up to max queued host keys to buf, returns how many
+static inline int kbd_take_host(kbd_state_t *kbd, uint8_t *buf, int max) {
+    kbd_host_ring_t *r = &kbd->host;
+    uint32_t head = r->head;
+    uint32_t n = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    if (n > (uint32_t)max) n = max;
+    for (uint32_t i = 0; i < n; i++) {
+        buf[i] = r->buf[(head + i) % KBD_HOST_QUEUE];
     }
-    SDL_UnlockMutex(kbd_state.scancode_mutex);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
 }
 
-static inline uint8_t kbd_read() {
-    uint8_t val = kbd_state.scancode_stack[0];
-    SDL_LockMutex(kbd_state.scancode_mutex);
-    if (kbd_state.scancode_ptr > 0) {
-        val = kbd_state.scancode_stack[--kbd_state.scancode_ptr];
+// CPU thread: sleep up to ns nanoseconds, less if a host key comes in
+static inline void kbd_host_wait(kbd_state_t *kbd, int64_t ns) {
+    kbd_host_ring_t *r = &kbd->host;
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+    if (tail == r->head) {
+        kbd_futex(&r->tail, FUTEX_WAIT_PRIVATE, tail, &ts);
     }
-    SDL_UnlockMutex(kbd_state.scancode_mutex);
-    return val;
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
 }
 
-static inline void kbd_tick() {
-    if (kbd_state.reset_timer > 0 && kbd_state.reset_timer-- == 1) {
-        kbd_state.scancode_stack[0] = 0xAA;
-        kbd_state.scancode_ptr = 1;
+static inline uint8_t kbd_read(kbd_state_t *kbd) {
+    if (kbd->len > 0) {
+        kbd->last = kbd->fifo[kbd->head];
+        kbd->head = (kbd->head + 1) % KBD_BUFFER;
+        kbd->len--;
     }
+    return kbd->last;
+}
 
-    if (kbd_state.state_sr & 2) {
-        *(kbd_state.irq) = false;
-    } else if (kbd_state.scancode_ptr > 0) {
-        *(kbd_state.irq) = true;
+// Update the IRQ line after port B writes, host input and resets
+static inline void kbd_tick(kbd_state_t *kbd) {
+    if (kbd->state_sr & 2) {
+        i8259_set_irq(kbd->pic, KBD_IRQ, false);
+    } else if (kbd->len > 0) {
+        i8259_set_irq(kbd->pic, KBD_IRQ, true);
     }
 }
 
-#endif // KBD_H
\ No newline at end of file
+#endif // KBD_H
@@ -0,0 +1,83 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#define BCACHE_BITS      11
+#define BCACHE_SIZE      (1 << BCACHE_BITS)
+#define BCACHE_MAX_INSNS 32
+
+typedef struct {
+    // Linear address and IP of the first instruction
+    uint32_t addr;
+    uint16_t ip;
+    uint8_t n_insns;
+    // A block covers at most two code pages; the generation of each is
+    // recorded so a store to either one makes the block stale
+    uint16_t pages[2];
+    uint32_t gens[2];
+    x86_insn_t insns[BCACHE_MAX_INSNS];
+} bcache_block_t;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t blocks_decoded;
+    uint64_t insns_decoded;
+    uint64_t insns_executed;
+    uint64_t invalidations;
+    // Fused pairs run, by FUSE_* kind
+    uint64_t fused[FUSE_COUNT];
+    // Fused pairs split by an interrupt after the first instruction
+    uint64_t fused_split;
+} bcache_stats_t;
+
+// Position of the running instruction stream inside a cached block
+typedef struct {
+    bcache_block_t *blk;
+    uint32_t pos;
+    uint64_t epoch;
+} bcache_cursor_t;
+
+// The blocks decoded from one machine's memory
+typedef struct bcache {
+    vm_mem_t *mem;
+    bcache_stats_t stats;
+    // Bumped whenever any block may have gone stale
+    uint64_t epoch;
+    uint32_t gens[MEM_WATCH_PAGES];
+    bcache_block_t blocks[BCACHE_SIZE];
+} bcache_t;
+
+// An empty cache of code in mem. Stores to the pages it decoded from drop
+// the blocks.
+bcache_t *bcache_new(vm_mem_t *mem);
+void bcache_free(bcache_t *bc);
+
+bcache_block_t *bcache_lookup(bcache_t *bc, x86_cpu_t *cpu, uint32_t addr);
+// Drop the blocks decoded from a MEM_WATCH_SHIFT sized page
+void bcache_invalidate_page(bcache_t *bc, uint32_t page);
+void bcache_flush(bcache_t *bc);
+void bcache_dump_stats(bcache_t *bc);
+
+// Next instruction at linear address addr (cs:ip of cpu), advancing IP past
+// it. Stays inside the current block while execution falls through.
+static inline const x86_insn_t *bcache_fetch(bcache_t *bc,
+                                             bcache_cursor_t *cur,
+                                             x86_cpu_t *cpu, uint32_t addr) {
+    bcache_block_t *blk = cur->blk;
+    if (blk == NULL || cur->epoch != bc->epoch || cur->pos >= blk->n_insns ||
+        ((blk->addr + blk->insns[cur->pos].ofs) & 0xFFFFF) != addr) {
+        blk = cur->blk = bcache_lookup(bc, cpu, addr);
+        cur->pos = 0;
+        cur->epoch = bc->epoch;
+    }
+    const x86_insn_t *insn = &blk->insns[cur->pos++];
+    bc->stats.insns_executed++;
+    cpu->ip += insn->len;
+    return insn;
+}
+
+#endif // BCACHE_H
@@ -1,2 +1,10 @@
 // Highlight changed registers in the trace
-#define CFG_DIFF_TRACE
\ No newline at end of file
+#define CFG_DIFF_TRACE
+// Dispatch opcodes through a table of label addresses instead of a switch
+#if defined(__GNUC__)
+#define CFG_COMPUTED_GOTO
+#endif
+// Translate blocks to host code for -e jit
+#if defined(__x86_64__) && defined(__linux__)
+#define CFG_JIT
+#endif
@@ -0,0 +1,34 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+typedef struct {
+    // Entries from vm_run into translated code
+    uint64_t runs;
+    uint64_t blocks_translated;
+    // Instructions emitted as host code vs. calls back into x86_exec
+    uint64_t insns_native;
+    uint64_t insns_helper;
+    // Block exits patched to jump straight to their successor
+    uint64_t links;
+    uint64_t flushes;
+    // Blocks replayed on the interpreter with -x
+    uint64_t checks;
+} jit_stats_t;
+
+// Translations and code buffer of one machine, made on its first jit_run
+typedef struct jit jit_t;
+
+// Run translated code from CS:IP for at most max_insns instructions, and
+// only blocks whose clocks fit before deadline. Returns how many ran; 0
+// means nothing could run there and the caller should step one instruction
+// itself.
+uint32_t jit_run(vm_t *vm, uint32_t max_insns, uint64_t deadline);
+void jit_flush(vm_t *vm);
+void jit_free(vm_t *vm);
+void jit_dump_stats(vm_t *vm);
+
+#endif // JIT_H
@@ -1,8 +0,0 @@
-#ifndef MAIN_H
-#define MAIN_H
-
-#include <signal.h>
-
-extern volatile sig_atomic_t stop_flag;
-
-#endif // MAIN_H
\ No newline at end of file
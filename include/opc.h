@@ -1,16 +1,121 @@
-typedef enum {
-    ADD_M8_R8   = 0x00,
-    ADD_M16_R16 = 0x01,
-    ADD_R8_R8   = 0x02,
-    ADD_R16_R16 = 0x03,
-    ADD_AL_IMM  = 0x04,
-    ADD_AX_IMM  = 0x05,
-    PUSH_ES     = 0x06,
-    POP_ES      = 0x07,
-    OR_M8_R8    = 0x08,
-    OR_M16_R16  = 0x09,
-    OR_R8_R8    = 0x0A,
-    OR_AL_IMM   = 0x0C,
-    OR_AX_IMM   = 0x0D,
-    PUSH_CS     = 0x0E,
-} x86_opc_t;
\ No newline at end of file
+#ifndef OPC_H
+#define OPC_H
+
+#include <stdint.h>
+
+// Every handler label in vm_run. Opcodes that share an implementation share a
+// handler and are told apart by the attributes in x86_opc_table.
+#define X86_HANDLERS(X)                                                        \
+    X(ILLEGAL)                                                                 \
+    X(PREFIX)                                                                  \
+    X(ARITH)                                                                   \
+    X(MOV_RM)                                                                  \
+    X(ALU_ACC)                                                                 \
+    X(INC_R16)                                                                 \
+    X(DEC_R16)                                                                 \
+    X(PUSH_R16)                                                                \
+    X(POP_R16)                                                                 \
+    X(XCHG_AX)                                                                 \
+    X(MOV_R16_IMM)                                                             \
+    X(MOV_R8_IMM)                                                              \
+    X(JCC)                                                                     \
+    X(JCXZ)                                                                    \
+    X(GRP_IMM)                                                                 \
+    X(SHIFT)                                                                   \
+    X(STRING)                                                                  \
+    X(PUSH_SEG)                                                                \
+    X(POP_SEG)                                                                 \
+    X(TEST_RM)                                                                 \
+    X(XCHG_RM)                                                                 \
+    X(MOV_RM_SEG)                                                              \
+    X(LEA)                                                                     \
+    X(MOV_SEG_RM)                                                              \
+    X(POP_RM)                                                                  \
+    X(CBW)                                                                     \
+    X(CWD)                                                                     \
+    X(CALL_FAR)                                                                \
+    X(PUSHF)                                                                   \
+    X(POPF)                                                                    \
+    X(SAHF)                                                                    \
+    X(LAHF)                                                                    \
+    X(MOV_ACC_MEM)                                                             \
+    X(MOV_MEM_ACC)                                                             \
+    X(TEST_ACC)                                                                \
+    X(RET_IMM)                                                                 \
+    X(RET)                                                                     \
+    X(LES_LDS)                                                                 \
+    X(MOV_RM_IMM)                                                              \
+    X(RETF_IMM)                                                                \
+    X(RETF)                                                                    \
+    X(INT3)                                                                    \
+    X(INT)                                                                     \
+    X(INTO)                                                                    \
+    X(IRET)                                                                    \
+    X(XLAT)                                                                    \
+    X(LOOPNZ)                                                                  \
+    X(LOOPZ)                                                                   \
+    X(LOOP)                                                                    \
+    X(IN_IMM)                                                                  \
+    X(OUT_IMM)                                                                 \
+    X(IN_DX)                                                                   \
+    X(OUT_DX)                                                                  \
+    X(CALL_NEAR)                                                               \
+    X(JMP_NEAR)                                                                \
+    X(JMP_FAR)                                                                 \
+    X(JMP_SHORT)                                                               \
+    X(HLT)                                                                     \
+    X(CMC)                                                                     \
+    X(GRP3)                                                                    \
+    X(CLC)                                                                     \
+    X(STC)                                                                     \
+    X(CLI)                                                                     \
+    X(STI)                                                                     \
+    X(CLD)                                                                     \
+    X(STD)                                                                     \
+    X(GRP4)                                                                    \
+    X(GRP5)
+
+#define X86_HANDLER_ENUM(name) H_##name,
+typedef enum { X86_HANDLERS(X86_HANDLER_ENUM) H_COUNT } x86_handler_t;
+#undef X86_HANDLER_ENUM
+
+// Prefix class of an opcode byte
+#define PFX_NONE 0
+#define PFX_SEG  1
+#define PFX_REP  2
+#define PFX_LOCK 3
+
+// Immediate operand following the opcode and ModR/M bytes
+#define IMM_NONE 0
+#define IMM_8    1
+// Sign-extended to 16 bits
+#define IMM_8S   2
+#define IMM_16   3
+// Byte or word depending on s
+#define IMM_S    4
+// Offset word then segment word
+#define IMM_FAR  5
+// IMM_S for TEST (reg 0/1) only, none for the rest of group 3
+#define IMM_GRP3 6
+
+typedef struct {
+    uint8_t handler;
+    // Word operand (bit 0 of most opcodes)
+    uint8_t s : 1;
+    // Direction, register is the destination (bit 1 of most opcodes).
+    // Inverts the condition for Jcc.
+    uint8_t d : 1;
+    // ALU function, register index, segment register or condition code
+    uint8_t fnc : 3;
+    uint8_t pfx : 2;
+    // Followed by a ModR/M byte
+    uint8_t modrm : 1;
+    uint8_t imm : 3;
+    // May transfer control, ends a basic block
+    uint8_t br : 1;
+} x86_opc_info_t;
+
+extern const x86_opc_info_t x86_opc_table[256];
+extern const char *const x86_handler_names[H_COUNT];
+
+#endif // OPC_H
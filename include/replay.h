@@ -0,0 +1,99 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+// Record and replay of a session. Everything from outside the machine is
+// logged with the CPU clock at which the devices took it; given the same
+// starting state, feeding it back at the same clocks runs the same way.
+
+#define REPLAY_MAGIC   "86EMRPLY"
+#define REPLAY_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // Machine the recording starts from, see snap_machine_id()
+    uint64_t start_id;
+    uint64_t start_cycles;
+} replay_header_t;
+
+// What an entry carries. Entries follow the header as a varint of the
+// clocks since the previous one, the kind and a data byte.
+typedef enum {
+    REPLAY_KBD,
+} replay_kind_t;
+
+typedef enum {
+    REPLAY_OFF,
+    REPLAY_RECORD,
+    // Host input is ignored until the log runs out
+    REPLAY_PLAY,
+} replay_mode_t;
+
+typedef struct {
+    uint64_t cycles;
+    uint8_t kind;
+    uint8_t data;
+} replay_entry_t;
+
+// Kept in vm->replay, made on first use
+typedef struct replay_state {
+    replay_mode_t mode;
+    FILE *f;
+    // Clock of the last entry read or written
+    uint64_t last;
+    // Entry due next when playing
+    uint64_t next;
+    uint8_t next_kind;
+    uint8_t next_data;
+    uint32_t entries;
+    vm_t *vm;
+    // Playing runs at full speed; the setting to put back
+    bool idle_sleep;
+    // Every input taken since replay_journal_start(), so that reverse
+    // execution can run the same stretch again. Entries from pos on are
+    // fed back before anything else.
+    bool journal_on;
+    replay_entry_t *journal;
+    size_t journal_len;
+    size_t journal_cap;
+    size_t journal_pos;
+} replay_state_t;
+
+// Start logging input to path from the machine as it is now
+bool replay_record(vm_t *vm, const char *path);
+// Start feeding the input logged in path, which has to have been recorded
+// from the machine as it is now. Idle time is skipped rather than slept
+// until the recording runs out.
+bool replay_play(vm_t *vm, const char *path);
+void replay_close(vm_t *vm);
+void replay_free(vm_t *vm);
+
+// Keep a journal of the input taken from now on, or drop it
+void replay_journal_start(vm_t *vm);
+void replay_journal_stop(vm_t *vm);
+// The machine has been put back to CPU clock cycles: feed the journal
+// again from there
+void replay_rewind(vm_t *vm, uint64_t cycles);
+
+// Whether input is coming from a recording or the journal, and host input
+// is to be ignored
+static inline bool replay_playing(vm_t *vm) {
+    replay_state_t *r = vm->replay;
+    if (r == NULL) return false;
+    return __atomic_load_n(&r->mode, __ATOMIC_RELAXED) == REPLAY_PLAY ||
+           r->journal_pos < r->journal_len;
+}
+
+// Log host input the devices took at CPU clock cycles
+void replay_log(vm_t *vm, uint64_t cycles, replay_kind_t kind, uint8_t data);
+// Take the next logged input if it is due by cycles
+bool replay_next(vm_t *vm, uint64_t cycles, uint8_t *kind, uint8_t *data);
+
+#endif // REPLAY_H
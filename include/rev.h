@@ -0,0 +1,47 @@
+#ifndef REV_H
+#define REV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Reverse execution for the debugger. While history is kept the machine is
+// checkpointed as it runs, memory as the pages stored to since the
+// checkpoint before. Going back puts the nearest checkpoint at or before
+// the target back and runs forward to it again, with input fed back from
+// the replay journal so that the run is the same. Runs forward from a point
+// in the past take the same input again until they reach the present.
+
+// Instructions between checkpoints as they are taken
+#define REV_INTERVAL 100000
+// Bounds on the history. Past them, checkpoints are dropped where they are
+// densest relative to their age, so that the recent past stays quick to
+// reach and the distant past gets coarser.
+#define REV_CKPT_MAX 256
+#define REV_MEM_MAX  (64 << 20)
+
+// The history of a machine, vm->rev
+typedef struct rev_state rev_state_t;
+
+// Start keeping history from the machine as it is now. Translated code
+// only calls into the devices at block exits, which depend on where a run
+// started, so the JIT engine can't be run back; false for it.
+bool rev_start(vm_t *vm);
+void rev_stop(vm_t *vm);
+bool rev_active(vm_t *vm);
+
+// vm_run, checkpointing on the way when history is kept
+void rev_run(vm_t *vm, int max_insns);
+
+// Each of these puts the machine back as it was before an instruction,
+// returning false with the machine unchanged if there is none in the
+// history: the one before the current instruction, the last one at the
+// breakpoint, and the last one to store to linear address addr
+bool rev_step(vm_t *vm);
+bool rev_continue(vm_t *vm);
+bool rev_last_write(vm_t *vm, uint32_t addr);
+
+void rev_dump_stats(vm_t *vm);
+
+#endif // REV_H
@@ -0,0 +1,72 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Device deadlines on the CPU clock. The CPU loop compares vm->cycles with
+// vm->sched.next after every instruction and only calls into the devices
+// once it has been reached.
+
+typedef enum {
+    // Next change of the PIT counter 0 output
+    SCHED_PIT,
+    // Keyboard self-test reply after a reset
+    SCHED_KBD,
+    // Next input of a replayed recording
+    SCHED_INPUT,
+    // Next DMA span to land
+    SCHED_DMA,
+    // Next scancode of text being typed in
+    SCHED_TYPE,
+    // End of the current run, see vm_run_until()
+    SCHED_END,
+    SCHED_COUNT,
+} sched_event_t;
+
+#define SCHED_NEVER UINT64_MAX
+
+// Called with the scheduler's context and the CPU clock it runs at, which
+// may be past the deadline
+typedef void (*sched_fn_t)(void *ctx, uint64_t cycles);
+
+typedef struct {
+    // Earliest deadline; 0 has the CPU call in after this instruction
+    uint64_t next;
+    // Set from any thread along with next = 0
+    bool kick;
+    // Min-heap of pending events on when, and each event's heap slot or -1
+    uint8_t heap[SCHED_COUNT];
+    int8_t slot[SCHED_COUNT];
+    int count;
+    uint64_t when[SCHED_COUNT];
+    sched_fn_t fn[SCHED_COUNT];
+    void *ctx;
+} sched_state_t;
+
+void sched_init(sched_state_t *s, void *ctx);
+void sched_register(sched_state_t *s, sched_event_t ev, sched_fn_t fn);
+
+// Run ev at CPU clock when instead of its current deadline; SCHED_NEVER
+// cancels it. CPU thread only.
+void sched_at(sched_state_t *s, sched_event_t ev, uint64_t when);
+
+// Run every event due at cycles, earliest first
+void sched_run(sched_state_t *s, uint64_t cycles);
+
+// Have the CPU call in after the current instruction. Safe from any thread,
+// for host input.
+void sched_kick(sched_state_t *s);
+
+// Earliest deadline of the pending events other than ev
+uint64_t sched_next_except(sched_state_t *s, sched_event_t ev);
+
+static inline uint64_t sched_next(sched_state_t *s) {
+    return __atomic_load_n(&s->next, __ATOMIC_RELAXED);
+}
+
+static inline bool sched_due(sched_state_t *s, uint64_t cycles) {
+    return cycles >= sched_next(s);
+}
+
+#endif // SCHED_H
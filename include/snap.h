@@ -0,0 +1,57 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vm.h"
+#include "vm_mem.h"
+
+// Machine snapshots. A file is a snap_header_t, the CPU, the device state
+// and then the memory pages it holds, page aligned so that the file can be
+// mapped and copied from directly. A full snapshot holds every page; an
+// incremental one only those stored to since its parent, which is loaded
+// first.
+
+#define SNAP_MAGIC      "86EMSNAP"
+#define SNAP_VERSION    7
+#define SNAP_PAGE_SHIFT MEM_PAGE_SHIFT
+#define SNAP_PAGE_SIZE  (1 << SNAP_PAGE_SHIFT)
+#define SNAP_PATH_MAX   4096
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    // Layout of what follows, which has to match this build's
+    uint32_t cpu_size;
+    uint32_t io_size;
+    uint32_t page_shift;
+    // Hash of the whole machine when saved, and of the parent's, 0 if this
+    // is a full snapshot
+    uint64_t id;
+    uint64_t parent_id;
+    char parent[SNAP_PATH_MAX];
+    uint64_t cycles;
+    uint64_t insns;
+    uint8_t map[MEM_PAGES];
+    // Pages held in this file, in address order from pages_ofs
+    uint64_t present[MEM_PAGES / 64];
+    uint32_t cpu_ofs;
+    uint32_t io_ofs;
+    uint32_t pages_ofs;
+} snap_header_t;
+
+// Hash of the CPU, device and memory state, which identifies a snapshot
+uint64_t snap_machine_id(vm_t *vm);
+
+// Write the machine to path. Incremental snapshots keep only the pages
+// stored to since the snapshot last saved or loaded, which becomes the
+// parent. Returns false after printing why it failed.
+bool snap_save(vm_t *vm, const char *path, bool incremental);
+
+// Put the machine back as saved to path, loading its parents first
+bool snap_load(vm_t *vm, const char *path);
+// Forget the snapshot last saved or loaded
+void snap_free(vm_t *vm);
+
+#endif // SNAP_H
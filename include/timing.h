@@ -0,0 +1,41 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+// 8088 clock counts. The figures are the 8086 datasheet's with CLK_BUS added
+// for every word moved, since the 8088 needs a second bus cycle for the
+// high byte.
+
+// 14.31818 MHz crystal over 3
+#define CPU_CLOCK_HZ 4772727
+
+#define CLK_BUS 4
+
+// Fewest clocks any instruction takes
+#define CLK_MIN 2
+
+// Push flags, CS and IP and fetch the vector; INT n, INT 3, INTO, divide
+// errors and hardware interrupts all go through it
+#define CLK_INT_ENTRY (51 + 5 * CLK_BUS)
+// The two INTA cycles of a hardware interrupt on top of the entry
+#define CLK_INTR_ACK 10
+
+// Per bit for shifts and rotates by CL
+#define CLK_SHIFT_BIT 4
+
+// Clocks of a decoded instruction, not counting the parts that depend on
+// the operands: taken branches, REP elements and shift counts
+uint16_t x86_clocks(const x86_insn_t *insn);
+
+// Per element of a REP string instruction
+uint16_t x86_rep_clocks(uint8_t opc);
+
+// Extra clocks when a conditional jump, loop or JCXZ branches
+static inline uint16_t x86_taken_clocks(uint8_t handler) {
+    return handler == H_LOOPNZ ? 14 : 12;
+}
+
+#endif // TIMING_H
@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct {
     char* buf;
@@ -15,6 +16,10 @@ char* arg_next(arg_split_t *it);
 bool sep_whitespace(char c);
 bool sep_semi(char c);
 
+// The whole of the file at path in a malloc'd buffer of *len bytes, or NULL
+// if it can't be opened
+char *read_file(const char *path, size_t *len);
+
 #define SEGMENT(base,offset) ((((base) << 4) + ((uint16_t)(offset))) & 0xFFFFF)
 #define SEXT_8_16(x) ((int16_t)((int8_t)(x)))
 #define SEXT_16_32(x) ((int32_t)((int16_t)(x)))
@@ -1,10 +1,13 @@
 #ifndef vm_MAIN_H
 #define vm_MAIN_H
 
+#include <signal.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "vm_mem.h"
 #include "util.h"
+#include "opc.h"
+#include "sched.h"
 
 typedef union {
     uint16_t x;
@@ -36,48 +39,228 @@ typedef union {
 #define FLAGS_RESERVED_MASK 0xF02A
 #define FLAGS_DEFAULT       0xF002
 
+// Kind of the last flag-setting operation, see last_op_t
+// flags is up to date
+#define LAZY_NONE 0
+// ADD/ADC: O S Z A P C
+#define LAZY_ADD  1
+// SUB/SBB/CMP/NEG: O S Z A P C
+#define LAZY_SUB  2
+// INC/DEC: O S Z A P, C stays in flags
+#define LAZY_INC  3
+#define LAZY_DEC  4
+// Logic ops and shifts: S Z P, the rest already written to flags
+#define LAZY_SZP  5
+
+// Last flag-setting ALU operation. The arithmetic flags it produced are
+// worked out from it only when something reads them.
 typedef struct {
     uint32_t op1;
     uint32_t op2;
+    // Unmasked result, carry or borrow out lands above the operand size
     uint32_t res;
     uint8_t opc;
     uint8_t is_16;
 } last_op_t;
 
+// Register numbers as encoded in ModR/M and opcode bits
+#define REG_AX 0
+#define REG_CX 1
+#define REG_DX 2
+#define REG_BX 3
+#define REG_SP 4
+#define REG_BP 5
+#define REG_SI 6
+#define REG_DI 7
+
+#define SREG_ES 0
+#define SREG_CS 1
+#define SREG_SS 2
+#define SREG_DS 3
+
+// Byte register number (AL CL DL BL AH CH DH BH) to an index into regs8
+#define REG8_IDX(r) ((((r) & 3) << 1) | (((r) >> 2) & 1))
+
 typedef struct {
-    x86_reg_t a;
-    x86_reg_t b;
-    x86_reg_t c;
-    x86_reg_t d;
-    uint16_t si;
-    uint16_t di;
-    uint16_t bp;
-    uint16_t sp;
-    uint16_t es;
-    uint16_t cs;
-    uint16_t ss;
-    uint16_t ds;
+    union {
+        uint16_t regs[8];
+        uint8_t regs8[16];
+        struct {
+            x86_reg_t a;
+            x86_reg_t c;
+            x86_reg_t d;
+            x86_reg_t b;
+            uint16_t sp;
+            uint16_t bp;
+            uint16_t si;
+            uint16_t di;
+        };
+    };
+    union {
+        uint16_t sregs[4];
+        struct {
+            uint16_t es;
+            uint16_t cs;
+            uint16_t ss;
+            uint16_t ds;
+        };
+    };
+    // Linear base of each segment, sregs[n] << 4. Set both with x86_set_sreg.
+    uint32_t sbase[4];
     uint16_t ip;
     // TODO change this to a union type
     x86_flags_t flags;
+    // Flags covered by last_op.opc are stale in flags until x86_flags_sync
+    last_op_t last_op;
     int int_src;
     // TODO remove this Shit
     int seg_override;
 } x86_cpu_t; 
 
 
+typedef struct {
+    union {
+        uint8_t rm_byte;
+        struct {
+            uint8_t rm : 3;
+            uint8_t reg : 3;
+            uint8_t mod : 2;
+        } __attribute__((packed));
+    };
+    uint16_t disp;
+} mod_reg_rm_t;
+
+// Flag-setting instruction the block cache runs in one step with the Jcc
+// following it, see x86_insn_t.fuse
+#define FUSE_NONE    0
+// CMP r/m, CMP with an immediate
+#define FUSE_CMP_JCC  1
+// TEST r/m, TEST with an immediate
+#define FUSE_TEST_JCC 2
+// INC/DEC r16
+#define FUSE_DEC_JCC  3
+#define FUSE_COUNT    4
+
+// One instruction with its prefixes and operands already fetched
+typedef struct {
+    uint8_t opc;
+    // REP prefix byte, 0 if none
+    uint8_t pfx;
+    int8_t seg_override;
+    // Length in bytes including prefixes
+    uint8_t len;
+    // Offset from the start of the containing block
+    uint8_t ofs;
+    x86_opc_info_t info;
+    mod_reg_rm_t mod_reg_rm;
+    // Immediate, sign-extended to 16 bits for IMM_8S
+    uint16_t imm;
+    // Segment of a far pointer immediate
+    uint16_t imm2;
+    // 8088 clocks before operand-dependent extras, see x86_clocks
+    uint16_t clk;
+    // FUSE_*, set by the block cache decoder
+    uint8_t fuse;
+} x86_insn_t;
+
+typedef enum {
+    // Fetch and decode every instruction
+    VM_ENGINE_INTERP,
+    // Run predecoded basic blocks from the block cache
+    VM_ENGINE_BCACHE,
+    // Translate blocks to host code, stepping the block cache where it can't
+    VM_ENGINE_JIT,
+} vm_engine_t;
+
+// Machine state at the end of a loop iteration, compared with the next one
+typedef struct {
+    uint32_t addr;
+    uint32_t stores;
+    uint32_t io;
+    uint64_t cycles;
+    uint64_t insns;
+    x86_cpu_t cpu;
+} idle_probe_t;
+
+// Why the last run stopped short at an instruction it couldn't complete,
+// which cs:ip is left at
+typedef enum {
+    VM_FAULT_NONE,
+    // An opcode or encoding the 8086 doesn't have
+    VM_FAULT_OPCODE,
+    // A read of a port no device answers
+    VM_FAULT_PORT,
+} vm_fault_t;
+
+// AFL-style edge coverage: one byte per hash of a branch and its target
+#define VM_COV_MAP_SIZE (1 << 16)
+
+struct vm_io;
+struct jit;
+struct replay_state;
+struct rev_state;
+struct snap_state;
+
+// One machine. Everything it runs on hangs off this, so any number can run
+// side by side, each on one thread at a time.
 // TODO separate out into CPU and VM structs, 
 // but dont want to add another indirection so idk
-typedef struct {
+typedef struct vm {
     x86_cpu_t cpu;
     struct {
         bool enable_trace;
+        vm_engine_t engine;
+        // Replay every translated block on the interpreter and compare
+        bool jit_check;
+        // Spend time skipped while idle sleeping on the host
+        bool idle_sleep;
+        // Never open a display window
+        bool headless;
+        // A HLT ends the run rather than waiting for an interrupt
+        bool halt_stop;
     } opts;
     struct {
+        // CPU clocks, peripherals are run against this
         uint64_t cycles;
+        uint64_t insns;
+        // Host time spent in vm_run
+        uint64_t host_ns;
+        // Clocks skipped in HLT and polling loops
+        uint64_t idle_cycles;
+        // Clock the current run ends at, see vm_run_until()
+        uint64_t cycles_end;
         int32_t bkpt;
         bool bkpt_clear;
+        // INTR pin, driven by the interrupt controller
+        bool intr;
     };
+    // Set from any thread or a signal handler to have runs and the
+    // debugger return
+    volatile sig_atomic_t stop;
+    // What the guest wrote to port 0xFF to end the run; -1 until then
+    int exit_code;
+    vm_fault_t fault;
+    // Hit counts of the edges taken, VM_COV_MAP_SIZE bytes, counted when
+    // set. Runs with it set step the block cache rather than the JIT.
+    uint8_t *cov_map;
+    // Hash of the last branch target, shifted as AFL does
+    uint32_t cov_prev;
+    // Port reads and writes so far
+    uint32_t io_access_count;
+    // Loops ending in a backward branch and loops around an IN
+    idle_probe_t idle_probes[2];
+    // Host time the last idle sleep overran by, taken off the next
+    int64_t idle_overrun;
+    sched_state_t sched;
+    // Device state, owned by the backend
+    struct vm_io *io;
+    struct bcache *bcache;
+    struct jit *jit;
+    // Recording, reverse execution and snapshot lineage, NULL until used
+    struct replay_state *replay;
+    struct rev_state *rev;
+    struct snap_state *snap;
+    vm_mem_t mem;
 } vm_t;
 
 typedef union {
@@ -86,42 +269,93 @@ typedef union {
 } flags_union;
 
 
+// A machine at the reset vector with blank memory, see init_mem_blank()
 vm_t* vm_init();
+void vm_free(vm_t *vm);
+
+// Run up to max_insns instructions, or until stopped if negative. Stops
+// short at a fault, see vm->fault, which every run starts clear of.
+void vm_run(vm_t* state, int max_insns);
+// vm_run() that also ends once vm->cycles reaches end_cycles, at the first
+// instruction boundary there or past it. A HLT waiting then is left at, to
+// wait again on the next run.
+void vm_run_until(vm_t *vm, int max_insns, uint64_t end_cycles);
+
+// Whether the last run stopped at the breakpoint, which the next one runs
+// past
+static inline bool vm_at_bkpt(vm_t *vm) {
+    return vm->bkpt >= 0 && vm->bkpt_clear &&
+           SEGMENT(vm->cpu.cs, vm->cpu.ip) == (uint32_t)vm->bkpt;
+}
+
+// Emulated against host clock rate
+void vm_dump_stats(vm_t *vm);
 
-void vm_run(vm_t* state, int max_cycles);
+// Decode the instruction at cs:*ip, leaving *ip just past it
+void x86_decode(vm_mem_t *m, uint16_t cs, uint16_t *ip, x86_insn_t *insn);
 
-#define LOAD_IP_BYTE(cpu) (load_u8(cpu->cs, (cpu->ip++)))
-static inline uint16_t LOAD_IP_WORD(x86_cpu_t* cpu) {
-    uint8_t b1 = LOAD_IP_BYTE(cpu);
-    uint8_t b2 = LOAD_IP_BYTE(cpu);
-    return (b2 << 8) + b1;
+#define X86_EXEC_OK   0
+#define X86_EXEC_HALT 1
+// The guest asked to exit, see vm->exit_code
+#define X86_EXEC_EXIT 2
+// The instruction can't be run, see vm->fault
+#define X86_EXEC_FAULT 3
+
+// Execute a decoded instruction; IP must already point past it
+int x86_exec(vm_t *vm, const x86_insn_t *insn);
+
+void x86_flags_materialize(x86_cpu_t *cpu);
+
+// Bring flags up to date with last_op
+static inline void x86_flags_sync(x86_cpu_t *cpu) {
+    if (cpu->last_op.opc != LAZY_NONE) {
+        x86_flags_materialize(cpu);
+    }
+}
+
+static inline void x86_set_sreg(x86_cpu_t *cpu, uint8_t sr, uint16_t val) {
+    cpu->sregs[sr] = val;
+    cpu->sbase[sr] = (uint32_t)val << 4;
+}
+
+// Recompute sbase after sregs was written directly
+static inline void x86_sync_sbase(x86_cpu_t *cpu) {
+    for (int i = 0; i < 4; i++) {
+        cpu->sbase[i] = (uint32_t)cpu->sregs[i] << 4;
+    }
 }
 
-static inline void push_u8(x86_cpu_t *cpu, uint8_t val) {
+static inline void push_u8(vm_t *vm, uint8_t val) {
+    x86_cpu_t *cpu = &vm->cpu;
     cpu->sp -= 1;
-    store_u8(cpu->ss, cpu->sp, val);
+    store_u8_base(&vm->mem, cpu->sbase[SREG_SS], cpu->sp, val);
 }
 
-static inline void push_u16(x86_cpu_t *cpu, uint16_t val) {
-    push_u8(cpu, val >> 8);
-    push_u8(cpu, val & 0xFF);
+static inline void push_u16(vm_t *vm, uint16_t val) {
+    x86_cpu_t *cpu = &vm->cpu;
+    cpu->sp -= 2;
+    store_u16_base(&vm->mem, cpu->sbase[SREG_SS], cpu->sp, val);
 }
 
-static inline uint8_t pop_u8(x86_cpu_t *cpu) {
-    uint8_t res = load_u8(cpu->ss, cpu->sp);
+static inline uint8_t pop_u8(vm_t *vm) {
+    x86_cpu_t *cpu = &vm->cpu;
+    uint8_t res = load_u8_base(&vm->mem, cpu->sbase[SREG_SS], cpu->sp);
     cpu->sp += 1;
     return res;
 }
 
-static inline uint16_t pop_u16(x86_cpu_t *cpu) {
-    uint8_t b1 = pop_u8(cpu);
-    uint8_t b2 = pop_u8(cpu);
-    return (b2 << 8) + b1;
+static inline uint16_t pop_u16(vm_t *vm) {
+    x86_cpu_t *cpu = &vm->cpu;
+    uint16_t res = load_u16_base(&vm->mem, cpu->sbase[SREG_SS], cpu->sp);
+    cpu->sp += 2;
+    return res;
 }
 
-static inline void pop_flags(x86_cpu_t *cpu) {
-    uint16_t fl = pop_u16(cpu);
+static inline void pop_flags(vm_t *vm) {
+    x86_cpu_t *cpu = &vm->cpu;
+    uint16_t fl = pop_u16(vm);
     cpu->flags.num = FLAGS_DEFAULT | (fl & ~FLAGS_RESERVED_MASK);
+    cpu->last_op.opc = LAZY_NONE;
 }
 
 #endif // vm_MAIN_H
\ No newline at end of file
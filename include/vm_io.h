@@ -1,22 +1,68 @@
 #ifndef VM_IO_H
 #define VM_IO_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "sched.h"
+#include "vm.h"
+
 #define PPI_REG_PORT_A 0x60
 #define PPI_REG_PORT_B 0x61
 #define PPI_REG_PORT_C 0x62
 
-void io_init();
+// The devices of a machine, vm->io, defined by the backend
+typedef struct vm_io vm_io_t;
+
+// Plug the devices into vm. They read the time off vm->cycles, the CPU
+// clock, and schedule on vm->sched.
+void io_init(vm_t *vm);
+void io_free(vm_t *vm);
+
+void io_write_u16(vm_t *vm, uint16_t addr, uint16_t data);
+uint16_t io_read_u16(vm_t *vm, uint16_t addr, uint16_t pc);
+
+// Run the device events due by now and pick up IRQ lines
+void io_run(vm_t *vm);
+
+// After every instruction: one compare unless a device is due
+static inline void io_tick(vm_t *vm) {
+    if (sched_due(&vm->sched, vm->cycles)) io_run(vm);
+}
+
+#define IO_NO_EVENT SCHED_NEVER
+
+// CPU clock of the next change the devices make on their own, such as a
+// timer output, or IO_NO_EVENT. Host input is not counted.
+uint64_t io_next_event(vm_t *vm, uint64_t cycles);
+// CPU clock up to which a read of port addr returns what it does at cycles
+uint64_t io_read_stable_until(vm_t *vm, uint16_t addr, uint64_t cycles);
+// Host input is waiting to be delivered
+bool io_input_pending(vm_t *vm);
+// Sleep up to ns host nanoseconds, waking as soon as host input comes in
+void io_input_wait(vm_t *vm, int64_t ns);
+
+// Type in len bytes of ASCII text on the keyboard, after anything still
+// being typed. Keys go in as fast as the guest takes them: each once the
+// last one has been read from port A and, for a key press, once the BIOS
+// keyboard buffer has room. Returns false, typing nothing, while a replay
+// plays: the recording has the session's keys.
+bool io_type(vm_t *vm, const char *text, size_t len);
 
-void io_write_u16(uint16_t addr, uint16_t data);
-uint16_t io_read_u16(uint16_t addr, uint16_t pc);
+// Device state as kept in a snapshot: io_snap_size() bytes, free of host
+// pointers. Restoring reschedules the device events.
+size_t io_snap_size();
+void io_save(vm_t *vm, void *buf);
+void io_restore(vm_t *vm, const void *buf);
 
-void io_tick(uint64_t cycles);
+void io_dump_stats(vm_t *vm);
 
-uint8_t io_int_ack();
+uint8_t io_int_ack(vm_t *vm);
 
-bool io_int_poll();
+// The interrupt controller has a request for the CPU
+static inline bool io_int_poll(vm_t *vm) {
+    return vm->intr;
+}
 
 #endif // VM_IO_H
\ No newline at end of file
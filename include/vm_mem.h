@@ -1,8 +1,10 @@
 #ifndef VM_MEM_H
 #define VM_MEM_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "util.h"
 
 typedef struct {
@@ -10,45 +12,222 @@ typedef struct {
     size_t prog_start;
 } prog_info_t;
 
-extern uint8_t* mem;
-extern prog_info_t prog_info;
+// 1MB address space. The array has MEM_SLACK more zeroed bytes past the
+// top, so an access running off the end stays inside it.
+#define MEM_SIZE  (1 << 20)
+#define MEM_SLACK 0x10000
 
+// What each 4KB page of the address space is. Loads are plain loads from
+// memory everywhere: unmapped pages hold 0xFF, the open bus. Stores to ROM
+// and unmapped pages are dropped.
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGES      (MEM_SIZE >> MEM_PAGE_SHIFT)
 
-void init_mem_blank();
-void load_mem(FILE *prog, int offset);
+typedef enum {
+    MEM_PAGE_RAM,
+    MEM_PAGE_ROM,
+    // Device memory the host side reads, such as the CGA frame buffer
+    MEM_PAGE_MMIO,
+    MEM_PAGE_UNMAPPED,
+} mem_page_type_t;
 
-// memory is little endian
-static inline uint8_t load_u8(uint16_t seg, uint16_t offset) {
-    return mem[SEGMENT(seg, offset)];
+// Per-page flags that send a store through mem_watch_hit() before it lands
+#define MEM_WATCH_SHIFT 8
+#define MEM_WATCH_PAGES ((1 << 20) >> MEM_WATCH_SHIFT)
+// Page holds code decoded into the block cache
+#define MEM_WATCH_CODE  0x01
+// Overwritten bytes are kept in vm_mem_t.store_log
+#define MEM_WATCH_LOG   0x02
+// ROM or unmapped: stores are dropped
+#define MEM_WATCH_RO    0x04
+// Some dirty view has the page clean
+#define MEM_WATCH_DIRTY 0x08
+// Holds vm_mem_t.watch_addr
+#define MEM_WATCH_ADDR  0x10
+
+// Dirty page tracking. Each consumer opens its own view with a page size of
+// 1 << shift bytes, at least 1 << MEM_WATCH_SHIFT, and takes pages from it
+// independently of the others. The first store to a page a view has clean
+// goes through mem_watch_hit(); later ones to that page don't. With no view
+// open nothing is armed.
+#define MEM_DIRTY_VIEWS 4
+
+typedef struct {
+    bool open;
+    uint8_t shift;
+    // One bit per page
+    uint64_t bits[MEM_WATCH_PAGES / 64];
+} mem_dirty_view_t;
+
+typedef struct {
+    uint32_t addr;
+    uint8_t old;
+} mem_log_entry_t;
+
+typedef struct {
+    mem_log_entry_t *entries;
+    size_t len;
+    size_t cap;
+} mem_log_t;
+
+struct bcache;
+
+// The address space of one machine
+typedef struct vm_mem {
+    // MEM_SIZE + MEM_SLACK bytes
+    uint8_t *data;
+    uint8_t map[MEM_PAGES];
+    // Flags may be changed from another thread through mem_dirty_take(), so
+    // go through mem_watch_set/clear rather than writing them directly
+    uint8_t watch_pages[MEM_WATCH_PAGES];
+    // Bumped by every store, so a caller can tell whether memory was written
+    uint32_t store_count;
+    mem_dirty_view_t dirty_views[MEM_DIRTY_VIEWS];
+    // A single byte whose stores are counted in watch_addr_hits, for the
+    // debugger to find the stores to it; -1 if none
+    int32_t watch_addr;
+    uint64_t watch_addr_hits;
+    // Undo log of stores to MEM_WATCH_LOG pages
+    mem_log_t store_log;
+    // Where the last image went in
+    prog_info_t prog_info;
+    // Dropping the blocks decoded from MEM_WATCH_CODE pages on a store
+    struct bcache *bcache;
+} vm_mem_t;
+
+// Zeroed memory mapped like an IBM PC with 640KB, a CGA card and the
+// system ROMs at F0000
+void init_mem_blank(vm_mem_t *m);
+void mem_free(vm_mem_t *m);
+// Mark [addr, addr + len) as type; both must be page aligned
+void mem_map_set(vm_mem_t *m, uint32_t addr, uint32_t len,
+                 mem_page_type_t type);
+// Whether a store to every byte of [addr, addr + len) lands
+bool mem_range_writable(vm_mem_t *m, uint32_t addr, uint32_t len);
+// Copy a ROM image in at offset, past the write protection
+void load_mem(vm_mem_t *m, FILE *prog, int offset);
+// Map the size byte image open as fd in at offset as ROM instead, with its
+// pages shared by every machine that maps the same file. Only for whole
+// pages going to ROM or unmapped space; false if it can't be, and the image
+// has to be copied in with load_mem().
+bool mem_map_rom(vm_mem_t *m, int fd, size_t size, uint32_t offset);
+
+static inline void mem_watch_set(vm_mem_t *m, uint32_t page, uint8_t flags) {
+    __atomic_fetch_or(&m->watch_pages[page], flags, __ATOMIC_RELAXED);
+}
+
+static inline void mem_watch_clear(vm_mem_t *m, uint32_t page,
+                                   uint8_t flags) {
+    __atomic_fetch_and(&m->watch_pages[page], ~flags, __ATOMIC_RELAXED);
+}
+
+// Returns whether the store lands
+bool mem_watch_hit(vm_mem_t *m, uint32_t addr);
+// Watch a store to every byte of [addr, addr + len), which must not wrap
+// and must be writable
+void mem_watch_range(vm_mem_t *m, uint32_t addr, uint32_t len);
+
+// Called before every store; false if it is to be dropped
+static inline bool mem_watch_store(vm_mem_t *m, uint32_t addr) {
+    m->store_count++;
+    if (m->watch_pages[addr >> MEM_WATCH_SHIFT]) {
+        return mem_watch_hit(m, addr);
+    }
+    return true;
+}
+
+// Open a view with every page dirty; -1 if all are taken
+int mem_dirty_open(vm_mem_t *m, uint8_t shift);
+void mem_dirty_close(vm_mem_t *m, int view);
+// Get and clear whether the page of view holding addr was stored to.
+// Safe from any one thread per view.
+bool mem_dirty_take(vm_mem_t *m, int view, uint32_t addr);
+// Whether the page of view holding addr was stored to, leaving it dirty
+bool mem_dirty_peek(vm_mem_t *m, int view, uint32_t addr);
+// mem_dirty_take() of every page at once, into a bitmap of the view's pages
+// with room for MEM_WATCH_PAGES bits. Returns how many were dirty.
+uint32_t mem_dirty_take_all(vm_mem_t *m, int view, uint64_t *pages);
+// Mark [addr, addr + len) dirty after writing the data directly
+void mem_dirty_range(vm_mem_t *m, uint32_t addr, uint32_t len);
+
+void mem_watch_addr_set(vm_mem_t *m, int32_t addr);
+
+// Log every store from now on
+void mem_log_enable(vm_mem_t *m);
+// Put back the logged bytes, newest first, and empty the log
+void mem_log_undo(vm_mem_t *m);
+
+// memory is little endian. The _base accessors take a linear segment base,
+// seg << 4, such as x86_cpu_t.sbase.
+static inline uint8_t load_u8_base(vm_mem_t *m, uint32_t base,
+                                   uint16_t offset) {
+    return m->data[(base + offset) & 0xFFFFF];
+}
+
+// A word at offset FFFF wraps to offset 0 of the same segment, and one at
+// FFFFF to linear 0. Anything else is a single host access.
+static inline uint16_t load_u16_base(vm_mem_t *m, uint32_t base,
+                                     uint16_t offset) {
+    uint32_t addr = (base + offset) & 0xFFFFF;
+    if (offset != 0xFFFF && addr != 0xFFFFF) {
+        uint16_t val;
+        memcpy(&val, m->data + addr, 2);
+        return val;
+    }
+    return m->data[addr] |
+           (m->data[(base + (uint16_t)(offset + 1)) & 0xFFFFF] << 8);
+}
+
+static inline void store_u8_base(vm_mem_t *m, uint32_t base, uint16_t offset,
+                                 uint8_t val) {
+    uint32_t addr = (base + offset) & 0xFFFFF;
+    if (mem_watch_store(m, addr)) m->data[addr] = val;
+}
+
+static inline void store_u16_base(vm_mem_t *m, uint32_t base,
+                                  uint16_t offset, uint16_t val) {
+    uint32_t addr = (base + offset) & 0xFFFFF;
+    if (offset != 0xFFFF && addr != 0xFFFFF &&
+        !(m->watch_pages[addr >> MEM_WATCH_SHIFT] |
+          m->watch_pages[(addr + 1) >> MEM_WATCH_SHIFT])) {
+        m->store_count++;
+        memcpy(m->data + addr, &val, 2);
+        return;
+    }
+    store_u8_base(m, base, offset, val & 0xFF);
+    store_u8_base(m, base, offset + 1, val >> 8);
+}
+
+static inline uint8_t load_u8(vm_mem_t *m, uint16_t seg, uint16_t offset) {
+    return load_u8_base(m, (uint32_t)seg << 4, offset);
 }
 
-static inline uint8_t load_u8_direct(uint32_t addr) {
-    return mem[addr & 0xFFFFF];
+static inline uint8_t load_u8_direct(vm_mem_t *m, uint32_t addr) {
+    return m->data[addr & 0xFFFFF];
 }
 
-// todo: this is not actually how it works on x86..
-static inline uint16_t load_u16(uint16_t seg, uint16_t offset) {
-    return (mem[SEGMENT(seg, offset+1)] << 8) + (mem[SEGMENT(seg, offset)]);
+static inline uint16_t load_u16(vm_mem_t *m, uint16_t seg, uint16_t offset) {
+    return load_u16_base(m, (uint32_t)seg << 4, offset);
 }
 
-static inline uint32_t load_u32(uint16_t seg, uint16_t offset) {
-    return (mem[SEGMENT(seg, offset+3)] << 24)
-         + (mem[SEGMENT(seg, offset+2)] << 16)
-         + (mem[SEGMENT(seg, offset+1)] << 8)
-         + (mem[SEGMENT(seg, offset+0)]);
+static inline uint32_t load_u32(vm_mem_t *m, uint16_t seg, uint16_t offset) {
+    return load_u16(m, seg, offset) |
+           ((uint32_t)load_u16(m, seg, offset + 2) << 16);
 }
 
-static inline void store_u16(uint16_t seg, uint16_t offset, uint16_t val) {
-    mem[SEGMENT(seg, offset)] = val & 0xFF;
-    mem[SEGMENT(seg, offset+1)] = val >> 8;
+static inline void store_u16(vm_mem_t *m, uint16_t seg, uint16_t offset,
+                             uint16_t val) {
+    store_u16_base(m, (uint32_t)seg << 4, offset, val);
 }
 
-static inline void store_u8(uint16_t seg, uint16_t offset, uint8_t val) {
-    mem[SEGMENT(seg, offset)] = val;
+static inline void store_u8(vm_mem_t *m, uint16_t seg, uint16_t offset,
+                            uint8_t val) {
+    store_u8_base(m, (uint32_t)seg << 4, offset, val);
 }
 
-static inline void store_u8_direct(uint32_t addr, uint8_t val) {
-    mem[addr & 0xFFFFF] = val;
+static inline void store_u8_direct(vm_mem_t *m, uint32_t addr, uint8_t val) {
+    addr &= 0xFFFFF;
+    if (mem_watch_store(m, addr)) m->data[addr] = val;
 }
 
 #endif // VM_MEM_H
\ No newline at end of file
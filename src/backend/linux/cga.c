@@ -6,94 +6,113 @@
 
 #include "vm_mem.h"
 #include "kbd.h"
-#include "main.h"
-
-const uint8_t SDL_to_PS2_scancode[] = {
-    /* SDL_SCANCODE_A to SDL_SCANCODE_Z */
-    [4] = 0x1e,  // A
-    [5] = 0x30,  // B
-    [6] = 0x2e,  // C
-    [7] = 0x20,  // D
-    [8] = 0x12,  // E
-    [9] = 0x21,  // F
-    [10] = 0x22, // G
-    [11] = 0x23, // H
-    [12] = 0x17, // I
-    [13] = 0x24, // J
-    [14] = 0x25, // K
-    [15] = 0x26, // L
-    [16] = 0x32, // M
-    [17] = 0x31, // N
-    [18] = 0x18, // O
-    [19] = 0x19, // P
-    [20] = 0x10, // Q
-    [21] = 0x13, // R
-    [22] = 0x1f, // S
-    [23] = 0x14, // T
-    [24] = 0x16, // U
-    [25] = 0x2f, // V
-    [26] = 0x11, // W
-    [27] = 0x2d, // X
-    [28] = 0x15, // Y
-    [29] = 0x2c, // Z
-
-    /* SDL_SCANCODE_1 to SDL_SCANCODE_0 */
-    [30] = 0x02, // 1
-    [31] = 0x03, // 2
-    [32] = 0x04, // 3
-    [33] = 0x05, // 4
-    [34] = 0x06, // 5
-    [35] = 0x07, // 6
-    [36] = 0x08, // 7
-    [37] = 0x09, // 8
-    [38] = 0x0a, // 9
-    [39] = 0x0b,  // 0
-
-    // space
-    [44] = 0x39,
-    // enter
-    [40] = 0x1c,
-    // backspace
-    [42] = 0x0e,
-
-    // lol
-    [52] = 0xff,
-
-    // function keys
-    [58] = 0x3b,
-    [59] = 0x3c,
-    [60] = 0x3d,
-    [61] = 0x3e,
-    [62] = 0x3f,
-    [63] = 0x40,
-    [64] = 0x41,
-    [65] = 0x42,
-    [66] = 0x43,
-    [67] = 0x44
+
+// XT scancode set 1 make code of each key; the cursor and editing keys an
+// XT only has on the keypad map to those
+static const uint8_t sdl_to_xt[SDL_SCANCODE_RALT + 1] = {
+    [SDL_SCANCODE_ESCAPE] = 0x01,
+    [SDL_SCANCODE_1] = 0x02, [SDL_SCANCODE_2] = 0x03,
+    [SDL_SCANCODE_3] = 0x04, [SDL_SCANCODE_4] = 0x05,
+    [SDL_SCANCODE_5] = 0x06, [SDL_SCANCODE_6] = 0x07,
+    [SDL_SCANCODE_7] = 0x08, [SDL_SCANCODE_8] = 0x09,
+    [SDL_SCANCODE_9] = 0x0A, [SDL_SCANCODE_0] = 0x0B,
+    [SDL_SCANCODE_MINUS] = 0x0C, [SDL_SCANCODE_EQUALS] = 0x0D,
+    [SDL_SCANCODE_BACKSPACE] = 0x0E, [SDL_SCANCODE_TAB] = 0x0F,
+    [SDL_SCANCODE_Q] = 0x10, [SDL_SCANCODE_W] = 0x11,
+    [SDL_SCANCODE_E] = 0x12, [SDL_SCANCODE_R] = 0x13,
+    [SDL_SCANCODE_T] = 0x14, [SDL_SCANCODE_Y] = 0x15,
+    [SDL_SCANCODE_U] = 0x16, [SDL_SCANCODE_I] = 0x17,
+    [SDL_SCANCODE_O] = 0x18, [SDL_SCANCODE_P] = 0x19,
+    [SDL_SCANCODE_LEFTBRACKET] = 0x1A, [SDL_SCANCODE_RIGHTBRACKET] = 0x1B,
+    [SDL_SCANCODE_RETURN] = 0x1C, [SDL_SCANCODE_KP_ENTER] = 0x1C,
+    [SDL_SCANCODE_LCTRL] = 0x1D, [SDL_SCANCODE_RCTRL] = 0x1D,
+    [SDL_SCANCODE_A] = 0x1E, [SDL_SCANCODE_S] = 0x1F,
+    [SDL_SCANCODE_D] = 0x20, [SDL_SCANCODE_F] = 0x21,
+    [SDL_SCANCODE_G] = 0x22, [SDL_SCANCODE_H] = 0x23,
+    [SDL_SCANCODE_J] = 0x24, [SDL_SCANCODE_K] = 0x25,
+    [SDL_SCANCODE_L] = 0x26, [SDL_SCANCODE_SEMICOLON] = 0x27,
+    [SDL_SCANCODE_APOSTROPHE] = 0x28, [SDL_SCANCODE_GRAVE] = 0x29,
+    [SDL_SCANCODE_LSHIFT] = 0x2A,
+    [SDL_SCANCODE_BACKSLASH] = 0x2B, [SDL_SCANCODE_NONUSHASH] = 0x2B,
+    [SDL_SCANCODE_NONUSBACKSLASH] = 0x2B,
+    [SDL_SCANCODE_Z] = 0x2C, [SDL_SCANCODE_X] = 0x2D,
+    [SDL_SCANCODE_C] = 0x2E, [SDL_SCANCODE_V] = 0x2F,
+    [SDL_SCANCODE_B] = 0x30, [SDL_SCANCODE_N] = 0x31,
+    [SDL_SCANCODE_M] = 0x32, [SDL_SCANCODE_COMMA] = 0x33,
+    [SDL_SCANCODE_PERIOD] = 0x34,
+    [SDL_SCANCODE_SLASH] = 0x35, [SDL_SCANCODE_KP_DIVIDE] = 0x35,
+    [SDL_SCANCODE_RSHIFT] = 0x36,
+    [SDL_SCANCODE_KP_MULTIPLY] = 0x37, [SDL_SCANCODE_PRINTSCREEN] = 0x37,
+    [SDL_SCANCODE_LALT] = 0x38, [SDL_SCANCODE_RALT] = 0x38,
+    [SDL_SCANCODE_SPACE] = 0x39, [SDL_SCANCODE_CAPSLOCK] = 0x3A,
+    [SDL_SCANCODE_F1] = 0x3B, [SDL_SCANCODE_F2] = 0x3C,
+    [SDL_SCANCODE_F3] = 0x3D, [SDL_SCANCODE_F4] = 0x3E,
+    [SDL_SCANCODE_F5] = 0x3F, [SDL_SCANCODE_F6] = 0x40,
+    [SDL_SCANCODE_F7] = 0x41, [SDL_SCANCODE_F8] = 0x42,
+    [SDL_SCANCODE_F9] = 0x43, [SDL_SCANCODE_F10] = 0x44,
+    [SDL_SCANCODE_NUMLOCKCLEAR] = 0x45, [SDL_SCANCODE_SCROLLLOCK] = 0x46,
+    [SDL_SCANCODE_KP_7] = 0x47, [SDL_SCANCODE_HOME] = 0x47,
+    [SDL_SCANCODE_KP_8] = 0x48, [SDL_SCANCODE_UP] = 0x48,
+    [SDL_SCANCODE_KP_9] = 0x49, [SDL_SCANCODE_PAGEUP] = 0x49,
+    [SDL_SCANCODE_KP_MINUS] = 0x4A,
+    [SDL_SCANCODE_KP_4] = 0x4B, [SDL_SCANCODE_LEFT] = 0x4B,
+    [SDL_SCANCODE_KP_5] = 0x4C,
+    [SDL_SCANCODE_KP_6] = 0x4D, [SDL_SCANCODE_RIGHT] = 0x4D,
+    [SDL_SCANCODE_KP_PLUS] = 0x4E,
+    [SDL_SCANCODE_KP_1] = 0x4F, [SDL_SCANCODE_END] = 0x4F,
+    [SDL_SCANCODE_KP_2] = 0x50, [SDL_SCANCODE_DOWN] = 0x50,
+    [SDL_SCANCODE_KP_3] = 0x51, [SDL_SCANCODE_PAGEDOWN] = 0x51,
+    [SDL_SCANCODE_KP_0] = 0x52, [SDL_SCANCODE_INSERT] = 0x52,
+    [SDL_SCANCODE_KP_PERIOD] = 0x53, [SDL_SCANCODE_DELETE] = 0x53,
 };
 
-volatile sig_atomic_t stop_flag = 0;
+#define BYTE_MASK(x, b) (-((x >> b) & 1))
+
+// Text mode redraws the rows on frame buffer pages stored to since the last
+// frame or the one before; a store racing with a take may land just after
+// the frame that took its page was drawn
+#define CGA_DIRTY_SHIFT 8
+#define CGA_TEXT_BYTES  (40 * 25 * 2)
+#define CGA_TEXT_PAGES  ((CGA_TEXT_BYTES >> CGA_DIRTY_SHIFT) + 1)
 
-cga_state_t cga_state;
+// Frame period of the window, whether or not the renderer waits for vsync
+#define CGA_FRAME_MS (1000 / 60)
 
-#define BYTE_MASK(x, b) (-((x >> b) & 1))
+static inline uint32_t textmode_take_dirty(cga_state_t *cga)
+{
+    uint32_t dirty = 0;
+    for (int p = 0; p < CGA_TEXT_PAGES; p++)
+    {
+        if (mem_dirty_take(cga->mem, cga->dirty_view, CGA_COLOR_ADDR + (p << CGA_DIRTY_SHIFT)))
+        {
+            dirty |= 1u << p;
+        }
+    }
+    return dirty;
+}
 
-static inline void textmode_update(uint32_t *screen)
+static inline void textmode_update(cga_state_t *cga, uint32_t *screen, uint32_t dirty)
 {
     for (int i = 0; i < 25; i++)
     {
+        uint32_t row_first = (80 * i) >> CGA_DIRTY_SHIFT;
+        uint32_t row_last = (80 * i + 79) >> CGA_DIRTY_SHIFT;
+        if (!(dirty & ((1u << row_first) | (1u << row_last))))
+        {
+            continue;
+        }
         for (int j = 0; j < 40; j++)
         {
             int cc_ind = (40 * i + j) << 1;
             int attr_ind = cc_ind + 1;
-            uint8_t cc = load_u8_direct(CGA_COLOR_ADDR + cc_ind);
-            uint8_t attr = load_u8_direct(CGA_COLOR_ADDR + attr_ind);
+            uint8_t cc = load_u8_direct(cga->mem, CGA_COLOR_ADDR + cc_ind);
+            uint8_t attr = load_u8_direct(cga->mem, CGA_COLOR_ADDR + attr_ind);
 
             uint32_t c_f = 0x7F000000 + ((attr & 0x08) ? 0x7F7F7F : 0) + ((BYTE_MASK(attr, 2) & 0x7F) << 16) + ((BYTE_MASK(attr, 1) & 0x7F) << 8) + (BYTE_MASK(attr, 0) & 0x7F);
             uint32_t c_b = 0x7F000000 + ((attr & 0x80) ? 0x7F7F7F : 0) + ((BYTE_MASK(attr, 6) & 0x7F) << 16) + ((BYTE_MASK(attr, 5) & 0x7F) << 8) + (BYTE_MASK(attr, 4) & 0x7F);
             for (int ci = 0; ci < 8; ci++)
             {
-                uint8_t row = cga_state.font[cc * 8 + ci];
+                uint8_t row = cga->font[cc * 8 + ci];
                 for (int cj = 0; cj < 8; cj++)
                 {
                     screen[(i * 8 + ci) * 40 * 8 + j * 8 + cj] = (row & 0x80) ? c_f : c_b;
@@ -104,35 +123,39 @@ static inline void textmode_update(uint32_t *screen)
     }
 }
 
-static inline void cga_loop()
+static inline void cga_loop(cga_state_t *cga)
 {
     SDL_Event e;
     bool running = true;
     uint32_t *screen = (uint32_t *)malloc(320 * 200 * sizeof(uint32_t));
-    while (running && !stop_flag)
+    uint8_t last_mode = 0xFF;
+    uint32_t last_dirty = 0;
+    // Presenting again is only needed when the window was uncovered
+    bool expose = true;
+    uint32_t frame = SDL_GetTicks();
+    while (running && !*cga->stop &&
+           !__atomic_load_n(&cga->quit, __ATOMIC_RELAXED))
     {
        while (SDL_PollEvent(&e) > 0)
        {
            if (e.type == SDL_QUIT) {
                running = false;
+           } else if (e.type == SDL_WINDOWEVENT) {
+               expose = true;
            } else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
-                uint8_t sc = e.key.keysym.scancode;
-                if (sc < 4 || sc > 67) {
+                SDL_Scancode sc = e.key.keysym.scancode;
+                uint8_t xt = (unsigned)sc < sizeof(sdl_to_xt) ? sdl_to_xt[sc] : 0;
+                if (xt == 0) {
                     printf("unrecognized scancode %d\n", sc);
                 } else {
-                    uint8_t converted = SDL_to_PS2_scancode[sc];
-                    if (converted == 0xFF) {
-                        kbd_push_scancode(0x2a| (e.type == SDL_KEYUP ? 0x80 : 0x00));
-                        kbd_push_scancode(0x28| (e.type == SDL_KEYUP ? 0x80 : 0x00));
-                    } else {
-                        kbd_push_scancode(converted | (e.type == SDL_KEYUP ? 0x80 : 0x00));
-                    }
-                    
+                    kbd_push_scancode(cga->kbd, xt | (e.type == SDL_KEYUP
+                                                      ? KBD_SC_BREAK : 0));
                 }
            }
        }
 
-       if (cga_state.mode & 0x2)
+       bool changed = expose || cga->mode != last_mode;
+       if (cga->mode & 0x2)
        {
            // Graphics mode
            // TBD
@@ -140,21 +163,51 @@ static inline void cga_loop()
        else
        {
            // Text mode
-           textmode_update(screen);
+           uint32_t dirty = textmode_take_dirty(cga);
+           if (cga->mode != last_mode)
+           {
+               dirty = ~0u;
+           }
+           if (dirty | last_dirty)
+           {
+               textmode_update(cga, screen, dirty | last_dirty);
+               changed = true;
+           }
+           last_dirty = dirty;
        }
+       last_mode = cga->mode;
 
-       SDL_UpdateTexture(cga_state.tex, NULL, screen, 320 * sizeof(uint32_t));
-       SDL_RenderClear(cga_state.renderer);
-       SDL_RenderCopy(cga_state.renderer, cga_state.tex, NULL, NULL);
-       SDL_RenderPresent(cga_state.renderer);
+       // A frame with nothing new leaves the last one up
+       if (changed)
+       {
+           SDL_UpdateTexture(cga->tex, NULL, screen, 320 * sizeof(uint32_t));
+           SDL_RenderClear(cga->renderer);
+           SDL_RenderCopy(cga->renderer, cga->tex, NULL, NULL);
+           SDL_RenderPresent(cga->renderer);
+           expose = false;
+       }
+
+       uint32_t now = SDL_GetTicks();
+       frame += CGA_FRAME_MS;
+       if ((int32_t)(frame - now) > 0)
+       {
+           SDL_Delay(frame - now);
+       }
+       else
+       {
+           // Behind: start the next frame's wait from now
+           frame = now;
+       }
     }
     free(screen);
-    SDL_DestroyRenderer(cga_state.renderer);
-    SDL_DestroyWindow(cga_state.window);
+    free(cga->font);
+    mem_dirty_close(cga->mem, cga->dirty_view);
+    SDL_DestroyRenderer(cga->renderer);
+    SDL_DestroyWindow(cga->window);
     SDL_Quit();
 }
 
-static inline void cga_init()
+static inline void cga_init(cga_state_t *cga)
 {
     // Open the SDL Window
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
@@ -178,7 +231,9 @@ static inline void cga_init()
         exit(1);
     }
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1,
+                                                SDL_RENDERER_ACCELERATED |
+                                                SDL_RENDERER_PRESENTVSYNC);
     if (!renderer)
     {
         printf("Failed to create SDL renderer\n");
@@ -199,35 +254,46 @@ static inline void cga_init()
         exit(1);
     }
 
-    cga_state.font = (uint8_t *)malloc(sizeof(uint8_t) * CGA_FONTROM_SIZE);
-    size_t n = fread(cga_state.font, 1, CGA_FONTROM_SIZE, font_f);
+    cga->font = (uint8_t *)malloc(sizeof(uint8_t) * CGA_FONTROM_SIZE);
+    size_t n = fread(cga->font, 1, CGA_FONTROM_SIZE, font_f);
     if (n != CGA_FONTROM_SIZE)
     {
         printf("Invalid font ROM, read %ld bytes instead of expected 2048\n", n);
         exit(1);
     }
 
-    cga_state.mode = 0;
-    cga_state.lock = SDL_CreateMutex();
-    cga_state.renderer = renderer;
-    cga_state.window = window;
-    cga_state.tex = texture;
+    cga->dirty_view = mem_dirty_open(cga->mem, CGA_DIRTY_SHIFT);
+    if (cga->dirty_view < 0)
+    {
+        printf("No dirty memory view left for the CGA renderer\n");
+        exit(1);
+    }
+    cga->renderer = renderer;
+    cga->window = window;
+    cga->tex = texture;
 }
 
 void *cga_thread(void *arg)
 {
-    (void)arg;
-    pthread_detach(pthread_self());
+    cga_state_t *cga = arg;
 
-    cga_init();
+    cga_init(cga);
 
-    cga_loop();
+    cga_loop(cga);
 
     pthread_exit(NULL);
 }
 
-void cga_start()
+void cga_start(cga_state_t *cga)
+{
+    cga->started = true;
+    pthread_create(&cga->thread, NULL, cga_thread, cga);
+}
+
+void cga_stop(cga_state_t *cga)
 {
-    pthread_t ptid;
-    pthread_create(&ptid, NULL, cga_thread, NULL);
+    if (!cga->started) return;
+    __atomic_store_n(&cga->quit, true, __ATOMIC_RELAXED);
+    pthread_join(cga->thread, NULL);
+    cga->started = false;
 }
\ No newline at end of file
@@ -4,19 +4,163 @@
 #include <stdio.h>
 #include <string.h>
 
-i8237_state_t i8237_state;
+// Bytes bounced at a time when a span can't be handed over in place
+#define DMA_BOUNCE 4096
 
-void i8237_init() {
-    memset(&i8237_state, 0, sizeof(i8237_state_t));
+void i8237_init(i8237_state_t *dma, vm_mem_t *mem, sched_state_t *sched) {
+    memset(dma, 0, sizeof(i8237_state_t));
+    dma->mem = mem;
+    dma->sched = sched;
+    dma->en = true;
     for (int i = 0; i < 4; i++) {
-        i8237_state.chans[i].masked = true;
+        dma->chans[i].masked = true;
     }
 }
 
-uint8_t i8237_cr_read(uint8_t port) {
+void i8237_attach(i8237_state_t *dma, uint8_t chan, const dma_dev_t *dev) {
+    assert(chan < 4);
+    dma->devs[chan] = *dev;
+}
+
+void i8237_restore(i8237_state_t *dma, const i8237_state_t *saved) {
+    i8237_state_t wiring = *dma;
+    *dma = *saved;
+    memcpy(dma->devs, wiring.devs, sizeof(dma->devs));
+    dma->mem = wiring.mem;
+    dma->sched = wiring.sched;
+}
+
+// Have SCHED_DMA run when the first span going lands
+static void i8237_schedule(i8237_state_t *dma) {
+    uint64_t next = SCHED_NEVER;
+    for (int i = 0; i < 4; i++) {
+        if (dma->chans[i].busy && dma->chans[i].due < next) {
+            next = dma->chans[i].due;
+        }
+    }
+    sched_at(dma->sched, SCHED_DMA, next);
+}
+
+// Start a span on chan if its device has bytes ready and the channel may
+// take them. The span's bus cycles take up the time up to its due clock.
+static void i8237_start(i8237_state_t *dma, uint8_t chan, uint64_t now) {
+    dma_chan_t *c = &dma->chans[chan];
+    dma_dev_t *dev = &dma->devs[chan];
+    if (c->busy || c->masked || !dma->en || !dev->req_fn) return;
+    uint32_t n = dev->req_fn(dev->ctx);
+    uint32_t left = c->cntr.x + 1u;
+    if (n > left) n = left;
+    if (n == 0) return;
+    c->busy = n;
+    c->due = now + (uint64_t)n * DMA_XFER_CLK;
+    dma->status |= 0x10 << chan;
+}
+
+// Hand len bytes at linear lo to the device or take them from it, which
+// the address counts through the other way round when down
+static void i8237_span(i8237_state_t *dma, dma_dev_t *dev, uint8_t xfer,
+                       uint32_t lo, uint32_t len, bool down) {
+    vm_mem_t *m = dma->mem;
+    bool to_mem = xfer != DMA_XFER_READ;
+    if (!down && xfer == DMA_XFER_READ) {
+        dev->ack_fn(dev->ctx, m->data + lo, len, false);
+        return;
+    }
+    if (!down && xfer == DMA_XFER_WRITE && mem_range_writable(m, lo, len)) {
+        mem_watch_range(m, lo, len);
+        dev->ack_fn(dev->ctx, m->data + lo, len, true);
+        return;
+    }
+    // Down counting, ROM and verify go through a buffer a byte at a time
+    uint8_t buf[DMA_BOUNCE];
+    for (uint32_t done = 0; done < len; ) {
+        uint32_t n = len - done < DMA_BOUNCE ? len - done : DMA_BOUNCE;
+        if (xfer == DMA_XFER_READ) {
+            for (uint32_t i = 0; i < n; i++) {
+                buf[i] = load_u8_direct(m, lo + len - 1 - (done + i));
+            }
+        }
+        dev->ack_fn(dev->ctx, buf, n, to_mem);
+        if (xfer == DMA_XFER_WRITE) {
+            for (uint32_t i = 0; i < n; i++) {
+                uint32_t ofs = done + i;
+                store_u8_direct(m, down ? lo + len - 1 - ofs : lo + ofs,
+                                buf[i]);
+            }
+        }
+        done += n;
+    }
+}
+
+// Move the len bytes of a span, which fit in the count, in runs up to the
+// end of the 64K page the address wraps around in
+static void i8237_move(i8237_state_t *dma, uint8_t chan, uint32_t len) {
+    dma_chan_t *c = &dma->chans[chan];
+    dma_dev_t *dev = &dma->devs[chan];
+    uint32_t left = c->cntr.x + 1u;
+    while (len) {
+        uint16_t a = c->addr.x;
+        uint32_t n = c->down_en ? a + 1u : 0x10000u - a;
+        if (n > len) n = len;
+        // Only the low 4 bits of the page register are wired on a PC
+        uint32_t lo = (uint32_t)(c->page & 0x0F) << 16 |
+                      (uint16_t)(c->down_en ? a - (n - 1) : a);
+        i8237_span(dma, dev, c->xfer, lo, n, c->down_en);
+        c->addr.x = c->down_en ? a - n : a + n;
+        c->cntr.x -= n;
+        left -= n;
+        len -= n;
+    }
+    if (left) return;
+    // Terminal count
+    dma->status |= 1 << chan;
+    if (c->auto_en) {
+        c->addr.x = c->base_addr;
+        c->cntr.x = c->base_cntr;
+    } else {
+        c->masked = true;
+    }
+    if (dev->tc_fn) dev->tc_fn(dev->ctx);
+}
+
+void i8237_dreq(i8237_state_t *dma, uint8_t chan, uint64_t now) {
+    i8237_start(dma, chan, now);
+    i8237_schedule(dma);
+}
+
+void i8237_event(i8237_state_t *dma, uint64_t now) {
+    for (uint8_t i = 0; i < 4; i++) {
+        dma_chan_t *c = &dma->chans[i];
+        if (!c->busy || c->due > now) continue;
+        uint32_t len = c->busy;
+        c->busy = 0;
+        dma->status &= ~(0x10 << i);
+        i8237_move(dma, i, len);
+        // A device with more ready goes on from when this span ended
+        i8237_start(dma, i, c->due);
+    }
+    i8237_schedule(dma);
+}
+
+// Let channels go whose devices were held off by a mask or the disable bit
+static void i8237_resume(i8237_state_t *dma, uint64_t now) {
+    for (uint8_t i = 0; i < 4; i++) {
+        i8237_start(dma, i, now);
+    }
+    i8237_schedule(dma);
+}
+
+uint8_t i8237_cr_read(i8237_state_t *dma, uint8_t port) {
     uint8_t ret = 0;
     switch (port) {
-        // lazy mf
+        // Reading the status clears the terminal count bits
+        case 0x08: {
+            ret = dma->status;
+            dma->status &= 0xF0;
+            break;
+        }
+        // Temporary register, only used by memory to memory transfers
+        case 0x0D: break;
         default: {
             printf("Unrecognized I8237 read register %d\n", port);
         }
@@ -25,82 +169,58 @@ uint8_t i8237_cr_read(uint8_t port) {
 }
 
 
-void i8237_cr_write(uint8_t port, uint8_t val) {
-    printf("write %04x\n", port);
+void i8237_cr_write(i8237_state_t *dma, uint8_t port, uint8_t val,
+                    uint64_t now) {
     uint8_t chan_sel = val & 0b11;
     switch (port) {
         case 0x08: {
-            i8237_state.en = (val & I8237_CMD_COND) ? true : false;
+            dma->en = !(val & I8237_CMD_DISABLE);
             break;
         }
+        // Software requests only start memory to memory transfers, which
+        // the PC doesn't wire up
+        case 0x09: return;
         case 0x0A: {
-            i8237_state.chans[chan_sel].masked = I8237_SC_MASK_ON(val);
+            dma->chans[chan_sel].masked = I8237_SC_MASK_ON(val);
             break;
         }
         case 0x0B: {
-            i8237_state.chans[chan_sel].down_en = I8237_MODE_DOWN(val);
-            i8237_state.chans[chan_sel].auto_en = I8237_MODE_AUTO(val);
-            i8237_state.chans[chan_sel].wr_en   = I8237_MODE_WR(val);
-            // lazy about mode selection for the moment since it doesnt
-            // seem to matter if we're not simulating the bus
-            break;
+            dma->chans[chan_sel].down_en = I8237_MODE_DOWN(val);
+            dma->chans[chan_sel].auto_en = I8237_MODE_AUTO(val);
+            dma->chans[chan_sel].xfer    = I8237_MODE_XFER(val);
+            // Single, block and demand mode all come down to moving what
+            // the device has ready
+            return;
         }
         case 0x0C: {
-            i8237_state.ff = false;
-            break;
+            dma->ff = false;
+            return;
         }
         case 0x0D: {
-            i8237_state.ff = false;
-            i8237_state.status = 0;
+            dma->ff = false;
+            dma->status = 0;
             for (int i = 0; i < 4; i++) {
-                i8237_state.chans[i].masked = true;
+                dma->chans[i].masked = true;
             }
             break;
         }
         case 0x0E: {
             for (int i = 0; i < 4; i++) {
-                i8237_state.chans[i].masked = false;
+                dma->chans[i].masked = false;
             }
             break;
         }
         case 0x0F: {
             for (int i = 0; i < 4; i++) {
-                i8237_state.chans[i].masked = val & 1;
+                dma->chans[i].masked = val & 1;
                 val >>= 1;
             }
             break;
         }
         default: {
             printf("Unrecognized I8237 write register %d\n", port);
+            return;
         }
     }
+    i8237_resume(dma, now);
 }
-
-
-void i8237_xfer(uint8_t chan, uint8_t *buf) {
-    if (!i8237_state.en || chan >= 4) return;
-    dma_chan_t *chan_obj = &i8237_state.chans[chan];
-    if (chan_obj->masked 
-        || (chan_obj->cntr.x == 0)) return;
-
-    uint32_t addr_base = chan_obj->page << 16;
-    uint16_t addr_cnt = chan_obj->addr.x;
-    int16_t direction = chan_obj->down_en ? -1 : 1;
-
-    for (uint16_t ofs = 0; ofs < chan_obj->cntr.x; ofs += 1) {
-        // keep 64KB wrapping functionality
-        addr_cnt = direction * ofs + chan_obj->addr.x;
-        if (chan_obj->wr_en) {
-            uint8_t val = buf[ofs];
-            store_u8((addr_base >> 4), addr_cnt, val);
-        } else {
-            uint8_t val = load_u8((addr_base >> 4), addr_cnt);
-            buf[ofs] = val;
-        }
-    }
-    
-    if (!chan_obj->auto_en) {
-        chan_obj->cntr.x = 0;
-        chan_obj->addr.x = addr_cnt;
-    }
-}
\ No newline at end of file
@@ -1,104 +1,275 @@
 #include "i8253.h"
 
 #include <string.h>
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
 
-i8253_state_t i8253_state;
+void i8253_init(i8253_state_t *pit) {
+    memset(pit, 0, sizeof(i8253_state_t));
+    for (int i = 0; i < 3; i++) {
+        pit->chans[i].gate = true;
+    }
+}
+
+static uint16_t i8253_from_bcd(uint16_t v) {
+    return (v >> 12) * 1000 + ((v >> 8) & 0xF) * 100 + ((v >> 4) & 0xF) * 10 +
+           (v & 0xF);
+}
+
+static uint16_t i8253_to_bcd(uint32_t v) {
+    return ((v / 1000) % 10) << 12 | ((v / 100) % 10) << 8 |
+           ((v / 10) % 10) << 4 | (v % 10);
+}
 
-void i8253_init(bool *timer_irq) {
-    memset(&i8253_state, 0, sizeof(i8253_state_t));
-    i8253_state.out[0] = timer_irq;
+// Counts wrap at this, which is what a count of 0 stands for
+static inline uint32_t i8253_range(const i8253_chan_t *c) {
+    return c->bcd ? 10000 : 0x10000;
+}
 
-    i8253_state.status = 0b01000000;
+// The count being counted down, as a number
+static inline uint32_t i8253_n(const i8253_chan_t *c) {
+    uint32_t n = c->bcd ? i8253_from_bcd(c->count) : c->count;
+    return n ? n : i8253_range(c);
+}
 
-    if (timer_irq) {
-        *timer_irq = false;
+// Take a count written in modes 2 and 3 once its period has come
+static void i8253_sync(i8253_chan_t *c, uint64_t now) {
+    if (c->pending && now >= c->pending_at) {
+        c->count = c->reload;
+        c->start = c->pending_at;
+        c->pending = false;
     }
 }
 
-void i8253_cr_write(uint8_t val) {
-    i8253_state.init = true;
-    // only care about counter 0
-    if ((val & 0b11000000) == 0) {
-        if ((val & 0b00110000) == 0) {
-            // Latch mode
-            i8253_state.ctrs_latch[0] = i8253_state.ctrs[0].x;
-            i8253_state.status = (i8253_state.status & 0b11001111) | (val & 0b00110000);
-        } else {
-            i8253_state.status = (i8253_state.status & 0b11000000) | (val & 0b00111111);
+// Input clocks counted since the count was loaded
+static uint64_t i8253_elapsed(const i8253_chan_t *c, uint64_t now) {
+    return c->held ? c->held_ticks : now - c->start;
+}
+
+static uint32_t i8253_count(i8253_chan_t *c, uint64_t now) {
+    if (!c->counting && !c->held) {
+        return c->bcd ? i8253_from_bcd(c->reload) : c->reload;
+    }
+    uint64_t t = i8253_elapsed(c, now);
+    uint32_t n = i8253_n(c);
+    uint32_t range = i8253_range(c);
+    switch (c->mode) {
+        // N, N-1, ... 1, then 0 and on round without reloading
+        case 0:
+        case 1:
+        case 4:
+        case 5: return (n + range - t % range) % range;
+        // N ... 1, reloading from 1
+        case 2: return n - t % n;
+        // Down by 2 through each half of the period, from N each time. An
+        // odd N drops to N-1 in the high half and N-3 in the low one first.
+        case 3: {
+            uint32_t p = t % n;
+            bool low = p >= (n + 1) / 2;
+            if (low) p -= (n + 1) / 2;
+            if (p == 0) return n;
+            if (!(n & 1)) return n - 2 * p;
+            return low ? n - 1 - 2 * p : n + 1 - 2 * p;
         }
-        *i8253_state.out[0] = false;
-        i8253_state.access_ctrs[0] = 0;
+        default: return 0;
     }
 }
 
-void i8253_timer_write(uint8_t ofs, uint8_t val) {
-    if (ofs == 0) {
-        switch (i8253_state.status & 0b00110000) {
-            // TODO assuming you can't write in latch mode 
-            // TODO stopping the counting while writing the first byte as described in datasheet
-            case 0b00000000: break;
-            case 0b00010000: i8253_state.ctrs[0].b.l = val; break;
-            case 0b00100000: i8253_state.ctrs[0].b.h = val; break;
-            case 0b00110000: {
-                if (i8253_state.access_ctrs[0] & 1) {
-                    i8253_state.ctrs[0].b.h = val;
-                } else {
-                    i8253_state.ctrs[0].b.l = val;
-                }
-                break;
-            }
+bool i8253_out(i8253_state_t *pit, uint8_t ofs, uint64_t now) {
+    i8253_chan_t *c = &pit->chans[ofs];
+    i8253_sync(c, now);
+    if (!c->counting && !c->held) {
+        // Low from the control word on, in mode 0; high waiting otherwise
+        return c->mode != 0;
+    }
+    uint64_t t = i8253_elapsed(c, now);
+    uint32_t n = i8253_n(c);
+    switch (c->mode) {
+        // High once the count runs out
+        case 0:
+        case 1: return t >= n;
+        // Low for the clock the count is at 1
+        case 2: return t % n != n - 1;
+        // High for the first half of the period, the longer one if N is odd
+        case 3: return t % n < (n + 1) / 2;
+        // Low for the clock after the count reaches 0
+        case 4:
+        case 5: return t != n;
+        default: return true;
+    }
+}
+
+uint64_t i8253_next_change(i8253_state_t *pit, uint8_t ofs, uint64_t now) {
+    i8253_chan_t *c = &pit->chans[ofs];
+    i8253_sync(c, now);
+    if (!c->counting) return PIT_NEVER;
+    uint64_t t = now - c->start;
+    uint32_t n = i8253_n(c);
+    uint64_t period = now - t % n;
+    switch (c->mode) {
+        case 0:
+        case 1: return t < n ? c->start + n : PIT_NEVER;
+        case 2: {
+            if (n == 1) return PIT_NEVER;
+            return t % n < n - 1 ? period + n - 1 : period + n;
+        }
+        case 3: {
+            if (n == 1) return PIT_NEVER;
+            return t % n < (n + 1) / 2 ? period + (n + 1) / 2 : period + n;
         }
-        *i8253_state.out[0] = false;
-        i8253_state.ctr_limits[0] = i8253_state.ctrs[0].x;
-        i8253_state.access_ctrs[0]++;
+        case 4:
+        case 5: {
+            if (t < n) return c->start + n;
+            return t == n ? c->start + n + 1 : PIT_NEVER;
+        }
+        default: return PIT_NEVER;
     }
 }
 
-uint8_t i8253_timer_read(uint8_t ofs) {
-    // Timer 0
-    uint8_t ret;
-    if (ofs == 0) {
-        switch (i8253_state.status & 0b00110000) {
-            case 0b00000000: ret = (i8253_state.access_ctrs[0] & 1) ? (i8253_state.ctrs_latch[0] >> 8) : (i8253_state.ctrs_latch[0]); break;
-            case 0b00010000: ret = (i8253_state.ctrs[0].b.l); break;
-            case 0b00100000: ret = (i8253_state.ctrs[0].b.h); break;
-            case 0b00110000: ret = (i8253_state.access_ctrs[0] & 1) ? (i8253_state.ctrs[0].b.h) : (i8253_state.ctrs[0].b.l); break;
+void i8253_cr_write(i8253_state_t *pit, uint8_t val, uint64_t now) {
+    // Counter 3 is the 8254's read-back command
+    if ((val >> 6) == 3) return;
+    i8253_chan_t *c = &pit->chans[val >> 6];
+    i8253_sync(c, now);
+    uint8_t rw = (val >> 4) & 3;
+    if (rw == PIT_RW_LATCH) {
+        // The first latch holds until it has been read
+        if (!c->latched) {
+            uint32_t count = i8253_count(c, now);
+            c->latch = c->bcd ? i8253_to_bcd(count) : count;
+            c->latched = true;
         }
-    } else {
-        // Timer 1 and 2: lol
-        // dumb hack to pass POST
-        ret = i8253_state.access_ctrs[1] > 0 ? 0 : 0xFF;
+        return;
     }
-    i8253_state.access_ctrs[ofs]++;
-    return ret;
-}
-
-void i8253_tick() {
-    if (!i8253_state.init) { return; }
-    assert(i8253_state.out[0]);
-    switch (i8253_state.status & 0b1110) {
-        // Mode 0
-        case 0b0000: {
-            if (--i8253_state.ctrs[0].x == 0) {
-                *i8253_state.out[0] = true;
+    c->rw = rw;
+    c->mode = (val >> 1) & 7;
+    // 6 and 7 are 2 and 3 again
+    if (c->mode > 5) c->mode -= 4;
+    c->bcd = val & 1;
+    c->loaded = false;
+    c->counting = false;
+    c->held = false;
+    c->pending = false;
+    c->latched = false;
+    c->read_hi = false;
+    c->write_hi = false;
+}
+
+// Start counting down from the count just loaded
+static void i8253_start(i8253_chan_t *c, uint64_t now) {
+    c->count = c->reload;
+    c->start = now;
+    c->pending = false;
+    // Only modes 0 and 4 are started with the gate low, which holds them
+    c->counting = c->gate;
+    c->held = !c->gate;
+    c->held_ticks = 0;
+}
+
+void i8253_timer_write(i8253_state_t *pit, uint8_t ofs, uint8_t val,
+                       uint64_t now) {
+    i8253_chan_t *c = &pit->chans[ofs];
+    i8253_sync(c, now);
+    switch (c->rw) {
+        case PIT_RW_LSB: c->reload = val; break;
+        case PIT_RW_MSB: c->reload = val << 8; break;
+        case PIT_RW_BOTH: {
+            if (!c->write_hi) {
+                c->write_lo = val;
+                c->write_hi = true;
+                // Mode 0 stops counting until the whole count is in
+                if (c->mode == 0) {
+                    c->counting = false;
+                    c->held = false;
+                }
+                return;
             }
+            c->reload = c->write_lo | val << 8;
+            c->write_hi = false;
             break;
         }
-        // Mode 3
-        case 0b1110:
-        case 0b0110: {
-            if (--i8253_state.ctrs[0].x == 0xFFFF) {
-                i8253_state.ctrs[0].x = i8253_state.ctr_limits[0] - 1;
+        default: return;
+    }
+    bool first = !c->loaded;
+    c->loaded = true;
+    switch (c->mode) {
+        case 0:
+        case 4: i8253_start(c, now); break;
+        // Waiting for a trigger on the gate; one going on keeps its count
+        case 1:
+        case 5: break;
+        case 2:
+        case 3: {
+            if (first || !c->counting) {
+                if (c->gate) i8253_start(c, now);
+            } else {
+                uint32_t n = i8253_n(c);
+                c->pending = true;
+                c->pending_at = now - (now - c->start) % n + n;
+            }
+            break;
+        }
+    }
+}
+
+void i8253_gate(i8253_state_t *pit, uint8_t ofs, bool gate, uint64_t now) {
+    i8253_chan_t *c = &pit->chans[ofs];
+    i8253_sync(c, now);
+    if (c->gate == gate) return;
+    c->gate = gate;
+    switch (c->mode) {
+        case 0:
+        case 4: {
+            if (!gate && c->counting) {
+                c->held_ticks = now - c->start;
+                c->held = true;
+                c->counting = false;
+            } else if (gate && c->held) {
+                c->start = now - c->held_ticks;
+                c->held = false;
+                c->counting = true;
             }
-            *i8253_state.out[0] = (i8253_state.ctrs[0].x >= (i8253_state.ctr_limits[0]>>1));
             break;
         }
-        default: {
-            printf("unrecognized timer mode %d\n", i8253_state.status);
+        // A rising edge starts the count again
+        case 1:
+        case 5: if (gate && c->loaded) i8253_start(c, now); break;
+        // Low stops the count with the output high, rising starts it again
+        case 2:
+        case 3: {
+            if (!gate) {
+                c->counting = false;
+                c->pending = false;
+                c->count = c->reload;
+            } else if (c->loaded) {
+                i8253_start(c, now);
+            }
             break;
         }
     }
 }
+
+uint8_t i8253_timer_read(i8253_state_t *pit, uint8_t ofs, uint64_t now) {
+    i8253_chan_t *c = &pit->chans[ofs];
+    i8253_sync(c, now);
+    uint16_t val;
+    if (c->latched) {
+        val = c->latch;
+    } else {
+        uint32_t count = i8253_count(c, now);
+        val = c->bcd ? i8253_to_bcd(count) : count;
+    }
+    bool hi;
+    switch (c->rw) {
+        case PIT_RW_MSB: hi = true; break;
+        case PIT_RW_BOTH: hi = c->read_hi; c->read_hi = !c->read_hi; break;
+        default: hi = false; break;
+    }
+    // A latch is let go once read through
+    if (c->rw != PIT_RW_BOTH || !c->read_hi) c->latched = false;
+    return hi ? val >> 8 : val & 0xFF;
+}
+
+uint8_t i8253_cr_read(i8253_state_t *pit, uint64_t now) {
+    i8253_chan_t *c = &pit->chans[0];
+    return (i8253_out(pit, 0, now) ? 0x80 : 0) | c->rw << 4 | c->mode << 1 |
+           c->bcd;
+}
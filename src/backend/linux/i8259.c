@@ -5,97 +5,126 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-i8259_state_t i8259_state;
-
-void i8259_init() {
-    memset(&i8259_state, 0, sizeof(i8259_state_t));
+void i8259_init(i8259_state_t *pic, bool *intr) {
+    memset(pic, 0, sizeof(i8259_state_t));
     // -1 = uninitialized, 0 = fully initialized, n>0 = during initialization
-    i8259_state.icw_ind = -1; 
+    pic->icw_ind = -1;
+    pic->lowest = 7;
+    pic->intr = intr;
+    *intr = false;
+}
+
+// Rotate mask so that bit 0 is the IRQ with the highest priority
+static inline uint8_t i8259_by_priority(i8259_state_t *pic, uint8_t mask) {
+    uint8_t top = (pic->lowest + 1) & 7;
+    return (uint8_t)(mask >> top | mask << ((8 - top) & 7));
+}
+
+// IRQ of the highest priority bit of mask, which is not empty
+static inline uint8_t i8259_highest(i8259_state_t *pic, uint8_t mask) {
+    return (__builtin_ctz(i8259_by_priority(pic, mask)) + pic->lowest + 1) & 7;
+}
+
+void i8259_update(i8259_state_t *pic) {
+    uint8_t req = pic->irr & ~pic->imr;
+    bool intr = false;
+    if (pic->icw_ind == 0 && req) {
+        // Only a request above everything in service gets through
+        uint8_t isr = i8259_by_priority(pic, pic->isr);
+        intr = !isr || __builtin_ctz(i8259_by_priority(pic, req)) <
+                           __builtin_ctz(isr);
+    }
+    *pic->intr = intr;
+}
+
+// OCW2: end of interrupt and priority rotation
+static void i8259_ocw2(i8259_state_t *pic, uint8_t val) {
+    uint8_t irq = val & I8259_OCW2_IRQ;
+    switch (val & I8259_OCW2_CMD) {
+        // Clear the highest priority ISR bit, which is the interrupt being
+        // serviced as lower ones can't get in while it is
+        case I8259_EOI:
+        case I8259_ROTATE_EOI: {
+            if (!pic->isr) return;
+            irq = i8259_highest(pic, pic->isr);
+            pic->isr &= ~(1 << irq);
+            if ((val & I8259_OCW2_CMD) == I8259_ROTATE_EOI) {
+                pic->lowest = irq;
+            }
+            break;
+        }
+        case I8259_SPECIFIC_EOI: pic->isr &= ~(1 << irq); break;
+        case I8259_ROTATE_SPECIFIC_EOI: {
+            pic->isr &= ~(1 << irq);
+            pic->lowest = irq;
+            break;
+        }
+        case I8259_SET_PRIORITY: pic->lowest = irq; break;
+        // Rotation in automatic EOI mode is not supported
+        default: return;
+    }
+    i8259_update(pic);
 }
 
-void i8259_write_command(uint8_t val) {
-    if ((val & I8259_ICW1_INIT) && (i8259_state.icw_ind <= 0)) {
+void i8259_write_command(i8259_state_t *pic, uint8_t val) {
+    if ((val & I8259_ICW1_INIT) && (pic->icw_ind <= 0)) {
         // Start initialization sequence
-        i8259_state.icw[0] = val;
+        pic->icw[0] = val;
         // Why Are You Not Using ICW4
-        assert(i8259_state.icw[0] & I8259_ICW1_ICW4);
+        assert(pic->icw[0] & I8259_ICW1_ICW4);
         // Why Are You Trying To Cascade PICs
-        assert(i8259_state.icw[0] & I8259_ICW1_SINGL);
-        i8259_state.icw_ind = 1;
-    } else if (val == I8259_EOI) {
-        // End of Interrupt
-        // Clear highest priority ISR bit
-        // Necessarily will be this way because high priority ISRs (interrupt service routines)
-        // won't be interrupted by lower priority ones
-        for (int i = 0; i < 8; i++) {
-            if (i8259_state.isr & (1 << i)) {
-                i8259_state.isr &= ~(1 << i);
-            }
+        assert(pic->icw[0] & I8259_ICW1_SINGL);
+        pic->icw_ind = 1;
+        pic->imr = 0;
+        pic->isr = 0;
+        pic->lowest = 7;
+        pic->read_isr = false;
+        i8259_update(pic);
+    } else if (val & I8259_OCW3) {
+        if (val & I8259_OCW3_RR) {
+            pic->read_isr = val & I8259_OCW3_RIS;
         }
+    } else {
+        i8259_ocw2(pic, val);
     }
 }
 
-void i8259_write_data(uint8_t val) {
-    if (i8259_state.icw_ind == 0) {
-        // write mask 
-        i8259_state.imr = val;
-    } else if (i8259_state.icw_ind > 0) {
-        i8259_state.icw[i8259_state.icw_ind] = val;
-        if (i8259_state.icw_ind == 1) {
-            i8259_state.icw_ind = 3;
+void i8259_write_data(i8259_state_t *pic, uint8_t val) {
+    if (pic->icw_ind == 0) {
+        // write mask
+        pic->imr = val;
+    } else if (pic->icw_ind > 0) {
+        pic->icw[pic->icw_ind] = val;
+        if (pic->icw_ind == 1) {
+            pic->icw_ind = 3;
         } else {
-            i8259_state.icw_ind = 0;
+            pic->icw_ind = 0;
         }
     }
-    printf("IMR=%02x\n", i8259_state.imr);
+    i8259_update(pic);
+    printf("IMR=%02x\n", pic->imr);
     for (int i = 0; i < 4; i++) {
-        printf("ICW[%d]=%02x\n", i, i8259_state.icw[i]);
+        printf("ICW[%d]=%02x\n", i, pic->icw[i]);
     }
 }
 
-uint8_t i8259_read_command() {
-    printf("unimplemented\n");
-    exit(1);
+uint8_t i8259_read_command(i8259_state_t *pic) {
+    return pic->read_isr ? pic->isr : pic->irr;
 }
 
-uint8_t i8259_read_data() {
-    return i8259_state.imr;
+uint8_t i8259_read_data(i8259_state_t *pic) {
+    return pic->imr;
 }
 
-void i8259_tick() {
-    // Not initialized
-    if (i8259_state.icw_ind != 0) return;
-    int irq_sel = -1;
-    for (int i = 0; i < 8; i++) {
-        // Positive edge
-        if (i8259_state.irqs[i] && !i8259_state.irqs_last[i] && irq_sel < 0 ) {
-            irq_sel = i;
-        }
-        // IRQ went down? make sure IRR bit is clear
-        if (!i8259_state.irqs[i]) {
-            i8259_state.irr &= ~(1 << i);        
-        }
-        i8259_state.irqs_last[i] = i8259_state.irqs[i];
-    }
-    if (irq_sel < 0) {
-        return;
-    }
-    i8259_state.irr |= (1 << irq_sel);
-}
-
-uint8_t i8259_ack() {
+uint8_t i8259_ack(i8259_state_t *pic) {
     // Interrupt line should still be high when we process this, since we handle things atomically
-    assert(i8259_int());
-    uint8_t mask = CALCULATE_ISR_MASK(i8259_state.isr) & ~i8259_state.imr;
-    
-    int i;
-    for (i = 0; i < 8; i++) {
-        if ((1 << i) & i8259_state.irr & mask) {
-            i8259_state.isr |= 1 << i;
-            i8259_state.irr &= ~(1 << i);
-            break;
-        }
+    assert(i8259_int(pic));
+    uint8_t irq = i8259_highest(pic, pic->irr & ~pic->imr);
+    pic->irr &= ~(1 << irq);
+    if (!(pic->icw[3] & I8259_ICW4_AEOI)) {
+        pic->isr |= 1 << irq;
     }
-    uint8_t vector_ofs = (i8259_state.icw[1] & I8259_ICW2_OFS_MASK);
-    return vector_ofs + i;
-}
\ No newline at end of file
+    i8259_update(pic);
+    uint8_t vector_ofs = (pic->icw[1] & I8259_ICW2_OFS_MASK);
+    return vector_ofs + irq;
+}
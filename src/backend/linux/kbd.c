@@ -0,0 +1,82 @@
+#include "kbd.h"
+
+// Modifier held down around a key
+#define KBD_SHIFT 0x100
+#define KBD_CTRL  0x200
+
+// Set 1 make code of the key typing each ASCII character on a US keyboard,
+// with its modifier. Characters with no key are 0.
+static const uint16_t kbd_ascii[128] = {
+    // Control characters are Ctrl and the letter, bar the ones with keys
+    [0x01] = KBD_CTRL | 0x1E, [0x02] = KBD_CTRL | 0x30,
+    [0x03] = KBD_CTRL | 0x2E, [0x04] = KBD_CTRL | 0x20,
+    [0x05] = KBD_CTRL | 0x12, [0x06] = KBD_CTRL | 0x21,
+    [0x07] = KBD_CTRL | 0x22, [0x0B] = KBD_CTRL | 0x25,
+    [0x0C] = KBD_CTRL | 0x26, [0x0E] = KBD_CTRL | 0x31,
+    [0x0F] = KBD_CTRL | 0x18, [0x10] = KBD_CTRL | 0x19,
+    [0x11] = KBD_CTRL | 0x10, [0x12] = KBD_CTRL | 0x13,
+    [0x13] = KBD_CTRL | 0x1F, [0x14] = KBD_CTRL | 0x14,
+    [0x15] = KBD_CTRL | 0x16, [0x16] = KBD_CTRL | 0x2F,
+    [0x17] = KBD_CTRL | 0x11, [0x18] = KBD_CTRL | 0x2D,
+    [0x19] = KBD_CTRL | 0x15, [0x1A] = KBD_CTRL | 0x2C,
+    ['\b'] = 0x0E, ['\t'] = 0x0F, ['\n'] = 0x1C, ['\r'] = 0x1C,
+    [0x1B] = 0x01,
+
+    [' '] = 0x39,
+    ['1'] = 0x02, ['2'] = 0x03, ['3'] = 0x04, ['4'] = 0x05, ['5'] = 0x06,
+    ['6'] = 0x07, ['7'] = 0x08, ['8'] = 0x09, ['9'] = 0x0A, ['0'] = 0x0B,
+    ['!'] = KBD_SHIFT | 0x02, ['@'] = KBD_SHIFT | 0x03,
+    ['#'] = KBD_SHIFT | 0x04, ['$'] = KBD_SHIFT | 0x05,
+    ['%'] = KBD_SHIFT | 0x06, ['^'] = KBD_SHIFT | 0x07,
+    ['&'] = KBD_SHIFT | 0x08, ['*'] = KBD_SHIFT | 0x09,
+    ['('] = KBD_SHIFT | 0x0A, [')'] = KBD_SHIFT | 0x0B,
+    ['-'] = 0x0C, ['_'] = KBD_SHIFT | 0x0C,
+    ['='] = 0x0D, ['+'] = KBD_SHIFT | 0x0D,
+    ['['] = 0x1A, ['{'] = KBD_SHIFT | 0x1A,
+    [']'] = 0x1B, ['}'] = KBD_SHIFT | 0x1B,
+    [';'] = 0x27, [':'] = KBD_SHIFT | 0x27,
+    ['\''] = 0x28, ['"'] = KBD_SHIFT | 0x28,
+    ['`'] = 0x29, ['~'] = KBD_SHIFT | 0x29,
+    ['\\'] = 0x2B, ['|'] = KBD_SHIFT | 0x2B,
+    [','] = 0x33, ['<'] = KBD_SHIFT | 0x33,
+    ['.'] = 0x34, ['>'] = KBD_SHIFT | 0x34,
+    ['/'] = 0x35, ['?'] = KBD_SHIFT | 0x35,
+
+    ['a'] = 0x1E, ['b'] = 0x30, ['c'] = 0x2E, ['d'] = 0x20, ['e'] = 0x12,
+    ['f'] = 0x21, ['g'] = 0x22, ['h'] = 0x23, ['i'] = 0x17, ['j'] = 0x24,
+    ['k'] = 0x25, ['l'] = 0x26, ['m'] = 0x32, ['n'] = 0x31, ['o'] = 0x18,
+    ['p'] = 0x19, ['q'] = 0x10, ['r'] = 0x13, ['s'] = 0x1F, ['t'] = 0x14,
+    ['u'] = 0x16, ['v'] = 0x2F, ['w'] = 0x11, ['x'] = 0x2D, ['y'] = 0x15,
+    ['z'] = 0x2C,
+    ['A'] = KBD_SHIFT | 0x1E, ['B'] = KBD_SHIFT | 0x30,
+    ['C'] = KBD_SHIFT | 0x2E, ['D'] = KBD_SHIFT | 0x20,
+    ['E'] = KBD_SHIFT | 0x12, ['F'] = KBD_SHIFT | 0x21,
+    ['G'] = KBD_SHIFT | 0x22, ['H'] = KBD_SHIFT | 0x23,
+    ['I'] = KBD_SHIFT | 0x17, ['J'] = KBD_SHIFT | 0x24,
+    ['K'] = KBD_SHIFT | 0x25, ['L'] = KBD_SHIFT | 0x26,
+    ['M'] = KBD_SHIFT | 0x32, ['N'] = KBD_SHIFT | 0x31,
+    ['O'] = KBD_SHIFT | 0x18, ['P'] = KBD_SHIFT | 0x19,
+    ['Q'] = KBD_SHIFT | 0x10, ['R'] = KBD_SHIFT | 0x13,
+    ['S'] = KBD_SHIFT | 0x1F, ['T'] = KBD_SHIFT | 0x14,
+    ['U'] = KBD_SHIFT | 0x16, ['V'] = KBD_SHIFT | 0x2F,
+    ['W'] = KBD_SHIFT | 0x11, ['X'] = KBD_SHIFT | 0x2D,
+    ['Y'] = KBD_SHIFT | 0x15, ['Z'] = KBD_SHIFT | 0x2C,
+};
+
+size_t kbd_text_scancodes(const char *text, size_t len, uint8_t *out) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = text[i];
+        // CR LF is one Enter
+        if (c == '\n' && i > 0 && text[i - 1] == '\r') continue;
+        uint16_t key = c < 128 ? kbd_ascii[c] : 0;
+        if (key == 0) continue;
+        uint8_t mod = (key & KBD_SHIFT) ? KBD_SC_LSHIFT
+                    : (key & KBD_CTRL)  ? KBD_SC_CTRL : 0;
+        if (mod) out[n++] = mod;
+        out[n++] = key & 0x7F;
+        out[n++] = (key & 0x7F) | KBD_SC_BREAK;
+        if (mod) out[n++] = mod | KBD_SC_BREAK;
+    }
+    return n;
+}
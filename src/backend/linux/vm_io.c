@@ -5,118 +5,392 @@
 #include "i8253.h"
 #include "i8259.h"
 #include "i8237.h"
+#include "replay.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <SDL2/SDL_mutex.h>
 
-kbd_state_t kbd_state;
-
-struct {
+// The devices of one machine
+struct vm_io {
+    vm_t *vm;
+    i8253_state_t pit;
+    i8259_state_t pic;
+    i8237_state_t dma;
+    kbd_state_t kbd;
+    cga_state_t cga;
     bool sense_sw_en;
     uint8_t sense_sw;
-} global_io;
+    // Last write to PPI port B, which reads back
+    uint8_t ppi_b;
+    // PIT clock of the counter 0 output change SCHED_PIT was set for,
+    // PIT_NEVER if it was set by an access instead
+    uint64_t pit_change;
+    // The CGA window is up
+    bool gfx_initd;
+    // vm->opts.idle_sleep from before typing started
+    bool type_idle_sleep;
+};
+
+// Keys the BIOS may hold unread before typing waits for it; its buffer
+// takes 15, and the one last read may not be in it yet
+#define KBD_TYPE_AHEAD 8
+// CPU clocks between checks while typing is held up
+#define KBD_TYPE_POLL  1000
+
+static inline uint64_t pit_now(vm_t *vm) {
+    return vm->cycles / PIT_CLOCK_DIV;
+}
+
+// CPU clock of a PIT clock
+static inline uint64_t pit_cycles(uint64_t ticks) {
+    return ticks == PIT_NEVER ? SCHED_NEVER : ticks * PIT_CLOCK_DIV;
+}
+
+// SCHED_PIT: set IRQ 0 to the counter 0 output and wait for its next
+// change. A pulse shorter than the instruction it fell in is passed on
+// whole, so that the PIC sees the edge.
+static void pit_event(void *ctx, uint64_t cycles) {
+    vm_io_t *io = ctx;
+    uint64_t now = cycles / PIT_CLOCK_DIV;
+    bool out = i8253_out(&io->pit, 0, now);
+    if (out == i8259_line(&io->pic, 0) && io->pit_change <= now) {
+        i8259_set_irq(&io->pic, 0, !out);
+    }
+    i8259_set_irq(&io->pic, 0, out);
+    io->pit_change = i8253_next_change(&io->pit, 0, now);
+    sched_at(&io->vm->sched, SCHED_PIT, pit_cycles(io->pit_change));
+}
+
+// An access changed the PIT: the line follows at once, as the rest of a
+// translated block runs before the next event
+static void pit_kick(vm_io_t *io) {
+    io->pit_change = PIT_NEVER;
+    pit_event(io, io->vm->cycles);
+}
+
+// SCHED_KBD
+static void kbd_event(void *ctx, uint64_t cycles) {
+    vm_io_t *io = ctx;
+    (void)cycles;
+    kbd_reset_done(&io->kbd);
+}
+
+// SCHED_INPUT: feed the recorded or journaled input due by now
+static void input_event(void *ctx, uint64_t cycles) {
+    vm_io_t *io = ctx;
+    uint8_t kind, data;
+    while (replay_next(io->vm, cycles, &kind, &data)) {
+        switch (kind) {
+            case REPLAY_KBD: kbd_deliver(&io->kbd, data); break;
+            default: printf("unknown replay entry %d\n", kind); break;
+        }
+    }
+}
+
+// SCHED_DMA
+static void dma_event(void *ctx, uint64_t cycles) {
+    vm_io_t *io = ctx;
+    i8237_event(&io->dma, cycles);
+}
+
+static bool type_pending(vm_io_t *io) {
+    return io->kbd.typing_pos < io->kbd.typing_len;
+}
+
+static void type_stop(vm_io_t *io) {
+    io->kbd.typing_pos = io->kbd.typing_len = 0;
+    io->vm->opts.idle_sleep = io->type_idle_sleep;
+    sched_at(&io->vm->sched, SCHED_TYPE, SCHED_NEVER);
+}
+
+// The guest can take scancode sc now: the keyboard is enabled with its IRQ
+// unmasked, POST has set up the BIOS keyboard buffer at 40:1E, and a key
+// press has room in it
+static bool type_ready(vm_io_t *io, uint8_t sc) {
+    if (io->kbd.len > 0 || io->sense_sw_en ||
+        (io->pic.imr & (1 << KBD_IRQ))) {
+        return false;
+    }
+    uint16_t head = load_u16(&io->vm->mem, 0x40, 0x1A);
+    uint16_t tail = load_u16(&io->vm->mem, 0x40, 0x1C);
+    if (head < 0x1E || tail < 0x1E) return false;
+    return (sc & KBD_SC_BREAK) ||
+           ((tail - head) & 0x1F) / 2 < KBD_TYPE_AHEAD;
+}
+
+// SCHED_TYPE: send the next scancode being typed in, logging it for
+// replays like host input. A replay that started since has the session's
+// typing in it, so the rest is dropped.
+static void type_event(void *ctx, uint64_t cycles) {
+    vm_io_t *io = ctx;
+    kbd_state_t *kbd = &io->kbd;
+    if (!type_pending(io)) return;
+    if (replay_playing(io->vm)) {
+        type_stop(io);
+        return;
+    }
+    uint8_t sc = kbd->typing[kbd->typing_pos];
+    if (!type_ready(io, sc)) {
+        // A read of port A brings this forward
+        sched_at(&io->vm->sched, SCHED_TYPE, cycles + KBD_TYPE_POLL);
+        return;
+    }
+    replay_log(io->vm, cycles, REPLAY_KBD, sc);
+    kbd_deliver(kbd, sc);
+    if (++kbd->typing_pos == kbd->typing_len) type_stop(io);
+}
+
+// Take in host input at this clock, logging it for replays. A replay owns
+// the input until it runs out. Keys beyond what the keyboard has room for
+// stay in the ring until a read of port A makes some.
+static void host_input(vm_io_t *io, uint64_t cycles) {
+    if (!kbd_host_pending(&io->kbd)) return;
+    uint8_t keys[KBD_HOST_QUEUE];
+    if (replay_playing(io->vm)) {
+        kbd_take_host(&io->kbd, keys, KBD_HOST_QUEUE);
+        return;
+    }
+    int n = kbd_take_host(&io->kbd, keys, KBD_BUFFER - io->kbd.len);
+    for (int i = 0; i < n; i++) {
+        replay_log(io->vm, cycles, REPLAY_KBD, keys[i]);
+        kbd_deliver(&io->kbd, keys[i]);
+    }
+}
+
+void io_init(vm_t *vm) {
+    vm_io_t *io = calloc(1, sizeof(vm_io_t));
+    vm->io = io;
+    io->vm = vm;
+    io->sense_sw_en = true;
+    io->sense_sw = 0b00011100;
+    //          1 drive ^ | | |
+    //      40x25 display ^ | |
+    //    max dedotated wam ^ |
+    //               reserved ^
+    io->pit_change = PIT_NEVER;
+    sched_init(&vm->sched, io);
+    sched_register(&vm->sched, SCHED_PIT, pit_event);
+    sched_register(&vm->sched, SCHED_KBD, kbd_event);
+    sched_register(&vm->sched, SCHED_INPUT, input_event);
+    sched_register(&vm->sched, SCHED_DMA, dma_event);
+    sched_register(&vm->sched, SCHED_TYPE, type_event);
+    i8259_init(&io->pic, &vm->intr);
+    i8237_init(&io->dma, &vm->mem, &vm->sched);
+    i8253_init(&io->pit);
+    // Counter 2 is gated by PPI port B
+    i8253_gate(&io->pit, 2, false, pit_now(vm));
+    kbd_init(&io->kbd, &io->pic, &vm->sched);
+    io->cga.lock = SDL_CreateMutex();
+    io->cga.mem = &vm->mem;
+    io->cga.kbd = &io->kbd;
+    io->cga.stop = &vm->stop;
+}
+
+void io_free(vm_t *vm) {
+    vm_io_t *io = vm->io;
+    if (io == NULL) return;
+    cga_stop(&io->cga);
+    SDL_DestroyMutex(io->cga.lock);
+    kbd_free(&io->kbd);
+    free(io);
+    vm->io = NULL;
+}
 
-void io_init() {
-    global_io.sense_sw_en = true;
-    global_io.sense_sw = 0b00011100;
-    //              1 drive ^ | | |
-    //          40x25 display ^ | |
-    //        max dedotated wam ^ |
-    //                   reserved ^
-    i8259_init();
-    i8237_init();
-    i8253_init(&i8259_state.irqs[0]);
-    kbd_init(&i8259_state.irqs[1]);
+uint8_t io_int_ack(vm_t *vm) {
+    return i8259_ack(&vm->io->pic);
 }
 
-uint8_t io_int_ack() {
-    return i8259_ack();
+static void io_access_u16(vm_io_t *io, uint16_t addr) {
+    io->vm->io_access_count++;
+    if (CGA_REG_START <= addr && addr <= CGA_REG_END && !io->gfx_initd &&
+        !io->vm->opts.headless) {
+        cga_start(&io->cga);
+        io->gfx_initd = true;
+    }
+}
+
+typedef struct {
+    i8253_state_t pit;
+    i8259_state_t pic;
+    i8237_state_t dma;
+    uint8_t kbd_fifo[KBD_BUFFER];
+    uint8_t kbd_head;
+    uint8_t kbd_len;
+    uint8_t kbd_last;
+    uint8_t kbd_sr;
+    uint8_t cga_mode;
+    bool sense_sw_en;
+    uint8_t sense_sw;
+    uint8_t ppi_b;
+    bool gfx_initd;
+    uint64_t pit_change;
+    // Deadline of each sched_event_t, SCHED_NEVER if not pending
+    uint64_t sched_when[SCHED_COUNT];
+} io_snap_t;
+
+size_t io_snap_size() {
+    return sizeof(io_snap_t);
 }
 
-bool io_int_poll() {
-    return i8259_int();
+void io_save(vm_t *vm, void *buf) {
+    vm_io_t *io = vm->io;
+    io_snap_t *s = buf;
+    memset(s, 0, sizeof(*s));
+    s->pit = io->pit;
+    s->pic = io->pic;
+    s->pic.intr = NULL;
+    s->dma = io->dma;
+    memset(s->dma.devs, 0, sizeof(s->dma.devs));
+    s->dma.mem = NULL;
+    s->dma.sched = NULL;
+    memcpy(s->kbd_fifo, io->kbd.fifo, KBD_BUFFER);
+    s->kbd_head = io->kbd.head;
+    s->kbd_len = io->kbd.len;
+    s->kbd_last = io->kbd.last;
+    s->kbd_sr = io->kbd.state_sr;
+    s->cga_mode = io->cga.mode;
+    s->sense_sw_en = io->sense_sw_en;
+    s->sense_sw = io->sense_sw;
+    s->ppi_b = io->ppi_b;
+    s->gfx_initd = io->gfx_initd;
+    s->pit_change = io->pit_change;
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        s->sched_when[i] = vm->sched.slot[i] < 0 ? SCHED_NEVER
+                                                 : vm->sched.when[i];
+    }
 }
 
-void io_access_u16(uint16_t addr) {
-    static bool gfx_initd = false;
-    if (CGA_REG_START <= addr && addr <= CGA_REG_END && !gfx_initd) {
-        cga_start();
-        gfx_initd = true;
+void io_restore(vm_t *vm, const void *buf) {
+    vm_io_t *io = vm->io;
+    const io_snap_t *s = buf;
+    io->pit = s->pit;
+    bool *intr = io->pic.intr;
+    io->pic = s->pic;
+    io->pic.intr = intr;
+    i8259_update(&io->pic);
+    i8237_restore(&io->dma, &s->dma);
+    memcpy(io->kbd.fifo, s->kbd_fifo, KBD_BUFFER);
+    io->kbd.head = s->kbd_head;
+    io->kbd.len = s->kbd_len;
+    io->kbd.last = s->kbd_last;
+    io->kbd.state_sr = s->kbd_sr;
+    io->cga.mode = s->cga_mode;
+    io->sense_sw_en = s->sense_sw_en;
+    io->sense_sw = s->sense_sw;
+    io->ppi_b = s->ppi_b;
+    io->pit_change = s->pit_change;
+    if (s->gfx_initd && !io->gfx_initd && !vm->opts.headless) {
+        cga_start(&io->cga);
+        io->gfx_initd = true;
     }
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        sched_at(&vm->sched, i, s->sched_when[i]);
+    }
+    sched_kick(&vm->sched);
 }
 
-void io_write_u16(uint16_t addr, uint16_t data) {    
+void io_write_u16(vm_t *vm, uint16_t addr, uint16_t data) {    
+    vm_io_t *io = vm->io;
     //printf("write %04x\n", addr);
-    io_access_u16(addr);
+    io_access_u16(io, addr);
     if (addr <= DMA_CHAN_REG_END) {
-        i8237_chan_write(addr, data);
+        i8237_chan_write(&io->dma, addr, data);
         return;
     } else if (addr <= DMA_CTRL_REG_END) {
-        i8237_cr_write(addr, data);
+        i8237_cr_write(&io->dma, addr, data, vm->cycles);
         return;
     }
     switch(addr) {
         case CGA_REG_MODE: {
-            SDL_LockMutex(cga_state.lock);
+            SDL_LockMutex(io->cga.lock);
             printf("mode %02x\n", data & 0xFF);
-            cga_state.mode = data & 0xFF;
-            SDL_UnlockMutex(cga_state.lock);
+            io->cga.mode = data & 0xFF;
+            SDL_UnlockMutex(io->cga.lock);
+            break;
+        }
+        case PIT_REG_CTRL: {
+            i8253_cr_write(&io->pit, data, pit_now(vm));
+            pit_kick(io);
+            break;
+        }
+        case PIT_REG_TIMER0:
+        case PIT_REG_TIMER1:
+        case PIT_REG_TIMER2: {
+            i8253_timer_write(&io->pit, addr - PIT_REG_TIMER0, data,
+                              pit_now(vm));
+            pit_kick(io);
             break;
         }
-        case PIT_REG_CTRL: i8253_cr_write(data); break;
-        case PIT_REG_TIMER0: i8253_timer_write(0, data); break;
-        case PIT_REG_TIMER1: i8253_timer_write(1, data); break;
-        case PIT_REG_TIMER2: i8253_timer_write(2, data); break;
-        case PIC_REG_COMMAND: i8259_write_command(data); break;
-        case PIC_REG_DATA: i8259_write_data(data); break;
-        case DMA_PAGE_CHAN0: i8237_state.chans[0].page = data; break;
-        case DMA_PAGE_CHAN1: i8237_state.chans[1].page = data; break;
-        case DMA_PAGE_CHAN2: i8237_state.chans[2].page = data; break;
-        case DMA_PAGE_CHAN3: i8237_state.chans[3].page = data; break;
+        case PIC_REG_COMMAND: i8259_write_command(&io->pic, data); break;
+        case PIC_REG_DATA: i8259_write_data(&io->pic, data); break;
+        case DMA_PAGE_CHAN0: io->dma.chans[0].page = data; break;
+        case DMA_PAGE_CHAN1: io->dma.chans[1].page = data; break;
+        case DMA_PAGE_CHAN2: io->dma.chans[2].page = data; break;
+        case DMA_PAGE_CHAN3: io->dma.chans[3].page = data; break;
         case PPI_REG_PORT_B: {
+            io->ppi_b = data;
+            // Bit 0 gates counter 2, bit 1 passes its output to the speaker
+            i8253_gate(&io->pit, 2, data & 1, pit_now(vm));
             if (data & 0x80) {
-                global_io.sense_sw_en = true;
+                io->sense_sw_en = true;
             } else {
                 // enable keyboard 
-                global_io.sense_sw_en = false;
+                io->sense_sw_en = false;
             }
-            kbd_update_state((data >> 6) & 3);
+            kbd_update_state(&io->kbd, (data >> 6) & 3, vm->cycles);
+            // The keyboard IRQ line follows the clock and enable bits
+            sched_kick(&vm->sched);
+            break;
+        }
+        // Exit code from the guest: the run stops after this instruction
+        case 0xFF: {
+            vm->exit_code = data & 0xFF;
+            vm->stop = 1;
             break;
         }
-        case 0xFF: { exit(data); }
         default: {} //printf("unrecognized wr port %04x\n", addr); }
     }
 }
 
-uint16_t io_read_u16(uint16_t addr, uint16_t pc) {
-    static uint32_t blank_ctr = 0;
-    io_access_u16(addr);
+uint16_t io_read_u16(vm_t *vm, uint16_t addr, uint16_t pc) {
+    vm_io_t *io = vm->io;
+    io_access_u16(io, addr);
     if (addr <= DMA_CHAN_REG_END) {
-        return i8237_chan_read(addr);
+        return i8237_chan_read(&io->dma, addr);
     } else if (addr <= DMA_CTRL_REG_END) {
-        return i8237_cr_read(addr);
+        return i8237_cr_read(&io->dma, addr);
     }
     switch(addr) {
-        case PIT_REG_CTRL: return i8253_cr_read();
-        case PIT_REG_TIMER0: return i8253_timer_read(0);
-        case PIT_REG_TIMER1: return i8253_timer_read(1);
-        case PIT_REG_TIMER2: return i8253_timer_read(2);
-        case PIC_REG_COMMAND: return i8259_read_command();
-        case PIC_REG_DATA: return i8259_read_data();
-        case DMA_PAGE_CHAN0: return i8237_state.chans[0].page;
-        case DMA_PAGE_CHAN1: return i8237_state.chans[1].page;
-        case DMA_PAGE_CHAN2: return i8237_state.chans[2].page;
-        case DMA_PAGE_CHAN3: return i8237_state.chans[3].page;
-        case PPI_REG_PORT_A: {
-            return global_io.sense_sw_en ? global_io.sense_sw : kbd_read();
+        case PIT_REG_CTRL: return i8253_cr_read(&io->pit, pit_now(vm));
+        case PIT_REG_TIMER0:
+        case PIT_REG_TIMER1:
+        case PIT_REG_TIMER2: {
+            return i8253_timer_read(&io->pit, addr - PIT_REG_TIMER0,
+                                    pit_now(vm));
         }
-        case PPI_REG_PORT_B: {
-            return global_io.sense_sw_en ? 0x80 : 0x00;
+        case PIC_REG_COMMAND: return i8259_read_command(&io->pic);
+        case PIC_REG_DATA: return i8259_read_data(&io->pic);
+        case DMA_PAGE_CHAN0: return io->dma.chans[0].page;
+        case DMA_PAGE_CHAN1: return io->dma.chans[1].page;
+        case DMA_PAGE_CHAN2: return io->dma.chans[2].page;
+        case DMA_PAGE_CHAN3: return io->dma.chans[3].page;
+        case PPI_REG_PORT_A: {
+            if (io->sense_sw_en) return io->sense_sw;
+            uint8_t sc = kbd_read(&io->kbd);
+            // Host keys held back for room come in after this instruction
+            if (kbd_host_pending(&io->kbd)) sched_kick(&vm->sched);
+            // Typing goes on as soon as the scancode has been taken
+            if (type_pending(io)) {
+                sched_at(&vm->sched, SCHED_TYPE, vm->cycles);
+            }
+            return sc;
         }
+        case PPI_REG_PORT_B: return io->ppi_b;
+        // Bit 5 is the counter 2 output
         case PPI_REG_PORT_C: {
-            // TODO
-            return 0;
+            return i8253_out(&io->pit, 2, pit_now(vm)) ? 0x20 : 0x00;
         }
         case 0x278:
         case 0x378:
@@ -130,23 +404,90 @@ uint16_t io_read_u16(uint16_t addr, uint16_t pc) {
             // uart thing
             return 0xFF;
         }
-        case CGA_REG_STATUS: blank_ctr++; return (blank_ctr % 8) ? 0x04 : 0x0B; // Display enabled, vertical retrace interval not set 
+        case CGA_REG_STATUS: return cga_status(vm->cycles);
+        // The run stops at the IN, with the open bus read
         default: {
-            printf("unrecognized rd port %04x\n", addr);
-            printf("HELP!. HELP!. HELP!. %04x\n", pc);
-            exit(EXIT_FAILURE);
+            printf("unrecognized rd port %04x at %04x\n", addr, pc);
+            vm->fault = VM_FAULT_PORT;
+            return 0xFF;
         };
     }
 }
 
-void io_tick(uint64_t cycles) {
-    // Timer ticks every other instruction
-    // Laziest attempt at "cycle accuracy" (just what is required to pass the PC BIOS check)
-    if (cycles % 2 == 1) {
-        i8253_tick();
+uint64_t io_next_event(vm_t *vm, uint64_t cycles) {
+    // A request the CPU has yet to take counts as due now
+    if (vm->intr) {
+        return cycles;
+    }
+    // The end of a run is no change of the devices
+    uint64_t next = sched_next_except(&vm->sched, SCHED_END);
+    return next < cycles ? cycles : next;
+}
+
+uint64_t io_read_stable_until(vm_t *vm, uint16_t addr, uint64_t cycles) {
+    vm_io_t *io = vm->io;
+    switch(addr) {
+        case CGA_REG_STATUS: return cga_status_until(cycles);
+        // Scancodes go away as they are read
+        case PPI_REG_PORT_A: {
+            return (io->sense_sw_en || io->kbd.len == 0)
+                ? IO_NO_EVENT : cycles;
+        }
+        case PPI_REG_PORT_C: {
+            uint64_t next = i8253_next_change(&io->pit, 2,
+                                              cycles / PIT_CLOCK_DIV);
+            return pit_cycles(next);
+        }
+        case PPI_REG_PORT_B:
+        case PIC_REG_DATA:
+        case DMA_PAGE_CHAN0:
+        case DMA_PAGE_CHAN1:
+        case DMA_PAGE_CHAN2:
+        case DMA_PAGE_CHAN3:
+            return IO_NO_EVENT;
+        default: return cycles;
+    }
+}
+
+bool io_input_pending(vm_t *vm) {
+    return kbd_host_pending(&vm->io->kbd) && !replay_playing(vm);
+}
+
+void io_input_wait(vm_t *vm, int64_t ns) {
+    kbd_host_wait(&vm->io->kbd, ns);
+}
+
+bool io_type(vm_t *vm, const char *text, size_t len) {
+    vm_io_t *io = vm->io;
+    kbd_state_t *kbd = &io->kbd;
+    if (replay_playing(vm)) return false;
+    if (!type_pending(io)) {
+        // The guest sets the pace; sleeping on idle would only slow it down
+        io->type_idle_sleep = vm->opts.idle_sleep;
+        vm->opts.idle_sleep = false;
+        kbd->typing_pos = kbd->typing_len = 0;
+    }
+    kbd->typing = realloc(kbd->typing, kbd->typing_len + len * 4);
+    kbd->typing_len += kbd_text_scancodes(text, len,
+                                          kbd->typing + kbd->typing_len);
+    if (type_pending(io)) {
+        sched_at(&vm->sched, SCHED_TYPE, vm->cycles);
+    } else {
+        type_stop(io);
     }
+    return true;
+}
+
+void io_dump_stats(vm_t *vm) {
+    kbd_state_t *kbd = &vm->io->kbd;
+    printf("keys overflowed: %u from the host, %u in the keyboard\n",
+           __atomic_load_n(&kbd->host.overflows, __ATOMIC_RELAXED),
+           kbd->dropped);
+}
 
-    kbd_tick();
-    
-    i8259_tick();
+void io_run(vm_t *vm) {
+    vm_io_t *io = vm->io;
+    sched_run(&vm->sched, vm->cycles);
+    host_input(io, vm->cycles);
+    kbd_tick(&io->kbd);
 }
\ No newline at end of file
@@ -1,31 +1,292 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "vm_mem.h"
+#include "bcache.h"
+#include "cga.h"
 
-// 1MB address space
-#define MEM_SIZE 1024*1024*1024
+// Size of the CGA frame buffer
+#define CGA_MEM_SIZE 0x4000
 
-uint8_t *mem;
-prog_info_t prog_info;
+void init_mem_blank(vm_mem_t *m) {
+    memset(m, 0, sizeof(vm_mem_t));
+    // Mapped rather than allocated, so that ROM images can be mapped over it
+    m->data = mmap(NULL, MEM_SIZE + MEM_SLACK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(m->data != MAP_FAILED);
+    m->watch_addr = -1;
+    mem_map_set(m, 0, MEM_SIZE, MEM_PAGE_UNMAPPED);
+    mem_map_set(m, 0x00000, 0xA0000, MEM_PAGE_RAM);
+    mem_map_set(m, CGA_COLOR_ADDR, CGA_MEM_SIZE, MEM_PAGE_MMIO);
+    // BIOS at FE000, BASIC at F6000
+    mem_map_set(m, 0xF0000, 0x10000, MEM_PAGE_ROM);
+}
+
+void mem_free(vm_mem_t *m) {
+    munmap(m->data, MEM_SIZE + MEM_SLACK);
+    free(m->store_log.entries);
+    m->data = NULL;
+    m->store_log.entries = NULL;
+}
+
+void mem_map_set(vm_mem_t *m, uint32_t addr, uint32_t len,
+                 mem_page_type_t type) {
+    assert(((addr | len) & ((1 << MEM_PAGE_SHIFT) - 1)) == 0);
+    assert(addr + len <= MEM_SIZE);
+    bool ro = type == MEM_PAGE_ROM || type == MEM_PAGE_UNMAPPED;
+    for (uint32_t page = addr >> MEM_PAGE_SHIFT;
+         page < (addr + len) >> MEM_PAGE_SHIFT; page++) {
+        uint32_t lo = page << MEM_PAGE_SHIFT;
+        if (type == MEM_PAGE_UNMAPPED) {
+            memset(m->data + lo, 0xFF, 1 << MEM_PAGE_SHIFT);
+        } else if (type != MEM_PAGE_ROM && m->map[page] == MEM_PAGE_UNMAPPED) {
+            memset(m->data + lo, 0, 1 << MEM_PAGE_SHIFT);
+        }
+        m->map[page] = type;
+        for (uint32_t w = lo >> MEM_WATCH_SHIFT;
+             w < (lo + (1 << MEM_PAGE_SHIFT)) >> MEM_WATCH_SHIFT; w++) {
+            if (ro) {
+                mem_watch_set(m, w, MEM_WATCH_RO);
+            } else {
+                mem_watch_clear(m, w, MEM_WATCH_RO);
+            }
+        }
+    }
+    mem_dirty_range(m, addr, len);
+}
 
-void init_mem_blank() {
-    mem = (uint8_t*)malloc(MEM_SIZE);
+bool mem_range_writable(vm_mem_t *m, uint32_t addr, uint32_t len) {
+    for (uint32_t page = addr >> MEM_PAGE_SHIFT;
+         page <= (addr + len - 1) >> MEM_PAGE_SHIFT; page++) {
+        if (m->map[page] == MEM_PAGE_ROM ||
+            m->map[page] == MEM_PAGE_UNMAPPED) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void load_mem(FILE *prog, int offset) {
+void load_mem(vm_mem_t *m, FILE *prog, int offset) {
     assert(offset < MEM_SIZE);
-    uint8_t* imem = mem + offset;
+    uint8_t* imem = m->data + offset;
 
     size_t prog_size = 0;
     // TODO just calculate the number of bytes to read ahead of time?
-    while (fread(imem, 1, 1, prog) && imem < (mem+MEM_SIZE)) {
+    while (fread(imem, 1, 1, prog) && imem < (m->data+MEM_SIZE)) {
         //printf("%02x ", *imem);
         prog_size++;
         imem++;
     }
-    prog_info.prog_start = offset;
-    prog_info.prog_size = prog_size;
-}
\ No newline at end of file
+    m->prog_info.prog_start = offset;
+    m->prog_info.prog_size = prog_size;
+    mem_dirty_range(m, offset, prog_size);
+
+    // An image loaded outside the default map, e.g. an option ROM at C8000,
+    // becomes ROM
+    uint32_t lo = offset & ~((1 << MEM_PAGE_SHIFT) - 1);
+    for (uint32_t a = lo; a < offset + prog_size && a < MEM_SIZE;
+         a += 1 << MEM_PAGE_SHIFT) {
+        if (m->map[a >> MEM_PAGE_SHIFT] == MEM_PAGE_UNMAPPED) {
+            mem_map_set(m, a, 1 << MEM_PAGE_SHIFT, MEM_PAGE_ROM);
+        }
+    }
+}
+
+bool mem_map_rom(vm_mem_t *m, int fd, size_t size, uint32_t offset) {
+    const uint32_t page = 1 << MEM_PAGE_SHIFT;
+    if (sysconf(_SC_PAGESIZE) != page || size == 0 || (size & (page - 1)) ||
+        (offset & (page - 1)) || offset + size > MEM_SIZE) {
+        return false;
+    }
+    for (uint32_t a = offset; a < offset + size; a += page) {
+        uint8_t type = m->map[a >> MEM_PAGE_SHIFT];
+        if (type != MEM_PAGE_ROM && type != MEM_PAGE_UNMAPPED) return false;
+    }
+    // Private, so a direct write such as a snapshot load copies the page
+    // rather than changing the file
+    if (mmap(m->data + offset, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        // The range may be gone; put blank memory back for the copy
+        mmap(m->data + offset, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return false;
+    }
+    mem_map_set(m, offset, size, MEM_PAGE_ROM);
+    m->prog_info.prog_start = offset;
+    m->prog_info.prog_size = size;
+    mem_dirty_range(m, offset, size);
+    return true;
+}
+
+static inline void mem_log_push(vm_mem_t *m, uint32_t addr) {
+    mem_log_t *log = &m->store_log;
+    if (log->len == log->cap) {
+        log->cap = log->cap ? log->cap * 2 : 256;
+        log->entries = realloc(log->entries, log->cap * sizeof(mem_log_entry_t));
+    }
+    log->entries[log->len].addr = addr;
+    log->entries[log->len].old = m->data[addr];
+    log->len++;
+}
+
+int mem_dirty_open(vm_mem_t *m, uint8_t shift) {
+    assert(shift >= MEM_WATCH_SHIFT && shift <= 20);
+    for (int i = 0; i < MEM_DIRTY_VIEWS; i++) {
+        mem_dirty_view_t *v = &m->dirty_views[i];
+        if (!v->open) {
+            v->shift = shift;
+            memset(v->bits, 0xFF, sizeof(v->bits));
+            __atomic_store_n(&v->open, true, __ATOMIC_RELEASE);
+            return i;
+        }
+    }
+    return -1;
+}
+
+void mem_dirty_close(vm_mem_t *m, int view) {
+    // Pages still armed for it take one more hit each that marks nothing
+    __atomic_store_n(&m->dirty_views[view].open, false, __ATOMIC_RELEASE);
+}
+
+// Have the next store to a page of v just taken go through mem_watch_hit()
+static void mem_dirty_arm(vm_mem_t *m, mem_dirty_view_t *v, uint32_t page) {
+    uint32_t lo = (page << v->shift) >> MEM_WATCH_SHIFT;
+    uint32_t hi = ((page + 1) << v->shift) >> MEM_WATCH_SHIFT;
+    for (uint32_t w = lo; w < hi; w++) {
+        mem_watch_set(m, w, MEM_WATCH_DIRTY);
+    }
+}
+
+bool mem_dirty_take(vm_mem_t *m, int view, uint32_t addr) {
+    mem_dirty_view_t *v = &m->dirty_views[view];
+    uint32_t page = (addr & 0xFFFFF) >> v->shift;
+    uint64_t bit = 1ull << (page & 63);
+    if (!(__atomic_fetch_and(&v->bits[page / 64], ~bit, __ATOMIC_RELAXED) &
+          bit)) {
+        // Still armed from the last take
+        return false;
+    }
+    mem_dirty_arm(m, v, page);
+    return true;
+}
+
+bool mem_dirty_peek(vm_mem_t *m, int view, uint32_t addr) {
+    mem_dirty_view_t *v = &m->dirty_views[view];
+    uint32_t page = (addr & 0xFFFFF) >> v->shift;
+    return (__atomic_load_n(&v->bits[page / 64], __ATOMIC_RELAXED) >>
+            (page & 63)) & 1;
+}
+
+uint32_t mem_dirty_take_all(vm_mem_t *m, int view, uint64_t *pages) {
+    mem_dirty_view_t *v = &m->dirty_views[view];
+    uint32_t words = ((MEM_SIZE >> v->shift) + 63) / 64;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < words; i++) {
+        pages[i] = __atomic_exchange_n(&v->bits[i], 0, __ATOMIC_RELAXED);
+        for (uint64_t b = pages[i]; b; b &= b - 1) {
+            mem_dirty_arm(m, v, i * 64 + __builtin_ctzll(b));
+            n++;
+        }
+    }
+    return n;
+}
+
+// A store to a MEM_WATCH_SHIFT page. The flag is cleared before the views
+// are marked, so a take racing with this leaves the page marked or armed.
+static void mem_dirty_mark(vm_mem_t *m, uint32_t page) {
+    mem_watch_clear(m, page, MEM_WATCH_DIRTY);
+    uint32_t addr = page << MEM_WATCH_SHIFT;
+    for (int i = 0; i < MEM_DIRTY_VIEWS; i++) {
+        mem_dirty_view_t *v = &m->dirty_views[i];
+        if (__atomic_load_n(&v->open, __ATOMIC_ACQUIRE)) {
+            uint32_t p = addr >> v->shift;
+            __atomic_fetch_or(&v->bits[p / 64], 1ull << (p & 63),
+                              __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void mem_dirty_range(vm_mem_t *m, uint32_t addr, uint32_t len) {
+    if (len == 0) return;
+    for (uint32_t page = addr >> MEM_WATCH_SHIFT;
+         page <= (addr + len - 1) >> MEM_WATCH_SHIFT; page++) {
+        mem_dirty_mark(m, page);
+    }
+}
+
+bool mem_watch_hit(vm_mem_t *m, uint32_t addr) {
+    uint32_t page = addr >> MEM_WATCH_SHIFT;
+    uint8_t flags = m->watch_pages[page];
+    if (flags & MEM_WATCH_RO) {
+        return false;
+    }
+    if (flags & MEM_WATCH_LOG) {
+        mem_log_push(m, addr);
+    }
+    if (flags & MEM_WATCH_CODE) {
+        bcache_invalidate_page(m->bcache, page);
+    }
+    if (flags & MEM_WATCH_DIRTY) {
+        mem_dirty_mark(m, page);
+    }
+    if ((flags & MEM_WATCH_ADDR) && (int32_t)addr == m->watch_addr) {
+        m->watch_addr_hits++;
+    }
+    return true;
+}
+
+void mem_watch_range(vm_mem_t *m, uint32_t addr, uint32_t len) {
+    uint32_t end = addr + len;
+    m->store_count += len;
+    for (uint32_t page = addr >> MEM_WATCH_SHIFT;
+         page <= (end - 1) >> MEM_WATCH_SHIFT; page++) {
+        uint8_t flags = m->watch_pages[page];
+        if (flags & MEM_WATCH_LOG) {
+            uint32_t lo = page << MEM_WATCH_SHIFT;
+            uint32_t hi = lo + (1 << MEM_WATCH_SHIFT);
+            for (uint32_t a = lo < addr ? addr : lo; a < hi && a < end; a++) {
+                mem_log_push(m, a);
+            }
+        }
+        if (flags & MEM_WATCH_CODE) {
+            bcache_invalidate_page(m->bcache, page);
+        }
+        if (flags & MEM_WATCH_DIRTY) {
+            mem_dirty_mark(m, page);
+        }
+        if ((flags & MEM_WATCH_ADDR) && (int32_t)addr <= m->watch_addr &&
+            m->watch_addr < (int32_t)end) {
+            m->watch_addr_hits++;
+        }
+    }
+}
+
+void mem_watch_addr_set(vm_mem_t *m, int32_t addr) {
+    if (m->watch_addr >= 0) {
+        mem_watch_clear(m, m->watch_addr >> MEM_WATCH_SHIFT, MEM_WATCH_ADDR);
+    }
+    m->watch_addr = addr;
+    m->watch_addr_hits = 0;
+    if (addr >= 0) {
+        mem_watch_set(m, addr >> MEM_WATCH_SHIFT, MEM_WATCH_ADDR);
+    }
+}
+
+void mem_log_enable(vm_mem_t *m) {
+    for (int i = 0; i < MEM_WATCH_PAGES; i++) {
+        mem_watch_set(m, i, MEM_WATCH_LOG);
+    }
+    m->store_log.len = 0;
+}
+
+void mem_log_undo(vm_mem_t *m) {
+    while (m->store_log.len > 0) {
+        mem_log_entry_t *e = &m->store_log.entries[--m->store_log.len];
+        m->data[e->addr] = e->old;
+    }
+}
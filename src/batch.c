@@ -0,0 +1,464 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "vm.h"
+#include "vm_io.h"
+#include "vm_mem.h"
+
+// 86em-batch: run a list of guest jobs headless on a pool of worker
+// threads, each job on a machine of its own, and write one JSON line of
+// results per job.
+//
+// A job is a line of the job list: image files each followed by its load
+// address as seg:ofs, then options as key=value:
+//   name=<label>     for the results; the line number by default
+//   cycles=<n>       CPU clock budget; -c by default
+//   expect=<n>       exit code the guest should write to port 0xFF; 0 by
+//                    default, or none for a job that should use up its budget
+//   engine=<engine>  interp, bcache or jit; -e by default
+//   keys=<file>      text to type in on the keyboard
+//   overrun=<n>      clocks a run may end past its budget; a job past it
+//                    reports overrun. Unchecked by default
+// Blank lines and anything after a # are skipped.
+
+#define BATCH_IMAGES_MAX 8
+#define BATCH_NAME_MAX   64
+// Instructions per vm_run between checks of the budget
+#define BATCH_CHUNK      10000
+#define BATCH_CYCLES     100000000ull
+#define BATCH_EXPECT_NONE -1
+
+// An image file, opened once and mapped by every job that loads it
+typedef struct {
+    char *path;
+    int fd;
+    size_t size;
+} batch_image_t;
+
+typedef struct {
+    char name[BATCH_NAME_MAX];
+    int n_images;
+    int images[BATCH_IMAGES_MAX];
+    uint32_t offsets[BATCH_IMAGES_MAX];
+    uint64_t cycles;
+    int expect;
+    vm_engine_t engine;
+    // Text to type in, or NULL
+    char *keys;
+    size_t keys_len;
+    uint64_t overrun;
+} batch_job_t;
+
+// Jobs left to one worker. The owner takes from the back, thieves from the
+// front, so that they only meet over its last job.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head;
+    size_t tail;
+} batch_queue_t;
+
+typedef struct {
+    batch_image_t *images;
+    int n_images;
+    batch_job_t *jobs;
+    size_t n_jobs;
+    batch_queue_t *queues;
+    int n_workers;
+    FILE *results;
+    pthread_mutex_t results_lock;
+    size_t failed;
+} batch_t;
+
+typedef struct {
+    batch_t *b;
+    int self;
+} batch_worker_t;
+
+static volatile sig_atomic_t batch_stop;
+// The machine each worker is running, NULL between jobs, for a SIGINT to
+// stop. SIGINT is blocked on the workers, so the handler runs on the main
+// thread; a worker waits out a handler in progress before freeing its
+// machine.
+static vm_t **batch_vms;
+static int batch_n_vms;
+static int batch_in_signal;
+
+static void batch_signal(int signal) {
+    if (signal != SIGINT) return;
+    batch_stop = 1;
+    __atomic_store_n(&batch_in_signal, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < batch_n_vms; i++) {
+        vm_t *vm = __atomic_load_n(&batch_vms[i], __ATOMIC_SEQ_CST);
+        if (vm != NULL) vm->stop = -1;
+    }
+    __atomic_store_n(&batch_in_signal, 0, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t batch_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool batch_parse_engine(const char *s, vm_engine_t *engine) {
+    if (strcmp(s, "interp") == 0) {
+        *engine = VM_ENGINE_INTERP;
+    } else if (strcmp(s, "bcache") == 0) {
+        *engine = VM_ENGINE_BCACHE;
+    } else if (strcmp(s, "jit") == 0) {
+        *engine = VM_ENGINE_JIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static int batch_image(batch_t *b, const char *path) {
+    for (int i = 0; i < b->n_images; i++) {
+        if (strcmp(b->images[i].path, path) == 0) return i;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Can't open file: %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    b->images = realloc(b->images, (b->n_images + 1) * sizeof(batch_image_t));
+    b->images[b->n_images] = (batch_image_t){strdup(path), fd, st.st_size};
+    return b->n_images++;
+}
+
+// Parse one line of the job list into job; false if it is malformed
+static bool batch_parse_job(batch_t *b, char *line, int line_no,
+                            const batch_job_t *dflt, batch_job_t *job) {
+    *job = *dflt;
+    snprintf(job->name, sizeof(job->name), "%d", line_no);
+    arg_split_t it = {line, false, .sep_match = sep_whitespace};
+    char *tok;
+    while ((tok = arg_next(&it)) != NULL) {
+        char *val = strchr(tok, '=');
+        if (val == NULL) {
+            char *ofs = arg_next(&it);
+            int addr = ofs != NULL ? parse_offset_segment(ofs) : -1;
+            if (addr < 0 || job->n_images == BATCH_IMAGES_MAX) {
+                fprintf(stderr, "Line %d: expected image and seg:ofs\n",
+                        line_no);
+                return false;
+            }
+            int img = batch_image(b, tok);
+            if (img < 0) return false;
+            job->images[job->n_images] = img;
+            job->offsets[job->n_images++] = addr;
+            continue;
+        }
+        *val++ = '\0';
+        if (strcmp(tok, "name") == 0) {
+            snprintf(job->name, sizeof(job->name), "%s", val);
+        } else if (strcmp(tok, "cycles") == 0) {
+            job->cycles = strtoull(val, NULL, 0);
+        } else if (strcmp(tok, "expect") == 0) {
+            job->expect = strcmp(val, "none") == 0 ? BATCH_EXPECT_NONE
+                                                   : atoi(val) & 0xFF;
+        } else if (strcmp(tok, "engine") == 0) {
+            if (!batch_parse_engine(val, &job->engine)) {
+                fprintf(stderr, "Line %d: unknown engine %s\n", line_no,
+                        val);
+                return false;
+            }
+        } else if (strcmp(tok, "overrun") == 0) {
+            job->overrun = strtoull(val, NULL, 0);
+        } else if (strcmp(tok, "keys") == 0) {
+            free(job->keys);
+            job->keys = read_file(val, &job->keys_len);
+            if (job->keys == NULL) return false;
+        } else {
+            fprintf(stderr, "Line %d: unknown option %s\n", line_no, tok);
+            return false;
+        }
+    }
+    if (job->n_images == 0) {
+        fprintf(stderr, "Line %d: no images\n", line_no);
+        return false;
+    }
+    return true;
+}
+
+static bool batch_read_jobs(batch_t *b, const char *path,
+                            const batch_job_t *dflt) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Can't open file: %s\n", path);
+        return false;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    bool ok = true;
+    for (int line_no = 1; ok && getline(&line, &cap, f) >= 0; line_no++) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *p = line;
+        while (sep_whitespace(*p)) p++;
+        if (*p == '\0') continue;
+        b->jobs = realloc(b->jobs, (b->n_jobs + 1) * sizeof(batch_job_t));
+        ok = batch_parse_job(b, p, line_no, dflt, &b->jobs[b->n_jobs]);
+        b->n_jobs += ok;
+    }
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+// Shared ROM images are mapped, anything else is copied in
+static bool batch_load(batch_t *b, vm_t *vm, const batch_job_t *job) {
+    for (int i = 0; i < job->n_images; i++) {
+        const batch_image_t *img = &b->images[job->images[i]];
+        if (mem_map_rom(&vm->mem, img->fd, img->size, job->offsets[i])) {
+            continue;
+        }
+        FILE *f = fopen(img->path, "r");
+        if (f == NULL) return false;
+        load_mem(&vm->mem, f, job->offsets[i]);
+        fclose(f);
+    }
+    return true;
+}
+
+static void batch_json_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void batch_report(batch_t *b, size_t idx, vm_t *vm, const char *status,
+                         uint64_t wall_ns) {
+    const batch_job_t *job = &b->jobs[idx];
+    x86_cpu_t *cpu = &vm->cpu;
+    pthread_mutex_lock(&b->results_lock);
+    FILE *f = b->results;
+    fprintf(f, "{\"job\":%zu,\"name\":", idx);
+    batch_json_str(f, job->name);
+    fprintf(f, ",\"status\":\"%s\",\"exit\":%d,\"expect\":", status,
+            vm->exit_code);
+    if (job->expect == BATCH_EXPECT_NONE) {
+        fprintf(f, "null");
+    } else {
+        fprintf(f, "%d", job->expect);
+    }
+    fprintf(f, ",\"cycles\":%lu,\"insns\":%lu,\"wall_ms\":%.3f", vm->cycles,
+            vm->insns, wall_ns / 1e6);
+    fprintf(f, ",\"regs\":{\"ax\":%u,\"bx\":%u,\"cx\":%u,\"dx\":%u,"
+               "\"sp\":%u,\"bp\":%u,\"si\":%u,\"di\":%u,"
+               "\"cs\":%u,\"ds\":%u,\"es\":%u,\"ss\":%u,"
+               "\"ip\":%u,\"flags\":%u}}\n",
+            cpu->a.x, cpu->b.x, cpu->c.x, cpu->d.x, cpu->sp, cpu->bp, cpu->si,
+            cpu->di, cpu->cs, cpu->ds, cpu->es, cpu->ss, cpu->ip,
+            cpu->flags.num);
+    fflush(f);
+    b->failed += strcmp(status, "pass") != 0;
+    pthread_mutex_unlock(&b->results_lock);
+}
+
+static void batch_run_job(batch_t *b, int self, size_t idx) {
+    const batch_job_t *job = &b->jobs[idx];
+    uint64_t start = batch_ns();
+    vm_t *vm = vm_init();
+    vm->opts.headless = true;
+    vm->opts.engine = job->engine;
+    __atomic_store_n(&batch_vms[self], vm, __ATOMIC_SEQ_CST);
+    // A SIGINT that came before the store
+    if (batch_stop) vm->stop = -1;
+
+    const char *status;
+    if (!batch_load(b, vm, job)) {
+        status = "error";
+    } else {
+        if (job->keys) io_type(vm, job->keys, job->keys_len);
+        bool halted = false;
+        while (vm->exit_code < 0 && vm->cycles < job->cycles && !vm->stop) {
+            uint64_t before = vm->insns;
+            vm_run_until(vm, BATCH_CHUNK, job->cycles);
+            // Short of the chunk and the budget without an exit or a stop:
+            // halted for good, or faulted
+            if (vm->exit_code < 0 && vm->insns - before < BATCH_CHUNK &&
+                vm->cycles < job->cycles && !vm->stop) {
+                halted = true;
+                break;
+            }
+        }
+        if (vm->exit_code >= 0) {
+            status = vm->exit_code == job->expect ? "pass" : "fail";
+        } else if (vm->fault != VM_FAULT_NONE) {
+            status = "crash";
+        } else if (halted) {
+            status = "halt";
+        } else if (vm->cycles < job->cycles) {
+            status = "stopped";
+        } else if (vm->cycles - job->cycles > job->overrun) {
+            status = "overrun";
+        } else {
+            status = job->expect == BATCH_EXPECT_NONE ? "pass" : "timeout";
+        }
+    }
+    batch_report(b, idx, vm, status, batch_ns() - start);
+    __atomic_store_n(&batch_vms[self], NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&batch_in_signal, __ATOMIC_SEQ_CST)) {
+    }
+    vm_free(vm);
+}
+
+static bool batch_take(batch_queue_t *q, bool steal, size_t *job) {
+    pthread_mutex_lock(&q->lock);
+    bool ok = q->head < q->tail;
+    if (ok) *job = steal ? q->jobs[q->head++] : q->jobs[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static void *batch_worker(void *arg) {
+    batch_worker_t *w = arg;
+    batch_t *b = w->b;
+    size_t job;
+    while (!batch_stop) {
+        bool found = batch_take(&b->queues[w->self], false, &job);
+        // Nothing left of its own: steal from the others in turn. Jobs are
+        // never added, so once every queue is empty the worker is done.
+        for (int i = 1; !found && i < b->n_workers; i++) {
+            found = batch_take(&b->queues[(w->self + i) % b->n_workers], true,
+                               &job);
+        }
+        if (!found) break;
+        batch_run_job(b, w->self, job);
+    }
+    return NULL;
+}
+
+static void batch_usage() {
+    fprintf(stderr,
+            "Usage: 86em-batch [-j workers] [-c cycles] [-e engine] "
+            "[-o results] [-v] joblist\n");
+}
+
+int main(int argc, char **argv) {
+    batch_t b = {0};
+    batch_job_t dflt = {.cycles = BATCH_CYCLES, .engine = VM_ENGINE_BCACHE,
+                        .overrun = UINT64_MAX};
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_workers = n_cpus > 0 ? n_cpus : 1;
+    const char *results_path = NULL;
+    bool verbose = false;
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "j:c:e:o:v")) != -1) {
+        switch (c) {
+            case 'j': n_workers = atoi(optarg); break;
+            case 'c': dflt.cycles = strtoull(optarg, NULL, 0); break;
+            case 'e': {
+                if (!batch_parse_engine(optarg, &dflt.engine)) {
+                    fprintf(stderr, "Unknown engine %s (expected interp, "
+                                    "bcache or jit)\n", optarg);
+                    return 2;
+                }
+                break;
+            }
+            case 'o': results_path = optarg; break;
+            case 'v': verbose = true; break;
+            default: batch_usage(); return 2;
+        }
+    }
+    if (optind != argc - 1 || n_workers < 1) {
+        batch_usage();
+        return 2;
+    }
+
+    // Results get stdout to themselves; what the machines print goes to
+    // stderr with -v, or nowhere
+    fflush(stdout);
+    b.results = results_path ? fopen(results_path, "w")
+                             : fdopen(dup(STDOUT_FILENO), "w");
+    if (b.results == NULL) {
+        fprintf(stderr, "Can't open file: %s\n", results_path);
+        return 2;
+    }
+    int quiet = verbose ? dup(STDERR_FILENO) : open("/dev/null", O_WRONLY);
+    dup2(quiet, STDOUT_FILENO);
+    close(quiet);
+
+    if (!batch_read_jobs(&b, argv[optind], &dflt)) {
+        fprintf(stderr, "Bad job list %s\n", argv[optind]);
+        return 2;
+    }
+
+    if ((size_t)n_workers > b.n_jobs) n_workers = b.n_jobs ? b.n_jobs : 1;
+    b.n_workers = n_workers;
+    b.queues = calloc(n_workers, sizeof(batch_queue_t));
+    pthread_mutex_init(&b.results_lock, NULL);
+    for (int w = 0; w < n_workers; w++) {
+        // An even share each to start with, in job list order
+        batch_queue_t *q = &b.queues[w];
+        size_t lo = b.n_jobs * w / n_workers;
+        size_t hi = b.n_jobs * (w + 1) / n_workers;
+        pthread_mutex_init(&q->lock, NULL);
+        q->jobs = malloc((hi - lo + 1) * sizeof(size_t));
+        // Taken from the back, so stored backwards
+        for (size_t i = lo; i < hi; i++) q->jobs[q->tail++] = hi - 1 - (i - lo);
+    }
+
+    batch_vms = calloc(n_workers, sizeof(vm_t *));
+    batch_n_vms = n_workers;
+    signal(SIGINT, batch_signal);
+    pthread_t *threads = calloc(n_workers, sizeof(pthread_t));
+    batch_worker_t *workers = calloc(n_workers, sizeof(batch_worker_t));
+    // The workers start with SIGINT blocked, leaving it to the main thread
+    sigset_t sigint, old;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, &old);
+    for (int w = 0; w < n_workers; w++) {
+        workers[w] = (batch_worker_t){&b, w};
+        pthread_create(&threads[w], NULL, batch_worker, &workers[w]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (int w = 0; w < n_workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    fclose(b.results);
+    for (int w = 0; w < n_workers; w++) {
+        pthread_mutex_destroy(&b.queues[w].lock);
+        free(b.queues[w].jobs);
+    }
+    for (int i = 0; i < b.n_images; i++) {
+        close(b.images[i].fd);
+        free(b.images[i].path);
+    }
+    for (size_t i = 0; i < b.n_jobs; i++) {
+        free(b.jobs[i].keys);
+    }
+    pthread_mutex_destroy(&b.results_lock);
+    free(threads);
+    free(workers);
+    free(batch_vms);
+    free(b.queues);
+    free(b.images);
+    free(b.jobs);
+    // Interrupted batches have jobs with no result
+    return b.failed || batch_stop ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcache.h"
+#include "vm_mem.h"
+
+#define BCACHE_HASH(addr) (((addr) * 2654435761u) >> (32 - BCACHE_BITS))
+#define CODE_PAGE(addr)   (((addr) & 0xFFFFF) >> MEM_WATCH_SHIFT)
+
+bcache_t *bcache_new(vm_mem_t *mem) {
+    bcache_t *bc = calloc(1, sizeof(bcache_t));
+    bc->mem = mem;
+    mem->bcache = bc;
+    return bc;
+}
+
+void bcache_free(bcache_t *bc) {
+    if (bc == NULL) return;
+    bcache_flush(bc);
+    bc->mem->bcache = NULL;
+    free(bc);
+}
+
+void bcache_invalidate_page(bcache_t *bc, uint32_t page) {
+    mem_watch_clear(bc->mem, page, MEM_WATCH_CODE);
+    bc->gens[page]++;
+    bc->epoch++;
+    bc->stats.invalidations++;
+}
+
+static inline bool bcache_valid(bcache_t *bc, bcache_block_t *blk) {
+    return bc->gens[blk->pages[0]] == blk->gens[0] &&
+           bc->gens[blk->pages[1]] == blk->gens[1];
+}
+
+// Whether insn and the Jcc after it can run as one step
+static uint8_t bcache_fuse_kind(const x86_insn_t *insn) {
+    const x86_opc_info_t info = insn->info;
+    switch (info.handler) {
+    case H_ARITH:
+    case H_ALU_ACC:
+        return info.fnc == 7 ? FUSE_CMP_JCC : FUSE_NONE;
+    case H_GRP_IMM:
+        return insn->mod_reg_rm.reg == 7 ? FUSE_CMP_JCC : FUSE_NONE;
+    case H_TEST_RM:
+    case H_TEST_ACC:
+        return FUSE_TEST_JCC;
+    case H_GRP3:
+        return insn->mod_reg_rm.reg < 2 ? FUSE_TEST_JCC : FUSE_NONE;
+    case H_INC_R16:
+    case H_DEC_R16:
+        return FUSE_DEC_JCC;
+    default:
+        return FUSE_NONE;
+    }
+}
+
+static void bcache_decode(bcache_t *bc, bcache_block_t *blk, uint16_t cs,
+                          uint16_t ip, uint32_t addr) {
+    uint16_t page_first = CODE_PAGE(addr);
+    uint16_t page_last = page_first;
+    uint16_t next_ip = ip;
+    uint32_t len = 0;
+    uint8_t n = 0;
+
+    blk->addr = addr;
+    blk->ip = ip;
+    while (n < BCACHE_MAX_INSNS) {
+        x86_insn_t *insn = &blk->insns[n];
+        x86_decode(bc->mem, cs, &next_ip, insn);
+        uint16_t end_page = CODE_PAGE(SEGMENT(cs, next_ip - 1));
+        // Keep the block within two pages and the offsets within a byte
+        if (n > 0 && ((end_page != page_first && end_page != page_first + 1) ||
+                      len + insn->len > 0xFF)) {
+            break;
+        }
+        insn->ofs = len;
+        len += insn->len;
+        page_last = end_page;
+        if (n > 0 && insn->info.handler == H_JCC) {
+            blk->insns[n - 1].fuse = bcache_fuse_kind(&blk->insns[n - 1]);
+        }
+        n++;
+        if (insn->info.br || insn->info.handler == H_ILLEGAL ||
+            next_ip < ip) {
+            break;
+        }
+    }
+    blk->n_insns = n;
+    blk->pages[0] = page_first;
+    blk->pages[1] = page_last;
+    blk->gens[0] = bc->gens[page_first];
+    blk->gens[1] = bc->gens[page_last];
+    mem_watch_set(bc->mem, page_first, MEM_WATCH_CODE);
+    mem_watch_set(bc->mem, page_last, MEM_WATCH_CODE);
+
+    bc->stats.blocks_decoded++;
+    bc->stats.insns_decoded += n;
+}
+
+bcache_block_t *bcache_lookup(bcache_t *bc, x86_cpu_t *cpu, uint32_t addr) {
+    bcache_block_t *blk = &bc->blocks[BCACHE_HASH(addr)];
+    bc->stats.lookups++;
+    if (blk->n_insns && blk->addr == addr && blk->ip == cpu->ip &&
+        bcache_valid(bc, blk)) {
+        bc->stats.hits++;
+        return blk;
+    }
+    bcache_decode(bc, blk, cpu->cs, cpu->ip, addr);
+    return blk;
+}
+
+void bcache_flush(bcache_t *bc) {
+    memset(bc->blocks, 0, sizeof(bc->blocks));
+    for (int i = 0; i < MEM_WATCH_PAGES; i++) {
+        mem_watch_clear(bc->mem, i, MEM_WATCH_CODE);
+    }
+    bc->epoch++;
+}
+
+void bcache_dump_stats(bcache_t *bc) {
+    bcache_stats_t *st = &bc->stats;
+    printf("block lookups:   %lu\n", st->lookups);
+    printf("block hits:      %lu (%.2f%%)\n", st->hits,
+           st->lookups ? 100.0 * st->hits / st->lookups : 0.0);
+    printf("blocks decoded:  %lu (avg %.2f insns)\n", st->blocks_decoded,
+           st->blocks_decoded ? (double)st->insns_decoded / st->blocks_decoded
+                              : 0.0);
+    printf("insns executed:  %lu\n", st->insns_executed);
+    printf("invalidations:   %lu\n", st->invalidations);
+    printf("fused cmp+jcc:   %lu\n", st->fused[FUSE_CMP_JCC]);
+    printf("fused test+jcc:  %lu\n", st->fused[FUSE_TEST_JCC]);
+    printf("fused dec+jcc:   %lu\n", st->fused[FUSE_DEC_JCC]);
+    printf("fusions split:   %lu\n", st->fused_split);
+}
@@ -1,22 +1,25 @@
+#include "vm.h"
+#include "vm_io.h"
 #include "vm_mem.h"
 #include "backend/linux/cga.h"
 #include <unistd.h>
 
 int main() {
-    init_mem_blank();
-    cga_start();
+    vm_t *vm = vm_init();
+    // The display comes up on the first access to a CGA register
+    io_read_u16(vm, CGA_REG_STATUS, 0);
     int c = 0;
     int d = 0;
     while(1) {
         for (int i = 0; i < 25; i++) {
             for (int j = 0; j < 40; j++) {
                 int ind = (40 * i + j) << 1;
-                store_u8_direct(CGA_MEM_ADDR + ind, c);
-                store_u8_direct(CGA_MEM_ADDR + ind+1, c+d);
+                store_u8_direct(&vm->mem, CGA_MEM_ADDR + ind, c);
+                store_u8_direct(&vm->mem, CGA_MEM_ADDR + ind+1, c+d);
             }
         }
         c = c + 1;
         d = d + 1;
         usleep(100000);
     }
-}
\ No newline at end of file
+}
@@ -8,9 +8,13 @@
 #include <readline/history.h>
 #include <readline/readline.h>
 
-#include "main.h"
+#include "bcache.h"
+#include "jit.h"
+#include "rev.h"
+#include "snap.h"
 #include "util.h"
 #include "vm.h"
+#include "vm_io.h"
 #include "vm_mem.h"
 
 /* A static variable for holding the line. */
@@ -36,8 +40,36 @@ char *rl_gets() {
     return (line_read);
 }
 
+static void dbg_report_stop(vm_t *vm) {
+    if (vm_at_bkpt(vm)) {
+        printf("Breakpoint hit at %08x\n", vm->bkpt);
+    }
+    if (vm->fault != VM_FAULT_NONE) {
+        printf("Stopped at %04x:%04x: %s\n", vm->cpu.cs, vm->cpu.ip,
+               vm->fault == VM_FAULT_OPCODE ? "invalid opcode"
+                                            : "read of an unknown port");
+    }
+}
+
+// Where a reverse command left the machine
+static void dbg_report_pos(vm_t *vm) {
+    dbg_report_stop(vm);
+    printf("At %04x:%04x after %lu instructions\n", vm->cpu.cs, vm->cpu.ip,
+           vm->insns);
+}
+
+static bool dbg_has_history(vm_t *vm) {
+    if (!rev_active(vm)) {
+        printf("No history kept; reverse execution needs the interp or "
+               "bcache engine\n");
+    }
+    return rev_active(vm);
+}
+
 void dbg_cmd(vm_t *vm, char *line) {
     arg_split_t it = {line, false, .sep_match = sep_whitespace};
+    // History is kept from the first command on
+    rev_start(vm);
 
     const char *cmd = arg_next(&it);
     // empty command?
@@ -50,9 +82,40 @@ void dbg_cmd(vm_t *vm, char *line) {
         if (cyc != NULL) {
             cyc_d = atoi(cyc);
         }
-        vm_run(vm, cyc_d);
+        rev_run(vm, cyc_d);
+        dbg_report_stop(vm);
     } else if (strcmp(cmd, "step") == 0 || strcmp(cmd, "s") == 0) {
-        vm_run(vm, 1);
+        rev_run(vm, 1);
+        dbg_report_stop(vm);
+    } else if (strcmp(cmd, "reverse-step") == 0 || strcmp(cmd, "rs") == 0) {
+        if (!dbg_has_history(vm)) return;
+        if (!rev_step(vm)) {
+            printf("No more history\n");
+        }
+        dbg_report_pos(vm);
+    } else if (strcmp(cmd, "reverse-continue") == 0 ||
+               strcmp(cmd, "rc") == 0) {
+        if (!dbg_has_history(vm)) return;
+        if (!rev_continue(vm)) {
+            printf("Breakpoint not hit earlier in the history\n");
+            return;
+        }
+        dbg_report_pos(vm);
+    } else if (strcmp(cmd, "reverse-write") == 0 || strcmp(cmd, "rw") == 0) {
+        // Back to just before the last store to a linear address
+        char *addr = arg_next(&it);
+        int32_t addr_d = addr != NULL ? parse_offset_segment(addr) : -1;
+        if (addr_d < 0) {
+            printf("Expected address of the form abcd:1234\n");
+            return;
+        }
+        if (!dbg_has_history(vm)) return;
+        if (!rev_last_write(vm, addr_d)) {
+            printf("No store to %05x earlier in the history\n", addr_d);
+            return;
+        }
+        printf("Next instruction stores to %05x\n", addr_d);
+        dbg_report_pos(vm);
     } else if (strcmp(cmd, "bkpt") == 0 || strcmp(cmd, "b") == 0) {
         char *bkpt = arg_next(&it);
 
@@ -79,17 +142,70 @@ void dbg_cmd(vm_t *vm, char *line) {
                     "hex");
             return;
         }
-        printf("ram[%08x] = %02x\n", addr_d, load_u8((addr_d & 0xF0000) >> 4, addr_d & 0xFFFF));
+        printf("ram[%08x] = %02x\n", addr_d, load_u8(&vm->mem, (addr_d & 0xF0000) >> 4, addr_d & 0xFFFF));
     } else if (strcmp(cmd, "trace") == 0 || strcmp(cmd, "t") == 0) {
         vm->opts.enable_trace = !vm->opts.enable_trace;
         printf("Tracing %s\n", vm->opts.enable_trace ? "on" : "off");
+    } else if (strcmp(cmd, "save") == 0) {
+        // save [-i] <file>, -i for only what changed since the last snapshot
+        char *path = arg_next(&it);
+        bool incremental = path != NULL && strcmp(path, "-i") == 0;
+        if (incremental) {
+            path = arg_next(&it);
+        }
+        if (path == NULL) {
+            printf("Expected snapshot file\n");
+            return;
+        }
+        snap_save(vm, path, incremental);
+    } else if (strcmp(cmd, "load") == 0) {
+        char *path = arg_next(&it);
+        if (path == NULL) {
+            printf("Expected snapshot file\n");
+            return;
+        }
+        if (snap_load(vm, path)) {
+            // The history is of another machine; it starts again from here
+            rev_stop(vm);
+        }
+    } else if (strcmp(cmd, "type") == 0) {
+        // type <text>, the rest of the line with \n, \t and \\ escapes
+        char *text = it.consumed ? "" : it.buf;
+        size_t len = 0;
+        for (char *p = text; *p; p++) {
+            char c = *p;
+            if (c == '\\' && p[1] != 0) {
+                c = *++p;
+                c = c == 'n' ? '\n' : c == 't' ? '\t' : c;
+            }
+            text[len++] = c;
+        }
+        if (!io_type(vm, text, len)) printf("Can't type during a replay\n");
+    } else if (strcmp(cmd, "typefile") == 0) {
+        char *path = arg_next(&it);
+        if (path == NULL) {
+            printf("Expected text file\n");
+            return;
+        }
+        size_t len;
+        char *text = read_file(path, &len);
+        if (text != NULL) {
+            if (!io_type(vm, text, len)) printf("Can't type during a replay\n");
+            free(text);
+        }
+    } else if (strcmp(cmd, "stats") == 0) {
+        vm_dump_stats(vm);
+        io_dump_stats(vm);
+        bcache_dump_stats(vm->bcache);
+        rev_dump_stats(vm);
+        if (vm->opts.engine == VM_ENGINE_JIT) jit_dump_stats(vm);
     } else {
         printf("unknown command: %s\n", cmd);
     }
 }
 
 void dbg_repl(vm_t *vm) {
-    while (!stop_flag) {
+    while (!vm->stop) {
         char *line = rl_gets();
         if (line == NULL) {
             break;
@@ -101,7 +217,7 @@ void dbg_repl(vm_t *vm) {
 void dbg_run_cmds(vm_t *vm, char *arg_command) {
     arg_split_t it = {arg_command, false, sep_semi};
     char *cmd;
-    while ((cmd = arg_next(&it)) != NULL && !stop_flag) {
+    while ((cmd = arg_next(&it)) != NULL && !vm->stop) {
         dbg_cmd(vm, cmd);
     }
 }
\ No newline at end of file
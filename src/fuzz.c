@@ -0,0 +1,416 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "snap.h"
+#include "util.h"
+#include "vm.h"
+#include "vm_io.h"
+#include "vm_mem.h"
+
+// 86em-fuzz: run one guest routine over and over on inputs from a fuzzer.
+//
+// The machine is brought up once, from the images up to a start address
+// (-b) or from a snapshot (-s), and kept as it is then. Every run puts it
+// back: the CPU and devices wholesale, memory only where it was stored to
+// since, MEM_WATCH_SHIFT bytes at a time. The input goes in at -i, its
+// length as a word at -l, and the machine runs until it halts, writes an
+// exit code to port 0xFF, uses up the clock budget or stops at something
+// it can't run, an invalid opcode or unknown port, which is the crash.
+//
+// Under afl-fuzz it is its own fork server, and counts edges into AFL's
+// shared map. A forked child runs inputs in persistent mode, stopping
+// itself after each for the server to wake it for the next, and is replaced
+// after FUZZ_PERSIST_RUNS or when AFL kills it on a hang:
+//   afl-fuzz -i seeds -o out -- 86em-fuzz -b f000:e0a0 -i 0:7000 -f @@ ...
+// On its own it runs the input -r times and prints the last result as a
+// JSON line, and writes the edge map out with -m.
+
+// Instructions per vm_run between checks of the budget
+#define FUZZ_CHUNK       10000
+#define FUZZ_CYCLES      1000000ull
+#define FUZZ_BOOT_CYCLES 1000000000ull
+#define FUZZ_INPUT_MAX   4096
+// AFL's control and status pipes
+#define FUZZ_FORKSRV_FD  198
+// Runs of one forked child before it exits and the next is forked
+#define FUZZ_PERSIST_RUNS 10000
+
+typedef enum {
+    FUZZ_EXIT,
+    FUZZ_HALT,
+    FUZZ_TIMEOUT,
+    FUZZ_CRASH,
+} fuzz_result_t;
+
+static const char *fuzz_result_names[] = {"exit", "halt", "timeout", "crash"};
+
+typedef struct {
+    vm_t *vm;
+    // The machine every run starts from
+    x86_cpu_t cpu;
+    uint64_t cycles;
+    uint64_t insns;
+    uint64_t idle_cycles;
+    uint8_t *io;
+    uint8_t *mem;
+    // Memory stored to since, a MEM_WATCH_SHIFT page at a time
+    int view;
+    uint64_t pages[MEM_WATCH_PAGES / 64];
+    uint32_t input_addr;
+    int32_t len_addr;
+    size_t input_max;
+    uint64_t budget;
+} fuzz_t;
+
+static uint64_t fuzz_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Keep the machine as it is now to start every run from
+static bool fuzz_base(fuzz_t *f) {
+    vm_t *vm = f->vm;
+    f->view = mem_dirty_open(&vm->mem, MEM_WATCH_SHIFT);
+    if (f->view < 0) return false;
+    mem_dirty_take_all(&vm->mem, f->view, f->pages);
+    f->cpu = vm->cpu;
+    f->cycles = vm->cycles;
+    f->insns = vm->insns;
+    f->idle_cycles = vm->idle_cycles;
+    f->io = malloc(io_snap_size());
+    io_save(vm, f->io);
+    f->mem = malloc(MEM_SIZE);
+    memcpy(f->mem, vm->mem.data, MEM_SIZE);
+    return true;
+}
+
+static void fuzz_restore(fuzz_t *f) {
+    vm_t *vm = f->vm;
+    vm_mem_t *m = &vm->mem;
+    const uint32_t size = 1 << MEM_WATCH_SHIFT;
+    if (mem_dirty_take_all(m, f->view, f->pages)) {
+        for (uint32_t i = 0; i < MEM_WATCH_PAGES / 64; i++) {
+            for (uint64_t b = f->pages[i]; b; b &= b - 1) {
+                uint32_t addr = (i * 64 + __builtin_ctzll(b))
+                                << MEM_WATCH_SHIFT;
+                memcpy(m->data + addr, f->mem + addr, size);
+                // Drops decoded code and tells the other views
+                mem_watch_range(m, addr, size);
+            }
+        }
+        // Which marked them stored to again
+        mem_dirty_take_all(m, f->view, f->pages);
+    }
+    vm->cpu = f->cpu;
+    vm->cycles = f->cycles;
+    vm->insns = f->insns;
+    vm->idle_cycles = f->idle_cycles;
+    io_restore(vm, f->io);
+    vm->exit_code = -1;
+    vm->stop = 0;
+    vm->cov_prev = 0;
+}
+
+static void fuzz_inject(fuzz_t *f, const uint8_t *input, size_t len) {
+    vm_mem_t *m = &f->vm->mem;
+    if (len) {
+        memcpy(m->data + f->input_addr, input, len);
+        mem_watch_range(m, f->input_addr, len);
+    }
+    if (f->len_addr >= 0) store_u16_base(m, f->len_addr, 0, len);
+}
+
+static fuzz_result_t fuzz_run(fuzz_t *f) {
+    vm_t *vm = f->vm;
+    uint64_t end = f->cycles + f->budget;
+    while (vm->cycles < end) {
+        uint64_t before = vm->insns;
+        vm_run_until(vm, FUZZ_CHUNK, end);
+        if (vm->exit_code >= 0) return FUZZ_EXIT;
+        if (vm->fault != VM_FAULT_NONE) return FUZZ_CRASH;
+        // Short of the chunk and the budget otherwise: halted
+        if (vm->insns - before < FUZZ_CHUNK && vm->cycles < end) {
+            return FUZZ_HALT;
+        }
+    }
+    return FUZZ_TIMEOUT;
+}
+
+// As waitpid() would have it from a process run on the input: the exit
+// code, or the signal a native program dies of for the same fault
+static int fuzz_wait_status(fuzz_t *f, fuzz_result_t res) {
+    if (res == FUZZ_CRASH) {
+        return f->vm->fault == VM_FAULT_OPCODE ? SIGILL : SIGBUS;
+    }
+    return res == FUZZ_EXIT ? (f->vm->exit_code & 0xFF) << 8 : 0;
+}
+
+// Read the input afresh: afl-fuzz rewrites the file, or the one standing
+// in for stdin, between runs
+static ssize_t fuzz_read(const char *path, uint8_t *buf, size_t max) {
+    if (path == NULL) return pread(STDIN_FILENO, buf, max, 0);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, max);
+    close(fd);
+    return n;
+}
+
+// A forked child's runs. Each but the first waits stopped for the server
+// to wake it, which tells the server the one before is done; a crash dies
+// of its signal, and the last run exits with its status.
+static void fuzz_afl_child(fuzz_t *f, const char *path, uint8_t *buf) {
+    close(FUZZ_FORKSRV_FD);
+    close(FUZZ_FORKSRV_FD + 1);
+    int status = 0;
+    for (int i = 0; i < FUZZ_PERSIST_RUNS; i++) {
+        if (i > 0) raise(SIGSTOP);
+        ssize_t n = fuzz_read(path, buf, f->input_max);
+        fuzz_restore(f);
+        fuzz_inject(f, buf, n > 0 ? n : 0);
+        fuzz_result_t res = fuzz_run(f);
+        status = fuzz_wait_status(f, res);
+        if (res == FUZZ_CRASH) {
+            signal(status, SIG_DFL);
+            raise(status);
+        }
+    }
+    _exit(status >> 8);
+}
+
+// Serve afl-fuzz until it goes away
+static void fuzz_afl_loop(fuzz_t *f, const char *path, uint8_t *buf) {
+    uint32_t was_killed;
+    pid_t child = -1;
+    bool stopped = false;
+    while (read(FUZZ_FORKSRV_FD, &was_killed, 4) == 4) {
+        // AFL killed the stopped child on a hang: reap it
+        if (stopped && was_killed) {
+            stopped = false;
+            if (waitpid(child, NULL, 0) < 0) break;
+        }
+        if (stopped) {
+            kill(child, SIGCONT);
+        } else {
+            child = fork();
+            if (child < 0) break;
+            if (child == 0) fuzz_afl_child(f, path, buf);
+        }
+        int32_t pid = child;
+        int status;
+        if (write(FUZZ_FORKSRV_FD + 1, &pid, 4) != 4 ||
+            waitpid(child, &status, WUNTRACED) < 0) {
+            break;
+        }
+        stopped = WIFSTOPPED(status);
+        if (write(FUZZ_FORKSRV_FD + 1, &status, 4) != 4) break;
+    }
+    if (stopped) {
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+    }
+}
+
+static bool fuzz_parse_engine(const char *s, vm_engine_t *engine) {
+    if (strcmp(s, "interp") == 0) {
+        *engine = VM_ENGINE_INTERP;
+    } else if (strcmp(s, "bcache") == 0) {
+        *engine = VM_ENGINE_BCACHE;
+    } else if (strcmp(s, "jit") == 0) {
+        *engine = VM_ENGINE_JIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Run from reset up to the start address
+static bool fuzz_boot(vm_t *vm, int start) {
+    vm->bkpt = start;
+    while (!vm_at_bkpt(vm) && vm->cycles < FUZZ_BOOT_CYCLES &&
+           vm->exit_code < 0) {
+        uint64_t before = vm->insns;
+        vm_run(vm, FUZZ_CHUNK);
+        if (vm->insns - before < FUZZ_CHUNK && !vm_at_bkpt(vm)) break;
+    }
+    bool ok = vm_at_bkpt(vm);
+    vm->bkpt = -1;
+    return ok;
+}
+
+static void fuzz_usage() {
+    fprintf(stderr,
+            "Usage: 86em-fuzz -i seg:ofs [-l seg:ofs] [-n max] [-b seg:ofs] "
+            "[-s snapshot] [-c cycles] [-e engine] [-f input] [-r runs] "
+            "[-m map] [-v] [bin file and offset]...\n");
+}
+
+int main(int argc, char **argv) {
+    fuzz_t f = {.len_addr = -1, .input_max = FUZZ_INPUT_MAX,
+                .budget = FUZZ_CYCLES};
+    int input_addr = -1, start = -1;
+    const char *snap_path = NULL, *input_path = NULL, *map_path = NULL;
+    vm_engine_t engine = VM_ENGINE_BCACHE;
+    long runs = 1;
+    bool verbose = false;
+    // Results get stdout to themselves; what the machine prints, and
+    // parse_offset_segment() with it, goes to stderr with -v, or nowhere
+    fflush(stdout);
+    FILE *results = fdopen(dup(STDOUT_FILENO), "w");
+    int quiet = open("/dev/null", O_WRONLY);
+    dup2(quiet, STDOUT_FILENO);
+    close(quiet);
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "i:l:n:b:s:c:e:f:r:m:v")) != -1) {
+        switch (c) {
+            // Where the input goes, and its length as a word
+            case 'i': input_addr = parse_offset_segment(optarg); break;
+            case 'l': f.len_addr = parse_offset_segment(optarg); break;
+            case 'n': f.input_max = strtoul(optarg, NULL, 0); break;
+            // Where runs start from: an address booted up to, a snapshot
+            case 'b': start = parse_offset_segment(optarg); break;
+            case 's': snap_path = optarg; break;
+            case 'c': f.budget = strtoull(optarg, NULL, 0); break;
+            case 'e': {
+                if (!fuzz_parse_engine(optarg, &engine)) {
+                    fprintf(stderr, "Unknown engine %s (expected interp, "
+                                    "bcache or jit)\n", optarg);
+                    return 2;
+                }
+                break;
+            }
+            case 'f': input_path = optarg; break;
+            case 'r': runs = atol(optarg); break;
+            case 'm': map_path = optarg; break;
+            case 'v': verbose = true; break;
+            default: fuzz_usage(); return 2;
+        }
+    }
+    int remain_args = argc - optind;
+    if (input_addr < 0 || remain_args % 2 || runs < 1 ||
+        (remain_args == 0 && snap_path == NULL)) {
+        fuzz_usage();
+        return 2;
+    }
+
+    if (verbose) dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    vm_t *vm = vm_init();
+    f.vm = vm;
+    vm->opts.headless = true;
+    vm->opts.engine = engine;
+    for (int i = optind; i < argc; i += 2) {
+        int offset = parse_offset_segment(argv[i + 1]);
+        FILE *prog = fopen(argv[i], "r");
+        if (prog == NULL || offset < 0) {
+            fprintf(stderr, "Can't load %s at %s\n", argv[i], argv[i + 1]);
+            return 2;
+        }
+        load_mem(&vm->mem, prog, offset);
+        fclose(prog);
+    }
+    if (snap_path != NULL && !snap_load(vm, snap_path)) {
+        fprintf(stderr, "Can't load snapshot %s\n", snap_path);
+        return 2;
+    }
+    if (start >= 0 && !fuzz_boot(vm, start)) {
+        fprintf(stderr, "Never got to %05x\n", start);
+        return 2;
+    }
+    vm->opts.halt_stop = true;
+
+    f.input_addr = input_addr;
+    if (f.input_addr + f.input_max > MEM_SIZE ||
+        !mem_range_writable(&vm->mem, f.input_addr, f.input_max) ||
+        (f.len_addr >= 0 && !mem_range_writable(&vm->mem, f.len_addr, 2))) {
+        fprintf(stderr, "Input doesn't fit in RAM at %05x\n", f.input_addr);
+        return 2;
+    }
+    if (!fuzz_base(&f)) {
+        fprintf(stderr, "No dirty view left to restore from\n");
+        return 2;
+    }
+
+    const char *shm_id = getenv("__AFL_SHM_ID");
+    if (shm_id != NULL) {
+        vm->cov_map = shmat(atoi(shm_id), NULL, 0);
+        if (vm->cov_map == (void *)-1) {
+            fprintf(stderr, "Can't attach AFL's map %s\n", shm_id);
+            return 2;
+        }
+    } else {
+        vm->cov_map = calloc(1, VM_COV_MAP_SIZE);
+    }
+
+    uint8_t *buf = malloc(f.input_max);
+    uint32_t hello = 0;
+    if (shm_id != NULL && write(FUZZ_FORKSRV_FD + 1, &hello, 4) == 4) {
+        fuzz_afl_loop(&f, input_path, buf);
+        return 0;
+    }
+
+    // Standalone, or run once by afl-showmap and the like: a pipe can only
+    // be read the once
+    ssize_t n = fuzz_read(input_path, buf, f.input_max);
+    if (n < 0 && input_path == NULL && errno == ESPIPE) {
+        n = 0;
+        ssize_t got;
+        while ((size_t)n < f.input_max &&
+               (got = read(STDIN_FILENO, buf + n, f.input_max - n)) > 0) {
+            n += got;
+        }
+    }
+    if (n < 0) {
+        fprintf(stderr, "Can't read input %s\n",
+                input_path ? input_path : "from stdin");
+        return 2;
+    }
+    fuzz_result_t res = FUZZ_EXIT;
+    uint64_t t = fuzz_ns();
+    for (long i = 0; i < runs; i++) {
+        fuzz_restore(&f);
+        fuzz_inject(&f, buf, n);
+        res = fuzz_run(&f);
+    }
+    t = fuzz_ns() - t;
+    int status = fuzz_wait_status(&f, res);
+    if (shm_id != NULL) {
+        fclose(results);
+        if (res == FUZZ_CRASH) {
+            signal(status, SIG_DFL);
+            raise(status);
+        }
+        return status >> 8;
+    }
+
+    uint32_t edges = 0;
+    for (uint32_t i = 0; i < VM_COV_MAP_SIZE; i++) edges += !!vm->cov_map[i];
+    static const char *fault_names[] = {"null", "\"opcode\"", "\"port\""};
+    fprintf(results, "{\"status\":\"%s\",\"exit\":%d,\"fault\":%s,"
+                     "\"cycles\":%lu,\"insns\":%lu,\"cs\":%u,\"ip\":%u,"
+                     "\"edges\":%u,\"runs\":%ld,\"execs_per_s\":%.0f}\n",
+            fuzz_result_names[res], vm->exit_code, fault_names[vm->fault],
+            vm->cycles - f.cycles, vm->insns - f.insns, vm->cpu.cs,
+            vm->cpu.ip, edges, runs, runs / (t / 1e9));
+    fclose(results);
+    if (map_path != NULL) {
+        FILE *map = fopen(map_path, "wb");
+        if (map == NULL ||
+            fwrite(vm->cov_map, VM_COV_MAP_SIZE, 1, map) != 1) {
+            fprintf(stderr, "Can't write map %s\n", map_path);
+            return 2;
+        }
+        fclose(map);
+    }
+    return res == FUZZ_CRASH ? 1 : 0;
+}
@@ -0,0 +1,695 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "jit.h"
+#include "bcache.h"
+#include "timing.h"
+#include "vm_mem.h"
+
+#ifdef CFG_JIT
+
+#include <sys/mman.h>
+
+// Guest blocks come from the block cache and are turned into x86-64 code.
+// Guest state stays in x86_cpu_t, addressed through rbx; the run context is
+// in r12. Register-only ALU ops, moves and branches are emitted as host
+// instructions (EFLAGS has the same layout as the 8086 flags, so results are
+// picked up with pushfq), everything else calls x86_exec for the one
+// instruction. Static exits are patched to jump straight to the next block.
+// Clocks of native instructions are added to vm->cycles before each helper
+// call and exit, x86_exec counts its own.
+
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_BITS      12
+#define JIT_SIZE      (1 << JIT_BITS)
+// Instructions run before returning to vm_run; bounds interrupt latency
+#define JIT_BUDGET    256
+// Upper bound on the code and data emitted for one block
+#define JIT_BLOCK_MAX 4096
+
+#define JIT_HASH(addr) (((addr) * 2654435761u) >> (32 - JIT_BITS))
+
+typedef struct {
+    x86_cpu_t *cpu;
+    vm_t *vm;
+    // Instructions left; a block that does not fit returns to vm_run
+    int32_t budget;
+    // Clock of the next device event; no block runs past it
+    uint64_t deadline;
+} jit_ctx_t;
+
+typedef struct {
+    uint32_t addr;
+    uint16_t ip;
+    bool used;
+    uint8_t n_insns;
+    // NULL if the first instruction can not be translated
+    uint8_t *entry;
+} jit_block_t;
+
+typedef uint8_t *(*jit_enter_fn)(jit_ctx_t *ctx, uint8_t *code);
+
+// The translations of one machine, each in a code buffer of its own
+struct jit {
+    jit_stats_t stats;
+    jit_block_t blocks[JIT_SIZE];
+    uint8_t *code;
+    uint8_t *code_start;
+    uint8_t *ptr;
+    uint8_t *epilogue;
+    jit_enter_fn enter;
+    bool unavailable;
+    // Block cache epoch the translations are from
+    uint64_t epoch;
+    // Bumped by every flush, patch sites from before it are gone
+    uint32_t generation;
+};
+
+#define CPU_OFS(field) ((uint8_t)offsetof(x86_cpu_t, field))
+#define CTX_BUDGET     ((uint8_t)offsetof(jit_ctx_t, budget))
+#define CTX_DEADLINE   ((uint8_t)offsetof(jit_ctx_t, deadline))
+#define OFS_FLAGS      CPU_OFS(flags)
+#define OFS_IP         CPU_OFS(ip)
+// rbx is also the vm_t
+#define VM_CYCLES      ((uint32_t)offsetof(vm_t, cycles))
+_Static_assert(offsetof(vm_t, cpu) == 0, "cpu must start vm_t");
+
+// Register numbers as in the ModR/M byte
+#define REG16_OFS(r) ((uint8_t)(offsetof(x86_cpu_t, regs) + 2 * (r)))
+#define REG8_OFS(r)  ((uint8_t)(offsetof(x86_cpu_t, regs8) + REG8_IDX(r)))
+#define REG_OFS(s, r) ((s) ? REG16_OFS(r) : REG8_OFS(r))
+
+// Flags written by each kind of operation
+#define FL_ARITH  0x8D5
+#define FL_INCDEC 0x8D4
+// Logic ops clear O, A and C
+#define FL_LOGIC  0x0C4
+
+#define FL_C 0x001
+#define FL_Z 0x040
+#define FL_I 0x200
+#define FL_D 0x400
+
+static inline void e8(jit_t *j, uint8_t b) { *j->ptr++ = b; }
+
+static inline void e16(jit_t *j, uint16_t v) {
+    memcpy(j->ptr, &v, 2);
+    j->ptr += 2;
+}
+
+static inline void e32(jit_t *j, uint32_t v) {
+    memcpy(j->ptr, &v, 4);
+    j->ptr += 4;
+}
+
+static inline void e64(jit_t *j, uint64_t v) {
+    memcpy(j->ptr, &v, 8);
+    j->ptr += 8;
+}
+
+static inline void patch_rel32(uint8_t *site, uint8_t *target) {
+    int32_t rel = target - (site + 4);
+    memcpy(site, &rel, 4);
+}
+
+// ModR/M for [rbx + ofs]
+static inline void e_cpu(jit_t *j, uint8_t reg, uint8_t ofs) {
+    e8(j, 0x43 | (reg << 3));
+    e8(j, ofs);
+}
+
+// Forward jcc rel32 (0x80 | cc) or jmp rel32 (0xE9), returns the patch site
+static uint8_t *e_jump(jit_t *j, uint8_t opc) {
+    if (opc == 0xE9) {
+        e8(j, 0xE9);
+    } else {
+        e8(j, 0x0F);
+        e8(j, opc);
+    }
+    uint8_t *site = j->ptr;
+    e32(j, 0);
+    return site;
+}
+
+// add qword [rbx+cycles], clk; clobbers the host flags
+static void e_add_cycles(jit_t *j, uint32_t clk) {
+    if (clk == 0) return;
+    e8(j, 0x48); e8(j, 0x81); e8(j, 0x83); e32(j, VM_CYCLES); e32(j, clk);
+}
+
+static void e_jmp_epilogue(jit_t *j) {
+    e8(j, 0xE9);
+    e32(j, j->epilogue - (j->ptr + 4));
+}
+
+// Hand unexecuted instructions back to the budget and return to vm_run
+static void e_exit_dynamic(jit_t *j, uint32_t unexecuted) {
+    if (unexecuted) {
+        e8(j, 0x41); e8(j, 0x81); e8(j, 0x44); e8(j, 0x24); e8(j, CTX_BUDGET); // add [r12+b], imm32
+        e32(j, unexecuted);
+    }
+    e8(j, 0x31); e8(j, 0xC0);                                   // xor eax, eax
+    e_jmp_epilogue(j);
+}
+
+// Leave for a known IP. The jmp falls through to the return until
+// jit_run links it to the translated successor.
+static void e_exit_static(jit_t *j, uint16_t ip) {
+    e8(j, 0x66); e8(j, 0xC7); e_cpu(j, 0, OFS_IP); e16(j, ip);  // mov [ip], imm16
+    uint8_t *site = e_jump(j, 0xE9);
+    e8(j, 0x48); e8(j, 0xB8); e64(j, (uint64_t)site);           // mov rax, site
+    e_jmp_epilogue(j);
+}
+
+// Merge the host flags selected by keep into the guest flags, clearing the
+// rest of clear
+static void e_capture_flags(jit_t *j, uint16_t keep, uint16_t clear) {
+    e8(j, 0x9C);                                                // pushfq
+    e8(j, 0x58);                                                // pop rax
+    e8(j, 0x25); e32(j, keep);                                  // and eax, keep
+    e8(j, 0x66); e8(j, 0x8B); e_cpu(j, 1, OFS_FLAGS);           // mov cx, [flags]
+    e8(j, 0x66); e8(j, 0x81); e8(j, 0xE1); e16(j, ~clear);      // and cx, ~clear
+    e8(j, 0x09); e8(j, 0xC1);                                   // or ecx, eax
+    e8(j, 0x66); e8(j, 0x89); e_cpu(j, 1, OFS_FLAGS);           // mov [flags], cx
+}
+
+// Load the guest arithmetic flags into EFLAGS for a jcc
+static void e_load_flags(jit_t *j) {
+    e8(j, 0x0F); e8(j, 0xB7); e_cpu(j, 0, OFS_FLAGS);           // movzx eax, [flags]
+    e8(j, 0x25); e32(j, FL_ARITH);                              // and eax, FL_ARITH
+    e8(j, 0x50);                                                // push rax
+    e8(j, 0x9D);                                                // popfq
+}
+
+// Guest CF into host CF for ADC/SBB
+static void e_load_carry(jit_t *j) {
+    e8(j, 0x66); e8(j, 0x0F); e8(j, 0xBA); e_cpu(j, 4, OFS_FLAGS); e8(j, 0); // bt [flags], 0
+}
+
+static void e_flag_op(jit_t *j, uint8_t fnc, uint16_t mask) {
+    // 1 = or, 4 = and, 6 = xor
+    e8(j, 0x66); e8(j, 0x81); e_cpu(j, fnc, OFS_FLAGS);
+    e16(j, fnc == 4 ? ~mask : mask);
+}
+
+static inline bool alu_is_logic(uint8_t fnc) {
+    return fnc == 1 || fnc == 4 || fnc == 6;
+}
+
+static void e_alu_flags(jit_t *j, uint8_t fnc) {
+    e_capture_flags(j, alu_is_logic(fnc) ? FL_LOGIC : FL_ARITH, FL_ARITH);
+}
+
+// op [dst], imm for ALU function fnc
+static void e_alu_imm(jit_t *j, uint8_t fnc, bool s, uint8_t dst, uint16_t imm) {
+    if (fnc == 2 || fnc == 3) e_load_carry(j);
+    if (s) {
+        e8(j, 0x66); e8(j, 0x81); e_cpu(j, fnc, dst); e16(j, imm);
+    } else {
+        e8(j, 0x80); e_cpu(j, fnc, dst); e8(j, imm);
+    }
+    e_alu_flags(j, fnc);
+}
+
+static inline bool jit_native_branch(uint8_t handler) {
+    switch (handler) {
+    case H_JMP_SHORT:
+    case H_JMP_NEAR:
+    case H_JCC:
+    case H_JCXZ:
+    case H_LOOP:
+    case H_LOOPZ:
+    case H_LOOPNZ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Emit a branch ending the block at ip (next_ip past it), clk being the
+// clocks of the block not yet added
+static void jit_emit_branch(jit_t *j, const x86_insn_t *insn, uint16_t next_ip,
+                            uint32_t clk) {
+    uint16_t target = next_ip + insn->imm;
+    uint8_t *taken, *fall = NULL;
+    e_add_cycles(j, clk + insn->clk);
+    switch (insn->info.handler) {
+    case H_JMP_SHORT:
+    case H_JMP_NEAR:
+        e_exit_static(j, target);
+        return;
+    case H_JCC:
+        e_load_flags(j);
+        taken = e_jump(j, 0x80 | (insn->info.fnc << 1) | insn->info.d);
+        break;
+    case H_JCXZ:
+        e8(j, 0x66); e8(j, 0x83); e_cpu(j, 7, REG16_OFS(REG_CX)); e8(j, 0); // cmp [cx], 0
+        taken = e_jump(j, 0x84);
+        break;
+    case H_LOOP:
+        e8(j, 0x66); e8(j, 0xFF); e_cpu(j, 1, REG16_OFS(REG_CX));      // dec [cx]
+        taken = e_jump(j, 0x85);
+        break;
+    case H_LOOPZ:
+    case H_LOOPNZ:
+        e8(j, 0x66); e8(j, 0xFF); e_cpu(j, 1, REG16_OFS(REG_CX));      // dec [cx]
+        fall = e_jump(j, 0x84);
+        e8(j, 0x66); e8(j, 0xF7); e_cpu(j, 0, OFS_FLAGS); e16(j, FL_Z); // test [flags], ZF
+        taken = e_jump(j, insn->info.handler == H_LOOPZ ? 0x85 : 0x84);
+        break;
+    default:
+        return;
+    }
+    if (fall) patch_rel32(fall, j->ptr);
+    e_exit_static(j, next_ip);
+    patch_rel32(taken, j->ptr);
+    e_add_cycles(j, x86_taken_clocks(insn->info.handler));
+    e_exit_static(j, target);
+}
+
+// Emit a straight-line instruction as host code if it only touches registers
+static bool jit_emit_native(jit_t *j, const x86_insn_t *insn) {
+    const x86_opc_info_t info = insn->info;
+    const mod_reg_rm_t m = insn->mod_reg_rm;
+    uint8_t dst, src;
+
+    switch (info.handler) {
+    case H_MOV_RM:
+    case H_ARITH:
+    case H_TEST_RM:
+        if (m.mod != 3) return false;
+        dst = REG_OFS(info.s, info.d ? m.reg : m.rm);
+        src = REG_OFS(info.s, info.d ? m.rm : m.reg);
+        if (info.s) e8(j, 0x66);
+        e8(j, info.s ? 0x8B : 0x8A); e_cpu(j, 0, src);          // mov ax/al, [src]
+        if (info.handler == H_MOV_RM) {
+            if (info.s) e8(j, 0x66);
+            e8(j, info.s ? 0x89 : 0x88); e_cpu(j, 0, dst);      // mov [dst], ax/al
+        } else if (info.handler == H_TEST_RM) {
+            if (info.s) e8(j, 0x66);
+            e8(j, info.s ? 0x85 : 0x84); e_cpu(j, 0, dst);      // test [dst], ax/al
+            e_capture_flags(j, FL_LOGIC, FL_ARITH);
+        } else {
+            if (info.fnc == 2 || info.fnc == 3) e_load_carry(j);
+            if (info.s) e8(j, 0x66);
+            e8(j, (info.fnc << 3) | info.s); e_cpu(j, 0, dst);  // op [dst], ax/al
+            e_alu_flags(j, info.fnc);
+        }
+        return true;
+    case H_ALU_ACC:
+        e_alu_imm(j, info.fnc, info.s, REG_OFS(info.s, REG_AX), insn->imm);
+        return true;
+    case H_GRP_IMM:
+        if (m.mod != 3) return false;
+        e_alu_imm(j, m.reg, info.s, REG_OFS(info.s, m.rm), insn->imm);
+        return true;
+    case H_TEST_ACC:
+        if (info.s) {
+            e8(j, 0x66); e8(j, 0xF7); e_cpu(j, 0, REG_OFS(info.s, REG_AX)); e16(j, insn->imm);
+        } else {
+            e8(j, 0xF6); e_cpu(j, 0, REG_OFS(info.s, REG_AX)); e8(j, insn->imm);
+        }
+        e_capture_flags(j, FL_LOGIC, FL_ARITH);
+        return true;
+    case H_INC_R16:
+    case H_DEC_R16:
+        e8(j, 0x66); e8(j, 0xFF);
+        e_cpu(j, info.handler == H_DEC_R16, REG16_OFS(info.fnc)); // inc/dec [reg]
+        e_capture_flags(j, FL_INCDEC, FL_INCDEC);
+        return true;
+    case H_MOV_R16_IMM:
+        e8(j, 0x66); e8(j, 0xC7); e_cpu(j, 0, REG16_OFS(info.fnc)); e16(j, insn->imm);
+        return true;
+    case H_MOV_R8_IMM:
+        e8(j, 0xC6); e_cpu(j, 0, REG8_OFS(info.fnc)); e8(j, insn->imm);
+        return true;
+    case H_XCHG_AX:
+        if (info.fnc != 0) {
+            uint8_t r = REG16_OFS(info.fnc);
+            e8(j, 0x66); e8(j, 0x8B); e_cpu(j, 0, r);           // mov ax, [r]
+            e8(j, 0x66); e8(j, 0x8B); e_cpu(j, 1, REG16_OFS(REG_AX)); // mov cx, [ax]
+            e8(j, 0x66); e8(j, 0x89); e_cpu(j, 1, r);           // mov [r], cx
+            e8(j, 0x66); e8(j, 0x89); e_cpu(j, 0, REG16_OFS(REG_AX)); // mov [ax], ax
+        }
+        return true;
+    case H_CLC: e_flag_op(j, 4, FL_C); return true;
+    case H_STC: e_flag_op(j, 1, FL_C); return true;
+    case H_CMC: e_flag_op(j, 6, FL_C); return true;
+    case H_CLI: e_flag_op(j, 4, FL_I); return true;
+    case H_STI: e_flag_op(j, 1, FL_I); return true;
+    case H_CLD: e_flag_op(j, 4, FL_D); return true;
+    case H_STD: e_flag_op(j, 1, FL_D); return true;
+    default:
+        return false;
+    }
+}
+
+// Nonzero tells the block to return to vm_run
+static int jit_helper_exec(jit_ctx_t *ctx, const x86_insn_t *insn) {
+    x86_cpu_t *cpu = ctx->cpu;
+    bcache_t *bc = ctx->vm->bcache;
+    uint16_t cs = cpu->cs;
+    uint16_t ip = cpu->ip;
+    uint64_t epoch = bc->epoch;
+    x86_exec(ctx->vm, insn);
+    // Translated code reads and writes flags directly
+    x86_flags_sync(cpu);
+    // A REP cut short by a device event goes back to its prefix
+    return cpu->cs != cs || cpu->ip != ip || cpu->int_src >= 0 ||
+           cpu->flags.t_f || bc->epoch != epoch;
+}
+
+static void e_helper(jit_t *j, const x86_insn_t *insn, uint16_t next_ip,
+                     uint32_t unexecuted) {
+    e8(j, 0x66); e8(j, 0xC7); e_cpu(j, 0, OFS_IP); e16(j, next_ip); // mov [ip], imm16
+    e8(j, 0x4C); e8(j, 0x89); e8(j, 0xE7);                      // mov rdi, r12
+    e8(j, 0x48); e8(j, 0xBE); e64(j, (uint64_t)insn);           // mov rsi, insn
+    e8(j, 0x48); e8(j, 0xB8); e64(j, (uint64_t)jit_helper_exec); // mov rax, helper
+    e8(j, 0xFF); e8(j, 0xD0);                                   // call rax
+    e8(j, 0x85); e8(j, 0xC0);                                   // test eax, eax
+    uint8_t *skip = e_jump(j, 0x84);                            // jz over the exit
+    e_exit_dynamic(j, unexecuted);
+    patch_rel32(skip, j->ptr);
+}
+
+// Left to vm_run: port I/O (so a cross-check replay has no side effects),
+// HLT and anything that fails to decode
+static inline bool jit_translatable(const x86_insn_t *insn) {
+    switch (insn->info.handler) {
+    case H_ILLEGAL:
+    case H_PREFIX:
+    case H_HLT:
+    case H_IN_IMM:
+    case H_IN_DX:
+    case H_OUT_IMM:
+    case H_OUT_DX:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static jit_t *jit_init(vm_t *vm) {
+    jit_t *j = vm->jit;
+    if (j == NULL) {
+        j = vm->jit = calloc(1, sizeof(jit_t));
+    }
+    if (j->code) return j;
+    if (j->unavailable) return NULL;
+    void *p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        printf("JIT: can't map code buffer, falling back to the block cache\n");
+        j->unavailable = true;
+        return NULL;
+    }
+    j->code = j->ptr = p;
+
+    // uint8_t *enter(jit_ctx_t *ctx, uint8_t *code)
+    j->enter = (jit_enter_fn)j->ptr;
+    e8(j, 0x53);                                                // push rbx
+    e8(j, 0x41); e8(j, 0x54);                                   // push r12
+    e8(j, 0x55);                                                // push rbp (align)
+    e8(j, 0x49); e8(j, 0x89); e8(j, 0xFC);                      // mov r12, rdi
+    e8(j, 0x48); e8(j, 0x8B); e8(j, 0x1F);                      // mov rbx, [rdi]
+    e8(j, 0xFF); e8(j, 0xE6);                                   // jmp rsi
+    j->epilogue = j->ptr;
+    e8(j, 0x5D);                                                // pop rbp
+    e8(j, 0x41); e8(j, 0x5C);                                   // pop r12
+    e8(j, 0x5B);                                                // pop rbx
+    e8(j, 0xC3);                                                // ret
+    j->code_start = j->ptr;
+    j->epoch = vm->bcache->epoch;
+    return j;
+}
+
+void jit_flush(vm_t *vm) {
+    jit_t *j = vm->jit;
+    if (j == NULL || j->code == NULL) return;
+    memset(j->blocks, 0, sizeof(j->blocks));
+    j->ptr = j->code_start;
+    j->epoch = vm->bcache->epoch;
+    j->generation++;
+    j->stats.flushes++;
+}
+
+void jit_free(vm_t *vm) {
+    jit_t *j = vm->jit;
+    if (j == NULL) return;
+    if (j->code) munmap(j->code, JIT_CODE_SIZE);
+    free(j);
+    vm->jit = NULL;
+}
+
+static void jit_translate(vm_t *vm, jit_block_t *jb, uint32_t addr) {
+    jit_t *j = vm->jit;
+    x86_cpu_t *cpu = &vm->cpu;
+    bcache_block_t *bb = bcache_lookup(vm->bcache, cpu, addr);
+    uint8_t n = 0;
+    while (n < bb->n_insns && jit_translatable(&bb->insns[n])) n++;
+
+    jb->addr = addr;
+    jb->ip = cpu->ip;
+    jb->used = true;
+    jb->n_insns = n;
+    jb->entry = NULL;
+    if (n == 0) return;
+
+    // Helpers get pointers to these copies, the cache block may be reused
+    x86_insn_t *insns = (x86_insn_t *)(((uintptr_t)j->ptr + 7) & ~7ul);
+    memcpy(insns, bb->insns, n * sizeof(x86_insn_t));
+    j->ptr = (uint8_t *)(insns + n);
+    jb->entry = j->ptr;
+
+    // Return unless the block's base clocks fit before the deadline, so
+    // that vm_run steps up to it
+    uint32_t blk_clk = 0;
+    for (uint8_t i = 0; i < n; i++) blk_clk += insns[i].clk;
+    e8(j, 0x48); e8(j, 0x8B); e8(j, 0x83); e32(j, VM_CYCLES);   // mov rax, [rbx+cycles]
+    e8(j, 0x48); e8(j, 0x05); e32(j, blk_clk);                  // add rax, clk
+    e8(j, 0x49); e8(j, 0x3B); e8(j, 0x44); e8(j, 0x24); e8(j, CTX_DEADLINE); // cmp rax, [r12+d]
+    uint8_t *in_time = e_jump(j, 0x86);
+    e_exit_dynamic(j, 0);
+    patch_rel32(in_time, j->ptr);
+
+    // sub [r12+budget], n; jge body; out of budget: undo and return
+    e8(j, 0x41); e8(j, 0x81); e8(j, 0x6C); e8(j, 0x24); e8(j, CTX_BUDGET); e32(j, n);
+    uint8_t *body = e_jump(j, 0x8D);
+    e_exit_dynamic(j, n);
+    patch_rel32(body, j->ptr);
+
+    uint16_t ip = bb->ip;
+    // Clocks of native instructions not yet added to vm->cycles
+    uint32_t clk = 0;
+    for (uint8_t i = 0; i < n; i++) {
+        const x86_insn_t *insn = &insns[i];
+        uint16_t next_ip = ip + insn->len;
+        if (insn->info.br && jit_native_branch(insn->info.handler)) {
+            jit_emit_branch(j, insn, next_ip, clk);
+            j->stats.insns_native++;
+            return;
+        }
+        if (!insn->info.br && jit_emit_native(j, insn)) {
+            clk += insn->clk;
+            j->stats.insns_native++;
+        } else {
+            e_add_cycles(j, clk);
+            clk = 0;
+            e_helper(j, insn, next_ip, n - i - 1);
+            j->stats.insns_helper++;
+            if (insn->info.handler == H_CALL_NEAR) {
+                e_exit_static(j, next_ip + insn->imm);
+                return;
+            }
+            if (insn->info.br) {
+                e_exit_dynamic(j, 0);
+                return;
+            }
+        }
+        ip = next_ip;
+    }
+    e_add_cycles(j, clk);
+    e_exit_static(j, ip);
+}
+
+static jit_block_t *jit_lookup(vm_t *vm, uint32_t addr) {
+    jit_t *j = vm->jit;
+    jit_block_t *jb = &j->blocks[JIT_HASH(addr)];
+    if (!jb->used || jb->addr != addr || jb->ip != vm->cpu.ip) {
+        if (j->code + JIT_CODE_SIZE - j->ptr < JIT_BLOCK_MAX) {
+            jit_flush(vm);
+        }
+        jit_translate(vm, jb, addr);
+        j->stats.blocks_translated += jb->entry != NULL;
+    }
+    return jb->entry ? jb : NULL;
+}
+
+static bool jit_reg_diff(const char *name, uint16_t jit, uint16_t ref) {
+    if (jit == ref) return false;
+    printf("  %s: jit %04x, interp %04x\n", name, jit, ref);
+    return true;
+}
+
+static bool jit_cpu_diff(const x86_cpu_t *jit, const x86_cpu_t *ref) {
+    static const char *const reg_names[8] = {"ax", "cx", "dx", "bx",
+                                             "sp", "bp", "si", "di"};
+    static const char *const sreg_names[4] = {"es", "cs", "ss", "ds"};
+    bool diff = false;
+    for (int i = 0; i < 8; i++) {
+        diff |= jit_reg_diff(reg_names[i], jit->regs[i], ref->regs[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        diff |= jit_reg_diff(sreg_names[i], jit->sregs[i], ref->sregs[i]);
+    }
+    diff |= jit_reg_diff("ip", jit->ip, ref->ip);
+    diff |= jit_reg_diff("fl", jit->flags.num, ref->flags.num);
+    if (jit->int_src != ref->int_src) {
+        printf("  int_src: jit %d, interp %d\n", jit->int_src, ref->int_src);
+        diff = true;
+    }
+    return diff;
+}
+
+// Value at addr after the translated run, given its store log
+static uint8_t jit_logged_value(const mem_log_entry_t *log, const uint8_t *vals,
+                                size_t len, uint32_t addr, uint8_t dflt) {
+    for (size_t i = 0; i < len; i++) {
+        if (log[i].addr == addr) return vals[i];
+    }
+    return dflt;
+}
+
+// Run one block, then roll it back and replay it on the interpreter. The
+// interpreter's result is kept.
+static uint32_t jit_run_checked(vm_t *vm, jit_block_t *jb) {
+    x86_cpu_t *cpu = &vm->cpu;
+    vm_mem_t *m = &vm->mem;
+    x86_cpu_t before = *cpu;
+    uint64_t cycles = vm->cycles;
+
+    mem_log_enable(m);
+    jit_ctx_t ctx = {cpu, vm, jb->n_insns, UINT64_MAX};
+    vm->jit->enter(&ctx, jb->entry);
+    uint32_t ran = jb->n_insns - ctx.budget;
+    x86_cpu_t after = *cpu;
+    uint64_t jit_cycles = vm->cycles - cycles;
+
+    size_t n_log = m->store_log.len;
+    mem_log_entry_t *log = malloc(n_log * sizeof(mem_log_entry_t) + 1);
+    uint8_t *vals = malloc(n_log + 1);
+    memcpy(log, m->store_log.entries, n_log * sizeof(mem_log_entry_t));
+    for (size_t i = 0; i < n_log; i++) vals[i] = m->data[log[i].addr];
+    mem_log_undo(m);
+
+    *cpu = before;
+    vm->cycles = cycles;
+    for (uint32_t i = 0; i < ran; i++) {
+        x86_insn_t insn;
+        x86_decode(m, cpu->cs, &cpu->ip, &insn);
+        x86_exec(vm, &insn);
+    }
+    x86_flags_sync(cpu);
+
+    bool diff = jit_cpu_diff(&after, cpu);
+    if (jit_cycles != vm->cycles - cycles) {
+        printf("  cycles: jit %lu, interp %lu\n", jit_cycles,
+               vm->cycles - cycles);
+        diff = true;
+    }
+    for (size_t i = 0; i < n_log; i++) {
+        if (m->data[log[i].addr] != vals[i]) {
+            printf("  [%05x]: jit %02x, interp %02x\n", log[i].addr, vals[i],
+                   m->data[log[i].addr]);
+            diff = true;
+        }
+    }
+    for (size_t i = 0; i < m->store_log.len; i++) {
+        mem_log_entry_t *e = &m->store_log.entries[i];
+        uint8_t v = jit_logged_value(log, vals, n_log, e->addr, e->old);
+        if (m->data[e->addr] != v) {
+            printf("  [%05x]: jit %02x, interp %02x\n", e->addr, v,
+                   m->data[e->addr]);
+            diff = true;
+        }
+    }
+    free(log);
+    free(vals);
+    m->store_log.len = 0;
+
+    if (diff) {
+        printf("JIT mismatch in block %04x:%04x after %u insns\n", before.cs,
+               before.ip, ran);
+        exit(1);
+    }
+    vm->jit->stats.checks++;
+    return ran;
+}
+
+uint32_t jit_run(vm_t *vm, uint32_t max_insns, uint64_t deadline) {
+    x86_cpu_t *cpu = &vm->cpu;
+    jit_t *j = jit_init(vm);
+    if (j == NULL || cpu->flags.t_f) return 0;
+    x86_flags_sync(cpu);
+    if (j->epoch != vm->bcache->epoch) jit_flush(vm);
+
+    jit_block_t *jb = jit_lookup(vm, SEGMENT(cpu->cs, cpu->ip));
+    if (jb == NULL || jb->n_insns > max_insns) return 0;
+    j->stats.runs++;
+    if (vm->opts.jit_check) return jit_run_checked(vm, jb);
+
+    int32_t budget = max_insns < JIT_BUDGET ? max_insns : JIT_BUDGET;
+    jit_ctx_t ctx = {cpu, vm, budget, deadline};
+    uint8_t *site = j->enter(&ctx, jb->entry);
+
+    // Left through an unlinked static exit: link it to the block at CS:IP
+    if (site && j->epoch == vm->bcache->epoch) {
+        uint32_t gen = j->generation;
+        jit_block_t *next = jit_lookup(vm, SEGMENT(cpu->cs, cpu->ip));
+        if (next && gen == j->generation) {
+            patch_rel32(site, next->entry);
+            j->stats.links++;
+        }
+    }
+    return budget - ctx.budget;
+}
+
+#else
+
+struct jit {
+    jit_stats_t stats;
+};
+
+uint32_t jit_run(vm_t *vm, uint32_t max_insns, uint64_t deadline) {
+    (void)vm;
+    (void)max_insns;
+    (void)deadline;
+    return 0;
+}
+
+void jit_flush(vm_t *vm) {
+    (void)vm;
+}
+
+void jit_free(vm_t *vm) {
+    (void)vm;
+}
+
+#endif // CFG_JIT
+
+void jit_dump_stats(vm_t *vm) {
+    // Nothing was translated before the first run
+    jit_stats_t none = {0};
+    jit_stats_t *st = vm->jit ? &vm->jit->stats : &none;
+    uint64_t insns = st->insns_native + st->insns_helper;
+    printf("jit runs:        %lu\n", st->runs);
+    printf("jit blocks:      %lu\n", st->blocks_translated);
+    printf("jit native:      %lu of %lu insns (%.2f%%)\n", st->insns_native,
+           insns, insns ? 100.0 * st->insns_native / insns : 0.0);
+    printf("jit links:       %lu\n", st->links);
+    printf("jit flushes:     %lu\n", st->flushes);
+    if (st->checks) printf("jit checks:      %lu\n", st->checks);
+}
@@ -2,16 +2,22 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
 
 #include "vm_mem.h"
 #include "vm.h"
 #include "dbg.h"
 #include "util.h"
-#include "main.h"
+#include "snap.h"
+#include "replay.h"
+#include "vm_io.h"
+
+// The machine a SIGINT stops
+static vm_t *main_vm;
 
 void signal_handler(int signal) {
-    if (signal == SIGINT) {
-        stop_flag = -1;
+    if (signal == SIGINT && main_vm != NULL) {
+        main_vm->stop = -1;
     }
 }
 
@@ -20,30 +26,63 @@ int main(int argc, char **argv) {
 
     int dbg = 0;
     int trace = 0;
+    vm_engine_t engine = VM_ENGINE_BCACHE;
+    int jit_check = 0;
     opterr = 0;
     int c;
-    char* arg_command;
+    char* arg_command = NULL;
+    char* snap_path = NULL;
+    char* record_path = NULL;
+    char* play_path = NULL;
+    char* keys_path = NULL;
 
-    while ((c = getopt(argc, argv, "dtc:")) != -1 ) {
+    while ((c = getopt(argc, argv, "dtxc:e:s:r:p:k:")) != -1 ) {
         switch (c) {
             case 'd': dbg = 1; break;
             case 't': trace = 1; break;
+            case 'x': jit_check = 1; break;
+            case 'e': {
+                if (strcmp(optarg, "interp") == 0) {
+                    engine = VM_ENGINE_INTERP;
+                } else if (strcmp(optarg, "bcache") == 0) {
+                    engine = VM_ENGINE_BCACHE;
+                } else if (strcmp(optarg, "jit") == 0) {
+                    engine = VM_ENGINE_JIT;
+                } else {
+                    printf("Unknown engine %s (expected interp, bcache or jit)\n", optarg);
+                    return 1;
+                }
+                break;
+            }
             case 'c': {
                 arg_command = optarg;
                 break;  
             } 
+            // Boot from a snapshot instead of the reset vector
+            case 's': snap_path = optarg; break;
+            // Record the session's input, or play a recording back
+            case 'r': record_path = optarg; break;
+            case 'p': play_path = optarg; break;
+            // Type in the text of a file once the machine is up
+            case 'k': keys_path = optarg; break;
             default: 
                 abort();
         }
     }
 
     int remain_args = argc - optind;
-    if (remain_args < 2 || remain_args % 2) {
+    if ((remain_args < 2 && snap_path == NULL) || remain_args % 2) {
         printf("Expected path to one or more [bin file and offset].\n");
         return 1;
     }
+    // A recording has the keys typed in the session it is of
+    if (keys_path != NULL && play_path != NULL) {
+        printf("Can't type in a file (-k) while playing a recording (-p)\n");
+        return 1;
+    }
 
-    init_mem_blank();
+    vm_t* vm = vm_init();
+    main_vm = vm;
     for (int i = 0; i < (remain_args >> 1); i++) {
         // Arguments: bin file, offset (segments pre-computed)
         const char *path = argv[optind];
@@ -60,14 +99,35 @@ int main(int argc, char **argv) {
             return 1;
         }
 
-        load_mem(prog, offset);
+        load_mem(&vm->mem, prog, offset);
         fclose(prog);
         optind += 2;
     }
 
-    vm_t* vm = vm_init();
-
     vm->opts.enable_trace = trace;
+    vm->opts.engine = engine;
+    vm->opts.jit_check = jit_check;
+    vm->opts.idle_sleep = true;
+
+    if (snap_path != NULL && !snap_load(vm, snap_path)) {
+        return 1;
+    }
+    if (record_path != NULL && !replay_record(vm, record_path)) {
+        return 1;
+    }
+    if (play_path != NULL && !replay_play(vm, play_path)) {
+        return 1;
+    }
+
+    if (keys_path != NULL) {
+        size_t len;
+        char *keys = read_file(keys_path, &len);
+        if (keys == NULL) {
+            return 1;
+        }
+        io_type(vm, keys, len);
+        free(keys);
+    }
 
     if (arg_command != NULL) {
         dbg_run_cmds(vm, arg_command);
@@ -79,5 +139,12 @@ int main(int argc, char **argv) {
         vm_run(vm, -1);
     }
 
-    return 0;
+    // Exit with the code the guest wrote to port 0xFF, or 1 if the CPU
+    // stopped at something it couldn't run
+    int code = vm->exit_code < 0 ? 0 : vm->exit_code;
+    if (vm->fault != VM_FAULT_NONE) code = 1;
+    replay_close(vm);
+    main_vm = NULL;
+    vm_free(vm);
+    return code;
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include "opc.h"
+
+#define OP(h, ...)   {.handler = H_##h, __VA_ARGS__}
+#define OP_PFX(p, f) {.handler = H_PREFIX, .fnc = f, .pfx = p}
+
+#define MODRM .modrm = 1
+#define BR    .br = 1
+
+// ALU r/m forms (d, s in the low bits) followed by AL/AX immediate forms
+#define ALU_ROW(f)                                                             \
+    [((f) << 3) + 0] = OP(ARITH, .fnc = f, MODRM),                             \
+    [((f) << 3) + 1] = OP(ARITH, .fnc = f, .s = 1, MODRM),                     \
+    [((f) << 3) + 2] = OP(ARITH, .fnc = f, .d = 1, MODRM),                     \
+    [((f) << 3) + 3] = OP(ARITH, .fnc = f, .s = 1, .d = 1, MODRM),             \
+    [((f) << 3) + 4] = OP(ALU_ACC, .fnc = f, .imm = IMM_S),                    \
+    [((f) << 3) + 5] = OP(ALU_ACC, .fnc = f, .s = 1, .imm = IMM_S)
+
+// Eight opcodes with the register index in the low 3 bits
+#define REG_ROW(base, h, ...)                                                  \
+    [(base) + 0] = OP(h, .fnc = 0, __VA_ARGS__),                               \
+    [(base) + 1] = OP(h, .fnc = 1, __VA_ARGS__),                               \
+    [(base) + 2] = OP(h, .fnc = 2, __VA_ARGS__),                               \
+    [(base) + 3] = OP(h, .fnc = 3, __VA_ARGS__),                               \
+    [(base) + 4] = OP(h, .fnc = 4, __VA_ARGS__),                               \
+    [(base) + 5] = OP(h, .fnc = 5, __VA_ARGS__),                               \
+    [(base) + 6] = OP(h, .fnc = 6, __VA_ARGS__),                               \
+    [(base) + 7] = OP(h, .fnc = 7, __VA_ARGS__)
+
+// Condition code in bits 1-3, inverted by bit 0
+#define JCC_PAIR(cc)                                                           \
+    [0x70 + ((cc) << 1)] = OP(JCC, .fnc = cc, .imm = IMM_8S, BR),              \
+    [0x71 + ((cc) << 1)] = OP(JCC, .fnc = cc, .d = 1, .imm = IMM_8S, BR)
+
+// Entries left out are zero, i.e. H_ILLEGAL
+const x86_opc_info_t x86_opc_table[256] = {
+    ALU_ROW(0),
+    [0x06] = OP(PUSH_SEG, .fnc = 0),
+    [0x07] = OP(POP_SEG, .fnc = 0),
+    ALU_ROW(1),
+    [0x0E] = OP(PUSH_SEG, .fnc = 1),
+    ALU_ROW(2),
+    [0x16] = OP(PUSH_SEG, .fnc = 2),
+    [0x17] = OP(POP_SEG, .fnc = 2),
+    ALU_ROW(3),
+    [0x1E] = OP(PUSH_SEG, .fnc = 3),
+    [0x1F] = OP(POP_SEG, .fnc = 3),
+    ALU_ROW(4),
+    [0x26] = OP_PFX(PFX_SEG, 0),
+    ALU_ROW(5),
+    [0x2E] = OP_PFX(PFX_SEG, 1),
+    ALU_ROW(6),
+    [0x36] = OP_PFX(PFX_SEG, 2),
+    ALU_ROW(7),
+    [0x3E] = OP_PFX(PFX_SEG, 3),
+
+    REG_ROW(0x40, INC_R16),
+    REG_ROW(0x48, DEC_R16),
+    REG_ROW(0x50, PUSH_R16),
+    REG_ROW(0x58, POP_R16),
+
+    JCC_PAIR(0), JCC_PAIR(1), JCC_PAIR(2), JCC_PAIR(3),
+    JCC_PAIR(4), JCC_PAIR(5), JCC_PAIR(6), JCC_PAIR(7),
+
+    // d selects a sign-extended 8-bit immediate
+    [0x80] = OP(GRP_IMM, MODRM, .imm = IMM_8),
+    [0x81] = OP(GRP_IMM, .s = 1, MODRM, .imm = IMM_16),
+    [0x82] = OP(GRP_IMM, .d = 1, MODRM, .imm = IMM_8),
+    [0x83] = OP(GRP_IMM, .s = 1, .d = 1, MODRM, .imm = IMM_8S),
+    [0x84] = OP(TEST_RM, MODRM),
+    [0x85] = OP(TEST_RM, .s = 1, MODRM),
+    [0x86] = OP(XCHG_RM, MODRM),
+    [0x87] = OP(XCHG_RM, .s = 1, MODRM),
+    [0x88] = OP(MOV_RM, MODRM),
+    [0x89] = OP(MOV_RM, .s = 1, MODRM),
+    [0x8A] = OP(MOV_RM, .d = 1, MODRM),
+    [0x8B] = OP(MOV_RM, .s = 1, .d = 1, MODRM),
+    [0x8C] = OP(MOV_RM_SEG, MODRM),
+    [0x8D] = OP(LEA, MODRM),
+    [0x8E] = OP(MOV_SEG_RM, MODRM),
+    [0x8F] = OP(POP_RM, MODRM),
+
+    REG_ROW(0x90, XCHG_AX),
+    [0x98] = OP(CBW),
+    [0x99] = OP(CWD),
+    [0x9A] = OP(CALL_FAR, .imm = IMM_FAR, BR),
+    [0x9C] = OP(PUSHF),
+    [0x9D] = OP(POPF),
+    [0x9E] = OP(SAHF),
+    [0x9F] = OP(LAHF),
+
+    [0xA0] = OP(MOV_ACC_MEM, .imm = IMM_16),
+    [0xA1] = OP(MOV_ACC_MEM, .s = 1, .imm = IMM_16),
+    [0xA2] = OP(MOV_MEM_ACC, .imm = IMM_16),
+    [0xA3] = OP(MOV_MEM_ACC, .s = 1, .imm = IMM_16),
+    [0xA4] = OP(STRING),
+    [0xA5] = OP(STRING, .s = 1),
+    [0xA6] = OP(STRING),
+    [0xA7] = OP(STRING, .s = 1),
+    [0xA8] = OP(TEST_ACC, .imm = IMM_S),
+    [0xA9] = OP(TEST_ACC, .s = 1, .imm = IMM_S),
+    [0xAA] = OP(STRING),
+    [0xAB] = OP(STRING, .s = 1),
+    [0xAC] = OP(STRING),
+    [0xAD] = OP(STRING, .s = 1),
+    [0xAE] = OP(STRING),
+    [0xAF] = OP(STRING, .s = 1),
+
+    REG_ROW(0xB0, MOV_R8_IMM, .imm = IMM_8),
+    REG_ROW(0xB8, MOV_R16_IMM, .imm = IMM_16),
+
+    [0xC2] = OP(RET_IMM, .imm = IMM_16, BR),
+    [0xC3] = OP(RET, BR),
+    [0xC4] = OP(LES_LDS, .fnc = 0, MODRM),
+    [0xC5] = OP(LES_LDS, .fnc = 3, MODRM),
+    [0xC6] = OP(MOV_RM_IMM, MODRM, .imm = IMM_S),
+    [0xC7] = OP(MOV_RM_IMM, .s = 1, MODRM, .imm = IMM_S),
+    [0xCA] = OP(RETF_IMM, .imm = IMM_16, BR),
+    [0xCB] = OP(RETF, BR),
+    [0xCC] = OP(INT3, BR),
+    [0xCD] = OP(INT, .imm = IMM_8, BR),
+    [0xCE] = OP(INTO, BR),
+    [0xCF] = OP(IRET, BR),
+
+    // d selects a shift count of CL
+    [0xD0] = OP(SHIFT, MODRM),
+    [0xD1] = OP(SHIFT, .s = 1, MODRM),
+    [0xD2] = OP(SHIFT, .d = 1, MODRM),
+    [0xD3] = OP(SHIFT, .s = 1, .d = 1, MODRM),
+    [0xD7] = OP(XLAT),
+
+    [0xE0] = OP(LOOPNZ, .imm = IMM_8S, BR),
+    [0xE1] = OP(LOOPZ, .imm = IMM_8S, BR),
+    [0xE2] = OP(LOOP, .imm = IMM_8S, BR),
+    [0xE3] = OP(JCXZ, .imm = IMM_8S, BR),
+    [0xE4] = OP(IN_IMM, .imm = IMM_8),
+    [0xE5] = OP(IN_IMM, .s = 1, .imm = IMM_8),
+    [0xE6] = OP(OUT_IMM, .imm = IMM_8),
+    [0xE7] = OP(OUT_IMM, .s = 1, .imm = IMM_8),
+    [0xE8] = OP(CALL_NEAR, .imm = IMM_16, BR),
+    [0xE9] = OP(JMP_NEAR, .imm = IMM_16, BR),
+    [0xEA] = OP(JMP_FAR, .imm = IMM_FAR, BR),
+    [0xEB] = OP(JMP_SHORT, .imm = IMM_8S, BR),
+    [0xEC] = OP(IN_DX),
+    [0xED] = OP(IN_DX, .s = 1),
+    [0xEE] = OP(OUT_DX),
+    [0xEF] = OP(OUT_DX, .s = 1),
+
+    [0xF0] = OP_PFX(PFX_LOCK, 0),
+    [0xF1] = OP_PFX(PFX_LOCK, 0),
+    [0xF2] = OP_PFX(PFX_REP, 0),
+    [0xF3] = OP_PFX(PFX_REP, 0),
+    [0xF4] = OP(HLT, BR),
+    [0xF5] = OP(CMC),
+    [0xF6] = OP(GRP3, MODRM, .imm = IMM_GRP3),
+    [0xF7] = OP(GRP3, .s = 1, MODRM, .imm = IMM_GRP3),
+    [0xF8] = OP(CLC),
+    [0xF9] = OP(STC),
+    [0xFA] = OP(CLI),
+    [0xFB] = OP(STI),
+    [0xFC] = OP(CLD),
+    [0xFD] = OP(STD),
+    [0xFE] = OP(GRP4, MODRM),
+    // Indirect CALL/JMP live here
+    [0xFF] = OP(GRP5, .s = 1, MODRM, BR),
+};
+
+#define X86_HANDLER_NAME(name) #name,
+const char *const x86_handler_names[H_COUNT] = {
+    X86_HANDLERS(X86_HANDLER_NAME)};
+#undef X86_HANDLER_NAME
@@ -0,0 +1,212 @@
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+#include "snap.h"
+
+static replay_state_t *replay_get(vm_t *vm) {
+    if (vm->replay == NULL) {
+        vm->replay = calloc(1, sizeof(replay_state_t));
+        vm->replay->vm = vm;
+    }
+    return vm->replay;
+}
+
+static void replay_write_varint(replay_state_t *r, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((v & 0x7F) | 0x80, r->f);
+        v >>= 7;
+    }
+    fputc(v, r->f);
+}
+
+static bool replay_read_varint(replay_state_t *r, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(r->f);
+        if (c == EOF) return false;
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+// Have the CPU call in for the next input due, from the journal first
+static void replay_arm(replay_state_t *r) {
+    uint64_t when = SCHED_NEVER;
+    if (r->journal_pos < r->journal_len) {
+        when = r->journal[r->journal_pos].cycles;
+    } else if (r->mode == REPLAY_PLAY) {
+        when = r->next;
+    }
+    sched_at(&r->vm->sched, SCHED_INPUT, when);
+}
+
+static void replay_journal_push(replay_state_t *r, uint64_t cycles,
+                                uint8_t kind, uint8_t data) {
+    if (!r->journal_on) return;
+    if (r->journal_len == r->journal_cap) {
+        r->journal_cap = r->journal_cap ? r->journal_cap * 2 : 256;
+        r->journal = realloc(r->journal,
+                             r->journal_cap * sizeof(replay_entry_t));
+    }
+    r->journal[r->journal_len++] = (replay_entry_t){cycles, kind, data};
+    r->journal_pos = r->journal_len;
+}
+
+// Read the next entry, or stop playing at the end of the log
+static void replay_advance(replay_state_t *r) {
+    uint64_t delta;
+    int kind, data;
+    if (!replay_read_varint(r, &delta) || (kind = fgetc(r->f)) == EOF ||
+        (data = fgetc(r->f)) == EOF) {
+        printf("Replay finished after %u inputs at %lu cycles\n", r->entries,
+               r->last);
+        replay_close(r->vm);
+        return;
+    }
+    r->next = r->last + delta;
+    r->next_kind = kind;
+    r->next_data = data;
+}
+
+bool replay_record(vm_t *vm, const char *path) {
+    replay_state_t *r = replay_get(vm);
+    replay_close(vm);
+    r->f = fopen(path, "wb");
+    if (r->f == NULL) {
+        printf("Can't open file: %s\n", path);
+        return false;
+    }
+    replay_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, REPLAY_MAGIC, sizeof(h.magic));
+    h.version = REPLAY_VERSION;
+    h.start_id = snap_machine_id(vm);
+    h.start_cycles = vm->cycles;
+    fwrite(&h, sizeof(h), 1, r->f);
+    fflush(r->f);
+    r->last = vm->cycles;
+    r->entries = 0;
+    r->mode = REPLAY_RECORD;
+    return true;
+}
+
+bool replay_play(vm_t *vm, const char *path) {
+    replay_state_t *r = replay_get(vm);
+    replay_close(vm);
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        printf("Can't open file: %s\n", path);
+        return false;
+    }
+    replay_header_t h;
+    if (fread(&h, sizeof(h), 1, r->f) != 1 ||
+        memcmp(h.magic, REPLAY_MAGIC, sizeof(h.magic)) != 0) {
+        printf("Not a recording: %s\n", path);
+    } else if (h.version != REPLAY_VERSION) {
+        printf("Recording %s is from another version (%u)\n", path,
+               h.version);
+    } else if (h.start_cycles != vm->cycles ||
+               h.start_id != snap_machine_id(vm)) {
+        printf("Recording %s starts from another machine state; load the "
+               "same ROMs or snapshot\n", path);
+    } else {
+        r->last = vm->cycles;
+        r->entries = 0;
+        r->mode = REPLAY_PLAY;
+        r->idle_sleep = vm->opts.idle_sleep;
+        vm->opts.idle_sleep = false;
+        replay_advance(r);
+        replay_arm(r);
+        return true;
+    }
+    fclose(r->f);
+    r->f = NULL;
+    return false;
+}
+
+void replay_close(vm_t *vm) {
+    replay_state_t *r = vm->replay;
+    if (r == NULL) return;
+    if (r->f != NULL) {
+        fclose(r->f);
+        r->f = NULL;
+    }
+    if (r->mode == REPLAY_PLAY) {
+        vm->opts.idle_sleep = r->idle_sleep;
+    }
+    __atomic_store_n(&r->mode, REPLAY_OFF, __ATOMIC_RELAXED);
+}
+
+void replay_free(vm_t *vm) {
+    replay_state_t *r = vm->replay;
+    if (r == NULL) return;
+    replay_close(vm);
+    free(r->journal);
+    free(r);
+    vm->replay = NULL;
+}
+
+void replay_journal_start(vm_t *vm) {
+    replay_state_t *r = replay_get(vm);
+    r->journal_on = true;
+    r->journal_len = r->journal_pos = 0;
+}
+
+void replay_journal_stop(vm_t *vm) {
+    replay_state_t *r = replay_get(vm);
+    free(r->journal);
+    r->journal = NULL;
+    r->journal_on = false;
+    r->journal_len = r->journal_pos = r->journal_cap = 0;
+    replay_arm(r);
+}
+
+void replay_rewind(vm_t *vm, uint64_t cycles) {
+    replay_state_t *r = replay_get(vm);
+    // Input taken at the clock itself is already in the machine
+    size_t pos = 0;
+    while (pos < r->journal_len && r->journal[pos].cycles <= cycles) pos++;
+    r->journal_pos = pos;
+    replay_arm(r);
+}
+
+void replay_log(vm_t *vm, uint64_t cycles, replay_kind_t kind, uint8_t data) {
+    replay_state_t *r = vm->replay;
+    if (r == NULL) return;
+    replay_journal_push(r, cycles, kind, data);
+    if (r->mode != REPLAY_RECORD) return;
+    replay_write_varint(r, cycles - r->last);
+    fputc(kind, r->f);
+    fputc(data, r->f);
+    // Kept on disk as it comes, for sessions that end in a crash
+    fflush(r->f);
+    r->last = cycles;
+    r->entries++;
+}
+
+bool replay_next(vm_t *vm, uint64_t cycles, uint8_t *kind, uint8_t *data) {
+    replay_state_t *r = vm->replay;
+    if (r == NULL) return false;
+    if (r->journal_pos < r->journal_len) {
+        const replay_entry_t *e = &r->journal[r->journal_pos];
+        if (e->cycles > cycles) return false;
+        *kind = e->kind;
+        *data = e->data;
+        r->journal_pos++;
+    } else if (r->mode == REPLAY_PLAY && r->next <= cycles) {
+        *kind = r->next_kind;
+        *data = r->next_data;
+        r->last = r->next;
+        r->entries++;
+        replay_journal_push(r, r->next, *kind, *data);
+        replay_advance(r);
+    } else {
+        return false;
+    }
+    replay_arm(r);
+    return true;
+}
@@ -0,0 +1,359 @@
+#include "rev.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "vm_io.h"
+#include "vm_mem.h"
+
+#define REV_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+
+typedef struct {
+    uint64_t insns;
+    uint64_t cycles;
+    uint64_t idle_cycles;
+    x86_cpu_t cpu;
+    uint8_t *io;
+    // Pages stored to since the checkpoint before, every page in the first,
+    // and their contents in address order
+    uint64_t pages[MEM_PAGES / 64];
+    uint32_t n_pages;
+    uint8_t *data;
+} rev_ckpt_t;
+
+// Kept in vm->rev while history is kept
+struct rev_state {
+    vm_t *vm;
+    int view;
+    rev_ckpt_t ckpts[REV_CKPT_MAX];
+    int n;
+    // Checkpoint the machine was at last; memory differs from it only in
+    // the pages the view has dirty
+    int base;
+    size_t mem_bytes;
+    // Checkpoints dropped to stay inside the bounds
+    uint32_t thinned;
+};
+
+static inline bool rev_has_page(const rev_ckpt_t *c, uint32_t page) {
+    return (c->pages[page / 64] >> (page & 63)) & 1;
+}
+
+// Where a page the checkpoint holds is in its data
+static uint8_t *rev_page_data(const rev_ckpt_t *c, uint32_t page) {
+    uint32_t idx = 0;
+    for (uint32_t i = 0; i < page / 64; i++) {
+        idx += __builtin_popcountll(c->pages[i]);
+    }
+    idx += __builtin_popcountll(c->pages[page / 64] &
+                                ((1ull << (page & 63)) - 1));
+    return c->data + (size_t)idx * REV_PAGE_SIZE;
+}
+
+static void rev_free(rev_state_t *rev, rev_ckpt_t *c) {
+    rev->mem_bytes -= (size_t)c->n_pages * REV_PAGE_SIZE;
+    free(c->data);
+    free(c->io);
+}
+
+// Drop checkpoint i, leaving what it held of memory to the one after
+static void rev_drop(rev_state_t *rev, int i) {
+    rev_ckpt_t *c = &rev->ckpts[i], *next = &rev->ckpts[i + 1];
+    uint64_t pages[MEM_PAGES / 64];
+    uint32_t n_pages = 0;
+    for (int w = 0; w < MEM_PAGES / 64; w++) {
+        pages[w] = c->pages[w] | next->pages[w];
+        n_pages += __builtin_popcountll(pages[w]);
+    }
+    uint8_t *data = malloc((size_t)n_pages * REV_PAGE_SIZE);
+    uint8_t *p = data;
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (rev_has_page(next, page)) {
+            memcpy(p, rev_page_data(next, page), REV_PAGE_SIZE);
+        } else if (rev_has_page(c, page)) {
+            memcpy(p, rev_page_data(c, page), REV_PAGE_SIZE);
+        } else {
+            continue;
+        }
+        p += REV_PAGE_SIZE;
+    }
+    rev_free(rev, c);
+    rev->mem_bytes -= (size_t)next->n_pages * REV_PAGE_SIZE;
+    free(next->data);
+    memcpy(next->pages, pages, sizeof(pages));
+    next->n_pages = n_pages;
+    next->data = data;
+    rev->mem_bytes += (size_t)n_pages * REV_PAGE_SIZE;
+    memmove(c, next, (rev->n - i - 1) * sizeof(rev_ckpt_t));
+    rev->n--;
+    if (rev->base > i) rev->base--;
+    rev->thinned++;
+}
+
+// Drop the checkpoint whose loss widens the gap around it the least
+// relative to how far back it is. Never the first, which holds all of
+// memory, nor the newest.
+static void rev_thin(rev_state_t *rev) {
+    const rev_ckpt_t *head = &rev->ckpts[rev->n - 1];
+    int best = -1;
+    double best_cost = 0;
+    for (int i = 1; i < rev->n - 1; i++) {
+        double gap = rev->ckpts[i + 1].insns - rev->ckpts[i - 1].insns;
+        double cost = gap / (head->insns - rev->ckpts[i].insns);
+        if (best < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    if (best >= 0) rev_drop(rev, best);
+}
+
+static void rev_checkpoint(vm_t *vm) {
+    rev_state_t *rev = vm->rev;
+    while (rev->n > 2 &&
+           (rev->n == REV_CKPT_MAX || rev->mem_bytes > REV_MEM_MAX)) {
+        rev_thin(rev);
+    }
+    rev_ckpt_t *c = &rev->ckpts[rev->n];
+    memset(c, 0, sizeof(*c));
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (mem_dirty_take(&vm->mem, rev->view, page << MEM_PAGE_SHIFT) || rev->n == 0) {
+            c->pages[page / 64] |= 1ull << (page & 63);
+            c->n_pages++;
+        }
+    }
+    c->data = malloc((size_t)c->n_pages * REV_PAGE_SIZE);
+    uint8_t *p = c->data;
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (rev_has_page(c, page)) {
+            memcpy(p, vm->mem.data + (page << MEM_PAGE_SHIFT), REV_PAGE_SIZE);
+            p += REV_PAGE_SIZE;
+        }
+    }
+    rev->mem_bytes += (size_t)c->n_pages * REV_PAGE_SIZE;
+    c->insns = vm->insns;
+    c->cycles = vm->cycles;
+    c->idle_cycles = vm->idle_cycles;
+    c->cpu = vm->cpu;
+    c->io = malloc(io_snap_size());
+    io_save(vm, c->io);
+    rev->base = rev->n++;
+}
+
+// Put the machine back as it was at checkpoint k
+static void rev_restore(vm_t *vm, int k) {
+    rev_state_t *rev = vm->rev;
+    // Pages that can differ from k: stored to since the checkpoint the
+    // machine was at, or held by a checkpoint between that one and k
+    uint64_t diff[MEM_PAGES / 64] = {0};
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (mem_dirty_take(&vm->mem, rev->view, page << MEM_PAGE_SHIFT)) {
+            diff[page / 64] |= 1ull << (page & 63);
+        }
+    }
+    int lo = k < rev->base ? k : rev->base;
+    int hi = k < rev->base ? rev->base : k;
+    for (int j = lo + 1; j <= hi; j++) {
+        for (int w = 0; w < MEM_PAGES / 64; w++) {
+            diff[w] |= rev->ckpts[j].pages[w];
+        }
+    }
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (!((diff[page / 64] >> (page & 63)) & 1)) continue;
+        int j = k;
+        while (!rev_has_page(&rev->ckpts[j], page)) j--;
+        uint32_t addr = page << MEM_PAGE_SHIFT;
+        memcpy(vm->mem.data + addr, rev_page_data(&rev->ckpts[j], page),
+               REV_PAGE_SIZE);
+        // Drops decoded code and tells the other views
+        mem_watch_range(&vm->mem, addr, REV_PAGE_SIZE);
+        mem_dirty_take(&vm->mem, rev->view, addr);
+    }
+
+    const rev_ckpt_t *c = &rev->ckpts[k];
+    vm->cpu = c->cpu;
+    vm->insns = c->insns;
+    vm->cycles = c->cycles;
+    vm->idle_cycles = c->idle_cycles;
+    io_restore(vm, c->io);
+    replay_rewind(vm, c->cycles);
+    rev->base = k;
+}
+
+// Forget the checkpoints after the one the machine was put back to
+static void rev_truncate(rev_state_t *rev) {
+    while (rev->n - 1 > rev->base) {
+        rev_free(rev, &rev->ckpts[--rev->n]);
+    }
+}
+
+// Newest checkpoint at or before insns
+static int rev_find(rev_state_t *rev, uint64_t insns) {
+    int k = rev->n - 1;
+    while (k > 0 && rev->ckpts[k].insns > insns) k--;
+    return k;
+}
+
+// Run forward to insns again without tracing or stopping at breakpoints
+static void rev_replay(vm_t *vm, uint64_t insns) {
+    bool trace = vm->opts.enable_trace;
+    int32_t bkpt = vm->bkpt;
+    vm->opts.enable_trace = false;
+    vm->bkpt = -1;
+    while (vm->insns < insns && !vm->stop) {
+        uint64_t before = vm->insns;
+        uint64_t left = insns - vm->insns;
+        vm_run(vm, left > REV_INTERVAL ? REV_INTERVAL : left);
+        if (vm->insns == before) break;
+    }
+    vm->opts.enable_trace = trace;
+    vm->bkpt = bkpt;
+}
+
+static void rev_goto(vm_t *vm, uint64_t insns) {
+    rev_restore(vm, rev_find(vm->rev, insns));
+    rev_replay(vm, insns);
+}
+
+bool rev_start(vm_t *vm) {
+    if (vm->rev) return true;
+    if (vm->opts.engine == VM_ENGINE_JIT) return false;
+    int view = mem_dirty_open(&vm->mem, MEM_PAGE_SHIFT);
+    if (view < 0) return false;
+    rev_state_t *rev = vm->rev = calloc(1, sizeof(rev_state_t));
+    rev->vm = vm;
+    rev->view = view;
+    replay_journal_start(vm);
+    rev_checkpoint(vm);
+    return true;
+}
+
+void rev_stop(vm_t *vm) {
+    rev_state_t *rev = vm->rev;
+    if (rev == NULL) return;
+    while (rev->n > 0) {
+        rev_free(rev, &rev->ckpts[--rev->n]);
+    }
+    mem_dirty_close(&vm->mem, rev->view);
+    free(rev);
+    vm->rev = NULL;
+    replay_journal_stop(vm);
+}
+
+bool rev_active(vm_t *vm) {
+    return vm->rev != NULL;
+}
+
+void rev_run(vm_t *vm, int max_insns) {
+    rev_state_t *rev = vm->rev;
+    if (rev == NULL) {
+        vm_run(vm, max_insns);
+        return;
+    }
+    uint64_t end = max_insns < 0 ? UINT64_MAX : vm->insns + max_insns;
+    while (vm->insns < end && !vm->stop) {
+        uint64_t next = rev->ckpts[rev->n - 1].insns + REV_INTERVAL;
+        if (vm->insns >= next) {
+            rev_checkpoint(vm);
+            continue;
+        }
+        uint64_t want = (end < next ? end : next) - vm->insns;
+        uint64_t before = vm->insns;
+        vm_run(vm, want);
+        // Stopped at a breakpoint or halted
+        if (vm->insns - before < want) break;
+    }
+    if (vm->insns >= rev->ckpts[rev->n - 1].insns + REV_INTERVAL) {
+        rev_checkpoint(vm);
+    }
+}
+
+bool rev_step(vm_t *vm) {
+    if (vm->insns <= vm->rev->ckpts[0].insns) return false;
+    rev_goto(vm, vm->insns - 1);
+    rev_truncate(vm->rev);
+    return true;
+}
+
+bool rev_continue(vm_t *vm) {
+    rev_state_t *rev = vm->rev;
+    uint64_t now = vm->insns;
+    int32_t addr = vm->bkpt;
+    bool trace = vm->opts.enable_trace;
+    vm->opts.enable_trace = false;
+    uint64_t found = UINT64_MAX;
+    // Each stretch between checkpoints from the newest back, until one
+    // passes the breakpoint
+    for (int k = rev_find(rev, now); k >= 0 && addr >= 0 && found == UINT64_MAX;
+         k--) {
+        uint64_t to = k + 1 < rev->n && rev->ckpts[k + 1].insns < now
+                          ? rev->ckpts[k + 1].insns
+                          : now;
+        rev_restore(vm, k);
+        vm->bkpt_clear = false;
+        while (vm->insns < to && !vm->stop) {
+            vm_run(vm, to - vm->insns);
+            if (vm->insns == to) break;
+            if (SEGMENT(vm->cpu.cs, vm->cpu.ip) != (uint32_t)addr) break;
+            found = vm->insns;
+        }
+    }
+    vm->opts.enable_trace = trace;
+    if (found == UINT64_MAX) {
+        rev_goto(vm, now);
+        return false;
+    }
+    rev_goto(vm, found);
+    vm->bkpt_clear = true;
+    rev_truncate(vm->rev);
+    return true;
+}
+
+bool rev_last_write(vm_t *vm, uint32_t addr) {
+    rev_state_t *rev = vm->rev;
+    uint64_t now = vm->insns;
+    bool trace = vm->opts.enable_trace;
+    vm->opts.enable_trace = false;
+    mem_watch_addr_set(&vm->mem, addr);
+    uint64_t found = UINT64_MAX;
+    for (int k = rev_find(rev, now); k >= 0 && found == UINT64_MAX; k--) {
+        uint64_t to = k + 1 < rev->n && rev->ckpts[k + 1].insns < now
+                          ? rev->ckpts[k + 1].insns
+                          : now;
+        rev_restore(vm, k);
+        vm->mem.watch_addr_hits = 0;
+        rev_replay(vm, to);
+        uint64_t hits = vm->mem.watch_addr_hits;
+        if (hits == 0) continue;
+        // Again, an instruction at a time up to the last of them
+        rev_restore(vm, k);
+        vm->mem.watch_addr_hits = 0;
+        int32_t bkpt = vm->bkpt;
+        vm->bkpt = -1;
+        while (vm->insns < to && !vm->stop) {
+            uint64_t before = vm->insns;
+            vm_run(vm, 1);
+            if (vm->mem.watch_addr_hits >= hits) {
+                found = before;
+                break;
+            }
+        }
+        vm->bkpt = bkpt;
+    }
+    mem_watch_addr_set(&vm->mem, -1);
+    vm->opts.enable_trace = trace;
+    rev_goto(vm, found == UINT64_MAX ? now : found);
+    if (found == UINT64_MAX) return false;
+    rev_truncate(vm->rev);
+    return true;
+}
+
+void rev_dump_stats(vm_t *vm) {
+    rev_state_t *rev = vm->rev;
+    if (rev == NULL) return;
+    printf("checkpoints:     %d (%u thinned out)\n", rev->n, rev->thinned);
+    printf("history from:    %lu insns\n", rev->ckpts[0].insns);
+    printf("history memory:  %zu KB\n", rev->mem_bytes >> 10);
+}
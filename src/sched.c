@@ -0,0 +1,113 @@
+#include "sched.h"
+
+#include <string.h>
+
+void sched_init(sched_state_t *s, void *ctx) {
+    memset(s, 0, sizeof(sched_state_t));
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        s->slot[i] = -1;
+    }
+    s->next = SCHED_NEVER;
+    s->ctx = ctx;
+}
+
+void sched_register(sched_state_t *s, sched_event_t ev, sched_fn_t fn) {
+    s->fn[ev] = fn;
+}
+
+static inline bool sched_before(sched_state_t *s, int a, int b) {
+    return s->when[s->heap[a]] < s->when[s->heap[b]];
+}
+
+static void sched_swap(sched_state_t *s, int a, int b) {
+    uint8_t ev = s->heap[a];
+    s->heap[a] = s->heap[b];
+    s->heap[b] = ev;
+    s->slot[s->heap[a]] = a;
+    s->slot[s->heap[b]] = b;
+}
+
+static void sched_sift_up(sched_state_t *s, int i) {
+    while (i > 0 && sched_before(s, i, (i - 1) / 2)) {
+        sched_swap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sched_sift_down(sched_state_t *s, int i) {
+    for (;;) {
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int m = i;
+        if (l < s->count && sched_before(s, l, m)) m = l;
+        if (r < s->count && sched_before(s, r, m)) m = r;
+        if (m == i) break;
+        sched_swap(s, i, m);
+        i = m;
+    }
+}
+
+static void sched_remove(sched_state_t *s, int i) {
+    int last = --s->count;
+    sched_swap(s, i, last);
+    s->slot[s->heap[last]] = -1;
+    if (i < last) {
+        sched_sift_down(s, i);
+        sched_sift_up(s, i);
+    }
+}
+
+// Publish the earliest deadline. A kick that came in meanwhile wins: it is
+// read after next is stored, and the kicking thread sets it before storing
+// its own 0.
+static void sched_update(sched_state_t *s) {
+    uint64_t next = s->count ? s->when[s->heap[0]] : SCHED_NEVER;
+    __atomic_store_n(&s->next, next, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->kick, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&s->next, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+void sched_at(sched_state_t *s, sched_event_t ev, uint64_t when) {
+    int i = s->slot[ev];
+    if (when == SCHED_NEVER) {
+        if (i >= 0) sched_remove(s, i);
+    } else if (i < 0) {
+        i = s->count++;
+        s->heap[i] = ev;
+        s->slot[ev] = i;
+        s->when[ev] = when;
+        sched_sift_up(s, i);
+    } else {
+        s->when[ev] = when;
+        sched_sift_up(s, i);
+        sched_sift_down(s, s->slot[ev]);
+    }
+    sched_update(s);
+}
+
+void sched_run(sched_state_t *s, uint64_t cycles) {
+    __atomic_store_n(&s->kick, false, __ATOMIC_SEQ_CST);
+    while (s->count && s->when[s->heap[0]] <= cycles) {
+        sched_event_t ev = s->heap[0];
+        sched_remove(s, 0);
+        // May schedule itself again
+        s->fn[ev](s->ctx, cycles);
+    }
+    sched_update(s);
+}
+
+void sched_kick(sched_state_t *s) {
+    __atomic_store_n(&s->kick, true, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->next, 0, __ATOMIC_SEQ_CST);
+}
+
+uint64_t sched_next_except(sched_state_t *s, sched_event_t ev) {
+    uint64_t next = SCHED_NEVER;
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        if (i != (int)ev && s->slot[i] >= 0 && s->when[i] < next) {
+            next = s->when[i];
+        }
+    }
+    return next;
+}
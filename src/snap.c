@@ -0,0 +1,283 @@
+#include "snap.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "jit.h"
+#include "vm_io.h"
+
+// Longest chain of incremental snapshots back to a full one
+#define SNAP_CHAIN_MAX 64
+
+// The snapshot last saved or loaded, parent of the next incremental one,
+// and the dirty view of pages stored to since. Kept in vm->snap.
+struct snap_state {
+    int view;
+    uint64_t id;
+    char path[SNAP_PATH_MAX];
+};
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    const snap_header_t *h;
+} snap_file_t;
+
+static uint64_t snap_hash(uint64_t h, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static inline bool snap_present(const snap_header_t *h, uint32_t page) {
+    return (h->present[page / 64] >> (page & 63)) & 1;
+}
+
+static struct snap_state *snap_get(vm_t *vm) {
+    if (vm->snap == NULL) {
+        vm->snap = calloc(1, sizeof(struct snap_state));
+        vm->snap->view = -1;
+    }
+    return vm->snap;
+}
+
+// Start a new dirty view from the current memory
+static void snap_mark_clean(vm_t *vm) {
+    struct snap_state *last = snap_get(vm);
+    if (last->view < 0) {
+        last->view = mem_dirty_open(&vm->mem, SNAP_PAGE_SHIFT);
+    }
+    if (last->view < 0) return;
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        mem_dirty_take(&vm->mem, last->view, page << SNAP_PAGE_SHIFT);
+    }
+}
+
+void snap_free(vm_t *vm) {
+    struct snap_state *last = vm->snap;
+    if (last == NULL) return;
+    if (last->view >= 0) mem_dirty_close(&vm->mem, last->view);
+    free(last);
+    vm->snap = NULL;
+}
+
+uint64_t snap_machine_id(vm_t *vm) {
+    size_t io_size = io_snap_size();
+    uint8_t *io = calloc(1, io_size);
+    io_save(vm, io);
+    uint64_t id = snap_hash(1469598103934665603ull, &vm->cpu,
+                            sizeof(x86_cpu_t));
+    id = snap_hash(id, io, io_size);
+    id = snap_hash(id, vm->mem.data, MEM_SIZE);
+    free(io);
+    return id;
+}
+
+bool snap_save(vm_t *vm, const char *path, bool incremental) {
+    struct snap_state *last = snap_get(vm);
+    if (incremental && (last->view < 0 || last->id == 0)) {
+        printf("No snapshot saved or loaded yet to be the parent\n");
+        return false;
+    }
+
+    snap_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    h.cpu_size = sizeof(x86_cpu_t);
+    h.io_size = io_snap_size();
+    h.page_shift = SNAP_PAGE_SHIFT;
+    h.cycles = vm->cycles;
+    h.insns = vm->insns;
+    memcpy(h.map, vm->mem.map, sizeof(h.map));
+    h.cpu_ofs = sizeof(h);
+    h.io_ofs = h.cpu_ofs + h.cpu_size;
+    h.pages_ofs = (h.io_ofs + h.io_size + SNAP_PAGE_SIZE - 1) &
+                  ~(SNAP_PAGE_SIZE - 1);
+
+    uint8_t *io = calloc(1, h.io_size);
+    io_save(vm, io);
+
+    // The pages stay dirty until the file is written, so that a failed
+    // save leaves them to the next one
+    uint32_t n_pages = 0;
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        bool dirty = last->view >= 0 &&
+                     mem_dirty_peek(&vm->mem, last->view,
+                                    page << SNAP_PAGE_SHIFT);
+        if (!incremental || dirty) {
+            h.present[page / 64] |= 1ull << (page & 63);
+            n_pages++;
+        }
+    }
+    if (incremental) {
+        h.parent_id = last->id;
+        snprintf(h.parent, sizeof(h.parent), "%s", last->path);
+    }
+    h.id = snap_machine_id(vm);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("Can't open file: %s\n", path);
+        free(io);
+        return false;
+    }
+    static const uint8_t pad[SNAP_PAGE_SIZE];
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(&vm->cpu, h.cpu_size, 1, f) == 1 &&
+              fwrite(io, h.io_size, 1, f) == 1 &&
+              fwrite(pad, h.pages_ofs - h.io_ofs - h.io_size, 1, f) == 1;
+    for (uint32_t page = 0; ok && page < MEM_PAGES; page++) {
+        if (snap_present(&h, page)) {
+            ok = fwrite(vm->mem.data + (page << SNAP_PAGE_SHIFT),
+                        SNAP_PAGE_SIZE, 1, f) == 1;
+        }
+    }
+    ok = fclose(f) == 0 && ok;
+    free(io);
+    if (!ok) {
+        printf("Failed writing snapshot %s\n", path);
+        return false;
+    }
+
+    last->id = h.id;
+    if (realpath(path, last->path) == NULL) {
+        snprintf(last->path, sizeof(last->path), "%s", path);
+    }
+    if (incremental) {
+        for (uint32_t page = 0; page < MEM_PAGES; page++) {
+            if (snap_present(&h, page)) {
+                mem_dirty_take(&vm->mem, last->view, page << SNAP_PAGE_SHIFT);
+            }
+        }
+    } else {
+        snap_mark_clean(vm);
+    }
+    printf("Saved %s: %u pages at %lu cycles\n", path, n_pages, h.cycles);
+    return true;
+}
+
+static void snap_unmap(snap_file_t *f) {
+    munmap(f->base, f->size);
+}
+
+// Map path and check that it fits this build
+static bool snap_map(const char *path, snap_file_t *f) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Can't open file: %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header_t)) {
+        printf("Not a snapshot: %s\n", path);
+        close(fd);
+        return false;
+    }
+    f->size = st.st_size;
+    f->base = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (f->base == MAP_FAILED) {
+        printf("Can't map file: %s\n", path);
+        return false;
+    }
+    f->h = (const snap_header_t *)f->base;
+
+    const snap_header_t *h = f->h;
+    uint32_t n_pages = 0;
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        n_pages += snap_present(h, page);
+    }
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0) {
+        printf("Not a snapshot: %s\n", path);
+    } else if (h->version != SNAP_VERSION || h->cpu_size != sizeof(x86_cpu_t) ||
+               h->io_size != io_snap_size() ||
+               h->page_shift != SNAP_PAGE_SHIFT) {
+        printf("Snapshot %s is from another version (%u)\n", path,
+               h->version);
+    } else if (h->io_ofs + h->io_size > f->size ||
+               h->cpu_ofs + h->cpu_size > f->size ||
+               h->pages_ofs + (size_t)n_pages * SNAP_PAGE_SIZE > f->size) {
+        printf("Snapshot %s is truncated\n", path);
+    } else {
+        return true;
+    }
+    snap_unmap(f);
+    return false;
+}
+
+bool snap_load(vm_t *vm, const char *path) {
+    // Newest first, back to the full snapshot
+    snap_file_t chain[SNAP_CHAIN_MAX];
+    int n = 0;
+    bool ok = snap_map(path, &chain[n]);
+    if (ok) n++;
+    while (ok && chain[n - 1].h->parent_id != 0) {
+        const snap_header_t *child = chain[n - 1].h;
+        char parent[SNAP_PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", child->parent);
+        if (n == SNAP_CHAIN_MAX) {
+            printf("Snapshot chain is longer than %d\n", SNAP_CHAIN_MAX);
+            ok = false;
+        } else if (!(ok = snap_map(parent, &chain[n]))) {
+            // Already reported
+        } else if (chain[n].h->id != child->parent_id) {
+            printf("Parent snapshot %s has changed since\n", parent);
+            snap_unmap(&chain[n]);
+            ok = false;
+        } else {
+            n++;
+        }
+    }
+    if (!ok) {
+        for (int i = 0; i < n; i++) snap_unmap(&chain[i]);
+        return false;
+    }
+
+    const snap_header_t *top = chain[0].h;
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (vm->mem.map[page] != top->map[page]) {
+            mem_map_set(&vm->mem, page << MEM_PAGE_SHIFT, 1 << MEM_PAGE_SHIFT,
+                        top->map[page]);
+        }
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        const uint8_t *data = chain[i].base + chain[i].h->pages_ofs;
+        for (uint32_t page = 0; page < MEM_PAGES; page++) {
+            if (snap_present(chain[i].h, page)) {
+                memcpy(vm->mem.data + (page << SNAP_PAGE_SHIFT), data,
+                       SNAP_PAGE_SIZE);
+                data += SNAP_PAGE_SIZE;
+            }
+        }
+    }
+    memcpy(&vm->cpu, chain[0].base + top->cpu_ofs, sizeof(x86_cpu_t));
+    vm->cycles = top->cycles;
+    vm->insns = top->insns;
+    io_restore(vm, chain[0].base + top->io_ofs);
+
+    // Memory changed under the caches, the idle probes and other views
+    bcache_flush(vm->bcache);
+    jit_flush(vm);
+    vm->mem.store_count++;
+    mem_dirty_range(&vm->mem, 0, MEM_SIZE);
+
+    struct snap_state *last = snap_get(vm);
+    last->id = top->id;
+    if (realpath(path, last->path) == NULL) {
+        snprintf(last->path, sizeof(last->path), "%s", path);
+    }
+    snap_mark_clean(vm);
+    printf("Loaded %s at %lu cycles\n", path, top->cycles);
+    for (int i = 0; i < n; i++) snap_unmap(&chain[i]);
+    return true;
+}
@@ -0,0 +1,252 @@
+#include "timing.h"
+
+#include <stdbool.h>
+
+// Effective address calculation, by mod 0 and mod 1/2 for each r/m
+static const uint8_t ea_clk[2][8] = {
+    {7, 8, 8, 7, 5, 5, 6, 5},
+    {11, 12, 12, 11, 9, 9, 9, 9},
+};
+
+// MUL, IMUL, DIV, IDIV by operand size, middle of the datasheet ranges
+static const uint8_t muldiv_clk[4][2] = {
+    {74, 126},
+    {89, 141},
+    {85, 153},
+    {107, 175},
+};
+
+static uint16_t string_clocks(uint8_t opc, uint16_t w) {
+    switch (opc & 0xFE) {
+    case 0xA4: return 18 + 2 * w;
+    case 0xA6: return 22 + 2 * w;
+    case 0xAA: return 11 + w;
+    case 0xAC: return 12 + w;
+    default:   return 15 + w;
+    }
+}
+
+uint16_t x86_rep_clocks(uint8_t opc) {
+    uint16_t w = (opc & 1) ? CLK_BUS : 0;
+    switch (opc & 0xFE) {
+    case 0xA4: return 17 + 2 * w;
+    case 0xA6: return 22 + 2 * w;
+    case 0xAA: return 10 + w;
+    case 0xAC: return 13 + w;
+    default:   return 15 + w;
+    }
+}
+
+uint16_t x86_clocks(const x86_insn_t *insn) {
+    const x86_opc_info_t info = insn->info;
+    const mod_reg_rm_t m = insn->mod_reg_rm;
+    bool mem = info.modrm && m.mod != 3;
+    uint16_t ea = 0;
+    if (mem) {
+        ea = (m.mod == 0) ? ea_clk[0][m.rm] : ea_clk[1][m.rm];
+    }
+    // Bus penalty of a word operand
+    uint16_t w = info.s ? CLK_BUS : 0;
+    uint16_t clk;
+
+    switch (info.handler) {
+    case H_ARITH:
+        // CMP only reads its destination
+        if (!mem) {
+            clk = 3;
+        } else if (info.d || info.fnc == 7) {
+            clk = 9 + ea + w;
+        } else {
+            clk = 16 + ea + 2 * w;
+        }
+        break;
+    case H_GRP_IMM:
+        if (!mem) {
+            clk = 4;
+        } else if (m.reg == 7) {
+            clk = 10 + ea + w;
+        } else {
+            clk = 17 + ea + 2 * w;
+        }
+        break;
+    case H_ALU_ACC:
+    case H_TEST_ACC:
+    case H_MOV_R16_IMM:
+    case H_MOV_R8_IMM:
+    case H_SAHF:
+    case H_LAHF:
+    case H_INTO:
+        clk = 4;
+        break;
+    case H_TEST_RM:
+        clk = mem ? 9 + ea + w : 3;
+        break;
+    case H_MOV_RM:
+        clk = mem ? (info.d ? 8 : 9) + ea + w : 2;
+        break;
+    case H_MOV_RM_IMM:
+        clk = mem ? 10 + ea + w : 4;
+        break;
+    case H_MOV_ACC_MEM:
+    case H_MOV_MEM_ACC:
+        clk = 10 + w;
+        break;
+    case H_MOV_SEG_RM:
+        clk = mem ? 8 + ea + CLK_BUS : 2;
+        break;
+    case H_MOV_RM_SEG:
+        clk = mem ? 9 + ea + CLK_BUS : 2;
+        break;
+    case H_LEA:
+        clk = 2 + ea;
+        break;
+    case H_LES_LDS:
+        clk = 16 + ea + 2 * CLK_BUS;
+        break;
+    case H_XCHG_AX:
+        clk = 3;
+        break;
+    case H_XCHG_RM:
+        clk = mem ? 17 + ea + 2 * w : 4;
+        break;
+    case H_INC_R16:
+    case H_DEC_R16:
+    case H_CBW:
+    case H_HLT:
+    case H_CMC:
+    case H_CLC:
+    case H_STC:
+    case H_CLI:
+    case H_STI:
+    case H_CLD:
+    case H_STD:
+        clk = 2;
+        break;
+    case H_CWD:
+        clk = 5;
+        break;
+    case H_GRP4:
+        clk = mem ? 15 + ea : 3;
+        break;
+    case H_PUSH_R16:
+        clk = 11 + CLK_BUS;
+        break;
+    case H_PUSH_SEG:
+    case H_PUSHF:
+        clk = 10 + CLK_BUS;
+        break;
+    case H_POP_R16:
+    case H_POP_SEG:
+    case H_POPF:
+        clk = 8 + CLK_BUS;
+        break;
+    case H_POP_RM:
+        clk = mem ? 17 + ea + 2 * CLK_BUS : 8 + CLK_BUS;
+        break;
+    case H_XLAT:
+        clk = 11;
+        break;
+    case H_CALL_NEAR:
+        clk = 19 + CLK_BUS;
+        break;
+    case H_CALL_FAR:
+        clk = 28 + 2 * CLK_BUS;
+        break;
+    case H_RET:
+        clk = 8 + CLK_BUS;
+        break;
+    case H_RET_IMM:
+        clk = 12 + CLK_BUS;
+        break;
+    case H_RETF:
+        clk = 18 + 2 * CLK_BUS;
+        break;
+    case H_RETF_IMM:
+        clk = 17 + 2 * CLK_BUS;
+        break;
+    case H_IRET:
+        clk = 24 + 3 * CLK_BUS;
+        break;
+    case H_JMP_SHORT:
+    case H_JMP_NEAR:
+    case H_JMP_FAR:
+        clk = 15;
+        break;
+    // Not taken; see x86_taken_clocks
+    case H_JCC:
+        clk = 4;
+        break;
+    case H_JCXZ:
+    case H_LOOPZ:
+        clk = 6;
+        break;
+    case H_LOOP:
+    case H_LOOPNZ:
+        clk = 5;
+        break;
+    // The rest of INT n and INT 3 is CLK_INT_ENTRY
+    case H_INT:
+        clk = 0;
+        break;
+    case H_INT3:
+        clk = 1;
+        break;
+    case H_IN_IMM:
+    case H_OUT_IMM:
+        clk = 10 + w;
+        break;
+    case H_IN_DX:
+    case H_OUT_DX:
+        clk = 8 + w;
+        break;
+    case H_SHIFT:
+        if (info.d) {
+            clk = mem ? 20 + ea + 2 * w : 8;
+        } else {
+            clk = mem ? 15 + ea + 2 * w : 2;
+        }
+        break;
+    case H_STRING:
+        clk = insn->pfx ? 9 : string_clocks(insn->opc, w);
+        break;
+    case H_GRP3:
+        if (m.reg < 2) {
+            clk = mem ? 11 + ea + w : 5;
+        } else if (m.reg < 4) {
+            clk = mem ? 16 + ea + 2 * w : 3;
+        } else {
+            clk = muldiv_clk[m.reg - 4][info.s];
+            if (mem) clk += 6 + ea + w;
+        }
+        break;
+    case H_GRP5:
+        switch (m.reg) {
+        case 0:
+        case 1:
+            clk = mem ? 15 + ea + 2 * CLK_BUS : 2;
+            break;
+        case 2:
+            clk = mem ? 21 + ea + 2 * CLK_BUS : 16 + CLK_BUS;
+            break;
+        case 3:
+            clk = 37 + ea + 4 * CLK_BUS;
+            break;
+        case 4:
+            clk = mem ? 18 + ea + CLK_BUS : 11;
+            break;
+        case 5:
+            clk = 24 + ea + 2 * CLK_BUS;
+            break;
+        default:
+            clk = mem ? 16 + ea + 2 * CLK_BUS : 11 + CLK_BUS;
+            break;
+        }
+        break;
+    default:
+        clk = 0;
+        break;
+    }
+    // Segment override prefix
+    if (insn->seg_override >= 0) clk += 2;
+    return clk;
+}
@@ -61,4 +61,26 @@ char* arg_next(arg_split_t *it) {
     }
 
     return start;
-}
\ No newline at end of file
+}
+
+char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("Can't open file: %s\n", path);
+        return NULL;
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    *len = 0;
+    size_t n;
+    do {
+        if (*len == cap) {
+            cap = cap ? cap * 2 : 4096;
+            buf = realloc(buf, cap);
+        }
+        n = fread(buf + *len, 1, cap - *len, f);
+        *len += n;
+    } while (n > 0);
+    fclose(f);
+    return buf;
+}
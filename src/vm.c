@@ -3,32 +3,33 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "util.h"
 #include "vm.h"
 #include "vm_io.h"
 #include "vm_mem.h"
-#include "main.h"
 
 #include "opc.h"
 
+#include "bcache.h"
+#include "jit.h"
+#include "replay.h"
+#include "rev.h"
+#include "snap.h"
+#include "timing.h"
+
 #include "cfg.h"
 
-typedef struct {
-    union {
-        uint8_t rm_byte;
-        struct {
-            uint8_t rm : 3;
-            uint8_t reg : 3;
-            uint8_t mod : 2;
-        } __attribute__((packed));
-    };
-    uint16_t disp;
-} mod_reg_rm_t;
+// SCHED_END: only there to have the CPU call in at the end of a run
+static void vm_end_event(void *ctx, uint64_t cycles) {
+    (void)ctx;
+    (void)cycles;
+}
 
 vm_t *vm_init() {
     vm_t *vm = (vm_t *)calloc(1, sizeof(vm_t));
-    vm->cpu.cs = 0xFFFF;
+    x86_set_sreg(&vm->cpu, SREG_CS, 0xFFFF);
     vm->cpu.flags.res0 = 1;
     vm->cpu.flags.res1 = 0;
     vm->cpu.flags.res2 = 0;
@@ -38,13 +39,31 @@ vm_t *vm_init() {
     vm->cpu.seg_override = -1;
 
     vm->cycles = 0;
+    vm->insns = 0;
     vm->bkpt = -1;
     vm->bkpt_clear = true;
-
-    io_init();
+    vm->exit_code = -1;
+    vm->opts.engine = VM_ENGINE_BCACHE;
+
+    init_mem_blank(&vm->mem);
+    vm->bcache = bcache_new(&vm->mem);
+    io_init(vm);
+    sched_register(&vm->sched, SCHED_END, vm_end_event);
+    vm->cycles_end = UINT64_MAX;
     return vm;
 }
 
+void vm_free(vm_t *vm) {
+    rev_stop(vm);
+    replay_free(vm);
+    snap_free(vm);
+    jit_free(vm);
+    io_free(vm);
+    bcache_free(vm->bcache);
+    mem_free(&vm->mem);
+    free(vm);
+}
+
 #ifdef CFG_DIFF_TRACE
 #define HIGHLIGHT(a, b)                                                        \
     if (a != b) {                                                              \
@@ -133,148 +152,30 @@ void dump_cpu(x86_cpu_t *cpu, x86_cpu_t *old_cpu) {
     printf("========================================\n");
 }
 
-// TODO: optimize these into writes/reads of offsets of the struct
-// if the fields are ordered the right way then you can vmply extract the bits
-// and use that as an offset
-void write_reg_u16(x86_cpu_t *cpu, uint8_t reg, uint16_t val) {
-    assert(reg < 0b1000);
-    switch (reg) {
-    case 0b000:
-        cpu->a.x = val;
-        break;
-    case 0b001:
-        cpu->c.x = val;
-        break;
-    case 0b010:
-        cpu->d.x = val;
-        break;
-    case 0b011:
-        cpu->b.x = val;
-        break;
-    case 0b100:
-        cpu->sp = val;
-        break;
-    case 0b101:
-        cpu->bp = val;
-        break;
-    case 0b110:
-        cpu->si = val;
-        break;
-    case 0b111:
-        cpu->di = val;
-        break;
-    }
+static inline void write_reg_u16(x86_cpu_t *cpu, uint8_t reg, uint16_t val) {
+    cpu->regs[reg & 7] = val;
 }
 
-void write_reg_u8(x86_cpu_t *cpu, uint8_t reg, uint8_t val) {
-    assert(reg < 0b1000);
-    switch (reg) {
-    case 0b000:
-        cpu->a.b.l = val;
-        break;
-    case 0b001:
-        cpu->c.b.l = val;
-        break;
-    case 0b010:
-        cpu->d.b.l = val;
-        break;
-    case 0b011:
-        cpu->b.b.l = val;
-        break;
-    case 0b100:
-        cpu->a.b.h = val;
-        break;
-    case 0b101:
-        cpu->c.b.h = val;
-        break;
-    case 0b110:
-        cpu->d.b.h = val;
-        break;
-    case 0b111:
-        cpu->b.b.h = val;
-        break;
-    }
+static inline void write_reg_u8(x86_cpu_t *cpu, uint8_t reg, uint8_t val) {
+    cpu->regs8[REG8_IDX(reg)] = val;
 }
 
-uint16_t read_reg_u16(x86_cpu_t *cpu, uint8_t reg) {
-    assert(reg < 0b1000);
-    switch (reg) {
-    case 0b000:
-        return cpu->a.x;
-    case 0b001:
-        return cpu->c.x;
-    case 0b010:
-        return cpu->d.x;
-    case 0b011:
-        return cpu->b.x;
-    case 0b100:
-        return cpu->sp;
-    case 0b101:
-        return cpu->bp;
-    case 0b110:
-        return cpu->si;
-    case 0b111:
-        return cpu->di;
-    default:
-        return 0;
-    }
+static inline uint16_t read_reg_u16(x86_cpu_t *cpu, uint8_t reg) {
+    return cpu->regs[reg & 7];
 }
 
-uint8_t read_reg_u8(x86_cpu_t *cpu, uint8_t reg) {
-    assert(reg < 0b1000);
-    switch (reg) {
-    case 0b000:
-        return cpu->a.b.l;
-    case 0b001:
-        return cpu->c.b.l;
-    case 0b010:
-        return cpu->d.b.l;
-    case 0b011:
-        return cpu->b.b.l;
-    case 0b100:
-        return cpu->a.b.h;
-    case 0b101:
-        return cpu->c.b.h;
-    case 0b110:
-        return cpu->d.b.h;
-    case 0b111:
-        return cpu->b.b.h;
-    default:
-        return 0;
-    }
+static inline uint8_t read_reg_u8(x86_cpu_t *cpu, uint8_t reg) {
+    return cpu->regs8[REG8_IDX(reg)];
 }
 
-uint16_t read_seg(x86_cpu_t *cpu, uint8_t sr) {
-    switch (sr) {
-    case 0b00:
-        return cpu->es;
-    case 0b01:
-        return cpu->cs;
-    case 0b10:
-        return cpu->ss;
-    case 0b11:
-        return cpu->ds;
-    default: {
-        return 0;
-    }
-    }
+// Segment register fields are 3 bits wide on some opcodes, the 8086 ignores
+// the top one
+static inline uint16_t read_seg(x86_cpu_t *cpu, uint8_t sr) {
+    return cpu->sregs[sr & 3];
 }
 
-void write_seg(x86_cpu_t *cpu, uint8_t sr, uint16_t val) {
-    switch (sr) {
-    case 0b00:
-        cpu->es = val;
-        break;
-    case 0b01:
-        cpu->cs = val;
-        break;
-    case 0b10:
-        cpu->ss = val;
-        break;
-    case 0b11:
-        cpu->ds = val;
-        break;
-    }
+static inline void write_seg(x86_cpu_t *cpu, uint8_t sr, uint16_t val) {
+    x86_set_sreg(cpu, sr & 3, val);
 }
 
 uint32_t get_16b_mem_base(x86_cpu_t *cpu, mod_reg_rm_t mod_reg_rm) {
@@ -304,41 +205,27 @@ uint32_t get_16b_mem_base(x86_cpu_t *cpu, mod_reg_rm_t mod_reg_rm) {
     }
 }
 
-static inline uint16_t x86_get_data_segment(x86_cpu_t *cpu) {
-    // Segment override is an offset
-    // -1 on the default (DS), 0 - 3 otherwise
-    // -1 wraps back around to 3 if we take mod 4 (& 0b11)
-    uint16_t segment = *(&cpu->es + ((4 + cpu->seg_override) & 0b11));
-    return segment;
+static inline uint32_t x86_data_base(x86_cpu_t *cpu) {
+    // Segment override is a segment register number, 0 - 3, or
+    // -1 for the default (DS) and -2 for a BP base (SS), which wrap
+    // around to 3 and 2 if we take mod 4 (& 0b11)
+    return cpu->sbase[cpu->seg_override & 0b11];
 }
 
-static inline mod_reg_rm_t read_mod_reg_rm(x86_cpu_t *cpu) {
-    mod_reg_rm_t mod_reg_rm;
-    mod_reg_rm.rm_byte = LOAD_IP_BYTE(cpu);
-    //printf("mod %d (%d)\n", mod_reg_rm.mod, mod_reg_rm.rm_byte);
-    if (mod_reg_rm.mod == 0b01) {
-        mod_reg_rm.disp = SEXT_8_16(LOAD_IP_BYTE(cpu));
-    } else if (mod_reg_rm.mod == 0b10) {
-        mod_reg_rm.disp = LOAD_IP_WORD(cpu);
-    } else if (mod_reg_rm.mod == 0b00 && mod_reg_rm.rm == 0b110) {
-        mod_reg_rm.disp = LOAD_IP_WORD(cpu);
-    } else {
-        mod_reg_rm.disp = 0;
-    }
-    return mod_reg_rm;
-}
+// Effective addresses are the segment register number << 16 | offset
+#define EA_BASE(cpu, ea) ((cpu)->sbase[(ea) >> 16])
+#define EA_OFS(ea)       ((uint16_t)(ea))
 
 static inline uint32_t mod_rm_effective_addr(x86_cpu_t *cpu,
                                              mod_reg_rm_t mod_reg_rm) {
     uint32_t base = mod_reg_rm.disp + get_16b_mem_base(cpu, mod_reg_rm);
     assert(-2 <= cpu->seg_override && cpu->seg_override <= 3);
-    uint32_t addr = (((uint32_t)x86_get_data_segment(cpu)) << 16) + (base & 0xFFFF);
-    //printf("effective seg %04x ofs %04x\n", addr >> 16, addr & 0xFFFF);
-    return addr;
+    return ((uint32_t)(cpu->seg_override & 0b11) << 16) + (base & 0xFFFF);
 }
 
-uint32_t read_mod_rm(x86_cpu_t *cpu, mod_reg_rm_t mod_reg_rm,
-                     uint8_t is_16) {
+uint32_t read_mod_rm(vm_t *vm, mod_reg_rm_t mod_reg_rm, uint8_t is_16) {
+    x86_cpu_t *cpu = &vm->cpu;
+    vm_mem_t *m = &vm->mem;
     uint32_t reg = is_16 ? read_reg_u16(cpu, mod_reg_rm.rm)
                          : read_reg_u8(cpu, mod_reg_rm.rm);
     if (mod_reg_rm.mod == 0b11) {
@@ -346,12 +233,15 @@ uint32_t read_mod_rm(x86_cpu_t *cpu, mod_reg_rm_t mod_reg_rm,
         return reg;
     } else {
         uint32_t addr = mod_rm_effective_addr(cpu, mod_reg_rm);
-        return is_16 ? load_u16(addr >> 16, addr & 0xFFFF) : load_u8(addr >> 16, addr & 0xFFFF);
+        return is_16 ? load_u16_base(m, EA_BASE(cpu, addr), EA_OFS(addr))
+                     : load_u8_base(m, EA_BASE(cpu, addr), EA_OFS(addr));
     }
 }
 
-void write_mod_rm(x86_cpu_t *cpu, mod_reg_rm_t mod_reg_rm, uint32_t val,
+void write_mod_rm(vm_t *vm, mod_reg_rm_t mod_reg_rm, uint32_t val,
                   uint8_t is_16) {
+    x86_cpu_t *cpu = &vm->cpu;
+    vm_mem_t *m = &vm->mem;
     if (mod_reg_rm.mod == 0b11) {
         // register only
         if (is_16) {
@@ -362,9 +252,9 @@ void write_mod_rm(x86_cpu_t *cpu, mod_reg_rm_t mod_reg_rm, uint32_t val,
     } else {
         uint32_t addr = mod_rm_effective_addr(cpu, mod_reg_rm);
         if (is_16) {
-            store_u16(addr >> 16, addr & 0xFFFF, val);
+            store_u16_base(m, EA_BASE(cpu, addr), EA_OFS(addr), val);
         } else {
-            store_u8(addr >> 16, addr & 0xFFFF, val);
+            store_u8_base(m, EA_BASE(cpu, addr), EA_OFS(addr), val);
         }        
     }
 }
@@ -376,78 +266,179 @@ static inline uint8_t parity_byte(uint8_t op) {
     return (~op) & 1;
 }
 
+// Flags each lazy kind computes
+static const uint16_t lazy_flags_mask[] = {
+    [LAZY_NONE] = 0,
+    [LAZY_ADD] = 0x8D5,
+    [LAZY_SUB] = 0x8D5,
+    [LAZY_INC] = 0x8D4,
+    [LAZY_DEC] = 0x8D4,
+    [LAZY_SZP] = 0x0C4,
+};
+
+static inline void x86_lazy_set(x86_cpu_t *cpu, uint8_t opc, uint32_t op1,
+                                uint32_t op2, uint32_t res, uint8_t is_16) {
+    cpu->last_op.op1 = op1;
+    cpu->last_op.op2 = op2;
+    cpu->last_op.res = res;
+    cpu->last_op.opc = opc;
+    cpu->last_op.is_16 = is_16;
+}
+
+void x86_flags_materialize(x86_cpu_t *cpu) {
+    const last_op_t *lo = &cpu->last_op;
+    uint32_t op_size = lo->is_16 ? 16 : 8;
+    uint32_t mask = (1 << op_size) - 1;
+    uint32_t res = lo->res;
+    x86_flags_t fl = {.num = 0};
+
+    fl.s_f = res >> (op_size - 1);
+    fl.z_f = (res & mask) == 0;
+    fl.p_f = parity_byte(res);
+    switch (lo->opc) {
+    case LAZY_ADD:
+    case LAZY_INC:
+        fl.c_f = res >> op_size;
+        fl.a_f = (lo->op1 ^ lo->op2 ^ res) >> 4;
+        fl.o_f = (~(lo->op1 ^ lo->op2) & (lo->op1 ^ res)) >> (op_size - 1);
+        break;
+    case LAZY_SUB:
+    case LAZY_DEC:
+        fl.c_f = res >> op_size;
+        fl.a_f = (lo->op1 ^ lo->op2 ^ res) >> 4;
+        fl.o_f = ((lo->op1 ^ lo->op2) & (lo->op1 ^ res)) >> (op_size - 1);
+        break;
+    }
+    uint16_t lazy_mask = lazy_flags_mask[lo->opc];
+    cpu->flags.num = (cpu->flags.num & ~lazy_mask) | (fl.num & lazy_mask);
+    cpu->last_op.opc = LAZY_NONE;
+}
+
+// Single flags for readers that need one, without a full x86_flags_sync
+static inline uint8_t x86_cf(x86_cpu_t *cpu) {
+    const last_op_t *lo = &cpu->last_op;
+    if (lo->opc == LAZY_ADD || lo->opc == LAZY_SUB) {
+        return (lo->res >> (lo->is_16 ? 16 : 8)) & 1;
+    }
+    return cpu->flags.c_f;
+}
+
+static inline uint8_t x86_zf(x86_cpu_t *cpu) {
+    const last_op_t *lo = &cpu->last_op;
+    if (lo->opc == LAZY_NONE) return cpu->flags.z_f;
+    return (lo->res & (lo->is_16 ? 0xFFFF : 0xFF)) == 0;
+}
+
+static inline uint8_t x86_sf(x86_cpu_t *cpu) {
+    const last_op_t *lo = &cpu->last_op;
+    if (lo->opc == LAZY_NONE) return cpu->flags.s_f;
+    return (lo->res >> (lo->is_16 ? 15 : 7)) & 1;
+}
+
+static inline uint8_t x86_pf(x86_cpu_t *cpu) {
+    const last_op_t *lo = &cpu->last_op;
+    if (lo->opc == LAZY_NONE) return cpu->flags.p_f;
+    return parity_byte(lo->res);
+}
+
+static inline uint8_t x86_of(x86_cpu_t *cpu) {
+    const last_op_t *lo = &cpu->last_op;
+    uint32_t sign = lo->is_16 ? 15 : 7;
+    switch (lo->opc) {
+    case LAZY_ADD:
+    case LAZY_INC:
+        return ((~(lo->op1 ^ lo->op2) & (lo->op1 ^ lo->res)) >> sign) & 1;
+    case LAZY_SUB:
+    case LAZY_DEC:
+        return (((lo->op1 ^ lo->op2) & (lo->op1 ^ lo->res)) >> sign) & 1;
+    default:
+        return cpu->flags.o_f;
+    }
+}
+
+// Jcc condition code (before the inversion in bit 0), read off last_op
+static inline uint32_t x86_cond(x86_cpu_t *cpu, uint8_t cc) {
+    switch (cc) {
+    // JO
+    case 0x0: return x86_of(cpu);
+    // JB
+    case 0x1: return x86_cf(cpu);
+    // JE
+    case 0x2: return x86_zf(cpu);
+    // JBE
+    case 0x3: return x86_cf(cpu) | x86_zf(cpu);
+    // JS
+    case 0x4: return x86_sf(cpu);
+    // JP
+    case 0x5: return x86_pf(cpu);
+    // JL
+    case 0x6: return x86_sf(cpu) ^ x86_of(cpu);
+    // JLE
+    default: return x86_zf(cpu) | (x86_sf(cpu) ^ x86_of(cpu));
+    }
+}
+
 uint32_t x86_add(x86_cpu_t *cpu, uint32_t op1, uint32_t op2, uint32_t carry,
                  uint8_t is_16) {
-    //printf("%08x, %08x, %08x", op1, op2, carry);
-    uint32_t op_size = is_16 ? 16 : 8;
-    uint32_t top_bit = 1 << (op_size - 1);
-    uint32_t mask = (1 << (op_size)) - 1;
-    uint32_t res = (op1 & mask) + (op2 & mask) + carry;
-    cpu->flags.c_f = (res >> op_size);
-    cpu->flags.s_f = (res >> (op_size - 1));
-    cpu->flags.o_f = ((~(op1 ^ op2) & (op1 ^ res)) & top_bit) ? 1 : 0;
-    cpu->flags.a_f = ((op1 & 0xF) + (op2 & 0xF) + carry) & 0x10 ? 1 : 0;
-    res = res & mask;
-    cpu->flags.p_f = parity_byte(res);
-    cpu->flags.z_f = res == 0;
-    return res;
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    op1 &= mask;
+    op2 &= mask;
+    uint32_t res = op1 + op2 + carry;
+    x86_lazy_set(cpu, LAZY_ADD, op1, op2, res, is_16);
+    return res & mask;
 }
 
 uint32_t x86_sub(x86_cpu_t *cpu, uint32_t op1, uint32_t op2, uint32_t carry,
                  uint8_t is_16) {
-    uint32_t op_size = is_16 ? 16 : 8;
-    uint32_t mask = (1 << (op_size)) - 1;
-    cpu->flags.c_f = (op1 & mask) < ((op2 & mask) + carry);
-    cpu->flags.a_f = (op1 & 0xF) < ((op2 & 0xF) + carry);
-    uint32_t op2_start = op2;
-    op2 = ((op2 ^ mask) + 1) & mask;
-    uint32_t res = op1 + op2 - carry;
-    uint32_t top_bit = 1 << (op_size - 1);
-    cpu->flags.s_f = (res >> (op_size - 1));
-    cpu->flags.o_f =  (((op1 ^ op2_start) & ~(op2_start ^ res)) & top_bit) ? 1 : 0;
-    res = res & mask;
-    cpu->flags.p_f = parity_byte(res);
-    cpu->flags.z_f = res == 0;
-    return res;
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    op1 &= mask;
+    op2 &= mask;
+    uint32_t res = op1 - op2 - carry;
+    x86_lazy_set(cpu, LAZY_SUB, op1, op2, res, is_16);
+    return res & mask;
 }
 
-uint32_t x86_or(x86_cpu_t *cpu, uint32_t op1, uint32_t op2, uint8_t is_16) {
-    uint32_t op_size = (is_16 ? 16 : 8);
-    uint32_t mask = ((1 << op_size) - 1);
-    uint32_t res = (op1 | op2) & mask;
+// INC/DEC leave CF alone
+static inline uint32_t x86_inc(x86_cpu_t *cpu, uint32_t op1, uint8_t is_16) {
+    cpu->flags.c_f = x86_cf(cpu);
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    op1 &= mask;
+    uint32_t res = op1 + 1;
+    x86_lazy_set(cpu, LAZY_INC, op1, 1, res, is_16);
+    return res & mask;
+}
+
+static inline uint32_t x86_dec(x86_cpu_t *cpu, uint32_t op1, uint8_t is_16) {
+    cpu->flags.c_f = x86_cf(cpu);
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    op1 &= mask;
+    uint32_t res = op1 - 1;
+    x86_lazy_set(cpu, LAZY_DEC, op1, 1, res, is_16);
+    return res & mask;
+}
+
+static inline uint32_t x86_logic_flags(x86_cpu_t *cpu, uint32_t res,
+                                       uint8_t is_16) {
     cpu->flags.c_f = 0;
     cpu->flags.o_f = 0;
     cpu->flags.a_f = 0;
-    cpu->flags.p_f = parity_byte(res);
-    cpu->flags.s_f = (res >> (op_size - 1));
-    cpu->flags.z_f = res == 0;
+    x86_lazy_set(cpu, LAZY_SZP, 0, 0, res, is_16);
     return res;
 }
 
+uint32_t x86_or(x86_cpu_t *cpu, uint32_t op1, uint32_t op2, uint8_t is_16) {
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    return x86_logic_flags(cpu, (op1 | op2) & mask, is_16);
+}
+
 uint32_t x86_and(x86_cpu_t *cpu, uint32_t op1, uint32_t op2, uint8_t is_16) {
-    uint32_t op_size = (is_16 ? 16 : 8);
-    uint32_t mask = ((1 << op_size) - 1);
-    uint32_t res = (op1 & op2) & mask;
-    cpu->flags.c_f = 0;
-    cpu->flags.o_f = 0;
-    cpu->flags.a_f = 0;
-    cpu->flags.p_f = parity_byte(res);
-    cpu->flags.s_f = (res >> (op_size - 1));
-    cpu->flags.z_f = res == 0;
-    return res;
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    return x86_logic_flags(cpu, (op1 & op2) & mask, is_16);
 }
 
 uint32_t x86_xor(x86_cpu_t *cpu, uint32_t op1, uint32_t op2, uint8_t is_16) {
-    uint32_t op_size = (is_16 ? 16 : 8);
-    uint32_t mask = ((1 << op_size) - 1);
-    uint32_t res = (op1 ^ op2) & mask;
-    cpu->flags.c_f = 0;
-    cpu->flags.o_f = 0;
-    cpu->flags.a_f = 0;
-    cpu->flags.p_f = parity_byte(res);
-    cpu->flags.s_f = (res >> (op_size - 1));
-    cpu->flags.z_f = res == 0;
-    return res;
+    uint32_t mask = is_16 ? 0xFFFF : 0xFF;
+    return x86_logic_flags(cpu, (op1 ^ op2) & mask, is_16);
 }
 
 // https://c9x.me/x86/html/file_module_x86_id_273.html
@@ -456,6 +447,7 @@ uint32_t x86_rotate(x86_cpu_t *cpu, uint8_t op, uint32_t x, uint32_t shamt,
     uint8_t op_size = is_16 ? 16 : 8;
     uint8_t rc_temp_shamt = shamt % (is_16 ? 17 : 9);
     uint8_t ro_temp_shamt = shamt % (is_16 ? 16 : 8);
+    x86_flags_sync(cpu);
     switch (op) {
     case 0b010: {
         while (rc_temp_shamt != 0) {
@@ -521,6 +513,7 @@ uint32_t x86_shift(x86_cpu_t *cpu, uint8_t op, uint32_t x, uint32_t shamt,
     if (shamt > 0xF) {
         printf("warning: shamt overflow detected, not handled properly\n");
     }
+    x86_flags_sync(cpu);
     switch (op) {
     // SHL
     case 0b100: {
@@ -555,9 +548,7 @@ uint32_t x86_shift(x86_cpu_t *cpu, uint8_t op, uint32_t x, uint32_t shamt,
     }
     }
     if (shamt) {
-        cpu->flags.p_f = parity_byte(x);
-        cpu->flags.s_f = (x >> (op_size - 1));
-        cpu->flags.z_f = ((x & op_mask) == 0);
+        x86_lazy_set(cpu, LAZY_SZP, 0, 0, x & op_mask, is_16);
     }
     return x;
 }
@@ -570,9 +561,9 @@ uint32_t x86_arith(x86_cpu_t *cpu, uint8_t fnc, uint32_t op1, uint32_t op2,
     case 0x1:
         return x86_or(cpu, op1, op2, s);
     case 0x2:
-        return x86_add(cpu, op1, op2, cpu->flags.c_f, s);
+        return x86_add(cpu, op1, op2, x86_cf(cpu), s);
     case 0x3:
-        return x86_sub(cpu, op1, op2, cpu->flags.c_f, s);
+        return x86_sub(cpu, op1, op2, x86_cf(cpu), s);
     case 0x4:
         return x86_and(cpu, op1, op2, s);
     case 0x5:
@@ -589,77 +580,79 @@ uint32_t x86_arith(x86_cpu_t *cpu, uint8_t fnc, uint32_t op1, uint32_t op2,
     }
 }
 
-static inline void x86_string_insn(x86_cpu_t *cpu, uint8_t opc) {
+static inline void x86_string_insn(vm_t *vm, uint8_t opc) {
+    x86_cpu_t *cpu = &vm->cpu;
+    vm_mem_t *m = &vm->mem;
     uint8_t sz = opc & 0x1;
-    int src_seg = x86_get_data_segment(cpu);
+    uint32_t src_base = x86_data_base(cpu);
     int src_ofs = cpu->si;
-    int dest_seg = cpu->es;
+    uint32_t dst_base = cpu->sbase[SREG_ES];
     int dest_ofs = cpu->di;
     int si_ofs = 0;
     int di_ofs = 0;
     switch (opc) {
     // MOVS (8-bit)
     case 0xA4: {
-        store_u8(dest_seg, dest_ofs, load_u8(src_seg, src_ofs));
+        store_u8_base(m, dst_base, dest_ofs, load_u8_base(m, src_base, src_ofs));
         si_ofs = 1;
         di_ofs = 1;
         break;
     }
     // MOVS (16-bit)
     case 0xA5: {
-        store_u16(dest_seg, dest_ofs, load_u16(src_seg, src_ofs));
+        store_u16_base(m, dst_base, dest_ofs, load_u16_base(m, src_base, src_ofs));
         si_ofs = 2;
         di_ofs = 2;
         break;
     }
     // CMPS (8-bit)
     case 0xA6: {
-        x86_sub(cpu, load_u8(src_seg, src_ofs), load_u8(dest_seg, dest_ofs), 0, sz);
+        x86_sub(cpu, load_u8_base(m, src_base, src_ofs), load_u8_base(m, dst_base, dest_ofs), 0, sz);
         si_ofs = 1;
         di_ofs = 1;
         break;
     }
     // CMPS (16-bit)
     case 0xA7: {
-        x86_sub(cpu, load_u16(src_seg, src_ofs), load_u16(dest_seg, dest_ofs), 0, sz);
+        x86_sub(cpu, load_u16_base(m, src_base, src_ofs), load_u16_base(m, dst_base, dest_ofs), 0, sz);
         si_ofs = 2;
         di_ofs = 2;
         break;
     }
     // STOS (8-bit)
     case 0xAA: {
-        store_u8(dest_seg, dest_ofs, cpu->a.b.l);
+        store_u8_base(m, dst_base, dest_ofs, cpu->a.b.l);
         di_ofs = 1;
         break;
     }
     // STOS (16-bit)
     case 0xAB: {
-        store_u16(dest_seg, dest_ofs, cpu->a.x);
+        store_u16_base(m, dst_base, dest_ofs, cpu->a.x);
         di_ofs = 2;
         break;
     }
     // LODS (8-bit)
     case 0xAC: {
-        cpu->a.b.l = load_u8(src_seg, src_ofs);
+        cpu->a.b.l = load_u8_base(m, src_base, src_ofs);
         si_ofs = 1;
         break;
     }
     // LODS (16-bit)
     case 0xAD: {
-        cpu->a.x = load_u16(src_seg, src_ofs);
+        cpu->a.x = load_u16_base(m, src_base, src_ofs);
         si_ofs = 2;
         break;
     }
     // SCAS (8-bit)
     case 0xAE: {
-        x86_sub(cpu, cpu->a.b.l, load_u8(dest_seg, dest_ofs), 0, sz);
+        x86_sub(cpu, cpu->a.b.l, load_u8_base(m, dst_base, dest_ofs), 0, sz);
         si_ofs = 1;
         di_ofs = 1;
         break;
     }
     // SCAS (16-bit)
     case 0xAF: {
-        x86_sub(cpu, cpu->a.x, load_u16(dest_seg, dest_ofs), 0, sz);
+        x86_sub(cpu, cpu->a.x, load_u16_base(m, dst_base, dest_ofs), 0, sz);
         si_ofs = 2;
         di_ofs = 2;
         break;
@@ -674,32 +667,194 @@ static inline void x86_string_insn(x86_cpu_t *cpu, uint8_t opc) {
     }
 }
 
-static inline void x86_group1(x86_cpu_t *cpu, uint8_t is_16) {
-    mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-    uint32_t op1 = read_mod_rm(cpu, mod_reg_rm, is_16);
+// Elements of size w from seg:ofs onwards that touch neither the end of the
+// segment nor the end of the address space, so they sit in one flat range
+static inline uint32_t rep_run_len(uint32_t base, uint16_t ofs, uint32_t w,
+                                   bool down) {
+    uint32_t lin = (base + ofs) & 0xFFFFF;
+    if (!down) {
+        uint32_t room = 0x10000 - ofs;
+        if (0x100000 - lin < room) room = 0x100000 - lin;
+        return room / w;
+    }
+    if (ofs + w > 0x10000 || lin + w > 0x100000) return 0;
+    return (ofs < lin ? ofs : lin) / w + 1;
+}
+
+static inline uint32_t rep_elem(const uint8_t *mem, uint32_t addr,
+                                uint32_t w) {
+    return w == 2 ? mem[addr] | (mem[addr + 1] << 8) : mem[addr];
+}
+
+// Up to k elements of a REP string instruction on flat ranges starting at
+// linear src and dst. Returns how many ran; *stop is set when a compare
+// ended the repeat.
+static uint32_t x86_rep_run(vm_t *vm, uint8_t opc, uint8_t pfx, uint32_t k,
+                            uint32_t src, uint32_t dst, bool *stop) {
+    x86_cpu_t *cpu = &vm->cpu;
+    uint8_t *mem = vm->mem.data;
+    uint32_t w = (opc & 1) + 1;
+    bool down = cpu->flags.d_f;
+    int32_t step = down ? -(int32_t)w : (int32_t)w;
+    uint32_t len = k * w;
+    uint32_t src_lo = down ? src - (k - 1) * w : src;
+    uint32_t dst_lo = down ? dst - (k - 1) * w : dst;
+    // Value the repeat stops on for CMPS/SCAS: REPE stops on a mismatch
+    bool stop_eq = !(pfx & 1);
+    uint32_t i;
+
+    switch (opc) {
+    case 0xA4:
+    case 0xA5:
+        mem_watch_range(&vm->mem, dst_lo, len);
+        if (src_lo + len <= dst_lo || dst_lo + len <= src_lo) {
+            memcpy(mem + dst_lo, mem + src_lo, len);
+        } else {
+            // Overlapping copies see their own stores, e.g. a fill from
+            // MOVSB with DI = SI + 1
+            for (i = 0; i < k; i++) {
+                uint32_t val = rep_elem(mem, src + i * step, w);
+                mem[dst + i * step] = val;
+                if (w == 2) mem[dst + i * step + 1] = val >> 8;
+            }
+        }
+        return k;
+    case 0xAA:
+    case 0xAB:
+        mem_watch_range(&vm->mem, dst_lo, len);
+        if (w == 1 || cpu->a.b.l == cpu->a.b.h) {
+            memset(mem + dst_lo, cpu->a.b.l, len);
+        } else {
+            for (i = 0; i < len; i += 2) {
+                mem[dst_lo + i] = cpu->a.b.l;
+                mem[dst_lo + i + 1] = cpu->a.b.h;
+            }
+        }
+        return k;
+    case 0xAC:
+        cpu->a.b.l = rep_elem(mem, src + (k - 1) * step, w);
+        return k;
+    case 0xAD:
+        cpu->a.x = rep_elem(mem, src + (k - 1) * step, w);
+        return k;
+    case 0xAE:
+    case 0xAF: {
+        uint32_t acc = w == 2 ? cpu->a.x : cpu->a.b.l;
+        if (w == 1 && !down && stop_eq) {
+            const uint8_t *hit = memchr(mem + dst, acc, k);
+            i = hit ? (uint32_t)(hit - (mem + dst)) : k - 1;
+        } else {
+            for (i = 0; i < k - 1; i++) {
+                if ((rep_elem(mem, dst + i * step, w) == acc) == stop_eq) break;
+            }
+        }
+        uint32_t val = rep_elem(mem, dst + i * step, w);
+        x86_sub(cpu, acc, val, 0, w == 2);
+        *stop = (val == acc) == stop_eq;
+        return i + 1;
+    }
+    case 0xA6:
+    case 0xA7: {
+        for (i = 0; i < k - 1; i++) {
+            if ((rep_elem(mem, src + i * step, w) == rep_elem(mem, dst + i * step, w)) ==
+                stop_eq) {
+                break;
+            }
+        }
+        uint32_t a = rep_elem(mem, src + i * step, w);
+        uint32_t b = rep_elem(mem, dst + i * step, w);
+        x86_sub(cpu, a, b, 0, w == 2);
+        *stop = (a == b) == stop_eq;
+        return i + 1;
+    }
+    }
+    return 0;
+}
+
+// REP-prefixed string instruction, for at most max elements. Whole runs go
+// straight to the flat memory array; an element straddling a segment or 1MB
+// wrap goes through x86_string_insn. Returns true if max cut the repeat
+// short.
+static bool x86_rep_string(vm_t *vm, uint8_t opc, uint8_t pfx, uint32_t max) {
+    x86_cpu_t *cpu = &vm->cpu;
+    bool compare_enable = ((opc & 0x06) == 0x6);
+    bool uses_src = opc <= 0xA7 || opc >= 0xAC;
+    bool uses_dst = opc <= 0xAB || opc >= 0xAE;
+    uint32_t src_base = x86_data_base(cpu);
+    uint32_t dst_base = cpu->sbase[SREG_ES];
+    uint32_t w = (opc & 1) + 1;
+    bool down = cpu->flags.d_f;
+    uint16_t counter = cpu->c.x;
+    uint32_t left = counter < max ? counter : max;
+    bool stop = false;
+
+    while (left != 0) {
+        uint32_t k = left;
+        uint32_t run;
+        if (uses_src) {
+            run = rep_run_len(src_base, cpu->si, w, down);
+            if (run < k) k = run;
+        }
+        if (uses_dst) {
+            run = rep_run_len(dst_base, cpu->di, w, down);
+            if (run < k) k = run;
+        }
+        // A run that stores into ROM or unmapped space goes element by
+        // element so those stores are dropped
+        if (k != 0 && opc <= 0xAB) {
+            uint32_t dst = (dst_base + cpu->di) & 0xFFFFF;
+            if (!mem_range_writable(&vm->mem, down ? dst - (k - 1) * w : dst, k * w)) {
+                k = 0;
+            }
+        }
+        if (k == 0) {
+            x86_string_insn(vm, opc);
+            k = 1;
+            stop = compare_enable && ((pfx & 0x1) ^ x86_zf(cpu));
+        } else {
+            k = x86_rep_run(vm, opc, pfx, k, (src_base + cpu->si) & 0xFFFFF,
+                            (dst_base + cpu->di) & 0xFFFFF, &stop);
+            uint16_t delta = k * w;
+            if (down) delta = -delta;
+            if (uses_src) cpu->si += delta;
+            if (uses_dst) cpu->di += delta;
+        }
+        counter -= k;
+        left -= k;
+        if (stop) break;
+    }
+    cpu->c.x = counter;
+    return !stop && counter != 0;
+}
+
+static inline void x86_group1(vm_t *vm, const x86_insn_t *insn) {
+    x86_cpu_t *cpu = &vm->cpu;
+    mod_reg_rm_t mod_reg_rm = insn->mod_reg_rm;
+    uint8_t is_16 = insn->info.s;
+    uint32_t op1 = read_mod_rm(vm, mod_reg_rm, is_16);
 
     switch (mod_reg_rm.reg) {
     // TEST
     case 0b001:
     case 0b000: {
-        uint32_t imm = is_16 ? LOAD_IP_WORD(cpu) : LOAD_IP_BYTE(cpu);
-        x86_and(cpu, op1, imm, is_16);
+        x86_and(cpu, op1, insn->imm, is_16);
         break;
     }
     // NOT
     case 0b010: {
-        write_mod_rm(cpu, mod_reg_rm, ~op1, is_16);
+        write_mod_rm(vm, mod_reg_rm, ~op1, is_16);
         break;
     }
     // NEG
     case 0b011: {
         // TODO is the carry flag logic different here or does this work
         op1 = x86_sub(cpu, 0, op1, 0, is_16);
-        write_mod_rm(cpu, mod_reg_rm, op1, is_16);
+        write_mod_rm(vm, mod_reg_rm, op1, is_16);
         break;
     }
     // MUL
     case 0b100: {
+        x86_flags_sync(cpu);
         if (is_16) {
             uint32_t prod = cpu->a.x * op1;
             cpu->a.x = prod;
@@ -717,6 +872,7 @@ static inline void x86_group1(x86_cpu_t *cpu, uint8_t is_16) {
     }
     // IMUL
     case 0b101: {
+        x86_flags_sync(cpu);
         if (is_16) {
             int32_t ax_s = SEXT_16_32(cpu->a.x);
             int32_t prod = ax_s * SEXT_16_32(op1);
@@ -795,6 +951,7 @@ DIVEXC:
         // even though these flags are UB, the testcases store them to RAM
         // because of the exception so we can't mask them
         // 8086 seems to clear the undefined flags
+        x86_flags_sync(cpu);
         cpu->flags.num = cpu->flags.num & 0b1111011100101010;
         cpu->flags.p_f = parity_byte(cpu->a.x);
         cpu->flags.z_f = is_16 ? (cpu->a.x == 0) : (cpu->a.b.l == 0);
@@ -806,56 +963,9 @@ DIVEXC:
     
 }
 
-// TODO: make this into a table
-uint8_t insn_mode(uint8_t opc) {
-    if (((opc & 0x4) == 0) && ((opc & 0xF0) <= 0x30 || (opc & 0xFC) == 0x88)) {
-        // arithmetic type instruction
-        return 1;
-    } else if ((opc & 0xC6) == 0x04) {
-        // AX/AL immediate instruction
-        return 2;
-    } else if ((opc & 0xF8) == 0x40) {
-        // Inc
-        return 3;
-    } else if ((opc & 0xF8) == 0x48) {
-        // Dec
-        return 4;
-    } else if ((opc & 0xF8) == 0x50) {
-        // Push
-        return 5;
-    } else if ((opc & 0xF8) == 0x58) {
-        // Pop
-        return 6;
-    } else if ((opc & 0xF8) == 0x90) {
-        // XCHG
-        return 7;
-    } else if ((opc & 0xF8) == 0xB8) {
-        // MOV (16-bit)
-        return 8;
-    } else if ((opc & 0xF8) == 0xB0) {
-        // MOV (8-bit)
-        return 9;
-    } else if ((opc & 0xF0) == 0x70 || opc == 0xE3) {
-        // Branch
-        return 10;
-    } else if ((opc & 0xFC) == 0x80) {
-        // Immediate-type
-        return 11;
-    } else if ((opc & 0xFC) == 0xD0) {
-        // Shift
-        return 12;
-    } else if ((opc & 0xF4) == 0xA4 || ((opc & 0xFE) == 0xAA)) {
-        // String instruction
-        return 13;
-    } else if ((opc & 0xFC) == 0xF0 || (opc & 0xE7) == 0x26) {
-        // Prefix
-        return 14;
-    }
-
-    return 0;
-}
-
-static inline void x86_handle_interrupts(x86_cpu_t *cpu) {
+static inline void x86_handle_interrupts(vm_t *vm) {
+    x86_cpu_t *cpu = &vm->cpu;
+    vm_mem_t *m = &vm->mem;
     int int_src = cpu->int_src;
 
     if (int_src >= 0)
@@ -863,8 +973,9 @@ static inline void x86_handle_interrupts(x86_cpu_t *cpu) {
 
     // NMI is not handled, nothing critical uses NMI in IBM PC
 
-    if (cpu->flags.i_f && io_int_poll()) {
-        int_src = io_int_ack();
+    if (io_int_poll(vm) && cpu->flags.i_f) {
+        int_src = io_int_ack(vm);
+        vm->cycles += CLK_INTR_ACK;
         goto INTERRUPT_FOUND;
     }
 
@@ -877,6 +988,7 @@ static inline void x86_handle_interrupts(x86_cpu_t *cpu) {
     return;
 
 INTERRUPT_FOUND:;
+    x86_flags_sync(cpu);
     if (int_src == 0x9) printf("INTERRUPTED (%d)!!\n",int_src);
     uint8_t temp_tf;
 
@@ -884,713 +996,920 @@ INTERRUPT_FOUND:;
     cpu->int_src = -1;
 
     do {
+        vm->cycles += CLK_INT_ENTRY;
         // PUSH FLAGS
-        push_u16(cpu, cpu->flags.num);
+        push_u16(vm, cpu->flags.num);
         // LET TEMP = TF
         temp_tf = cpu->flags.t_f;
         // CLEAR IF & TF
         cpu->flags.t_f = 0;
         cpu->flags.i_f = 0;
         // PUSH CS & IP
-        push_u16(cpu, cpu->cs);
-        push_u16(cpu, cpu->ip);
+        push_u16(vm, cpu->cs);
+        push_u16(vm, cpu->ip);
         // CALL INTERRUPT SERVICE ROUTINE
         assert(int_src < 256);
-        cpu->ip = load_u16(0, int_src * 4);
-        cpu->cs = load_u16(0, int_src * 4 + 2);
+        cpu->ip = load_u16(m, 0, int_src * 4);
+        x86_set_sreg(cpu, SREG_CS, load_u16(m, 0, int_src * 4 + 2));
     } while (temp_tf); // add NMI check here to enable NMI functionality
 }
 
-void vm_run(vm_t *vm, int max_cycles) {
-    x86_cpu_t *cpu = &vm->cpu;
-    //int prog_end = prog_info.prog_start + prog_info.prog_size;
-    int cyc_start = vm->cycles;
-#ifdef CFG_DIFF_TRACE
-    x86_cpu_t  old_cpu = *cpu;
-#endif
-    int addr;
-    //((addr = SEGMENT(cpu->cs, cpu->ip)) < prog_end)
-    while ((max_cycles < 0 ||
-            ((vm->cycles - cyc_start) < ((uint64_t)max_cycles)))) {
-        if (stop_flag) return;
-        addr = SEGMENT(cpu->cs, cpu->ip);
-        if (addr == vm->bkpt && !vm->bkpt_clear) {
-            printf("Breakpoint hit at %08x\n", addr);
-            vm->bkpt_clear = true;
-            return;
-        }
-        if ((vm->bkpt > 0) && vm->bkpt_clear) {
-            vm->bkpt_clear = false;
-        }
-        uint8_t opc = LOAD_IP_BYTE(cpu);
-        uint8_t mode;
-        uint8_t pfx = 0;
-        cpu->seg_override = -1;
-        vm->cycles++;
-
-        // Get all prefixes
-        while ((mode = insn_mode(opc)) == 14) {
-            if ((opc & 0xFC) == 0xF0) {
-                // ignore LOCK prefix
-                pfx = (opc & 2) ? opc : 0;
-            } else {
-                // Must be a segment override
-                cpu->seg_override = (opc >> 3) & 0b11;
-            }
-            opc = LOAD_IP_BYTE(cpu);
-        }
+// Code bytes from cs:start on, read through p until the offset or the 1MB
+// would wrap
+typedef struct {
+    vm_mem_t *m;
+    const uint8_t *p;
+    uint32_t room;
+    uint16_t cs;
+    uint16_t start;
+} x86_code_t;
+
+static inline uint8_t fetch_u8(const x86_code_t *code, uint16_t *ip) {
+    uint16_t n = (*ip)++ - code->start;
+    return n < code->room ? code->p[n] : load_u8(code->m, code->cs, code->start + n);
+}
+
+static inline uint16_t fetch_u16(const x86_code_t *code, uint16_t *ip) {
+    uint8_t b1 = fetch_u8(code, ip);
+    uint8_t b2 = fetch_u8(code, ip);
+    return (b2 << 8) + b1;
+}
 
-        if (vm->opts.enable_trace) {
-            printf("Op: %02x; Pfx: %02x; SegOvr: %d; Mode: %d\n", opc, pfx, cpu->seg_override, mode);
+void x86_decode(vm_mem_t *m, uint16_t cs, uint16_t *ip, x86_insn_t *insn) {
+    uint16_t start = *ip;
+    uint32_t lin = SEGMENT(cs, start);
+    x86_code_t code = {
+        .m = m,
+        .p = m->data + lin,
+        .room = 0x10000 - start,
+        .cs = cs,
+        .start = start,
+    };
+    if (MEM_SIZE - lin < code.room) code.room = MEM_SIZE - lin;
+    uint8_t opc = fetch_u8(&code, ip);
+    x86_opc_info_t info = x86_opc_table[opc];
+    insn->pfx = 0;
+    insn->seg_override = -1;
+
+    // Get all prefixes
+    while (info.pfx != PFX_NONE) {
+        if (info.pfx == PFX_SEG) {
+            insn->seg_override = info.fnc;
+        } else {
+            // ignore LOCK prefix
+            insn->pfx = (info.pfx == PFX_REP) ? opc : 0;
+        }
+        opc = fetch_u8(&code, ip);
+        info = x86_opc_table[opc];
+    }
+    insn->opc = opc;
+    insn->info = info;
+
+    mod_reg_rm_t *mod_reg_rm = &insn->mod_reg_rm;
+    mod_reg_rm->rm_byte = 0;
+    mod_reg_rm->disp = 0;
+    if (info.modrm) {
+        mod_reg_rm->rm_byte = fetch_u8(&code, ip);
+        if (mod_reg_rm->mod == 0b01) {
+            mod_reg_rm->disp = SEXT_8_16(fetch_u8(&code, ip));
+        } else if (mod_reg_rm->mod == 0b10) {
+            mod_reg_rm->disp = fetch_u16(&code, ip);
+        } else if (mod_reg_rm->mod == 0b00 && mod_reg_rm->rm == 0b110) {
+            mod_reg_rm->disp = fetch_u16(&code, ip);
         }
+    }
+    // The one group encoding with nothing behind it
+    if (info.handler == H_GRP5 && mod_reg_rm->reg == 0b111) {
+        insn->info.handler = H_ILLEGAL;
+    }
 
-        switch (insn_mode(opc)) {
-        case 1: {
-            
-            mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-            uint8_t s = opc & 0x1;
-            uint8_t d = opc & 0x2;
+    uint8_t imm = info.imm;
+    if (imm == IMM_GRP3) {
+        imm = (mod_reg_rm->reg & 0b110) ? IMM_NONE : IMM_S;
+    }
+    if (imm == IMM_S) {
+        imm = info.s ? IMM_16 : IMM_8;
+    }
+    insn->imm = 0;
+    insn->imm2 = 0;
+    switch (imm) {
+    case IMM_8:
+        insn->imm = fetch_u8(&code, ip);
+        break;
+    case IMM_8S:
+        insn->imm = SEXT_8_16(fetch_u8(&code, ip));
+        break;
+    case IMM_16:
+        insn->imm = fetch_u16(&code, ip);
+        break;
+    case IMM_FAR:
+        insn->imm = fetch_u16(&code, ip);
+        insn->imm2 = fetch_u16(&code, ip);
+        break;
+    }
+    insn->len = *ip - start;
+    insn->clk = x86_clocks(insn);
+    insn->fuse = FUSE_NONE;
+}
 
-            uint32_t op1 = s ? read_reg_u16(cpu, mod_reg_rm.reg)
-                             : read_reg_u8(cpu, mod_reg_rm.reg);
-            uint32_t op2 = read_mod_rm(cpu, mod_reg_rm, s);
+static inline void x86_jcc(vm_t *vm, const x86_insn_t *insn) {
+    if (x86_cond(&vm->cpu, insn->info.fnc) ^ insn->info.d) {
+        vm->cpu.ip += insn->imm;
+        vm->cycles += x86_taken_clocks(H_JCC);
+    }
+}
 
-            if (!d) {
-                // swap
-                uint32_t temp;
-                temp = op1;
-                op1 = op2;
-                op2 = temp;
-            }
+#ifdef CFG_COMPUTED_GOTO
+#define DISPATCH(h) goto *dispatch_tbl[h];
+#define HANDLER(name) L_##name:
+#else
+#define DISPATCH(h) switch (h)
+#define HANDLER(name) case H_##name:
+#endif
+// Leave the handler; `break` would not leave it under computed goto
+#define NEXT goto DISPATCH_END
 
-            if ((opc & 0xFC) == 0x88) {
-                op1 = op2;
-            } else {
-                op1 = x86_arith(cpu, (opc >> 3) & 0x7, op1, op2, s);
-            }
+int x86_exec(vm_t *vm, const x86_insn_t *insn) {
+    x86_cpu_t *cpu = &vm->cpu;
+    vm_mem_t *m = &vm->mem;
+#ifdef CFG_COMPUTED_GOTO
+#define X86_HANDLER_LABEL(name) [H_##name] = &&L_##name,
+    static const void *const dispatch_tbl[H_COUNT] = {
+        X86_HANDLERS(X86_HANDLER_LABEL)};
+#undef X86_HANDLER_LABEL
+#endif
+    const uint8_t opc = insn->opc;
+    const uint8_t pfx = insn->pfx;
+    const x86_opc_info_t info = insn->info;
+    const uint8_t s = info.s;
+    const mod_reg_rm_t mod_reg_rm = insn->mod_reg_rm;
+    cpu->seg_override = insn->seg_override;
+    vm->cycles += insn->clk;
+
+    DISPATCH(info.handler) {
+    HANDLER(ARITH) {
+        uint32_t op1 = s ? read_reg_u16(cpu, mod_reg_rm.reg)
+                         : read_reg_u8(cpu, mod_reg_rm.reg);
+        uint32_t op2 = read_mod_rm(vm, mod_reg_rm, s);
+
+        if (!info.d) {
+            // swap
+            uint32_t temp;
+            temp = op1;
+            op1 = op2;
+            op2 = temp;
+        }
 
-            if (!d) {
-                write_mod_rm(cpu, mod_reg_rm, op1, s);
-            } else {
-                if (s) {
-                    write_reg_u16(cpu, mod_reg_rm.reg, op1);
-                } else {
-                    write_reg_u8(cpu, mod_reg_rm.reg, op1);
-                }
-            }
-            break;
+        op1 = x86_arith(cpu, info.fnc, op1, op2, s);
+
+        if (!info.d) {
+            write_mod_rm(vm, mod_reg_rm, op1, s);
+        } else if (s) {
+            write_reg_u16(cpu, mod_reg_rm.reg, op1);
+        } else {
+            write_reg_u8(cpu, mod_reg_rm.reg, op1);
         }
-        case 2: {
-            uint8_t s = opc & 0x1;
-            uint32_t imm = 0;
-            uint32_t op1 = 0;
+        NEXT;
+    }
+    HANDLER(MOV_RM) {
+        if (info.d) {
+            uint32_t op = read_mod_rm(vm, mod_reg_rm, s);
             if (s) {
-                imm = LOAD_IP_WORD(cpu);
-                op1 = cpu->a.x;
+                write_reg_u16(cpu, mod_reg_rm.reg, op);
             } else {
-                imm = LOAD_IP_BYTE(cpu);
-                op1 = cpu->a.b.l;
+                write_reg_u8(cpu, mod_reg_rm.reg, op);
             }
-            op1 = x86_arith(cpu, (opc >> 3) & 0x7, op1, imm, s);
+        } else {
+            uint32_t op = s ? read_reg_u16(cpu, mod_reg_rm.reg)
+                            : read_reg_u8(cpu, mod_reg_rm.reg);
+            write_mod_rm(vm, mod_reg_rm, op, s);
+        }
+        NEXT;
+    }
+    HANDLER(ALU_ACC) {
+        if (s) {
+            cpu->a.x = x86_arith(cpu, info.fnc, cpu->a.x, insn->imm, s);
+        } else {
+            cpu->a.b.l = x86_arith(cpu, info.fnc, cpu->a.b.l, insn->imm, s);
+        }
+        NEXT;
+    }
+    HANDLER(INC_R16) {
+        uint32_t res = x86_inc(cpu, read_reg_u16(cpu, info.fnc), 1);
+        write_reg_u16(cpu, info.fnc, res);
+        NEXT;
+    }
+    HANDLER(DEC_R16) {
+        uint32_t res = x86_dec(cpu, read_reg_u16(cpu, info.fnc), 1);
+        write_reg_u16(cpu, info.fnc, res);
+        NEXT;
+    }
+    HANDLER(PUSH_R16) {
+        uint32_t res = read_reg_u16(cpu, info.fnc);
+        push_u16(vm, res);
+        NEXT;
+    }
+    HANDLER(POP_R16) {
+        write_reg_u16(cpu, info.fnc, pop_u16(vm));
+        NEXT;
+    }
+    HANDLER(XCHG_AX) {
+        uint32_t op1 = read_reg_u16(cpu, info.fnc);
+        write_reg_u16(cpu, info.fnc, cpu->a.x);
+        cpu->a.x = op1;
+        NEXT;
+    }
+    HANDLER(MOV_R16_IMM) {
+        write_reg_u16(cpu, info.fnc, insn->imm);
+        NEXT;
+    }
+    HANDLER(MOV_R8_IMM) {
+        write_reg_u8(cpu, info.fnc, insn->imm);
+        NEXT;
+    }
+    HANDLER(JCC) {
+        x86_jcc(vm, insn);
+        NEXT;
+    }
+    HANDLER(JCXZ) {
+        if (cpu->c.x == 0) {
+            cpu->ip += insn->imm;
+            vm->cycles += x86_taken_clocks(H_JCXZ);
+        }
+        NEXT;
+    }
+    HANDLER(GRP_IMM) {
+        uint32_t op1 = read_mod_rm(vm, mod_reg_rm, s);
+        op1 = x86_arith(cpu, mod_reg_rm.reg, op1, insn->imm, s);
+        write_mod_rm(vm, mod_reg_rm, op1, s);
+        NEXT;
+    }
+    HANDLER(SHIFT) {
+        uint32_t shamt = info.d ? cpu->c.b.l : 1;
+        if (info.d) vm->cycles += shamt * CLK_SHIFT_BIT;
+        uint32_t op1 = read_mod_rm(vm, mod_reg_rm, s);
+        if ((mod_reg_rm.reg & 0b100) == 0b100) {
+            op1 = x86_shift(cpu, mod_reg_rm.reg, op1, shamt, s);
+        } else {
+            op1 = x86_rotate(cpu, mod_reg_rm.reg, op1, shamt, s);
+        }
+        write_mod_rm(vm, mod_reg_rm, op1, s);
+        NEXT;
+    }
+    HANDLER(STRING) {
+        if (pfx) {
+            // Only the elements due before the next device event, at least
+            // one; the rest start over from the prefix once it has been
+            // run, which leaves room for an interrupt in between. Starting
+            // over is free, so that where events fall never shows in the
+            // clock and a replay without them stays in step.
+            uint16_t count = cpu->c.x;
+            uint16_t clk = x86_rep_clocks(opc);
+            uint64_t next = sched_next(&vm->sched);
+            uint64_t fit = next > vm->cycles ? (next - vm->cycles) / clk : 0;
+            uint32_t max = fit == 0 ? 1 : fit < count ? fit : count;
+            if (x86_rep_string(vm, opc, pfx, max)) {
+                cpu->ip -= insn->len;
+                vm->cycles -= insn->clk;
+            }
+            vm->cycles += (uint32_t)(uint16_t)(count - cpu->c.x) * clk;
+        } else {
+            x86_string_insn(vm, opc);
+        }
+        NEXT;
+    }
+    HANDLER(PUSH_SEG) {
+        push_u16(vm, read_seg(cpu, info.fnc));
+        NEXT;
+    }
+    HANDLER(POP_SEG) {
+        write_seg(cpu, info.fnc, pop_u16(vm));
+        NEXT;
+    }
+    HANDLER(TEST_RM) {
+        uint32_t op1 = s ? read_reg_u16(cpu, mod_reg_rm.reg)
+                         : read_reg_u8(cpu, mod_reg_rm.reg);
+        uint32_t op2 = read_mod_rm(vm, mod_reg_rm, s);
+        x86_and(cpu, op1, op2, s);
+        NEXT;
+    }
+    HANDLER(XCHG_RM) {
+        uint32_t op1 = s ? read_reg_u16(cpu, mod_reg_rm.reg)
+                         : read_reg_u8(cpu, mod_reg_rm.reg);
+        uint32_t op2 = read_mod_rm(vm, mod_reg_rm, s);
+        write_mod_rm(vm, mod_reg_rm, op1, s);
+        if (s) {
+            write_reg_u16(cpu, mod_reg_rm.reg, op2);
+        } else {
+            write_reg_u8(cpu, mod_reg_rm.reg, op2);
+        }
+        NEXT;
+    }
+    HANDLER(MOV_RM_SEG) {
+        uint16_t val = read_seg(cpu, mod_reg_rm.reg & 0b11);
+        write_mod_rm(vm, mod_reg_rm, val, 1);
+        NEXT;
+    }
+    HANDLER(LEA) {
+        // TODO: i guess this should be the case?
+        // no point in doing effective address of a register
+        assert(mod_reg_rm.mod != 0b11);
+        uint32_t base = mod_reg_rm.disp + get_16b_mem_base(cpu, mod_reg_rm);
+        write_reg_u16(cpu, mod_reg_rm.reg, base & 0xFFFF);
+        NEXT;
+    }
+    HANDLER(MOV_SEG_RM) {
+        uint32_t op = read_mod_rm(vm, mod_reg_rm, 1);
+        write_seg(cpu, mod_reg_rm.reg & 0b11, op);
+        NEXT;
+    }
+    HANDLER(POP_RM) {
+        uint16_t tos = pop_u16(vm);
+        write_mod_rm(vm, mod_reg_rm, tos, 1);
+        NEXT;
+    }
+    HANDLER(CBW) {
+        cpu->a.x = SEXT_8_16(cpu->a.b.l);
+        NEXT;
+    }
+    HANDLER(CWD) {
+        cpu->d.x = (cpu->a.x & 0x8000) ? 0xFFFF : 0;
+        NEXT;
+    }
+    // CALL (FAR, ABSOLUTE)
+    HANDLER(CALL_FAR) {
+        push_u16(vm, cpu->cs);
+        push_u16(vm, cpu->ip);
+        cpu->ip = insn->imm;
+        x86_set_sreg(cpu, SREG_CS, insn->imm2);
+        NEXT;
+    }
+    HANDLER(PUSHF) {
+        x86_flags_sync(cpu);
+        push_u16(vm, cpu->flags.num);
+        NEXT;
+    }
+    HANDLER(POPF) {
+        pop_flags(vm);
+        NEXT;
+    }
+    HANDLER(SAHF) {
+        x86_flags_t ah_flags;
+        ah_flags.num = cpu->a.b.h;
+        x86_flags_sync(cpu);
+        cpu->flags.s_f = ah_flags.s_f;
+        cpu->flags.z_f = ah_flags.z_f;
+        cpu->flags.a_f = ah_flags.a_f;
+        cpu->flags.p_f = ah_flags.p_f;
+        cpu->flags.c_f = ah_flags.c_f;
+        NEXT;
+    }
+    HANDLER(LAHF) {
+        x86_flags_sync(cpu);
+        cpu->a.b.h = (cpu->flags.num) & 0xFF;
+        NEXT;
+    }
+    HANDLER(MOV_ACC_MEM) {
+        if (s) {
+            cpu->a.x = load_u16_base(m, x86_data_base(cpu), insn->imm);
+        } else {
+            cpu->a.b.l = load_u8_base(m, x86_data_base(cpu), insn->imm);
+        }
+        NEXT;
+    }
+    HANDLER(MOV_MEM_ACC) {
+        if (s) {
+            store_u16_base(m, x86_data_base(cpu), insn->imm, cpu->a.x);
+        } else {
+            store_u8_base(m, x86_data_base(cpu), insn->imm, cpu->a.b.l);
+        }
+        NEXT;
+    }
+    HANDLER(TEST_ACC) {
+        x86_and(cpu, s ? cpu->a.x : cpu->a.b.l, insn->imm, s);
+        NEXT;
+    }
+    HANDLER(RET_IMM) {
+        cpu->ip = pop_u16(vm);
+        cpu->sp += insn->imm;
+        NEXT;
+    }
+    HANDLER(RET) {
+        cpu->ip = pop_u16(vm);
+        NEXT;
+    }
+    HANDLER(LES_LDS) {
+        uint32_t op1 = mod_rm_effective_addr(cpu, mod_reg_rm);
+        uint32_t base = EA_BASE(cpu, op1);
+        write_reg_u16(cpu, mod_reg_rm.reg, load_u16_base(m, base, EA_OFS(op1)));
+        write_seg(cpu, info.fnc, load_u16_base(m, base, EA_OFS(op1) + 2));
+        NEXT;
+    }
+    HANDLER(MOV_RM_IMM) {
+        write_mod_rm(vm, mod_reg_rm, insn->imm, s);
+        NEXT;
+    }
+    HANDLER(RETF_IMM) {
+        cpu->ip = pop_u16(vm);
+        x86_set_sreg(cpu, SREG_CS, pop_u16(vm));
+        cpu->sp += insn->imm;
+        NEXT;
+    }
+    HANDLER(RETF) {
+        cpu->ip = pop_u16(vm);
+        x86_set_sreg(cpu, SREG_CS, pop_u16(vm));
+        NEXT;
+    }
+    HANDLER(INT3) {
+        assert(cpu->int_src < 0);
+        cpu->int_src = 3;
+        NEXT;
+    }
+    HANDLER(INT) {
+        assert(cpu->int_src < 0);
+        cpu->int_src = insn->imm;
+        NEXT;
+    }
+    HANDLER(INTO) {
+        assert(cpu->int_src < 0);
+        x86_flags_sync(cpu);
+        if (cpu->flags.o_f) {
+            cpu->int_src = 4;
+        }
+        NEXT;
+    }
+    HANDLER(IRET) {
+        cpu->ip = pop_u16(vm);
+        x86_set_sreg(cpu, SREG_CS, pop_u16(vm));
+        pop_flags(vm);
+        NEXT;
+    }
+    HANDLER(XLAT) {
+        cpu->a.b.l = load_u8_base(m, x86_data_base(cpu), cpu->b.x + cpu->a.b.l);
+        NEXT;
+    }
+    HANDLER(LOOPNZ) {
+        cpu->c.x--;
+        if (!x86_zf(cpu) && cpu->c.x) {
+            cpu->ip += insn->imm;
+            vm->cycles += x86_taken_clocks(H_LOOPNZ);
+        }
+        NEXT;
+    }
+    HANDLER(LOOPZ) {
+        cpu->c.x--;
+        if (x86_zf(cpu) && cpu->c.x) {
+            cpu->ip += insn->imm;
+            vm->cycles += x86_taken_clocks(H_LOOPZ);
+        }
+        NEXT;
+    }
+    HANDLER(LOOP) {
+        cpu->c.x--;
+        if (cpu->c.x) {
+            cpu->ip += insn->imm;
+            vm->cycles += x86_taken_clocks(H_LOOP);
+        }
+        NEXT;
+    }
+    HANDLER(IN_IMM) {
+        if (s) {
+            cpu->a.x = io_read_u16(vm, insn->imm, cpu->ip);
+        } else {
+            cpu->a.b.l = io_read_u16(vm, insn->imm, cpu->ip);
+        }
+        if (vm->fault) return X86_EXEC_FAULT;
+        NEXT;
+    }
+    HANDLER(OUT_IMM) {
+        io_write_u16(vm, insn->imm, s ? cpu->a.x : cpu->a.b.l);
+        if (vm->exit_code >= 0) return X86_EXEC_EXIT;
+        NEXT;
+    }
+    HANDLER(IN_DX) {
+        if (s) {
+            cpu->a.x = io_read_u16(vm, cpu->d.x, cpu->ip);
+        } else {
+            cpu->a.b.l = io_read_u16(vm, cpu->d.x, cpu->ip);
+        }
+        if (vm->fault) return X86_EXEC_FAULT;
+        NEXT;
+    }
+    HANDLER(OUT_DX) {
+        io_write_u16(vm, cpu->d.x, s ? cpu->a.x : cpu->a.b.l);
+        if (vm->exit_code >= 0) return X86_EXEC_EXIT;
+        NEXT;
+    }
+    HANDLER(CALL_NEAR) {
+        // TODO: exceptions
+        push_u16(vm, cpu->ip);
+        cpu->ip += insn->imm;
+        NEXT;
+    }
+    // TODO exceptions for near and far jump
+    HANDLER(JMP_NEAR) {
+        cpu->ip += insn->imm;
+        NEXT;
+    }
+    HANDLER(JMP_FAR) {
+        cpu->ip = insn->imm;
+        x86_set_sreg(cpu, SREG_CS, insn->imm2);
+        NEXT;
+    }
+    HANDLER(JMP_SHORT) {
+        cpu->ip += insn->imm;
+        NEXT;
+    }
+    HANDLER(HLT) {
+        return X86_EXEC_HALT;
+    }
+    HANDLER(CMC) {
+        x86_flags_sync(cpu);
+        cpu->flags.c_f = ~cpu->flags.c_f;
+        NEXT;
+    }
+    HANDLER(GRP3) {
+        x86_group1(vm, insn);
+        NEXT;
+    }
+    HANDLER(CLC) {
+        x86_flags_sync(cpu);
+        cpu->flags.c_f = 0;
+        NEXT;
+    }
+    HANDLER(STC) {
+        x86_flags_sync(cpu);
+        cpu->flags.c_f = 1;
+        NEXT;
+    }
+    HANDLER(CLI) {
+        cpu->flags.i_f = 0;
+        NEXT;
+    }
+    HANDLER(STI) {
+        cpu->flags.i_f = 1;
+        NEXT;
+    }
+    HANDLER(CLD) {
+        cpu->flags.d_f = 0;
+        NEXT;
+    }
+    HANDLER(STD) {
+        cpu->flags.d_f = 1;
+        NEXT;
+    }
+    HANDLER(GRP4) {
+        uint32_t op1 = read_mod_rm(vm, mod_reg_rm, 0);
+        if (mod_reg_rm.reg) {
+            op1 = x86_dec(cpu, op1, 0);
+        } else {
+            op1 = x86_inc(cpu, op1, 0);
+        }
+        write_mod_rm(vm, mod_reg_rm, op1, 0);
+        NEXT;
+    }
+    HANDLER(GRP5) {
+        if (mod_reg_rm.reg == 0b110) cpu->sp -= 2;
+        uint32_t op1 = read_mod_rm(vm, mod_reg_rm, 1);
+        uint32_t addr = mod_rm_effective_addr(cpu, mod_reg_rm);
 
-            if (s) {
-                cpu->a.x = op1;
-            } else {
-                cpu->a.b.l = op1;
-            }
+        switch (mod_reg_rm.reg) {
+        // TODO: why does the manual say mem16 specifically but not
+        // reg16/mem16? INC
+        case 0b000: {
+            uint32_t res = x86_inc(cpu, op1, 1);
+            write_mod_rm(vm, mod_reg_rm, res, 1);
             break;
         }
-        case 3: {
-            uint8_t reg = opc & 0x7;
-            uint8_t carry_save = cpu->flags.c_f;
-            uint32_t res = x86_add(cpu, read_reg_u16(cpu, reg), 1, 0, 1);
-            cpu->flags.c_f = carry_save;
-            write_reg_u16(cpu, reg, res);
+        // DEC
+        case 0b001: {
+            uint32_t res = x86_dec(cpu, op1, 1);
+            write_mod_rm(vm, mod_reg_rm, res, 1);
             break;
         }
-        case 4: {
-            uint8_t reg = opc & 0x7;
-            uint8_t carry_save = cpu->flags.c_f;
-            uint32_t res = x86_sub(cpu, read_reg_u16(cpu, reg), 1, 0, 1);
-            cpu->flags.c_f = carry_save;
-            write_reg_u16(cpu, reg, res);
+        // Near call absolute
+        case 0b010: {
+            push_u16(vm, cpu->ip);
+            cpu->ip = op1;
             break;
         }
-        case 5: {
-            uint8_t reg = opc & 0x7;
-            uint32_t res = read_reg_u16(cpu, reg);
-            push_u16(cpu, res);
+        // Far call absolute
+        case 0b011: {
+            push_u16(vm, cpu->cs);
+            push_u16(vm, cpu->ip);
+            cpu->ip = load_u16_base(m, EA_BASE(cpu, addr), EA_OFS(addr));
+            x86_set_sreg(cpu, SREG_CS,
+                         load_u16_base(m, EA_BASE(cpu, addr), EA_OFS(addr) + 2));
             break;
         }
-        case 6: {
-            uint8_t reg = opc & 0x7;
-            write_reg_u16(cpu, reg, pop_u16(cpu));
+        // Near jump absolute
+        case 0b100: {
+            cpu->ip = op1;
             break;
         }
-        case 7: {
-            uint8_t reg = opc & 0x7;
-            uint32_t op1 = read_reg_u16(cpu, reg);
-            write_reg_u16(cpu, reg, cpu->a.x);
-            cpu->a.x = op1;
+        // Far jump absolute
+        // TODO idk if it works the same as the far call
+        case 0b101: {
+            cpu->ip = load_u16_base(m, EA_BASE(cpu, addr), EA_OFS(addr));
+            x86_set_sreg(cpu, SREG_CS,
+                         load_u16_base(m, EA_BASE(cpu, addr), EA_OFS(addr) + 2));
             break;
         }
-        case 8: {
-            uint8_t reg = opc & 0x7;
-            uint32_t imm = LOAD_IP_WORD(cpu);
-            write_reg_u16(cpu, reg, imm);
+        // Push
+        case 0b110: {
+            store_u16_base(m, cpu->sbase[SREG_SS], cpu->sp, op1);
             break;
         }
-        case 9: {
-            uint8_t reg = opc & 0x7;
-            uint32_t imm = LOAD_IP_BYTE(cpu);
-            write_reg_u8(cpu, reg, imm);
-            break;
+        // FF /7 is decoded as ILLEGAL
+        default: break;
         }
-        case 10: {
-            uint32_t imm = SEXT_8_16(LOAD_IP_BYTE(cpu));
-            uint32_t cond = 0;
-            switch (opc & 0b1110) {
-            // J0
-            case 0x0:
-                cond = (cpu->flags.o_f);
-                break;
-            // JB
-            case 0x2:
-                cond = (cpu->flags.c_f);
-                break;
-            // JE
-            case 0x4:
-                cond = (cpu->flags.z_f);
-                break;
-            // JBE
-            case 0x6:
-                cond = (cpu->flags.c_f) | (cpu->flags.z_f);
-                break;
-            // JS
-            case 0x8:
-                cond = (cpu->flags.s_f);
-                break;
-            // JP
-            case 0xA:
-                cond = (cpu->flags.p_f);
-                break;
-            // JL
-            case 0xC:
-                cond = (cpu->flags.s_f) ^ (cpu->flags.o_f);
-                break;
-            // JLE
-            case 0xE:
-                cond = (cpu->flags.z_f) |
-                       ((cpu->flags.s_f) ^ (cpu->flags.o_f));
-                break;
-            }
-            cond ^= (opc & 0x1);
-            if (opc == 0xE3) {
-                cond = (cpu->c.x == 0);
-            }
-            if (cond) {
-                cpu->ip = cpu->ip + imm;
-            }
-            break;
+        NEXT;
+    }
+    // Prefixes are consumed by the decoder and never dispatched
+    HANDLER(PREFIX)
+    HANDLER(ILLEGAL) {
+        printf("unrecognized opcode: %02x\n", opc);
+        vm->fault = VM_FAULT_OPCODE;
+        return X86_EXEC_FAULT;
+    }
+    }
+DISPATCH_END:
+    return X86_EXEC_OK;
+}
+
+static inline uint64_t host_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Longest loop iteration, in instructions, taken as a polling loop
+#define IDLE_LOOP_MAX    1024
+// Clocks to wait at a time when only host input can end the wait
+#define IDLE_WAIT_CLOCKS (CPU_CLOCK_HZ / 100)
+// Longest host sleep between checks for input
+#define IDLE_SLICE_NS    1000000
+
+// Sleep as long as clocks take on an 8088, less what earlier sleeps
+// overran, so that idle time keeps pace with the host. Input cuts it short.
+static void vm_idle_sleep(vm_t *vm, uint64_t clocks) {
+    int64_t want = clocks * 1000000000ull / CPU_CLOCK_HZ - vm->idle_overrun;
+    uint64_t start = host_ns();
+    int64_t slept = 0;
+    while (slept < want && !vm->stop && !io_input_pending(vm)) {
+        int64_t left = want - slept;
+        io_input_wait(vm, left < IDLE_SLICE_NS ? left : IDLE_SLICE_NS);
+        slept = host_ns() - start;
+    }
+    vm->idle_overrun = slept < want ? 0 : slept - want;
+}
+
+// Move the clock on by clocks spent idle
+static void vm_idle(vm_t *vm, uint64_t clocks) {
+    if (vm->opts.idle_sleep) vm_idle_sleep(vm, clocks);
+    vm->cycles += clocks;
+    vm->idle_cycles += clocks;
+}
+
+typedef enum {
+    // An interrupt is up for the CPU to take
+    VM_HALT_WOKEN,
+    // Nothing can ever raise one
+    VM_HALT_FOREVER,
+    // A stop request or the end of the run came first
+    VM_HALT_PAUSED,
+} vm_halt_t;
+
+// HLT: move from device event to device event until one raises an
+// interrupt, never past the end of the run
+static vm_halt_t vm_halt_wait(vm_t *vm) {
+    if (!vm->cpu.flags.i_f) return VM_HALT_FOREVER;
+    while (!vm->stop && vm->cycles < vm->cycles_end) {
+        io_tick(vm);
+        if (io_int_poll(vm)) return VM_HALT_WOKEN;
+        uint64_t next = io_next_event(vm, vm->cycles);
+        if (next == IO_NO_EVENT) {
+            // Only host input can end it
+            if (!vm->opts.idle_sleep) return VM_HALT_FOREVER;
+            next = vm->cycles + IDLE_WAIT_CLOCKS;
         }
-        case 11: {
-            uint8_t s = opc & 0x1;
-            uint8_t x = (opc >> 1) & 0x1;
-            mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-            uint32_t imm =
-                s ? (x ? (SEXT_8_16(LOAD_IP_BYTE(cpu))) : LOAD_IP_WORD(cpu))
-                  : (LOAD_IP_BYTE(cpu));
-            uint32_t op1 = read_mod_rm(cpu, mod_reg_rm, s);
-            op1 = x86_arith(cpu, mod_reg_rm.reg, op1, imm, s);
-            write_mod_rm(cpu, mod_reg_rm, op1, s);
-            break;
+        if (next > vm->cycles_end) next = vm->cycles_end;
+        if (next > vm->cycles) vm_idle(vm, next - vm->cycles);
+    }
+    return VM_HALT_PAUSED;
+}
+
+// Called after an instruction that may end a loop iteration: a backward
+// branch, or an IN from port (port >= 0) that read it at io_time. Back at
+// the same point in the same state, with no stores and no other port access
+// in between, the loop can only be left once a device changes something.
+// Whole iterations up to the next device event are skipped; the state after
+// them is the same.
+static void vm_idle_probe(vm_t *vm, uint32_t addr, int port,
+                          uint64_t io_time, uint64_t max_insns) {
+    idle_probe_t *p = &vm->idle_probes[port >= 0];
+    x86_cpu_t *cpu = &vm->cpu;
+    uint64_t insns = vm->insns - p->insns;
+    if (p->addr == addr && p->stores == vm->mem.store_count &&
+        vm->io_access_count - p->io == (port >= 0) && insns <= IDLE_LOOP_MAX &&
+        vm->cycles > p->cycles && memcmp(&p->cpu, cpu, sizeof(*cpu)) == 0) {
+        uint64_t period = vm->cycles - p->cycles;
+        uint64_t until = io_next_event(vm, vm->cycles);
+        if (until == IO_NO_EVENT && vm->opts.idle_sleep) {
+            until = vm->cycles + IDLE_WAIT_CLOCKS;
         }
-        case 12: {
-            uint8_t s = opc & 0x1;
-            uint32_t shamt = (opc & 0x2) ? cpu->c.b.l : 1;
-            mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-            uint32_t op1 = read_mod_rm(cpu, mod_reg_rm, s);
-            if ((mod_reg_rm.reg & 0b100) == 0b100) {
-                op1 = x86_shift(cpu, mod_reg_rm.reg, op1, shamt, s);
-            } else {
-                op1 = x86_rotate(cpu, mod_reg_rm.reg, op1, shamt, s);
-            }
-            write_mod_rm(cpu, mod_reg_rm, op1, s);
-            break;
+        if (until != IO_NO_EVENT && until > vm->cycles_end) {
+            until = vm->cycles_end;
         }
-        case 13: {
-            // String instruction
-            bool compare_enable = ((opc & 0x06) == 0x6);
-            uint16_t counter = pfx ? cpu->c.x : 1;
-            while (counter != 0) {
-                x86_string_insn(cpu, opc);
-                counter--;
-                if (compare_enable && ((pfx & 0x1) ^ cpu->flags.z_f))
-                    break;
-            }
-            if (pfx) {
-                cpu->c.x = counter;
-            }
-            break;
+        // Every skipped iteration has to end before the next event, and
+        // every skipped IN has to read what this one did
+        uint64_t n = 0;
+        if (until != IO_NO_EVENT && until > vm->cycles) {
+            n = (until - 1 - vm->cycles) / period;
         }
-        default: {
-            switch (opc) {
-            case 0x06: {
-                push_u16(cpu, cpu->es);
-                break;
-            }
-            case 0x07: {
-                cpu->es = pop_u16(cpu);
-                break;
-            }
-            case 0x16: {
-                push_u16(cpu, cpu->ss);
-                break;
-            }
-            case 0x17: {
-                cpu->ss = pop_u16(cpu);
-                break;
-            }
-            case 0x0E: {
-                push_u16(cpu, cpu->cs);
-                break;
-            }
-            case 0x1E: {
-                push_u16(cpu, cpu->ds);
-                break;
-            }
-            case 0x1F: {
-                cpu->ds = pop_u16(cpu);
-                break;
-            }
-            case 0x84: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op1 = read_reg_u8(cpu, mod_reg_rm.reg);
-                uint32_t op2 = read_mod_rm(cpu, mod_reg_rm, 0);
-                x86_and(cpu, op1, op2, 0);
-                break;
-            }
-            case 0x85: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op1 = read_reg_u16(cpu, mod_reg_rm.reg);
-                uint32_t op2 = read_mod_rm(cpu, mod_reg_rm, 1);
-                x86_and(cpu, op1, op2, 1);
-                break;
-            }
-            case 0x86: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op1 = read_reg_u8(cpu, mod_reg_rm.reg);
-                uint32_t op2 = read_mod_rm(cpu, mod_reg_rm, 0);
-                write_mod_rm(cpu, mod_reg_rm, op1, 0);
-                write_reg_u8(cpu, mod_reg_rm.reg, op2);
-                break;
-            }
-            case 0x87: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op1 = read_reg_u16(cpu, mod_reg_rm.reg);
-                uint32_t op2 = read_mod_rm(cpu, mod_reg_rm, 1);
-                write_mod_rm(cpu, mod_reg_rm, op1, 1);
-                write_reg_u16(cpu, mod_reg_rm.reg, op2);
-                break;
-            }
-            case 0x8C: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint16_t val = read_seg(cpu, mod_reg_rm.reg & 0b11);
-                write_mod_rm(cpu, mod_reg_rm, val, 1);
-                break;
-            }
-            case 0x8D: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                // TODO: i guess this should be the case?
-                // no point in doing effective address of a register
-                assert(mod_reg_rm.mod != 0b11);
-                uint32_t base = mod_reg_rm.disp + get_16b_mem_base(cpu, mod_reg_rm);
-                write_reg_u16(cpu, mod_reg_rm.reg, base & 0xFFFF);
-                break;
-            }
-            case 0x8E: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op = read_mod_rm(cpu, mod_reg_rm, 1);
-                write_seg(cpu, mod_reg_rm.reg & 0b11, op);
-                break;
-            }
-            case 0x8F: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint16_t tos = pop_u16(cpu);
-                write_mod_rm(cpu, mod_reg_rm, tos, 1);
-                break;
-            }
-            // CBW
-            case 0x98: {
-                cpu->a.x = SEXT_8_16(cpu->a.b.l);
-                break;
-            }
-            // CWD
-            case 0x99: {
-                cpu->d.x = (cpu->a.x & 0x8000) ? 0xFFFF : 0;
-                break;
-            }
-            // CALL (FAR, ABSOLUTE)
-            case 0x9A: {
-                uint32_t ip = LOAD_IP_WORD(cpu);
-                uint32_t cs = LOAD_IP_WORD(cpu);
-                push_u16(cpu, cpu->cs);
-                push_u16(cpu, cpu->ip);
-                cpu->ip = ip;
-                cpu->cs = cs;
-                break;
-            }
-            case 0x9C: {
-                push_u16(cpu, cpu->flags.num);
-                break;
-            }
-            case 0x9D: {
-                pop_flags(cpu);
-                break;
-            }
-            case 0x9E: {
-                x86_flags_t ah_flags;
-                ah_flags.num = cpu->a.b.h;
-                cpu->flags.s_f = ah_flags.s_f;
-                cpu->flags.z_f = ah_flags.z_f;
-                cpu->flags.a_f = ah_flags.a_f;
-                cpu->flags.p_f = ah_flags.p_f;
-                cpu->flags.c_f = ah_flags.c_f;
-                break;
-            }
-            case 0x9F: {
-                cpu->a.b.h = (cpu->flags.num) & 0xFF;
-                break;
-            }
-            case 0xA0: {
-                uint32_t offset = LOAD_IP_WORD(cpu);
-                cpu->a.b.l = load_u8(x86_get_data_segment(cpu), offset);
-                break;
-            }
-            case 0xA1: {
-                uint32_t offset = LOAD_IP_WORD(cpu);
-                cpu->a.x = load_u16(x86_get_data_segment(cpu), offset);
-                break;
-            }
-            case 0xA2: {
-                uint32_t offset = LOAD_IP_WORD(cpu);
-                store_u8(x86_get_data_segment(cpu), offset, cpu->a.b.l);
-                break;
+        if (port >= 0 && n) {
+            uint64_t stable = io_read_stable_until(vm, port, io_time);
+            if (stable <= io_time) {
+                n = 0;
+            } else if (stable != IO_NO_EVENT &&
+                       (stable - 1 - io_time) / period < n) {
+                n = (stable - 1 - io_time) / period;
             }
-            case 0xA3: {
-                uint32_t offset = LOAD_IP_WORD(cpu);
-                store_u16(x86_get_data_segment(cpu), offset, cpu->a.x);
-                break;
-            }
-            case 0xA8: {
-                uint32_t imm = LOAD_IP_BYTE(cpu);
-                x86_and(cpu, cpu->a.b.l, imm, 0);
-                break;
-            }
-            case 0xA9: {
-                uint32_t imm = LOAD_IP_WORD(cpu);
-                x86_and(cpu, cpu->a.x, imm, 1);
-                break;
-            }
-            case 0xC2: {
-                uint32_t imm = LOAD_IP_WORD(cpu);
-                cpu->ip = pop_u16(cpu);
-                cpu->sp += imm;
-                break;
-            }
-            case 0xC3: {
-                cpu->ip = pop_u16(cpu);
-                break;
-            }
-            // LES
-            case 0xC4:
-            // LDS
-            case 0xC5: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op1 = mod_rm_effective_addr(cpu, mod_reg_rm);
-                write_reg_u16(cpu, mod_reg_rm.reg, load_u16(op1 >> 16, op1 & 0xFFFF));
-                if (opc & 1) {
-                    cpu->ds = load_u16(op1 >> 16, (op1 & 0xFFFF)+2);
-                } else {
-                    cpu->es = load_u16(op1 >> 16, (op1 & 0xFFFF)+2);
-                }
-                break;
-            }
-            case 0xC6:
-            case 0xC7: {
-                uint8_t s = opc & 1;
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t imm = s ? LOAD_IP_WORD(cpu) : LOAD_IP_BYTE(cpu);
-                write_mod_rm(cpu, mod_reg_rm, imm, s);
-                break;
-            }
-            case 0xCA: {
-                uint32_t imm = LOAD_IP_WORD(cpu);
-                cpu->ip = pop_u16(cpu);
-                cpu->cs = pop_u16(cpu);
-                cpu->sp += imm;
-                break;
-            }
-            case 0xCB: {
-                cpu->ip = pop_u16(cpu);
-                cpu->cs = pop_u16(cpu);
-                break;
-            }
-            case 0xCC: {
-                assert(cpu->int_src < 0);
-                cpu->int_src = 3;
-                break;
-            }
-            case 0xCD: {
-                assert(cpu->int_src < 0);
-                uint32_t imm = LOAD_IP_BYTE(cpu);
-                cpu->int_src = imm;
-                break;
-            }
-            case 0xCE: {
-                assert(cpu->int_src < 0);
-                if (cpu->flags.o_f) {
-                    cpu->int_src = 4;
-                }
-                break;
-            }
-            case 0xCF: {
-                cpu->ip = pop_u16(cpu);
-                cpu->cs = pop_u16(cpu);
-                pop_flags(cpu);
-                break;
-            }
-            // XLATB
-            case 0xD7: {
-                cpu->a.b.l =
-                    load_u8(x86_get_data_segment(cpu), ((cpu->b.x + cpu->a.b.l) & 0xFFFF));
-                break;
-            }
-            // LOOPNZ
-            case 0xE0: {
-                uint8_t ofs = LOAD_IP_BYTE(cpu);
-                cpu->c.x--;
-                if ((cpu->flags.z_f == 0) && cpu->c.x) {
-                    cpu->ip += SEXT_8_16(ofs);
-                }
-                break;
-            }
-            // LOOPZ
-            case 0xE1: {
-                uint8_t ofs = LOAD_IP_BYTE(cpu);
-                cpu->c.x--;
-                if (cpu->flags.z_f && cpu->c.x) {
-                    cpu->ip += SEXT_8_16(ofs);
-                }
-                break;
-            }
-            // LOOP
-            case 0xE2: {
-                uint8_t ofs = LOAD_IP_BYTE(cpu);
-                cpu->c.x--;
-                if (cpu->c.x) {
-                    cpu->ip += SEXT_8_16(ofs);
-                }
-                break;
-            }
-            case 0xE4: {
-                uint32_t imm = LOAD_IP_BYTE(cpu);
-                cpu->a.b.l = io_read_u16(imm, cpu->ip);
-                break;
-            }
-            case 0xE5: {
-                uint32_t imm = LOAD_IP_BYTE(cpu);
-                cpu->a.x = io_read_u16(imm, cpu->ip);
-                break;
-            }
-            case 0xE6: {
-                uint32_t imm = LOAD_IP_BYTE(cpu);
-                io_write_u16(imm, cpu->a.b.l);
-                break;
-            }
-            case 0xE7: {
-                uint32_t imm = LOAD_IP_BYTE(cpu);
-                io_write_u16(imm, cpu->a.x);
-                break;
-            }
-            case 0xEC: {
-                cpu->a.b.l = io_read_u16(cpu->d.x, cpu->ip);
-                break;
-            }
-            case 0xED: {
-                cpu->a.x = io_read_u16(cpu->d.x, cpu->ip);
-                break;
-            }
-            case 0xEE: {
-                io_write_u16(cpu->d.x, cpu->a.b.l);
-                break;
-            }
-            case 0xEF: {
-                io_write_u16(cpu->d.x, cpu->a.x);
-                break;
-            }
-            case 0xE8: {
-                // near call
-                uint32_t ip_inc = LOAD_IP_WORD(cpu);
-                // TODO: exceptions
-                push_u16(cpu, cpu->ip);
-                cpu->ip = cpu->ip + ip_inc;
-                break;
-            }
-            // TODO exceptions for near and far jump
-            case 0xE9: {
-                // near jump
-                uint32_t ip_inc = LOAD_IP_WORD(cpu);
-                cpu->ip = cpu->ip + ip_inc;
-                break;
+        }
+        if (n) {
+            if (n > max_insns / insns) n = max_insns / insns;
+            vm_idle(vm, n * period);
+            vm->insns += n * insns;
+        }
+    }
+    p->addr = addr;
+    p->stores = vm->mem.store_count;
+    p->io = vm->io_access_count;
+    p->cycles = vm->cycles;
+    p->insns = vm->insns;
+    memcpy(&p->cpu, cpu, sizeof(*cpu));
+}
+
+// Instructions between checks for a stop request in the fast loop
+#define VM_POLL_INSNS 4096
+
+// io_tick(), and whether the run has reached its end, which SCHED_END has
+// the devices called in for. Costs the one compare when nothing is due.
+static inline bool vm_tick(vm_t *vm) {
+    if (!sched_due(&vm->sched, vm->cycles)) return false;
+    io_run(vm);
+    return vm->cycles >= vm->cycles_end;
+}
+
+// Count the edge from the last branch target to this one, hashed the way
+// AFL's QEMU mode hashes block addresses. Counts skip 0 as they wrap, so
+// an edge taken is never lost.
+static inline void vm_cov_edge(vm_t *vm, uint32_t to) {
+    uint32_t cur = ((to >> 4) ^ (to << 8)) & (VM_COV_MAP_SIZE - 1);
+    uint8_t *cnt = &vm->cov_map[cur ^ vm->cov_prev];
+    *cnt += 1 + (*cnt == 0xFF);
+    vm->cov_prev = cur >> 1;
+}
+
+// The body of vm_run, instantiated three times. With debug, it honours
+// breakpoints and tracing and checks for a stop request every instruction;
+// with cov, it counts every change of flow into vm->cov_map; with neither,
+// none of that is compiled in. Runs until vm->insns reaches end or the
+// clock vm->cycles_end; returns false if the CPU halted, faulted or hit a
+// breakpoint.
+static inline __attribute__((always_inline)) bool
+vm_run_loop(vm_t *vm, uint64_t end, const bool debug, const bool cov) {
+    x86_cpu_t *cpu = &vm->cpu;
+#ifdef CFG_DIFF_TRACE
+    x86_cpu_t old_cpu;
+    if (debug) old_cpu = *cpu;
+#endif
+    bcache_cursor_t cursor = {0};
+    x86_insn_t insn_buf;
+    int addr;
+    bool trace = debug && vm->opts.enable_trace;
+    // Skipped loop iterations would be missing from the trace
+    bool idle = !trace;
+    while (vm->insns < end) {
+        if (debug && vm->stop) break;
+
+        // Translated code only stops at block exits, so breakpoints,
+        // tracing and coverage need the stepping loop below
+        if (!debug && !cov && vm->opts.engine == VM_ENGINE_JIT) {
+            uint64_t left = end - vm->insns;
+            if (left > UINT32_MAX) left = UINT32_MAX;
+            // Device events are only run between runs, so translated code
+            // leaves the last few instructions before the next one to the
+            // loop below
+            uint32_t ran = jit_run(vm, left, sched_next(&vm->sched));
+            if (ran) {
+                // Translated code adds its own clocks to vm->cycles
+                vm->insns += ran;
+                bool at_end = vm_tick(vm);
+                x86_handle_interrupts(vm);
+                if (at_end) return true;
+                vm_idle_probe(vm, SEGMENT(cpu->cs, cpu->ip), -1, vm->cycles,
+                              end - vm->insns);
+                continue;
             }
-            case 0xEA: {
-                // far jump
-                uint32_t ip = LOAD_IP_WORD(cpu);
-                uint32_t cs = LOAD_IP_WORD(cpu);
-                cpu->ip = ip;
-                cpu->cs = cs;
-                break;
+        }
+
+        addr = SEGMENT(cpu->cs, cpu->ip);
+        if (debug) {
+            // Left to the caller to report, see vm_at_bkpt()
+            if (addr == vm->bkpt && !vm->bkpt_clear) {
+                vm->bkpt_clear = true;
+                return false;
             }
-            case 0xEB: {
-                // short jump
-                uint32_t ip_inc = SEXT_8_16(LOAD_IP_BYTE(cpu));
-                cpu->ip = cpu->ip + ip_inc;
-                break;
+            if ((vm->bkpt > 0) && vm->bkpt_clear) {
+                vm->bkpt_clear = false;
             }
-            case 0xF4: {
-                // Halt
+        }
+
+        const x86_insn_t *insn;
+        if (vm->opts.engine != VM_ENGINE_INTERP) {
+            insn = bcache_fetch(vm->bcache, &cursor, cpu, addr);
+        } else {
+            x86_decode(&vm->mem, cpu->cs, &cpu->ip, &insn_buf);
+            insn = &insn_buf;
+        }
+        vm->insns++;
+
+        if (trace) {
+            printf("Op: %02x; Pfx: %02x; SegOvr: %d; Handler: %s\n",
+                   insn->opc, insn->pfx, insn->seg_override,
+                   x86_handler_names[insn->info.handler]);
+        }
+
+        int port = -1;
+        if (insn->info.handler == H_IN_IMM) {
+            port = insn->imm;
+        } else if (insn->info.handler == H_IN_DX) {
+            port = cpu->d.x;
+        }
+
+        // Where the CPU goes unless something branches
+        uint32_t fall = cov ? SEGMENT(cpu->cs, cpu->ip) : 0;
+        int ret = x86_exec(vm, insn);
+        if (ret == X86_EXEC_EXIT) return false;
+        if (ret == X86_EXEC_FAULT) {
+            // Left at the instruction, which changed neither CS nor IP
+            cpu->ip -= insn->len;
+            return false;
+        }
+        if (ret == X86_EXEC_HALT) {
+            vm_halt_t halt = vm->opts.halt_stop ? VM_HALT_FOREVER
+                                                : vm_halt_wait(vm);
+            if (halt == VM_HALT_PAUSED) {
+                // Back on the HLT, which resuming waits in again
+                cpu->ip -= insn->len;
+                return false;
+            }
+            if (halt == VM_HALT_FOREVER) {
                 printf("CPU halt\n");
-                return;
-            }
-            case 0xF5: {
-                cpu->flags.c_f = ~cpu->flags.c_f;
-                break;
-            }
-            case 0xF6:
-            case 0xF7: {
-                x86_group1(cpu, opc & 1);
-                break;
-            }
-            case 0xF8: {
-                // clc
-                cpu->flags.c_f = 0;
-                break;
-            }
-            case 0xF9: {
-                // stc
-                cpu->flags.c_f = 1;
-                break;
-            }
-            case 0xFA: {
-                // cli
-                cpu->flags.i_f = 0;
-                break;
-            }
-            case 0xFB: {
-                // sti
-                cpu->flags.i_f = 1;
-                break;
-            }
-            case 0xFC: {
-                // cld
-                cpu->flags.d_f = 0;
-                break;
-            }
-            case 0xFD: {
-                // std
-                cpu->flags.d_f = 1;
-                break;
-            }
-            case 0xFE: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                uint32_t op1 = read_mod_rm(cpu, mod_reg_rm, 0);
-                uint8_t carry_save = cpu->flags.c_f;
-                if (mod_reg_rm.reg) {
-                    op1 = x86_sub(cpu, op1, 1, 0, 0);
-                } else {
-                    op1 = x86_add(cpu, op1, 1, 0, 0);
-                }
-                
-                cpu->flags.c_f = carry_save;
-                write_mod_rm(cpu, mod_reg_rm, op1, 0);
-                break;
-            }
-            case 0xFF: {
-                mod_reg_rm_t mod_reg_rm = read_mod_reg_rm(cpu);
-                if (mod_reg_rm.reg == 0b110) cpu->sp -= 2;
-                uint32_t op1 = read_mod_rm(cpu, mod_reg_rm, 1);
-                uint32_t addr = mod_rm_effective_addr(cpu, mod_reg_rm);
-                uint8_t carry_save = cpu->flags.c_f;
-
-                switch (mod_reg_rm.reg) {
-                // TODO: why does the manual say mem16 specifically but not
-                // reg16/mem16? INC
-                case 0b000: {
-                    uint32_t res = x86_add(cpu, op1, 1, 0, 1);
-                    cpu->flags.c_f = carry_save;
-                    write_mod_rm(cpu, mod_reg_rm, res, 1);
-                    break;
-                }
-                // DEC
-                case 0b001: {
-                    uint32_t res = x86_sub(cpu, op1, 1, 0, 1);
-                    cpu->flags.c_f = carry_save;
-                    write_mod_rm(cpu, mod_reg_rm, res, 1);
-                    break;
-                }
-                // Near call absolute
-                case 0b010: {
-                    push_u16(cpu, cpu->ip);
-                    cpu->ip = op1;
-                    break;
-                }
-                // Far call absolute
-                case 0b011: {
-                    push_u16(cpu, cpu->cs);
-                    push_u16(cpu, cpu->ip);
-                    cpu->ip = load_u16(addr >> 16, addr & 0xFFFF);
-                    cpu->cs = load_u16(addr >> 16, (addr & 0xFFFF) + 2);
-                    break;
-                }
-                // Near jump absolute
-                case 0b100: {
-                    cpu->ip = op1;
-                    break;
-                }
-                // Far jump absolute
-                // TODO idk if it works the same as the far call
-                case 0b101: {
-                    cpu->ip = load_u16(addr >> 16, addr & 0xFFFF);
-                    cpu->cs = load_u16(addr >> 16, (addr & 0xFFFF) + 2);
-                    break;
-                }
-                // Push
-                case 0b110: {
-                    store_u8(cpu->ss, cpu->sp+1, op1 >> 8);
-                    store_u8(cpu->ss, cpu->sp, op1);
-                    break;
-                }
-                default: {
-                    printf("unrecognized group 2 function: %d\n",
-                           mod_reg_rm.reg);
-                    exit(EXIT_FAILURE);
-                }
-                }
-                break;
-            }
-            default: {
-                printf("unrecognized opcode: %02x\n", opc);
-                exit(1);
-            }
+                return false;
             }
         }
+        // An IN reads the devices once its clocks are counted
+        uint64_t io_time = vm->cycles;
+
+        // The Jcc after a compare goes in the same step, its condition read
+        // straight off last_op. An interrupt due after the compare still
+        // gets in between the two. Nothing may stop between the two, so
+        // this is left to the fast loop.
+        bool at_end = false;
+        if (!debug && insn->fuse && !cpu->flags.t_f && vm->insns < end) {
+            at_end = vm_tick(vm);
+            if (io_int_poll(vm) && cpu->flags.i_f) {
+                vm->bcache->stats.fused_split++;
+                x86_handle_interrupts(vm);
+                if (cov) vm_cov_edge(vm, SEGMENT(cpu->cs, cpu->ip));
+                if (at_end) return true;
+                continue;
+            }
+            const x86_insn_t *jcc =
+                bcache_fetch(vm->bcache, &cursor, cpu, SEGMENT(cpu->cs, cpu->ip));
+            vm->insns++;
+            vm->cycles += jcc->clk;
+            if (cov) fall = SEGMENT(cpu->cs, cpu->ip);
+            x86_jcc(vm, jcc);
+            vm->bcache->stats.fused[insn->fuse]++;
         }
 
-        io_tick(vm->cycles);
-        x86_handle_interrupts(cpu);
+        at_end |= vm_tick(vm);
+        x86_handle_interrupts(vm);
+
+        if (cov && SEGMENT(cpu->cs, cpu->ip) != fall) {
+            vm_cov_edge(vm, SEGMENT(cpu->cs, cpu->ip));
+        }
+
+        if (idle && !at_end && (port >= 0 || SEGMENT(cpu->cs, cpu->ip) < (uint32_t)addr)) {
+            vm_idle_probe(vm, SEGMENT(cpu->cs, cpu->ip), port, io_time,
+                          end - vm->insns);
+        }
 
-        if (vm->opts.enable_trace) {
+        if (trace) {
+            x86_flags_sync(cpu);
             #ifdef CFG_DIFF_TRACE
                     dump_cpu(cpu, &old_cpu);
                     memcpy(&old_cpu, cpu, sizeof(x86_cpu_t ));
@@ -1598,5 +1917,65 @@ void vm_run(vm_t *vm, int max_cycles) {
                     dump_cpu(cpu, NULL);
             #endif
         }
+        if (at_end) return true;
     }
+    return true;
+}
+
+static bool vm_run_debug(vm_t *vm, uint64_t end) {
+    return vm_run_loop(vm, end, true, false);
+}
+
+static bool vm_run_fast(vm_t *vm, uint64_t end) {
+    return vm_run_loop(vm, end, false, false);
+}
+
+static bool vm_run_cov(vm_t *vm, uint64_t end) {
+    return vm_run_loop(vm, end, false, true);
+}
+
+void vm_run(vm_t *vm, int max_insns) {
+    vm_run_until(vm, max_insns, UINT64_MAX);
+}
+
+void vm_run_until(vm_t *vm, int max_insns, uint64_t end_cycles) {
+    uint64_t ns_start = host_ns();
+    uint64_t end = max_insns < 0 ? UINT64_MAX : vm->insns + max_insns;
+    vm->fault = VM_FAULT_NONE;
+    vm->cycles_end = end_cycles;
+    // UINT64_MAX is SCHED_NEVER
+    sched_at(&vm->sched, SCHED_END, end_cycles);
+    // Picked again on every call, so debugger changes to the breakpoint or
+    // tracing take effect on the next one
+    if (vm->opts.enable_trace || vm->bkpt >= 0) {
+        if (vm->cycles < end_cycles) vm_run_debug(vm, end);
+    } else {
+        bool (*run)(vm_t *, uint64_t) = vm->cov_map ? vm_run_cov : vm_run_fast;
+        // A stop request is seen within VM_POLL_INSNS instructions
+        while (vm->insns < end && !vm->stop && vm->cycles < end_cycles) {
+            uint64_t chunk = end - vm->insns > VM_POLL_INSNS
+                                 ? vm->insns + VM_POLL_INSNS
+                                 : end;
+            if (!run(vm, chunk)) break;
+        }
+    }
+    sched_at(&vm->sched, SCHED_END, SCHED_NEVER);
+    vm->cycles_end = UINT64_MAX;
+    // Leave the flags readable for the debugger and callers
+    x86_flags_sync(&vm->cpu);
+    vm->host_ns += host_ns() - ns_start;
+}
+
+void vm_dump_stats(vm_t *vm) {
+    double emu_s = (double)vm->cycles / CPU_CLOCK_HZ;
+    double host_s = vm->host_ns / 1e9;
+    printf("insns:           %lu\n", vm->insns);
+    printf("cycles:          %lu (%.2f clk/insn)\n", vm->cycles,
+           vm->insns ? (double)vm->cycles / vm->insns : 0.0);
+    printf("emulated time:   %.3f s\n", emu_s);
+    printf("host time:       %.3f s\n", host_s);
+    printf("idle skipped:    %lu clocks\n", vm->idle_cycles);
+    printf("emulated clock:  %.2f MHz (%.2fx a %.2f MHz 8088)\n",
+           host_s > 0 ? vm->cycles / host_s / 1e6 : 0.0,
+           host_s > 0 ? emu_s / host_s : 0.0, CPU_CLOCK_HZ / 1e6);
 }
@@ -0,0 +1,140 @@
+[BITS 16]
+CPU 8086
+; Where REPE CMPS and REPNE SCAS stop and the flags they leave
+
+; Conditional jumps only reach 128 bytes on the 8086
+%macro fail_if 1
+j%-1 %%pass
+jmp fail
+%%pass:
+%endmacro
+
+cli
+xor ax, ax
+mov ds, ax
+mov ss, ax
+mov sp, 0x7000
+; IRQ 0 on vector 8 counts ticks at 0000:0500
+mov word [0x20], tick
+mov word [0x22], 0xF000
+mov word [0x500], 0
+mov al, 0x13
+out 0x20, al
+mov al, 0x08
+out 0x21, al
+mov al, 0x09
+out 0x21, al
+mov al, 0xFE
+out 0x21, al
+; Square wave every 1024 PIT clocks
+mov al, 0x36
+out 0x43, al
+xor al, al
+out 0x40, al
+mov al, 0x04
+out 0x40, al
+sti
+
+; Words 0 to 0FFF at 1000:0000
+
+; 1000:0000 and 1000:1000 both hold 1000h bytes of 41h, bar a 42h at
+; 1000:1800
+mov ax, 0x1000
+mov ds, ax
+mov es, ax
+cld
+mov al, 0x41
+xor di, di
+mov cx, 0x2000
+rep stosb
+mov byte [0x1800], 0x42
+
+; REPE CMPSB stops on the mismatch: 41h - 42h borrows
+xor si, si
+mov di, 0x1000
+mov cx, 0x1000
+repe cmpsb
+fail_if e
+fail_if nc
+fail_if ns
+cmp cx, 0x07FF
+fail_if ne
+cmp si, 0x0801
+fail_if ne
+cmp di, 0x1801
+fail_if ne
+
+; and runs out with ZF set when all match
+xor si, si
+mov di, 0x1000
+mov cx, 0x0800
+repe cmpsb
+fail_if ne
+or cx, cx
+fail_if nz
+
+; REPE CMPSW down, stopping on the word holding 42h
+std
+mov si, 0x0FFE
+mov di, 0x1FFE
+mov cx, 0x0800
+repe cmpsw
+fail_if e
+cmp cx, 0x0400
+fail_if ne
+cmp di, 0x17FE
+fail_if ne
+cld
+
+; REPNE SCASB stops on the match with ZF set
+mov al, 0x42
+mov di, 0x1000
+mov cx, 0x1000
+repne scasb
+fail_if ne
+cmp cx, 0x07FF
+fail_if ne
+cmp di, 0x1801
+fail_if ne
+
+; and runs out with ZF clear and the last compare's flags: 40h - 41h
+; borrows
+mov al, 0x40
+mov di, 0x1000
+mov cx, 0x0100
+repne scasb
+fail_if e
+fail_if nc
+fail_if ns
+or cx, cx
+fail_if nz
+
+; REPNE SCASW for 4141h from 1000:1800 finds it a word on
+mov ax, 0x4141
+mov di, 0x1800
+mov cx, 0x10
+repne scasw
+fail_if ne
+cmp cx, 0x0E
+fail_if ne
+cmp di, 0x1804
+fail_if ne
+
+xor al, al
+out 0xFF, al
+
+fail:
+mov al, 1
+out 0xFF, al
+
+tick:
+push ax
+push ds
+xor ax, ax
+mov ds, ax
+inc word [0x500]
+mov al, 0x20
+out 0x20, al
+pop ds
+pop ax
+iret
@@ -0,0 +1,112 @@
+[BITS 16]
+CPU 8086
+; REP MOVSW and REP STOSB with DF=1, taking timer interrupts on the way
+
+; Conditional jumps only reach 128 bytes on the 8086
+%macro fail_if 1
+j%-1 %%pass
+jmp fail
+%%pass:
+%endmacro
+
+cli
+xor ax, ax
+mov ds, ax
+mov ss, ax
+mov sp, 0x7000
+; IRQ 0 on vector 8 counts ticks at 0000:0500
+mov word [0x20], tick
+mov word [0x22], 0xF000
+mov word [0x500], 0
+mov al, 0x13
+out 0x20, al
+mov al, 0x08
+out 0x21, al
+mov al, 0x09
+out 0x21, al
+mov al, 0xFE
+out 0x21, al
+; Square wave every 1024 PIT clocks
+mov al, 0x36
+out 0x43, al
+xor al, al
+out 0x40, al
+mov al, 0x04
+out 0x40, al
+sti
+
+; Words 0 to 0FFF at 1000:0000
+mov ax, 0x1000
+mov ds, ax
+mov es, ax
+cld
+xor di, di
+xor ax, ax
+mov cx, 0x1000
+fill:
+stosw
+inc ax
+loop fill
+
+; Copy them down from the top to 1000:2000. The copy spans many timer
+; periods, so ticks have to get in during it.
+xor ax, ax
+mov ss, ax
+mov bx, [ss:0x500]
+std
+mov si, 0x1FFE
+mov di, 0x3FFE
+mov cx, 0x1000
+rep movsw
+cmp bx, [ss:0x500]
+fail_if e
+or cx, cx
+fail_if nz
+cmp si, 0xFFFE
+fail_if ne
+cmp di, 0x1FFE
+fail_if ne
+cld
+mov si, 0x2000
+xor dx, dx
+mov cx, 0x1000
+check_copy:
+lodsw
+cmp ax, dx
+fail_if ne
+inc dx
+loop check_copy
+
+; Fill 1000:5000 to 1000:5FFF from the top
+std
+mov al, 0xAA
+mov di, 0x5FFF
+mov cx, 0x1000
+rep stosb
+cmp di, 0x4FFF
+fail_if ne
+cmp byte [0x4FFF], 0
+fail_if ne
+cmp byte [0x5000], 0xAA
+fail_if ne
+cmp byte [0x5FFF], 0xAA
+fail_if ne
+
+xor al, al
+out 0xFF, al
+
+fail:
+mov al, 1
+out 0xFF, al
+
+tick:
+push ax
+push ds
+xor ax, ax
+mov ds, ax
+inc word [0x500]
+mov al, 0x20
+out 0x20, al
+pop ds
+pop ax
+iret
@@ -0,0 +1,106 @@
+[BITS 16]
+CPU 8086
+; Overlapping REP MOVSB and MOVSW, which fill from their first element
+
+; Conditional jumps only reach 128 bytes on the 8086
+%macro fail_if 1
+j%-1 %%pass
+jmp fail
+%%pass:
+%endmacro
+
+cli
+xor ax, ax
+mov ds, ax
+mov ss, ax
+mov sp, 0x7000
+; IRQ 0 on vector 8 counts ticks at 0000:0500
+mov word [0x20], tick
+mov word [0x22], 0xF000
+mov word [0x500], 0
+mov al, 0x13
+out 0x20, al
+mov al, 0x08
+out 0x21, al
+mov al, 0x09
+out 0x21, al
+mov al, 0xFE
+out 0x21, al
+; Square wave every 1024 PIT clocks
+mov al, 0x36
+out 0x43, al
+xor al, al
+out 0x40, al
+mov al, 0x04
+out 0x40, al
+sti
+
+; Words 0 to 0FFF at 1000:0000
+
+; MOVSB with DI = SI + 1 spreads 1000:0000 over the next 2000h bytes
+mov ax, 0x1000
+mov ds, ax
+mov es, ax
+cld
+mov byte [0x0000], 0x77
+xor si, si
+mov di, 1
+mov cx, 0x2000
+rep movsb
+cmp di, 0x2001
+fail_if ne
+cmp byte [0x2001], 0
+fail_if ne
+xor si, si
+mov cx, 0x2001
+check_bytes:
+lodsb
+cmp al, 0x77
+fail_if ne
+loop check_bytes
+
+; MOVSW with DI = SI + 2 repeats the word at 1000:3000
+mov word [0x3000], 0x1234
+mov si, 0x3000
+mov di, 0x3002
+mov cx, 0x800
+rep movsw
+cmp word [0x3002], 0x1234
+fail_if ne
+cmp word [0x4000], 0x1234
+fail_if ne
+cmp word [0x4002], 0
+fail_if ne
+
+; MOVSB down with DI = SI - 1 spreads 1000:6000 down to 1000:5000
+std
+mov byte [0x6000], 0x99
+mov si, 0x6000
+mov di, 0x5FFF
+mov cx, 0x1000
+rep movsb
+cmp di, 0x4FFF
+fail_if ne
+cmp byte [0x5000], 0x99
+fail_if ne
+cmp byte [0x4FFF], 0
+fail_if ne
+
+xor al, al
+out 0xFF, al
+
+fail:
+mov al, 1
+out 0xFF, al
+
+tick:
+push ax
+push ds
+xor ax, ax
+mov ds, ax
+inc word [0x500]
+mov al, 0x20
+out 0x20, al
+pop ds
+pop ax
+iret
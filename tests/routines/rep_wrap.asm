@@ -0,0 +1,119 @@
+[BITS 16]
+CPU 8086
+; REP string instructions wrapping at the end of a 64K segment
+
+; Conditional jumps only reach 128 bytes on the 8086
+%macro fail_if 1
+j%-1 %%pass
+jmp fail
+%%pass:
+%endmacro
+
+cli
+xor ax, ax
+mov ds, ax
+mov ss, ax
+mov sp, 0x7000
+; IRQ 0 on vector 8 counts ticks at 0000:0500
+mov word [0x20], tick
+mov word [0x22], 0xF000
+mov word [0x500], 0
+mov al, 0x13
+out 0x20, al
+mov al, 0x08
+out 0x21, al
+mov al, 0x09
+out 0x21, al
+mov al, 0xFE
+out 0x21, al
+; Square wave every 1024 PIT clocks
+mov al, 0x36
+out 0x43, al
+xor al, al
+out 0x40, al
+mov al, 0x04
+out 0x40, al
+sti
+
+; Words 0 to 0FFF at 1000:0000
+
+; STOSB from 2000:FF80 runs on at 2000:0000, not 3000:0000
+mov ax, 0x2000
+mov ds, ax
+mov es, ax
+cld
+mov al, 0x5A
+mov di, 0xFF80
+mov cx, 0x100
+rep stosb
+or cx, cx
+fail_if nz
+cmp di, 0x0080
+fail_if ne
+cmp byte [0xFF80], 0x5A
+fail_if ne
+cmp byte [0x0000], 0x5A
+fail_if ne
+cmp byte [0x007F], 0x5A
+fail_if ne
+cmp byte [0x0080], 0
+fail_if ne
+mov ax, 0x3000
+mov ds, ax
+cmp byte [0x0000], 0
+fail_if ne
+
+; MOVSW from 2000:FFFE to 4000:0000, then from 2000:FFFF with the word
+; split across the wrap
+mov ax, 0x2000
+mov ds, ax
+mov ax, 0x4000
+mov es, ax
+mov word [0xFFFE], 0x2211
+mov word [0x0000], 0x4433
+mov si, 0xFFFE
+xor di, di
+mov cx, 2
+rep movsw
+cmp si, 0x0002
+fail_if ne
+mov si, 0xFFFF
+mov cx, 1
+rep movsw
+cmp si, 0x0001
+fail_if ne
+cmp word [es:0x0000], 0x2211
+fail_if ne
+cmp word [es:0x0002], 0x4433
+fail_if ne
+cmp word [es:0x0004], 0x3322
+fail_if ne
+
+; LODSB down from 2000:0040 across the wrap to 2000:FFC1
+std
+mov si, 0x0040
+mov cx, 0x80
+rep lodsb
+cmp si, 0xFFC0
+fail_if ne
+cmp al, 0x5A
+fail_if ne
+
+xor al, al
+out 0xFF, al
+
+fail:
+mov al, 1
+out 0xFF, al
+
+tick:
+push ax
+push ds
+xor ax, ax
+mov ds, ax
+inc word [0x500]
+mov al, 0x20
+out 0x20, al
+pop ds
+pop ax
+iret
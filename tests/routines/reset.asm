@@ -0,0 +1,3 @@
+[BITS 16]
+; Reset vector for routines loaded at F000:0000
+jmp 0xF000:0x0000
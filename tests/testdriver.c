@@ -48,18 +48,18 @@ uint8_t REG_LUT[26 * 26] = {0};
 
 static inline void init_reg_lut() {
     // Add 1 so that 0 is an invalid default state
-    REG_LUT[REG_HASH("ax")] = 1 + (uint8_t)offsetof(x86_cpu_t, a);
-    REG_LUT[REG_HASH("bx")] = 1 + (uint8_t)offsetof(x86_cpu_t, b);
-    REG_LUT[REG_HASH("cx")] = 1 + (uint8_t)offsetof(x86_cpu_t, c);
-    REG_LUT[REG_HASH("dx")] = 1 + (uint8_t)offsetof(x86_cpu_t, d);
-    REG_LUT[REG_HASH("cs")] = 1 + (uint8_t)offsetof(x86_cpu_t, cs);
-    REG_LUT[REG_HASH("ss")] = 1 + (uint8_t)offsetof(x86_cpu_t, ss);
-    REG_LUT[REG_HASH("ds")] = 1 + (uint8_t)offsetof(x86_cpu_t, ds);
-    REG_LUT[REG_HASH("es")] = 1 + (uint8_t)offsetof(x86_cpu_t, es);
-    REG_LUT[REG_HASH("sp")] = 1 + (uint8_t)offsetof(x86_cpu_t, sp);
-    REG_LUT[REG_HASH("bp")] = 1 + (uint8_t)offsetof(x86_cpu_t, bp);
-    REG_LUT[REG_HASH("si")] = 1 + (uint8_t)offsetof(x86_cpu_t, si);
-    REG_LUT[REG_HASH("di")] = 1 + (uint8_t)offsetof(x86_cpu_t, di);
+    REG_LUT[REG_HASH("ax")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_AX]);
+    REG_LUT[REG_HASH("bx")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_BX]);
+    REG_LUT[REG_HASH("cx")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_CX]);
+    REG_LUT[REG_HASH("dx")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_DX]);
+    REG_LUT[REG_HASH("cs")] = 1 + (uint8_t)offsetof(x86_cpu_t, sregs[SREG_CS]);
+    REG_LUT[REG_HASH("ss")] = 1 + (uint8_t)offsetof(x86_cpu_t, sregs[SREG_SS]);
+    REG_LUT[REG_HASH("ds")] = 1 + (uint8_t)offsetof(x86_cpu_t, sregs[SREG_DS]);
+    REG_LUT[REG_HASH("es")] = 1 + (uint8_t)offsetof(x86_cpu_t, sregs[SREG_ES]);
+    REG_LUT[REG_HASH("sp")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_SP]);
+    REG_LUT[REG_HASH("bp")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_BP]);
+    REG_LUT[REG_HASH("si")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_SI]);
+    REG_LUT[REG_HASH("di")] = 1 + (uint8_t)offsetof(x86_cpu_t, regs[REG_DI]);
     REG_LUT[REG_HASH("ip")] = 1 + (uint8_t)offsetof(x86_cpu_t, ip);
     REG_LUT[REG_HASH("fl")] = 1 + (uint8_t)offsetof(x86_cpu_t, flags);
 }
@@ -103,6 +103,7 @@ int run_testcase(struct json_object *testcase) {
         // TODO endianness?
         ((uint16_t*)&vm->cpu)[reg_ofs >> 1] = reg_val; 
     }
+    x86_sync_sbase(&vm->cpu);
 
     const array_list *ram_init = json_get_array(initial, "ram");
     for (size_t i = 0; i < ram_init->length; i++) {
@@ -111,7 +112,7 @@ int run_testcase(struct json_object *testcase) {
         TESTCASE_ASSERT(ram_entry_arr->length == 2);
         int addr = json_object_get_int(ram_entry_arr->array[0]); 
         uint8_t val = json_object_get_int(ram_entry_arr->array[1]);
-        store_u8((addr & 0xF0000) >> 4, addr & 0xFFFF, val);
+        store_u8(&vm->mem, (addr & 0xF0000) >> 4, addr & 0xFFFF, val);
     }
 
     vm_run(vm, 1);
@@ -141,7 +142,7 @@ int run_testcase(struct json_object *testcase) {
         TESTCASE_ASSERT(ram_entry_arr->length == 2);
         int addr = json_object_get_int(ram_entry_arr->array[0]); 
         uint8_t expected = json_object_get_int(ram_entry_arr->array[1]);
-        uint8_t actual = load_u8((addr & 0xF0000) >> 4, addr & 0xFFFF);
+        uint8_t actual = load_u8(&vm->mem, (addr & 0xF0000) >> 4, addr & 0xFFFF);
         if (expected != actual) {
             fprintf(stdout,"\n\tram[%x] expected %04x got %04x", addr, expected, actual);
             ret = -1; 
@@ -384,7 +385,8 @@ int main(int argc, char **argv) {
     }
 
     vm = vm_init();
-    init_mem_blank();
+    // Test cases store anywhere in the 1MB
+    mem_map_set(&vm->mem, 0, MEM_SIZE, MEM_PAGE_RAM);
     init_reg_lut();
 
     if (vmdbg) {